@@ -0,0 +1,643 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This sample keeps many sign (or verify) operations in flight from a single thread, using the asynchronous
+	  engine in common/async_p11.c instead of one blocking thread per request.
+	- --workers threads make the blocking PKCS#11 calls with sessions from a session pool ; the main thread only
+	  submits jobs and collects the finished ones.
+	- In queue mode the main thread polls the completion eventfd, the way an event loop polls its sockets, and
+	  submits a new job for every job it reaps.
+	- In callback mode every job is resubmitted from its completion callback, and the main thread just waits.
+	- Latency is measured from submit to completion, so it includes the time a job waits for a worker.
+	- Example :-
+		Async_Signing_Benchmark 0 userpin --inflight 1000 --workers 16 --duration 10
+		Async_Signing_Benchmark 0 userpin --mode callback --op verify --mechanism ecdsa-sha256 --ops 100000 --json async.json
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include "../common/bench_stats.h"
+#include "../common/session_pool.h"
+#include "../common/crypto_ops.h"
+#include "../common/async_p11.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+#define REAP_BATCH 64
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+SessionPool *sessionPool = NULL;
+AsyncEngine *engine = NULL;
+CryptoKeyInfo signKey;
+CK_OBJECT_HANDLE hPublic = 0;
+CK_BYTE *verifySignature = NULL; // signature checked by every verify job.
+CK_ULONG verifySignatureLen = 0;
+
+CK_BYTE plainText[] = "Hello World, I've been waiting for the chance to see your face.";
+int inFlight = 256; // jobs kept submitted at all times.
+int nWorkers = 8;
+int sessions = 0; // defaults to the number of workers.
+long ops = 10000; // total operations.
+int durationSec = 0; // when set, run for this many seconds instead of a fixed number of operations.
+int callbackMode = 0;
+int verifyOp = 0;
+CK_ULONG keySize = 2048;
+char *jsonPath = NULL;
+char *csvPath = NULL;
+atomic_long remainingOps = 0; // submissions left when running a fixed number of operations.
+atomic_int stopSubmitting = 0;
+atomic_int activeJobs = 0; // jobs not yet retired (they stop being resubmitted once the run is over).
+
+
+// Signing mechanisms that can be benchmarked.
+typedef struct
+{
+	const char *option; // value accepted by --mechanism
+	const char *name;
+	CK_MECHANISM_TYPE type;
+	CK_KEY_TYPE keyType;
+} SignMechanism;
+
+SignMechanism signMechanisms[] =
+{
+	{"sha256-rsa-pkcs",	"CKM_SHA256_RSA_PKCS",		CKM_SHA256_RSA_PKCS,		CKK_RSA},
+	{"sha256-rsa-pkcs-pss",	"CKM_SHA256_RSA_PKCS_PSS",	CKM_SHA256_RSA_PKCS_PSS,	CKK_RSA},
+	{"ecdsa-sha256",	"CKM_ECDSA_SHA256",		CKM_ECDSA_SHA256,		CKK_EC},
+	{"eddsa",		"CKM_EDDSA",			CKM_EDDSA,			CKK_EC_EDWARDS}
+};
+SignMechanism *signMech = &signMechanisms[0];
+CK_RSA_PKCS_PSS_PARAMS pssParams = {CKM_SHA256, CKG_MGF1_SHA256, 32};
+CK_MECHANISM mech;
+
+
+// One job slot. It is owned by one worker at a time, so its counters need no lock.
+typedef struct
+{
+	AsyncJob job;
+	LatencyRecorder latency;
+	unsigned long errors;
+	CK_RV lastError;
+	CryptoBuffer signature;
+	double lastCompleted;
+} BenchJob;
+
+
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+
+
+// Initializes the library, logs in, and opens the session pool used by the workers.
+void connectToLunaSlot()
+{
+	CK_RV rv = CKR_OK;
+
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), sessions, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Closes the pool and the session, and finalizes the library.
+void disconnectFromLunaSlot()
+{
+	sessionPoolDestroy(sessionPool);
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Generates the session keypair used by the jobs. Session objects are visible to the pooled sessions too.
+void generateKeyPair()
+{
+	CK_MECHANISM rsaMech = {CKM_RSA_PKCS_KEY_PAIR_GEN};
+	CK_MECHANISM ecMech = {CKM_EC_KEY_PAIR_GEN};
+	CK_MECHANISM edMech = {CKM_EC_EDWARDS_KEY_PAIR_GEN};
+	CK_OBJECT_HANDLE hPrivate = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_BYTE exp[] = {0x01, 0x00, 0x01};
+	CK_BYTE p256[] = {0x06,0x08,0x2A,0x86,0x48,0xCE,0x3D,0x03,0x01,0x07}; // secp256r1
+	CK_BYTE ed25519[] = {0x06,0x09,0x2B,0x06,0x01,0x04,0x01,0xDA,0x47,0x0F,0x01}; // Ed25519, oid 1.3.6.1.4.1.11591.15.1
+
+	CK_ATTRIBUTE rsaPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_MODULUS_BITS,	&keySize,	sizeof(CK_ULONG)},
+		{CKA_PUBLIC_EXPONENT,	&exp,		sizeof(exp)}
+	};
+	CK_ATTRIBUTE ecPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,		p256,		sizeof(p256)}
+	};
+	CK_ATTRIBUTE edPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,		ed25519,	sizeof(ed25519)}
+	};
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SIGN,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,		sizeof(CK_BBOOL)}
+	};
+
+	if(signMech->keyType==CKK_EC)
+		checkOperation(p11Func->C_GenerateKeyPair(hSession, &ecMech, ecPub, sizeof(ecPub)/sizeof(*ecPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, &hPrivate), "C_GenerateKeyPair");
+	else if(signMech->keyType==CKK_EC_EDWARDS)
+		checkOperation(p11Func->C_GenerateKeyPair(hSession, &edMech, edPub, sizeof(edPub)/sizeof(*edPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, &hPrivate), "C_GenerateKeyPair");
+	else
+		checkOperation(p11Func->C_GenerateKeyPair(hSession, &rsaMech, rsaPub, sizeof(rsaPub)/sizeof(*rsaPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, &hPrivate), "C_GenerateKeyPair");
+	checkOperation(cryptoKeyInfo(p11Func, hSession, hPrivate, &signKey), "cryptoKeyInfo");
+	printf("\n> %s keypair generated.\n", (signMech->keyType==CKK_EC) ? "EC P-256"
+		: (signMech->keyType==CKK_EC_EDWARDS) ? "Ed25519" : "RSA");
+	printf("  --> Private key handle : %lu, public key handle : %lu.\n", hPrivate, hPublic);
+}
+
+
+
+// Sets up the mechanism, and for --op verify the signature every job checks.
+void prepareOperation()
+{
+	CryptoBuffer signature = {NULL, 0};
+
+	mech.mechanism = signMech->type;
+	mech.pParameter = NULL_PTR;
+	mech.ulParameterLen = 0;
+	if(signMech->type==CKM_SHA256_RSA_PKCS_PSS)
+	{
+		mech.pParameter = &pssParams;
+		mech.ulParameterLen = sizeof(pssParams);
+	}
+
+	if(verifyOp)
+	{
+		checkOperation(cryptoSign(p11Func, hSession, &mech, &signKey, plainText, sizeof(plainText)-1,
+			&signature, &verifySignatureLen), "cryptoSign");
+		verifySignature = signature.data;
+	}
+}
+
+
+
+// Resets a job before it is submitted (again).
+void prepareJob(BenchJob *bench, AsyncCallback callback)
+{
+	AsyncJob *job = &bench->job;
+
+	job->mech = &mech;
+	job->input = plainText;
+	job->inputLen = sizeof(plainText)-1;
+	job->callback = callback;
+	job->userData = bench;
+	if(verifyOp)
+	{
+		job->op = ASYNC_VERIFY;
+		job->hKey = hPublic;
+		job->output = verifySignature;
+		job->outputLen = verifySignatureLen;
+	}
+	else
+	{
+		job->op = ASYNC_SIGN;
+		job->hKey = signKey.hKey;
+		job->output = bench->signature.data;
+		job->outputLen = bench->signature.size;
+	}
+}
+
+
+
+// Decides whether one more job may be submitted.
+int claimSubmission()
+{
+	if(atomic_load(&stopSubmitting))
+		return 0;
+	if(durationSec>0)
+		return 1;
+	return atomic_fetch_sub(&remainingOps, 1)>0;
+}
+
+
+
+// Records the latency or the error of a finished job.
+void recordCompletion(BenchJob *bench)
+{
+	AsyncJob *job = &bench->job;
+
+	if(job->rv==CKR_OK)
+		latencyRecord(&bench->latency, job->completed - job->submitted);
+	else
+	{
+		bench->errors++;
+		bench->lastError = job->rv;
+	}
+	bench->lastCompleted = job->completed;
+}
+
+
+
+// Completion callback : records the job and submits it again from the worker thread.
+void onJobComplete(AsyncJob *job)
+{
+	BenchJob *bench = (BenchJob*)job->userData;
+
+	recordCompletion(bench);
+	if(claimSubmission())
+	{
+		prepareJob(bench, &onJobComplete);
+		if(asyncSubmit(engine, job)==CKR_OK)
+			return;
+	}
+	atomic_fetch_sub(&activeJobs, 1);
+}
+
+
+
+// Event loop : waits on the completion eventfd, reaps the finished jobs and submits a new job for each.
+void runQueueMode(double deadline)
+{
+	struct pollfd pfd = {asyncCompletionFd(engine), POLLIN, 0};
+	AsyncJob *done[REAP_BATCH];
+	BenchJob *bench = NULL;
+	int count = 0;
+
+	while(asyncInFlight(engine)>0)
+	{
+		poll(&pfd, 1, 100);
+		if(durationSec>0 && benchNowMicros()>=deadline)
+			atomic_store(&stopSubmitting, 1);
+
+		count = asyncReap(engine, done, REAP_BATCH);
+		for(int ctr=0; ctr<count; ctr++)
+		{
+			bench = (BenchJob*)done[ctr]->userData;
+			recordCompletion(bench);
+			if(!claimSubmission())
+				continue;
+			prepareJob(bench, NULL);
+			if(asyncSubmit(engine, &bench->job)!=CKR_OK)
+			{
+				bench->errors++;
+				bench->lastError = CKR_FUNCTION_REJECTED;
+			}
+		}
+	}
+}
+
+
+
+// Callback mode : the jobs resubmit themselves, the main thread only stops them at the deadline.
+void runCallbackMode(double deadline)
+{
+	while(atomic_load(&activeJobs)>0)
+	{
+		usleep(10000);
+		if(durationSec>0 && benchNowMicros()>=deadline)
+			atomic_store(&stopSubmitting, 1);
+	}
+}
+
+
+
+// Submits the first jobs, runs the chosen mode until every job is done, and reports throughput and latency.
+void runBenchmark()
+{
+	BenchJob *jobs = (BenchJob*)calloc(inFlight, sizeof(BenchJob));
+	CK_ULONG sigSize = cryptoSignatureSize(&signKey, &mech);
+	LatencyRecorder all;
+	BenchResult result;
+	double start = 0;
+	double end = 0;
+	double elapsed = 0;
+	CK_RV rv = CKR_OK;
+	CK_RV lastError = CKR_OK;
+	int submitted = 0;
+
+	memset(&result, 0, sizeof(result));
+	engine = asyncCreate(p11Func, sessionPool, nWorkers, inFlight, &rv);
+	checkOperation(rv, "asyncCreate");
+	atomic_store(&remainingOps, ops);
+
+	printf("\n> %s mode : %d jobs in flight, %d workers, %d sessions.\n", callbackMode ? "Callback" : "Queue", inFlight, nWorkers, sessions);
+	for(int ctr=0; ctr<inFlight; ctr++)
+	{
+		latencyInit(&jobs[ctr].latency, 0);
+		if(!verifyOp && cryptoBufferReserve(&jobs[ctr].signature, (sigSize>0) ? sigSize : 1024)!=0)
+			checkOperation(CKR_HOST_MEMORY, "cryptoBufferReserve");
+	}
+
+	start = benchNowMicros();
+	for(int ctr=0; ctr<inFlight && claimSubmission(); ctr++)
+	{
+		prepareJob(&jobs[ctr], callbackMode ? &onJobComplete : NULL);
+		atomic_fetch_add(&activeJobs, 1);
+		checkOperation(asyncSubmit(engine, &jobs[ctr].job), "asyncSubmit");
+		submitted++;
+	}
+
+	if(callbackMode)
+		runCallbackMode(start + durationSec * 1e6);
+	else
+		runQueueMode(start + durationSec * 1e6);
+	asyncDestroy(engine);
+
+	latencyInit(&all, 0);
+	end = start;
+	for(int ctr=0; ctr<submitted; ctr++)
+	{
+		latencyMerge(&all, &jobs[ctr].latency);
+		if(jobs[ctr].lastCompleted>end)
+			end = jobs[ctr].lastCompleted;
+		result.errors += jobs[ctr].errors;
+		if(jobs[ctr].errors>0)
+			lastError = jobs[ctr].lastError;
+	}
+	if(result.errors>0)
+		printf("\n  --> %lu operations failed, last error 0x%lX.\n", result.errors, lastError);
+	for(int ctr=0; ctr<inFlight; ctr++)
+	{
+		latencyFree(&jobs[ctr].latency);
+		cryptoBufferFree(&jobs[ctr].signature);
+	}
+
+	elapsed = (end - start) / 1e6;
+	snprintf(result.mechanism, sizeof(result.mechanism), "%s", signMech->name);
+	result.keySize = signKey.bits;
+	result.payload = sizeof(plainText)-1;
+	result.threads = nWorkers;
+	benchSummarize(&all, elapsed, &result);
+	latencyFree(&all);
+
+	printf("\n> %lu %s operations completed in %.2f seconds.\n\n", result.ops, verifyOp ? "verify" : "sign", elapsed);
+	benchPrintTable(stdout, &result, 1);
+	if(jsonPath!=NULL)
+		benchSaveJson(jsonPath, "Async_Signing_Benchmark", &result, 1);
+	if(csvPath!=NULL)
+		benchSaveCsv(csvPath, &result, 1);
+
+	free(jobs);
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char exeName[30])
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_officer_password> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --inflight <n>       jobs kept in flight (default 256).\n");
+	printf("  --workers <n>        threads making the PKCS#11 calls (default 8).\n");
+	printf("  --sessions <n>       maximum pooled sessions (default : one per worker).\n");
+	printf("  --ops <n>            total operations (default 10000).\n");
+	printf("  --duration <sec>     run for this many seconds instead.\n");
+	printf("  --mode <mode>        queue (default) : reap from the completion eventfd ; callback : resubmit from the callback.\n");
+	printf("  --op <op>            sign (default) or verify.\n");
+	printf("  --mechanism <name>   sha256-rsa-pkcs (default), sha256-rsa-pkcs-pss, ecdsa-sha256, eddsa.\n");
+	printf("  --key-size <bits>    RSA modulus size (default 2048).\n");
+	printf("  --json <file>        write the results as JSON ('-' for stdout).\n");
+	printf("  --csv <file>         write the results as CSV ('-' for stdout).\n\n");
+}
+
+
+
+// Reads the benchmark options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"inflight",	required_argument,	NULL,	'i'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{"sessions",	required_argument,	NULL,	's'},
+		{"ops",		required_argument,	NULL,	'o'},
+		{"duration",	required_argument,	NULL,	'd'},
+		{"mode",	required_argument,	NULL,	'M'},
+		{"op",		required_argument,	NULL,	'p'},
+		{"mechanism",	required_argument,	NULL,	'm'},
+		{"key-size",	required_argument,	NULL,	'k'},
+		{"json",	required_argument,	NULL,	'j'},
+		{"csv",		required_argument,	NULL,	'c'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'i': inFlight = atoi(optarg); break;
+			case 'w': nWorkers = atoi(optarg); break;
+			case 's': sessions = atoi(optarg); break;
+			case 'o': ops = atol(optarg); break;
+			case 'd': durationSec = atoi(optarg); break;
+			case 'k': keySize = strtoul(optarg, NULL, 10); break;
+			case 'j': jsonPath = optarg; break;
+			case 'c': csvPath = optarg; break;
+			case 'M':
+				if(strcmp(optarg, "queue")!=0 && strcmp(optarg, "callback")!=0)
+				{
+					usage(exeName);
+					exit(1);
+				}
+				callbackMode = (strcmp(optarg, "callback")==0);
+				break;
+			case 'p':
+				if(strcmp(optarg, "sign")!=0 && strcmp(optarg, "verify")!=0)
+				{
+					usage(exeName);
+					exit(1);
+				}
+				verifyOp = (strcmp(optarg, "verify")==0);
+				break;
+			case 'm':
+				signMech = NULL;
+				for(size_t ctr=0; ctr<sizeof(signMechanisms)/sizeof(*signMechanisms); ctr++)
+				{
+					if(strcmp(optarg, signMechanisms[ctr].option)==0)
+						signMech = &signMechanisms[ctr];
+				}
+				if(signMech==NULL)
+				{
+					printf("Unknown mechanism : %s\n", optarg);
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(inFlight<=0)
+		inFlight = 1;
+	if(nWorkers<=0)
+		nWorkers = 1;
+	if(sessions<=0)
+		sessions = nWorkers;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	generateKeyPair();
+	prepareOperation();
+	runBenchmark();
+
+	printf(">\nPlease wait ...\n");
+	free(verifySignature);
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
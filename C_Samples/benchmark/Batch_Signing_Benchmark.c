@@ -0,0 +1,622 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This sample measures the micro-batching dispatcher in common/batch_dispatch.c with many small, independent
+	  sign requests, the traffic where one thread per request (MultiThread_Signing_demo) wastes context switches.
+	- --clients threads each send one request at a time and wait for its signature, like independent callers.
+	- A few workers, each owning one session, take the requests in batches of up to --max-batch, waiting at most
+	  the latency budget for a batch to fill.
+	- The run is repeated for every budget in --budgets, so batching efficiency can be compared with tail latency.
+	  Budget 0 with --max-batch 1 is the one request per wake-up baseline.
+	- For every budget, the achieved batch sizes and the queueing delay are reported next to ops/sec and latency.
+	- --distinct makes the clients sign only a few different payloads, so identical requests in a batch are coalesced.
+	- Example :-
+		Batch_Signing_Benchmark 0 userpin --clients 256 --workers 4 --budgets 0,100,500,2000 --duration 5
+		Batch_Signing_Benchmark 0 userpin --mechanism ecdsa-sha256 --max-batch 64 --distinct 8 --csv batching.csv
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include "../common/bench_stats.h"
+#include "../common/session_pool.h"
+#include "../common/crypto_ops.h"
+#include "../common/batch_dispatch.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+#define MAX_LIST 16
+#define PAYLOAD_SIZE 32
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+SessionPool *sessionPool = NULL;
+BatchDispatcher *dispatcher = NULL;
+CryptoKeyInfo signKey;
+CK_OBJECT_HANDLE hPublic = 0;
+
+int nClients = 64;
+int nWorkers = 4;
+int sessions = 0; // one per worker.
+unsigned int maxBatch = 32;
+CK_ULONG budgets[MAX_LIST] = {0, 200, 1000}; // latency budgets in microseconds.
+int budgetCount = 3;
+int ops = 0; // requests per client ; when 0, each budget runs for durationSec.
+int durationSec = 5;
+int distinctPayloads = 0; // 0 : every request signs different data.
+CK_ULONG keySize = 2048;
+char *jsonPath = NULL;
+char *csvPath = NULL;
+atomic_int stopClients = 0;
+pthread_barrier_t startBarrier;
+
+
+// Signing mechanisms that can be benchmarked.
+typedef struct
+{
+	const char *option; // value accepted by --mechanism
+	const char *name;
+	CK_MECHANISM_TYPE type;
+	CK_KEY_TYPE keyType;
+} SignMechanism;
+
+SignMechanism signMechanisms[] =
+{
+	{"sha256-rsa-pkcs",	"CKM_SHA256_RSA_PKCS",		CKM_SHA256_RSA_PKCS,		CKK_RSA},
+	{"sha256-rsa-pkcs-pss",	"CKM_SHA256_RSA_PKCS_PSS",	CKM_SHA256_RSA_PKCS_PSS,	CKK_RSA},
+	{"ecdsa-sha256",	"CKM_ECDSA_SHA256",		CKM_ECDSA_SHA256,		CKK_EC},
+	{"eddsa",		"CKM_EDDSA",			CKM_EDDSA,			CKK_EC_EDWARDS}
+};
+SignMechanism *signMech = &signMechanisms[0];
+CK_RSA_PKCS_PSS_PARAMS pssParams = {CKM_SHA256, CKG_MGF1_SHA256, 32};
+CK_MECHANISM mech;
+
+
+// State owned by each client thread.
+typedef struct
+{
+	int id;
+	unsigned int seed; // picks the payload when --distinct is set.
+	BatchRequest request;
+	sem_t done; // posted by the completion callback.
+	CK_BYTE payload[PAYLOAD_SIZE];
+	CryptoBuffer signature;
+	LatencyRecorder latency;
+	unsigned long errors;
+	CK_RV lastError;
+	double started;
+	double finished;
+} SignClient;
+
+
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+
+
+// Initializes the library, logs in, and opens the session pool used by the workers.
+void connectToLunaSlot()
+{
+	CK_RV rv = CKR_OK;
+
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), sessions, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Closes the pool and the session, and finalizes the library.
+void disconnectFromLunaSlot()
+{
+	sessionPoolDestroy(sessionPool);
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Generates the session keypair used by the requests. Session objects are visible to the pooled sessions too.
+void generateKeyPair()
+{
+	CK_MECHANISM rsaMech = {CKM_RSA_PKCS_KEY_PAIR_GEN};
+	CK_MECHANISM ecMech = {CKM_EC_KEY_PAIR_GEN};
+	CK_MECHANISM edMech = {CKM_EC_EDWARDS_KEY_PAIR_GEN};
+	CK_OBJECT_HANDLE hPrivate = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_BYTE exp[] = {0x01, 0x00, 0x01};
+	CK_BYTE p256[] = {0x06,0x08,0x2A,0x86,0x48,0xCE,0x3D,0x03,0x01,0x07}; // secp256r1
+	CK_BYTE ed25519[] = {0x06,0x09,0x2B,0x06,0x01,0x04,0x01,0xDA,0x47,0x0F,0x01}; // Ed25519, oid 1.3.6.1.4.1.11591.15.1
+
+	CK_ATTRIBUTE rsaPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_MODULUS_BITS,	&keySize,	sizeof(CK_ULONG)},
+		{CKA_PUBLIC_EXPONENT,	&exp,		sizeof(exp)}
+	};
+	CK_ATTRIBUTE ecPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,		p256,		sizeof(p256)}
+	};
+	CK_ATTRIBUTE edPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,		ed25519,	sizeof(ed25519)}
+	};
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SIGN,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,		sizeof(CK_BBOOL)}
+	};
+
+	if(signMech->keyType==CKK_EC)
+		checkOperation(p11Func->C_GenerateKeyPair(hSession, &ecMech, ecPub, sizeof(ecPub)/sizeof(*ecPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, &hPrivate), "C_GenerateKeyPair");
+	else if(signMech->keyType==CKK_EC_EDWARDS)
+		checkOperation(p11Func->C_GenerateKeyPair(hSession, &edMech, edPub, sizeof(edPub)/sizeof(*edPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, &hPrivate), "C_GenerateKeyPair");
+	else
+		checkOperation(p11Func->C_GenerateKeyPair(hSession, &rsaMech, rsaPub, sizeof(rsaPub)/sizeof(*rsaPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, &hPrivate), "C_GenerateKeyPair");
+	checkOperation(cryptoKeyInfo(p11Func, hSession, hPrivate, &signKey), "cryptoKeyInfo");
+	printf("\n> %s keypair generated.\n", (signMech->keyType==CKK_EC) ? "EC P-256"
+		: (signMech->keyType==CKK_EC_EDWARDS) ? "Ed25519" : "RSA");
+	printf("  --> Private key handle : %lu, public key handle : %lu.\n", hPrivate, hPublic);
+}
+
+
+
+// Sets up the mechanism parameters.
+void prepareMechanism()
+{
+	mech.mechanism = signMech->type;
+	mech.pParameter = NULL_PTR;
+	mech.ulParameterLen = 0;
+	if(signMech->type==CKM_SHA256_RSA_PKCS_PSS)
+	{
+		mech.pParameter = &pssParams;
+		mech.ulParameterLen = sizeof(pssParams);
+	}
+}
+
+
+
+// Completion callback : wakes up the client waiting for this request.
+void onSigned(BatchRequest *request)
+{
+	SignClient *client = (SignClient*)request->userData;
+	sem_post(&client->done);
+}
+
+
+
+// Fills the payload of the next request : unique per request, or one of distinctPayloads shared values.
+void nextPayload(SignClient *client, unsigned long counter)
+{
+	unsigned long value = (distinctPayloads>0) ? (unsigned long)rand_r(&client->seed) % distinctPayloads
+		: ((unsigned long)client->id << 32) ^ counter;
+
+	memset(client->payload, 0x5A, PAYLOAD_SIZE);
+	memcpy(client->payload, &value, sizeof(value));
+}
+
+
+
+// Client thread : sends one request at a time and waits for its signature.
+void *signClient(void *arg)
+{
+	SignClient *client = (SignClient*)arg;
+	BatchRequest *request = &client->request;
+	double start = 0;
+	CK_RV rv;
+
+	pthread_barrier_wait(&startBarrier);
+	client->started = benchNowMicros();
+	for(unsigned long ctr=0; (ops==0) ? !atomic_load(&stopClients) : (ctr<(unsigned long)ops); ctr++)
+	{
+		nextPayload(client, ctr);
+		request->mech = &mech;
+		request->hKey = signKey.hKey;
+		request->data = client->payload;
+		request->dataLen = PAYLOAD_SIZE;
+		request->signature = client->signature.data;
+		request->signatureLen = client->signature.size;
+		request->callback = &onSigned;
+		request->userData = client;
+
+		start = benchNowMicros();
+		rv = batchSubmit(dispatcher, request);
+		if(rv==CKR_OK)
+		{
+			sem_wait(&client->done);
+			rv = request->rv;
+		}
+		if(rv==CKR_OK)
+			latencyRecord(&client->latency, benchNowMicros() - start);
+		else
+		{
+			client->errors++;
+			client->lastError = rv;
+		}
+	}
+	client->finished = benchNowMicros();
+	return 0;
+}
+
+
+
+// Runs the clients against a dispatcher with one latency budget.
+void runBudget(unsigned int budget, BenchResult *result, BatchStats *stats)
+{
+	pthread_t *threads = (pthread_t*)malloc(nClients * sizeof(pthread_t));
+	SignClient *clients = (SignClient*)calloc(nClients, sizeof(SignClient));
+	CK_ULONG sigSize = cryptoSignatureSize(&signKey, &mech);
+	LatencyRecorder all;
+	double start = 0;
+	double end = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(result, 0, sizeof(BenchResult));
+	dispatcher = batchCreate(p11Func, sessionPool, nWorkers, maxBatch, budget, nClients, &rv);
+	checkOperation(rv, "batchCreate");
+	atomic_store(&stopClients, 0);
+	pthread_barrier_init(&startBarrier, NULL, nClients+1);
+
+	for(int ctr=0; ctr<nClients; ctr++)
+	{
+		clients[ctr].id = ctr;
+		clients[ctr].seed = ctr + 1;
+		sem_init(&clients[ctr].done, 0, 0);
+		latencyInit(&clients[ctr].latency, (ops>0) ? ops : 0);
+		if(cryptoBufferReserve(&clients[ctr].signature, (sigSize>0) ? sigSize : 1024)!=0)
+			checkOperation(CKR_HOST_MEMORY, "cryptoBufferReserve");
+		pthread_create(&threads[ctr], NULL, &signClient, &clients[ctr]);
+	}
+	pthread_barrier_wait(&startBarrier);
+	if(ops==0)
+	{
+		sleep(durationSec);
+		atomic_store(&stopClients, 1);
+	}
+	for(int ctr=0; ctr<nClients; ctr++)
+		pthread_join(threads[ctr], NULL);
+	batchGetStats(dispatcher, stats);
+	batchDestroy(dispatcher);
+
+	latencyInit(&all, 0);
+	for(int ctr=0; ctr<nClients; ctr++)
+	{
+		latencyMerge(&all, &clients[ctr].latency);
+		if(ctr==0 || clients[ctr].started<start)
+			start = clients[ctr].started;
+		if(clients[ctr].finished>end)
+			end = clients[ctr].finished;
+		result->errors += clients[ctr].errors;
+		if(clients[ctr].errors>0)
+			rv = clients[ctr].lastError;
+		latencyFree(&clients[ctr].latency);
+		cryptoBufferFree(&clients[ctr].signature);
+		sem_destroy(&clients[ctr].done);
+	}
+	if(result->errors>0)
+		printf("  --> %lu sign requests failed, last error 0x%lX.\n", result->errors, rv);
+
+	snprintf(result->mechanism, sizeof(result->mechanism), "%s/%uus", signMech->name, budget);
+	result->keySize = signKey.bits;
+	result->payload = PAYLOAD_SIZE;
+	result->threads = nClients;
+	benchSummarize(&all, (end - start) / 1e6, result);
+	latencyFree(&all);
+
+	pthread_barrier_destroy(&startBarrier);
+	free(clients);
+	free(threads);
+}
+
+
+
+// Runs every latency budget and prints throughput, latency and batching side by side.
+void runBenchmark()
+{
+	BenchResult *results = (BenchResult*)calloc(budgetCount, sizeof(BenchResult));
+	BatchStats *stats = (BatchStats*)calloc(budgetCount, sizeof(BatchStats));
+
+	printf("\n> %d clients, %d workers (one session each), batches of up to %u.\n", nClients, nWorkers, maxBatch);
+	for(int ctr=0; ctr<budgetCount; ctr++)
+	{
+		printf("  --> Latency budget %lu us ...\n", budgets[ctr]);
+		runBudget(budgets[ctr], &results[ctr], &stats[ctr]);
+	}
+
+	printf("\n");
+	benchPrintTable(stdout, results, budgetCount);
+	printf("\n%10s %10s %10s %10s %9s %9s %9s %11s %11s %11s %11s\n", "BUDGET(us)", "REQUESTS", "BATCHES", "COALESCED",
+		"MEAN_BAT", "P50_BAT", "P99_BAT", "MEAN_Q(us)", "P50_Q(us)", "P99_Q(us)", "MAX_Q(us)");
+	for(int ctr=0; ctr<budgetCount; ctr++)
+	{
+		printf("%10lu %10lu %10lu %10lu %9.2f %9u %9u %11.1f %11.1f %11.1f %11.1f\n", budgets[ctr], stats[ctr].requests,
+			stats[ctr].batches, stats[ctr].coalesced, stats[ctr].meanBatch, stats[ctr].p50Batch, stats[ctr].p99Batch,
+			stats[ctr].meanDelay, stats[ctr].p50Delay, stats[ctr].p99Delay, stats[ctr].maxDelay);
+	}
+	printf("\n");
+	if(jsonPath!=NULL)
+		benchSaveJson(jsonPath, "Batch_Signing_Benchmark", results, budgetCount);
+	if(csvPath!=NULL)
+		benchSaveCsv(csvPath, results, budgetCount);
+
+	free(stats);
+	free(results);
+}
+
+
+
+// Reads a comma separated list of numbers. Returns the number of values read.
+int parseList(const char *text, CK_ULONG *list)
+{
+	int count = 0;
+	char *end = NULL;
+
+	while(*text!='\0' && count<MAX_LIST)
+	{
+		CK_ULONG value = strtoul(text, &end, 10);
+		if(end==text)
+			break;
+		list[count++] = value;
+		text = (*end==',') ? end+1 : end;
+		if(end==text && *end!='\0')
+			break;
+	}
+	return count;
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char exeName[30])
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_officer_password> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --clients <n>        client threads, each with one request outstanding (default 64).\n");
+	printf("  --workers <n>        session-owning workers signing the batches (default 4).\n");
+	printf("  --max-batch <n>      largest batch (default 32).\n");
+	printf("  --budgets <list>     latency budgets to compare, in microseconds (default 0,200,1000).\n");
+	printf("  --ops <n>            requests per client for every budget.\n");
+	printf("  --duration <sec>     run every budget for this many seconds instead (default 5).\n");
+	printf("  --distinct <n>       sign only n different payloads, so identical requests get coalesced (default : all distinct).\n");
+	printf("  --mechanism <name>   sha256-rsa-pkcs (default), sha256-rsa-pkcs-pss, ecdsa-sha256, eddsa.\n");
+	printf("  --key-size <bits>    RSA modulus size (default 2048).\n");
+	printf("  --json <file>        write the results as JSON ('-' for stdout).\n");
+	printf("  --csv <file>         write the results as CSV ('-' for stdout).\n\n");
+}
+
+
+
+// Reads the benchmark options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"clients",	required_argument,	NULL,	'C'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{"max-batch",	required_argument,	NULL,	'b'},
+		{"budgets",	required_argument,	NULL,	'B'},
+		{"ops",		required_argument,	NULL,	'o'},
+		{"duration",	required_argument,	NULL,	'd'},
+		{"distinct",	required_argument,	NULL,	'D'},
+		{"mechanism",	required_argument,	NULL,	'm'},
+		{"key-size",	required_argument,	NULL,	'k'},
+		{"json",	required_argument,	NULL,	'j'},
+		{"csv",		required_argument,	NULL,	'c'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'C': nClients = atoi(optarg); break;
+			case 'w': nWorkers = atoi(optarg); break;
+			case 'b': maxBatch = strtoul(optarg, NULL, 10); break;
+			case 'B': budgetCount = parseList(optarg, budgets); break;
+			case 'o': ops = atoi(optarg); break;
+			case 'd': durationSec = atoi(optarg); break;
+			case 'D': distinctPayloads = atoi(optarg); break;
+			case 'k': keySize = strtoul(optarg, NULL, 10); break;
+			case 'j': jsonPath = optarg; break;
+			case 'c': csvPath = optarg; break;
+			case 'm':
+				signMech = NULL;
+				for(size_t ctr=0; ctr<sizeof(signMechanisms)/sizeof(*signMechanisms); ctr++)
+				{
+					if(strcmp(optarg, signMechanisms[ctr].option)==0)
+						signMech = &signMechanisms[ctr];
+				}
+				if(signMech==NULL)
+				{
+					printf("Unknown mechanism : %s\n", optarg);
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(budgetCount==0)
+	{
+		printf("No latency budget given.\n");
+		exit(1);
+	}
+	if(nClients<=0)
+		nClients = 1;
+	if(nWorkers<=0)
+		nWorkers = 1;
+	if(maxBatch==0)
+		maxBatch = 1;
+	if(durationSec<=0)
+		durationSec = 1;
+	sessions = nWorkers;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	generateKeyPair();
+	prepareMechanism();
+	runBenchmark();
+
+	printf(">\nPlease wait ...\n");
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
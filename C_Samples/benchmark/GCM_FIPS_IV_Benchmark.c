@@ -0,0 +1,475 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+
+        OBJECTIVE :
+	- This sample measures what common/gcm_fips.c saves when decrypting CKM_AES_GCM records of a Luna HSM in
+	  FIPS mode (ciphertext || tag || IV appended by the HSM), for record sizes from 1 KiB to 64 MiB.
+	- Every record is decrypted --iterations times by two paths :-
+		> copy : the way CKM_AES_GCM_FIPS_demo used to work, the IV copied into a new 16 byte buffer (readIV) and
+		  the ciphertext copied into a new buffer without the IV (trimIV), then C_Decrypt.
+		> zero-copy : gcmFipsDecrypt, with the IV and the ciphertext used where they lie in the record.
+	- For every size, the time of both paths, the time spent copying, and the heap each path needs next to the
+	  record are reported; the copy path needs one more buffer as large as the record.
+	- The HSM or the library may refuse the largest records (CKR_DATA_LEN_RANGE); such sizes are skipped.
+	- Example :-
+		GCM_FIPS_IV_Benchmark 0 userpin --sizes 1K,64K,1M,16M,64M --iterations 20 --csv fips_iv.csv
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "../common/bench_stats.h"
+#include "../common/gcm_fips.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+#define MAX_LIST 16
+
+
+// Measures of one record size.
+typedef struct
+{
+	CK_ULONG size;
+	CK_RV skipped; // CKR_OK if the size was measured.
+	double copyMicros; // mean time of the copy path.
+	double copyOnlyMicros; // part of it spent in readIV and trimIV.
+	double zeroCopyMicros; // mean time of the zero-copy path.
+	CK_ULONG copyHeap; // heap allocated by each path per decryption, output included.
+	CK_ULONG zeroCopyHeap;
+} SizeReport;
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+CK_OBJECT_HANDLE hAesKey = 0;
+CK_BYTE aad[] = "127.0.0.1";
+
+CK_ULONG sizes[MAX_LIST] = {1024, 16*1024, 256*1024, 1024*1024, 4*1024*1024, 16*1024*1024, 64*1024*1024};
+int sizeCount = 7;
+int iterations = 10;
+char *jsonPath = NULL;
+char *csvPath = NULL;
+
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Connects to a Luna slot (C_Initialize, C_OpenSession, C_Login)
+void connectToLunaSlot()
+{
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Disconnects from Luna slot (C_Logout, C_CloseSession and C_Finalize)
+void disconnectFromLunaSlot()
+{
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Generates the AES-256 session key of the benchmark.
+void generateAESKey()
+{
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_ULONG keyLen = 32;
+	CK_MECHANISM mech = {CKM_AES_KEY_GEN};
+
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_VALUE_LEN,		&keyLen,	sizeof(CK_ULONG)}
+	};
+	CK_ULONG attribLen = sizeof(attrib) / sizeof(*attrib);
+	checkOperation(p11Func->C_GenerateKey(hSession, &mech, attrib, attribLen, &hAesKey), "C_GenerateKey");
+	printf("\n> AES key generated as handle : %lu\n", hAesKey);
+}
+
+
+
+// The decryption of CKM_AES_GCM_FIPS_demo before gcm_fips.c : the IV copied byte by byte, and the ciphertext copied
+// without it. *copyMicros receives the time spent copying.
+CK_RV decryptWithCopies(const CK_BYTE *record, CK_ULONG recordLen, CK_BYTE *out, CK_ULONG *outLen, double *copyMicros)
+{
+	CK_AES_GCM_PARAMS param = {NULL, GCM_FIPS_IV_LEN, GCM_FIPS_IV_LEN * 8, aad, sizeof(aad)-1, GCM_FIPS_TAG_LEN * 8};
+	CK_MECHANISM mech = {CKM_AES_GCM, &param, sizeof(param)};
+	CK_BYTE *iv = NULL;
+	CK_BYTE *encrypted = NULL;
+	double start = benchNowMicros();
+	int count = 0;
+	CK_RV rv = CKR_OK;
+
+	iv = (CK_BYTE*)calloc(GCM_FIPS_IV_LEN, sizeof(CK_BYTE)); // readIV
+	for(CK_ULONG ctr=recordLen-GCM_FIPS_IV_LEN; ctr<recordLen; ctr++)
+		iv[count++] = record[ctr];
+	encrypted = malloc(recordLen - GCM_FIPS_IV_LEN); // trimIV
+	memcpy(encrypted, record, recordLen - GCM_FIPS_IV_LEN);
+	*copyMicros = benchNowMicros() - start;
+
+	param.pIv = iv;
+	rv = p11Func->C_DecryptInit(hSession, &mech, hAesKey);
+	if(rv==CKR_OK)
+		rv = p11Func->C_Decrypt(hSession, encrypted, recordLen - GCM_FIPS_IV_LEN, out, outLen);
+	free(encrypted);
+	free(iv);
+	return rv;
+}
+
+
+
+// Encrypts one record of the given size, and times both decryption paths on it.
+void measureSize(CK_ULONG size, SizeReport *report, BenchResult *copyResult, BenchResult *zeroResult)
+{
+	CK_BYTE *data = (CK_BYTE*)malloc(size);
+	CK_BYTE *record = NULL;
+	CK_BYTE *out = NULL;
+	CK_ULONG recordLen = 0, outLen = 0;
+	LatencyRecorder copyRec, zeroRec;
+	double copySum = 0, copyOnlySum = 0, zeroSum = 0, start = 0, copyMicros = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(report, 0, sizeof(*report));
+	report->size = size;
+	for(CK_ULONG ctr=0; ctr<size; ctr++)
+		data[ctr] = (CK_BYTE)ctr;
+	gcmFipsEncrypt(p11Func, hSession, hAesKey, aad, sizeof(aad)-1, data, size, NULL_PTR, &recordLen);
+	record = (CK_BYTE*)malloc(recordLen);
+	rv = gcmFipsEncrypt(p11Func, hSession, hAesKey, aad, sizeof(aad)-1, data, size, record, &recordLen);
+	free(data);
+	if(rv!=CKR_OK)
+	{
+		report->skipped = rv;
+		free(record);
+		return;
+	}
+
+	latencyInit(&copyRec, iterations);
+	latencyInit(&zeroRec, iterations);
+	for(int ctr=0; ctr<iterations && rv==CKR_OK; ctr++)
+	{
+		// Both paths allocate their output, as the demo does, so only the copies differ.
+		start = benchNowMicros();
+		outLen = recordLen - GCM_FIPS_IV_LEN;
+		out = (CK_BYTE*)malloc(outLen);
+		rv = decryptWithCopies(record, recordLen, out, &outLen, &copyMicros);
+		free(out);
+		latencyRecord(&copyRec, benchNowMicros() - start);
+		copySum += benchNowMicros() - start;
+		copyOnlySum += copyMicros;
+		if(rv!=CKR_OK)
+			break;
+
+		start = benchNowMicros();
+		outLen = recordLen - GCM_FIPS_IV_LEN;
+		out = (CK_BYTE*)malloc(outLen);
+		rv = gcmFipsDecrypt(p11Func, hSession, hAesKey, aad, sizeof(aad)-1, record, recordLen, out, &outLen);
+		free(out);
+		latencyRecord(&zeroRec, benchNowMicros() - start);
+		zeroSum += benchNowMicros() - start;
+	}
+	free(record);
+	if(rv!=CKR_OK)
+		report->skipped = rv;
+	else
+	{
+		report->copyMicros = copySum / iterations;
+		report->copyOnlyMicros = copyOnlySum / iterations;
+		report->zeroCopyMicros = zeroSum / iterations;
+		report->copyHeap = GCM_FIPS_IV_LEN + 2 * (recordLen - GCM_FIPS_IV_LEN);
+		report->zeroCopyHeap = recordLen - GCM_FIPS_IV_LEN;
+
+		memset(copyResult, 0, sizeof(*copyResult));
+		memset(zeroResult, 0, sizeof(*zeroResult));
+		snprintf(copyResult->mechanism, sizeof(copyResult->mechanism), "CKM_AES_GCM copy IV");
+		snprintf(zeroResult->mechanism, sizeof(zeroResult->mechanism), "CKM_AES_GCM zero-copy IV");
+		copyResult->keySize = zeroResult->keySize = 256;
+		copyResult->payload = zeroResult->payload = size;
+		copyResult->threads = zeroResult->threads = 1;
+		benchSummarize(&copyRec, copySum / 1e6, copyResult);
+		benchSummarize(&zeroRec, zeroSum / 1e6, zeroResult);
+	}
+	latencyFree(&copyRec);
+	latencyFree(&zeroRec);
+}
+
+
+
+// Runs every size and prints what the zero-copy path saves.
+void runBenchmark()
+{
+	SizeReport reports[MAX_LIST];
+	BenchResult results[2*MAX_LIST];
+	size_t resultCount = 0;
+
+	printf("\n> Decrypting FIPS mode CKM_AES_GCM records, %d iterations per size.\n", iterations);
+	for(int ctr=0; ctr<sizeCount; ctr++)
+	{
+		measureSize(sizes[ctr], &reports[ctr], &results[resultCount], &results[resultCount+1]);
+		if(reports[ctr].skipped!=CKR_OK)
+			printf("  --> %10lu bytes : skipped, failed with 0x%lX.\n", sizes[ctr], reports[ctr].skipped);
+		else
+		{
+			printf("  --> %10lu bytes : done.\n", sizes[ctr]);
+			resultCount += 2;
+		}
+	}
+	if(resultCount==0)
+		return;
+
+	printf("\n");
+	benchPrintTable(stdout, results, resultCount);
+
+	printf("\n> Saved by the zero-copy path, per decryption :-\n\n");
+	printf("%12s %12s %12s %12s %12s %8s %14s %14s\n", "record", "copy ms", "zero-copy ms", "copying ms", "saved ms", "saved %",
+		"copy heap", "zero-copy heap");
+	for(int ctr=0; ctr<sizeCount; ctr++)
+	{
+		const SizeReport *r = &reports[ctr];
+		double saved = r->copyMicros - r->zeroCopyMicros;
+		if(r->skipped!=CKR_OK)
+			continue;
+		printf("%12lu %12.3f %12.3f %12.3f %12.3f %7.1f%% %14lu %14lu\n", r->size, r->copyMicros / 1000, r->zeroCopyMicros / 1000,
+			r->copyOnlyMicros / 1000, saved / 1000, (r->copyMicros>0 && saved>0) ? 100 * saved / r->copyMicros : 0.0,
+			r->copyHeap, r->zeroCopyHeap);
+	}
+	printf("\n");
+
+	if(jsonPath!=NULL)
+		benchSaveJson(jsonPath, "GCM_FIPS_IV_Benchmark", results, resultCount);
+	if(csvPath!=NULL)
+		benchSaveCsv(csvPath, results, resultCount);
+}
+
+
+
+// Parses a comma separated list of numbers. Sizes may use a K or M suffix (1K = 1024).
+int parseList(const char *text, CK_ULONG *list)
+{
+	int count = 0;
+	char *end = NULL;
+
+	while(*text!='\0' && count<MAX_LIST)
+	{
+		CK_ULONG value = strtoul(text, &end, 10);
+		if(end==text)
+			break;
+		if(*end=='K' || *end=='k')
+		{
+			value *= 1024;
+			end++;
+		}
+		else if(*end=='M' || *end=='m')
+		{
+			value *= 1024 * 1024;
+			end++;
+		}
+		if(value>0)
+			list[count++] = value;
+		text = (*end==',') ? end+1 : end;
+		if(end==text && *end!='\0')
+			break;
+	}
+	return count;
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_officer_password> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --sizes <list>       record sizes, K and M suffixes accepted (default 1K,16K,256K,1M,4M,16M,64M).\n");
+	printf("  --iterations <n>     decryptions per size and path (default 10).\n");
+	printf("  --json <file>        write the results as JSON ('-' for stdout).\n");
+	printf("  --csv <file>         write the results as CSV ('-' for stdout).\n\n");
+}
+
+
+
+// Reads the benchmark options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"sizes",	required_argument,	NULL,	's'},
+		{"iterations",	required_argument,	NULL,	'i'},
+		{"json",	required_argument,	NULL,	'j'},
+		{"csv",		required_argument,	NULL,	'c'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 's': sizeCount = parseList(optarg, sizes); break;
+			case 'i': iterations = atoi(optarg); break;
+			case 'j': jsonPath = optarg; break;
+			case 'c': csvPath = optarg; break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(iterations<=0)
+		iterations = 1;
+	if(sizeCount==0)
+	{
+		usage(exeName);
+		exit(1);
+	}
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	generateAESKey();
+	runBenchmark();
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
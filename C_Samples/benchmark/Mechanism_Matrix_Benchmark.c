@@ -0,0 +1,825 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This sample benchmarks the crypto operation of every encryption and signing sample in one run.
+	- It sweeps mechanism x key size x payload size x thread count, and reports one row per combination.
+	- Every row contains ops/sec, MB/sec and p50/p90/p99/p99.9/max latency, as a table and optionally as JSON / CSV.
+	- Only standard PKCS#11 mechanisms and session keys are used, so any P11_LIB can be benchmarked, including a software token.
+	- Combinations that cannot work (unsupported mechanism, payload larger than an RSA modulus allows) are skipped.
+	- Worker sessions come from one session pool for the whole run, so no cell pays for C_OpenSession.
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include "../common/bench_stats.h"
+#include "../common/session_pool.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+#define MAX_LIST 16
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+
+// Key families, each with its own list of key sizes.
+typedef enum { FAMILY_AES, FAMILY_DES3, FAMILY_RSA, FAMILY_EC, FAMILY_HMAC, FAMILY_EDWARDS } KeyFamily;
+
+
+// Mechanisms covered by the matrix. One entry per sample in encryption/ and signing/.
+typedef struct
+{
+	const char *option; // value accepted by --mechanisms
+	const char *name;
+	CK_MECHANISM_TYPE type;
+	int sign; // 1 for C_Sign, 0 for C_Encrypt
+	KeyFamily family;
+} MatrixMechanism;
+
+MatrixMechanism matrixMechanisms[] =
+{
+	{"aes-cbc-pad",		"CKM_AES_CBC_PAD",		CKM_AES_CBC_PAD,		0,	FAMILY_AES},
+	{"aes-ecb",		"CKM_AES_ECB",			CKM_AES_ECB,			0,	FAMILY_AES},
+	{"aes-ctr",		"CKM_AES_CTR",			CKM_AES_CTR,			0,	FAMILY_AES},
+	{"aes-gcm",		"CKM_AES_GCM",			CKM_AES_GCM,			0,	FAMILY_AES},
+	{"des3-cbc-pad",	"CKM_DES3_CBC_PAD",		CKM_DES3_CBC_PAD,		0,	FAMILY_DES3},
+	{"rsa-pkcs",		"CKM_RSA_PKCS",			CKM_RSA_PKCS,			0,	FAMILY_RSA},
+	{"rsa-pkcs-oaep",	"CKM_RSA_PKCS_OAEP",		CKM_RSA_PKCS_OAEP,		0,	FAMILY_RSA},
+	{"sha256-rsa-pkcs",	"CKM_SHA256_RSA_PKCS",		CKM_SHA256_RSA_PKCS,		1,	FAMILY_RSA},
+	{"sha256-rsa-pkcs-pss",	"CKM_SHA256_RSA_PKCS_PSS",	CKM_SHA256_RSA_PKCS_PSS,	1,	FAMILY_RSA},
+	{"ecdsa",		"CKM_ECDSA",			CKM_ECDSA,			1,	FAMILY_EC},
+	{"ecdsa-sha256",	"CKM_ECDSA_SHA256",		CKM_ECDSA_SHA256,		1,	FAMILY_EC},
+	{"eddsa",		"CKM_EDDSA",			CKM_EDDSA,			1,	FAMILY_EDWARDS},
+	{"sha256-hmac",		"CKM_SHA256_HMAC",		CKM_SHA256_HMAC,		1,	FAMILY_HMAC},
+	{"aes-cmac",		"CKM_AES_CMAC",			CKM_AES_CMAC,			1,	FAMILY_AES}
+};
+#define MECHANISM_COUNT (sizeof(matrixMechanisms)/sizeof(*matrixMechanisms))
+
+
+// Sweep settings. Key sizes are in bits, payloads in bytes.
+int selected[MECHANISM_COUNT];
+CK_ULONG aesSizes[MAX_LIST] = {128, 256};		int aesSizeCount = 2;
+CK_ULONG rsaSizes[MAX_LIST] = {2048, 4096};		int rsaSizeCount = 2;
+CK_ULONG ecSizes[MAX_LIST] = {256, 384};		int ecSizeCount = 2;
+CK_ULONG payloads[MAX_LIST] = {16, 256, 4096, 65536, 1048576};	int payloadCount = 5;
+CK_ULONG threadCounts[MAX_LIST] = {1, 4};		int threadCountCount = 2;
+int durationSec = 2; // length of each measurement.
+int opsPerThread = 0; // when set, each thread does a fixed number of operations instead of running for durationSec.
+int warmupOps = 5;
+int hsmGcmIv = 0; // pass a NULL IV to CKM_AES_GCM so the HSM generates it (Luna in FIPS mode).
+char *jsonPath = NULL;
+char *csvPath = NULL;
+SessionPool *sessionPool = NULL; // sized for the largest thread count.
+
+
+// Keys generated for the run, one per family and size.
+typedef struct
+{
+	KeyFamily family;
+	CK_ULONG bits;
+	CK_OBJECT_HANDLE hKey; // secret key or private key.
+	CK_OBJECT_HANDLE hPublic;
+	CK_RV rv; // result of key generation.
+	atomic_ulong ivCounter; // IV / counter block of the next operation, unique for the key across the whole run.
+} MatrixKey;
+
+MatrixKey keys[4 * MAX_LIST];
+int keyCount = 0;
+
+
+// One cell of the matrix, shared by its worker threads.
+typedef struct
+{
+	const MatrixMechanism *mech;
+	MatrixKey *key;
+	CK_ULONG payload;
+	CK_BYTE *input;
+	pthread_barrier_t barrier;
+	atomic_int stop;
+} MatrixCell;
+
+typedef struct
+{
+	MatrixCell *cell;
+	LatencyRecorder latency;
+	unsigned long errors;
+	CK_RV lastError;
+	double started; // measured phase of this thread, used for the wall time of the cell.
+	double finished;
+} MatrixWorker;
+
+
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Connects to a Luna slot (C_Initialize, C_OpenSession, C_Login)
+void connectToLunaSlot()
+{
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Disconnects from Luna slot (C_Logout, C_CloseSession and C_Finalize)
+void disconnectFromLunaSlot()
+{
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+
+
+// Generates the key used by every mechanism of a family and size. Failures are kept in key->rv so the cells can be skipped.
+void generateMatrixKey(MatrixKey *key)
+{
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_ULONG valueLen = key->bits / 8;
+	CK_KEY_TYPE genericKeyType = CKK_GENERIC_SECRET;
+	CK_BYTE exp[] = {0x01, 0x00, 0x01};
+	CK_BYTE p256[] = {0x06,0x08,0x2A,0x86,0x48,0xCE,0x3D,0x03,0x01,0x07}; // secp256r1
+	CK_BYTE p384[] = {0x06,0x05,0x2B,0x81,0x04,0x00,0x22}; // secp384r1
+	CK_BYTE p521[] = {0x06,0x05,0x2B,0x81,0x04,0x00,0x23}; // secp521r1
+	CK_BYTE ed25519[] = {0x06,0x09,0x2B,0x06,0x01,0x04,0x01,0xDA,0x47,0x0F,0x01}; // Ed25519, oid 1.3.6.1.4.1.11591.15.1
+	CK_MECHANISM mech = {CKM_AES_KEY_GEN, NULL_PTR, 0};
+
+	CK_ATTRIBUTE secretAttrib[] =
+	{
+		{CKA_TOKEN,	&no,	sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_SIGN,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_VERIFY,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_VALUE_LEN,	&valueLen,	sizeof(CK_ULONG)},
+		{CKA_KEY_TYPE,	&genericKeyType,	sizeof(CK_KEY_TYPE)}
+	};
+	CK_ULONG secretAttribLen = sizeof(secretAttrib)/sizeof(*secretAttrib) - 1; // CKA_KEY_TYPE is only needed for HMAC keys.
+
+	CK_ATTRIBUTE attribPub[] =
+	{
+		{CKA_TOKEN,	&no,	sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_VERIFY,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_MODULUS_BITS,	&key->bits,	sizeof(CK_ULONG)}, // replaced by CKA_EC_PARAMS for EC keys.
+		{CKA_PUBLIC_EXPONENT,	&exp,	sizeof(exp)}
+	};
+	CK_ULONG attribPubLen = sizeof(attribPub)/sizeof(*attribPub);
+
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,	&no,	sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,	sizeof(CK_BBOOL)},
+		{CKA_SIGN,	&yes,	sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,	&yes,	sizeof(CK_BBOOL)}
+	};
+	CK_ULONG attribPriLen = sizeof(attribPri)/sizeof(*attribPri);
+
+	switch(key->family)
+	{
+		case FAMILY_AES:
+			key->rv = p11Func->C_GenerateKey(hSession, &mech, secretAttrib, secretAttribLen, &key->hKey);
+			break;
+
+		case FAMILY_DES3:
+			mech.mechanism = CKM_DES3_KEY_GEN;
+			key->rv = p11Func->C_GenerateKey(hSession, &mech, secretAttrib, secretAttribLen - 1, &key->hKey); // no CKA_VALUE_LEN for DES3.
+			break;
+
+		case FAMILY_HMAC:
+			mech.mechanism = CKM_GENERIC_SECRET_KEY_GEN;
+			key->rv = p11Func->C_GenerateKey(hSession, &mech, secretAttrib, secretAttribLen + 1, &key->hKey);
+			break;
+
+		case FAMILY_RSA:
+			mech.mechanism = CKM_RSA_PKCS_KEY_PAIR_GEN;
+			key->rv = p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, attribPubLen, attribPri, attribPriLen, &key->hPublic, &key->hKey);
+			break;
+
+		case FAMILY_EC:
+			mech.mechanism = CKM_EC_KEY_PAIR_GEN;
+			attribPub[4].type = CKA_EC_PARAMS;
+			attribPub[4].pValue = (key->bits==384) ? p384 : (key->bits==521) ? p521 : p256;
+			attribPub[4].ulValueLen = (key->bits==384) ? sizeof(p384) : (key->bits==521) ? sizeof(p521) : sizeof(p256);
+			key->rv = p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, attribPubLen - 1, attribPri, attribPriLen, &key->hPublic, &key->hKey);
+			break;
+
+		case FAMILY_EDWARDS:
+			mech.mechanism = CKM_EC_EDWARDS_KEY_PAIR_GEN;
+			attribPub[4].type = CKA_EC_PARAMS;
+			attribPub[4].pValue = ed25519;
+			attribPub[4].ulValueLen = sizeof(ed25519);
+			key->rv = p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, attribPubLen - 1, attribPri, attribPriLen, &key->hPublic, &key->hKey);
+			break;
+	}
+
+	if(key->rv==CKR_OK)
+		printf("  --> Generated %s key (%lu bits).\n", (key->family==FAMILY_AES) ? "AES" : (key->family==FAMILY_DES3) ? "DES3" :
+			(key->family==FAMILY_HMAC) ? "generic secret" : (key->family==FAMILY_RSA) ? "RSA" : (key->family==FAMILY_EDWARDS) ? "Ed25519" : "EC",
+			key->bits);
+	else
+		printf("  --> Key generation for family %d (%lu bits) failed with 0x%lX, its cells are skipped.\n", key->family, key->bits, key->rv);
+}
+
+
+
+// Returns the key for a family and size, generating it on first use.
+MatrixKey *getMatrixKey(KeyFamily family, CK_ULONG bits)
+{
+	for(int ctr=0; ctr<keyCount; ctr++)
+	{
+		if(keys[ctr].family==family && keys[ctr].bits==bits)
+			return &keys[ctr];
+	}
+	keys[keyCount].family = family;
+	keys[keyCount].bits = bits;
+	generateMatrixKey(&keys[keyCount]);
+	return &keys[keyCount++];
+}
+
+
+
+// Largest payload a mechanism accepts for a key size, or 0 when there is no practical limit.
+CK_ULONG payloadLimit(const MatrixMechanism *mech, CK_ULONG bits)
+{
+	switch(mech->type)
+	{
+		case CKM_RSA_PKCS: return bits/8 - 11;
+		case CKM_RSA_PKCS_OAEP: return bits/8 - 2*32 - 2; // SHA-256 OAEP.
+		case CKM_ECDSA: return 64; // raw ECDSA signs a digest.
+		default: return 0;
+	}
+}
+
+
+
+// Returns 1 when the slot supports the mechanism.
+int mechanismSupported(CK_MECHANISM_TYPE type)
+{
+	CK_MECHANISM_INFO info;
+	return p11Func->C_GetMechanismInfo(slotId, type, &info)==CKR_OK;
+}
+
+
+
+// Runs one encrypt or sign operation of the cell. Every operation takes the next IV / counter of the key, so no
+// IV is used twice with a key, whichever cell or thread uses it.
+CK_RV runMatrixOperation(CK_SESSION_HANDLE hWorkerSession, MatrixCell *cell, CK_BYTE *output, CK_ULONG outputSize)
+{
+	unsigned long counter = atomic_fetch_add(&cell->key->ivCounter, 1);
+	CK_BYTE iv[16] = {0};
+	CK_AES_CTR_PARAMS ctrParam;
+	CK_AES_GCM_PARAMS gcmParam;
+	CK_RSA_PKCS_OAEP_PARAMS oaepParam = {CKM_SHA256, CKG_MGF1_SHA256, CKZ_DATA_SPECIFIED, NULL_PTR, 0};
+	CK_RSA_PKCS_PSS_PARAMS pssParam = {CKM_SHA256, CKG_MGF1_SHA256, 32};
+	CK_MECHANISM mech = {cell->mech->type, NULL_PTR, 0};
+	CK_OBJECT_HANDLE hKey = cell->key->hKey;
+	CK_ULONG outLen = outputSize;
+	CK_RV rv;
+
+	memcpy(iv, &counter, sizeof(counter));
+	switch(cell->mech->type)
+	{
+		case CKM_AES_CBC_PAD:
+			mech.pParameter = iv;
+			mech.ulParameterLen = 16;
+			break;
+		case CKM_DES3_CBC_PAD:
+			mech.pParameter = iv;
+			mech.ulParameterLen = 8;
+			break;
+		case CKM_AES_CTR:
+			ctrParam.ulCounterBits = 64;
+			memcpy(ctrParam.cb, iv, sizeof(iv));
+			mech.pParameter = &ctrParam;
+			mech.ulParameterLen = sizeof(ctrParam);
+			break;
+		case CKM_AES_GCM:
+			memset(&gcmParam, 0, sizeof(gcmParam));
+			gcmParam.pIv = hsmGcmIv ? NULL_PTR : iv;
+			gcmParam.ulIvLen = hsmGcmIv ? 0 : 12;
+			gcmParam.ulIvBits = gcmParam.ulIvLen * 8;
+			gcmParam.ulTagBits = 128;
+			mech.pParameter = &gcmParam;
+			mech.ulParameterLen = sizeof(gcmParam);
+			break;
+		case CKM_RSA_PKCS_OAEP:
+			mech.pParameter = &oaepParam;
+			mech.ulParameterLen = sizeof(oaepParam);
+			break;
+		case CKM_SHA256_RSA_PKCS_PSS:
+			mech.pParameter = &pssParam;
+			mech.ulParameterLen = sizeof(pssParam);
+			break;
+	}
+
+	if(cell->mech->sign)
+	{
+		rv = p11Func->C_SignInit(hWorkerSession, &mech, hKey);
+		if(rv==CKR_OK)
+			rv = p11Func->C_Sign(hWorkerSession, cell->input, cell->payload, output, &outLen);
+	}
+	else
+	{
+		if(cell->key->family==FAMILY_RSA)
+			hKey = cell->key->hPublic;
+		rv = p11Func->C_EncryptInit(hWorkerSession, &mech, hKey);
+		if(rv==CKR_OK)
+			rv = p11Func->C_Encrypt(hWorkerSession, cell->input, cell->payload, output, &outLen);
+	}
+	return rv;
+}
+
+
+
+// Worker thread of a cell. The output buffer is allocated once, big enough for any padding, tag or signature.
+void *matrixWorker(void *arg)
+{
+	MatrixWorker *worker = (MatrixWorker*)arg;
+	MatrixCell *cell = worker->cell;
+	PooledSession *session = NULL;
+	CK_SESSION_HANDLE hWorkerSession = 0;
+	CK_ULONG outputSize = cell->payload + 1024;
+	CK_BYTE *output = (CK_BYTE*)malloc(outputSize);
+	double start = 0;
+	CK_RV rv;
+
+	if(output==NULL)
+	{
+		// counted as an error of the cell; the barrier is still passed so the other threads are not blocked.
+		worker->errors = 1;
+		worker->lastError = CKR_HOST_MEMORY;
+		pthread_barrier_wait(&cell->barrier);
+		worker->started = worker->finished = benchNowMicros();
+		return 0;
+	}
+	checkOperation(sessionPoolAcquire(sessionPool, &session), "sessionPoolAcquire");
+	hWorkerSession = session->hSession;
+
+	for(int ctr=0; ctr<warmupOps; ctr++)
+		runMatrixOperation(hWorkerSession, cell, output, outputSize);
+
+	pthread_barrier_wait(&cell->barrier);
+	worker->started = benchNowMicros();
+
+	for(int ctr=0; (opsPerThread>0) ? (ctr<opsPerThread) : !atomic_load(&cell->stop); ctr++)
+	{
+		start = benchNowMicros();
+		rv = runMatrixOperation(hWorkerSession, cell, output, outputSize);
+		if(rv==CKR_OK)
+			latencyRecord(&worker->latency, benchNowMicros() - start);
+		else
+		{
+			worker->errors++;
+			worker->lastError = rv;
+		}
+	}
+	worker->finished = benchNowMicros();
+
+	sessionPoolRelease(sessionPool, session, (worker->errors>0) ? worker->lastError : CKR_OK);
+	free(output);
+	return 0;
+}
+
+
+
+// Measures one combination of mechanism, key, payload and thread count.
+void runCell(const MatrixMechanism *mech, MatrixKey *key, CK_ULONG payload, int threads, CK_BYTE *input, BenchResult *result)
+{
+	MatrixCell cell;
+	pthread_t *tid = (pthread_t*)malloc(threads * sizeof(pthread_t));
+	MatrixWorker *workers = (MatrixWorker*)calloc(threads, sizeof(MatrixWorker));
+	LatencyRecorder all;
+	CK_RV lastError = CKR_OK;
+	double start = 0;
+	double end = 0;
+
+	cell.mech = mech;
+	cell.key = key;
+	cell.payload = payload;
+	cell.input = input;
+	atomic_init(&cell.stop, 0);
+	pthread_barrier_init(&cell.barrier, NULL, threads+1);
+
+	memset(result, 0, sizeof(*result));
+	snprintf(result->mechanism, sizeof(result->mechanism), "%s", mech->name);
+	result->keySize = key->bits;
+	result->payload = payload;
+	result->threads = threads;
+
+	for(int ctr=0; ctr<threads; ctr++)
+	{
+		workers[ctr].cell = &cell;
+		latencyInit(&workers[ctr].latency, (opsPerThread>0) ? opsPerThread : 0);
+		pthread_create(&tid[ctr], NULL, &matrixWorker, &workers[ctr]);
+	}
+
+	pthread_barrier_wait(&cell.barrier);
+	if(opsPerThread<=0)
+	{
+		sleep(durationSec);
+		atomic_store(&cell.stop, 1);
+	}
+	for(int ctr=0; ctr<threads; ctr++)
+		pthread_join(tid[ctr], NULL);
+
+	latencyInit(&all, 0);
+	for(int ctr=0; ctr<threads; ctr++)
+	{
+		latencyMerge(&all, &workers[ctr].latency);
+		if(ctr==0 || workers[ctr].started<start)
+			start = workers[ctr].started;
+		if(workers[ctr].finished>end)
+			end = workers[ctr].finished;
+		result->errors += workers[ctr].errors;
+		if(workers[ctr].errors>0)
+			lastError = workers[ctr].lastError;
+		latencyFree(&workers[ctr].latency);
+	}
+	benchSummarize(&all, (end - start) / 1e6, result);
+	latencyFree(&all);
+
+	printf("  --> %-24s %5lu bits %8lu bytes %3d threads : %10.1f ops/sec %9.2f MB/sec p99 %8.3f ms",
+		mech->name, key->bits, payload, threads, result->opsPerSec, result->mbPerSec, result->p99/1000);
+	if(result->errors>0)
+		printf("  (%lu errors, last 0x%lX)", result->errors, lastError);
+	printf("\n");
+
+	pthread_barrier_destroy(&cell.barrier);
+	free(workers);
+	free(tid);
+}
+
+
+
+// Runs the whole sweep and writes the reports.
+void runMatrix()
+{
+	size_t maxResults = MECHANISM_COUNT * MAX_LIST * MAX_LIST * MAX_LIST;
+	BenchResult *results = (BenchResult*)calloc(maxResults, sizeof(BenchResult));
+	size_t resultCount = 0;
+	CK_ULONG maxPayload = 0;
+	CK_BYTE *input = NULL;
+	CK_ULONG des3Size[] = {192};
+	CK_ULONG hmacSize[] = {256};
+	CK_ULONG edwardsSize[] = {255}; // Ed25519.
+	CK_ULONG maxThreads = 0;
+	CK_RV rv = CKR_OK;
+
+	for(int ctr=0; ctr<payloadCount; ctr++)
+	{
+		if(payloads[ctr]>maxPayload)
+			maxPayload = payloads[ctr];
+	}
+	for(int ctr=0; ctr<threadCountCount; ctr++)
+	{
+		if(threadCounts[ctr]>maxThreads)
+			maxThreads = threadCounts[ctr];
+	}
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), maxThreads, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+
+	input = (CK_BYTE*)malloc(maxPayload);
+	checkOperation(p11Func->C_GenerateRandom(hSession, input, maxPayload), "C_GenerateRandom");
+
+	printf("\n> Running the matrix (%s per cell).\n", (opsPerThread>0) ? "fixed operations" : "fixed duration");
+	for(size_t m=0; m<MECHANISM_COUNT; m++)
+	{
+		const MatrixMechanism *mech = &matrixMechanisms[m];
+		CK_ULONG *sizes = aesSizes;
+		int sizeCount = aesSizeCount;
+
+		if(!selected[m])
+			continue;
+		if(!mechanismSupported(mech->type))
+		{
+			printf("  --> %s is not supported by slot %lu, skipped.\n", mech->name, slotId);
+			continue;
+		}
+
+		switch(mech->family)
+		{
+			case FAMILY_RSA: sizes = rsaSizes; sizeCount = rsaSizeCount; break;
+			case FAMILY_EC: sizes = ecSizes; sizeCount = ecSizeCount; break;
+			case FAMILY_DES3: sizes = des3Size; sizeCount = 1; break;
+			case FAMILY_HMAC: sizes = hmacSize; sizeCount = 1; break;
+			case FAMILY_EDWARDS: sizes = edwardsSize; sizeCount = 1; break;
+			default: break;
+		}
+
+		for(int k=0; k<sizeCount; k++)
+		{
+			MatrixKey *key = getMatrixKey(mech->family, sizes[k]);
+			CK_ULONG limit = payloadLimit(mech, sizes[k]);
+			if(key->rv!=CKR_OK)
+				continue;
+
+			for(int p=0; p<payloadCount; p++)
+			{
+				if(limit>0 && payloads[p]>limit)
+					continue;
+				for(int t=0; t<threadCountCount; t++)
+					runCell(mech, key, payloads[p], (int)threadCounts[t], input, &results[resultCount++]);
+			}
+		}
+	}
+
+	benchPrintTable(stdout, results, resultCount);
+	if(jsonPath!=NULL)
+		benchSaveJson(jsonPath, "Mechanism_Matrix_Benchmark", results, resultCount);
+	if(csvPath!=NULL)
+		benchSaveCsv(csvPath, results, resultCount);
+
+	sessionPoolDestroy(sessionPool);
+	free(input);
+	free(results);
+}
+
+
+
+// Parses a comma separated list of numbers. Sizes may use a K or M suffix (1K = 1024).
+int parseList(const char *text, CK_ULONG *list)
+{
+	int count = 0;
+	char *end = NULL;
+
+	while(*text!='\0' && count<MAX_LIST)
+	{
+		CK_ULONG value = strtoul(text, &end, 10);
+		if(end==text)
+			break;
+		if(*end=='K' || *end=='k')
+		{
+			value *= 1024;
+			end++;
+		}
+		else if(*end=='M' || *end=='m')
+		{
+			value *= 1024 * 1024;
+			end++;
+		}
+		if(value>0)
+			list[count++] = value;
+		text = (*end==',') ? end+1 : end;
+		if(end==text && *end!='\0')
+			break;
+	}
+	return count;
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --mechanisms <list>  mechanisms to run (default all) :\n                       ");
+	for(size_t ctr=0; ctr<MECHANISM_COUNT; ctr++)
+		printf("%s%s", matrixMechanisms[ctr].option, (ctr+1<MECHANISM_COUNT) ? "," : "\n");
+	printf("  --aes-sizes <list>   AES key sizes in bits (default 128,256).\n");
+	printf("  --rsa-sizes <list>   RSA key sizes in bits (default 2048,4096).\n");
+	printf("  --ec-sizes <list>    EC curve sizes (default 256,384).\n");
+	printf("  --payloads <list>    payload sizes in bytes, K and M suffixes allowed (default 16,256,4K,64K,1M).\n");
+	printf("  --threads <list>     thread counts (default 1,4).\n");
+	printf("  --duration <sec>     measurement time per cell (default 2).\n");
+	printf("  --ops <n>            fixed number of operations per thread instead of --duration.\n");
+	printf("  --warmup <n>         unmeasured operations per thread before each cell (default 5).\n");
+	printf("  --hsm-gcm-iv         let the HSM generate the CKM_AES_GCM IV (Luna in FIPS mode).\n");
+	printf("  --json <file>        write the results as JSON ('-' for stdout).\n");
+	printf("  --csv <file>         write the results as CSV ('-' for stdout).\n\n");
+}
+
+
+
+// Reads the sweep options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	int mechanismsSet = 0;
+	struct option longOptions[] =
+	{
+		{"mechanisms",	required_argument,	NULL,	'm'},
+		{"aes-sizes",	required_argument,	NULL,	'a'},
+		{"rsa-sizes",	required_argument,	NULL,	'r'},
+		{"ec-sizes",	required_argument,	NULL,	'e'},
+		{"payloads",	required_argument,	NULL,	'p'},
+		{"threads",	required_argument,	NULL,	't'},
+		{"duration",	required_argument,	NULL,	'd'},
+		{"ops",		required_argument,	NULL,	'o'},
+		{"warmup",	required_argument,	NULL,	'w'},
+		{"hsm-gcm-iv",	no_argument,		NULL,	'g'},
+		{"json",	required_argument,	NULL,	'j'},
+		{"csv",		required_argument,	NULL,	'c'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'm':
+			{
+				char *list = strdup(optarg);
+				for(char *name = strtok(list, ","); name!=NULL; name = strtok(NULL, ","))
+				{
+					size_t ctr = 0;
+					for(ctr=0; ctr<MECHANISM_COUNT; ctr++)
+					{
+						if(strcmp(name, matrixMechanisms[ctr].option)==0)
+							break;
+					}
+					if(ctr==MECHANISM_COUNT)
+					{
+						printf("Unknown mechanism : %s\n", name);
+						usage(exeName);
+						exit(1);
+					}
+					selected[ctr] = 1;
+				}
+				free(list);
+				mechanismsSet = 1;
+				break;
+			}
+			case 'a': aesSizeCount = parseList(optarg, aesSizes); break;
+			case 'r': rsaSizeCount = parseList(optarg, rsaSizes); break;
+			case 'e': ecSizeCount = parseList(optarg, ecSizes); break;
+			case 'p': payloadCount = parseList(optarg, payloads); break;
+			case 't': threadCountCount = parseList(optarg, threadCounts); break;
+			case 'd': durationSec = atoi(optarg); break;
+			case 'o': opsPerThread = atoi(optarg); break;
+			case 'w': warmupOps = atoi(optarg); break;
+			case 'g': hsmGcmIv = 1; break;
+			case 'j': jsonPath = optarg; break;
+			case 'c': csvPath = optarg; break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+
+	if(!mechanismsSet)
+	{
+		for(size_t ctr=0; ctr<MECHANISM_COUNT; ctr++)
+			selected[ctr] = 1;
+	}
+	if(payloadCount==0 || threadCountCount==0 || (opsPerThread<=0 && durationSec<=0))
+	{
+		usage(exeName);
+		exit(1);
+	}
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	runMatrix();
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
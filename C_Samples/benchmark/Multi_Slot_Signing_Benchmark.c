@@ -0,0 +1,596 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This sample signs on several slots (HSM partitions) at once, to scale throughput horizontally.
+	- A session pool is opened on every slot, and each sign operation is sent by common/slot_balancer.c to the slot
+	  with the lowest measured latency x requests in flight.
+	- A slot that keeps returning errors is drained, probed again after a cooldown, and brought back when it works.
+	- Every slot needs its own key : by default a session keypair is generated on each slot, or --label picks an
+	  existing private key with that CKA_LABEL on every slot (for example a key cloned to each partition).
+	- Per-slot throughput is printed every second, and the run is summarised like the other benchmarks.
+	- Example :-
+		Multi_Slot_Signing_Benchmark all userpin --threads 16 --duration 30 --mechanism ecdsa-sha256
+		Multi_Slot_Signing_Benchmark 0,1,2 userpin --threads 8 --ops 1000 --label signing-key --json slots.json
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include "../common/bench_stats.h"
+#include "../common/session_pool.h"
+#include "../common/slot_balancer.h"
+#include "../common/crypto_ops.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+#define MAX_SLOTS 64
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_BYTE *slotPin = NULL; // slot password
+
+char *slotList = NULL; // "all" or a comma separated list of slot ids.
+CK_SLOT_ID slotIds[MAX_SLOTS];
+int slotCount = 0;
+SlotBalancer *balancer = NULL;
+CryptoKeyInfo slotKeys[MAX_SLOTS]; // signing key of every slot.
+
+CK_BYTE plainText[] = "Hello World, I've been waiting for the chance to see your face.";
+int nThreads = 4;
+int ops = 1000;
+int durationSec = 0; // when set, threads keep signing for this many seconds instead of a fixed number of operations.
+int warmupOps = 0;
+int sessionsPerSlot = 0; // defaults to the number of threads.
+CK_ULONG keySize = 2048;
+char *keyLabel = NULL;
+char *jsonPath = NULL;
+char *csvPath = NULL;
+atomic_int stopSigning = 0;
+pthread_barrier_t startBarrier;
+
+
+// Signing mechanisms that can be benchmarked.
+typedef struct
+{
+	const char *option; // value accepted by --mechanism
+	const char *name;
+	CK_MECHANISM_TYPE type;
+	CK_KEY_TYPE keyType;
+} SignMechanism;
+
+SignMechanism signMechanisms[] =
+{
+	{"sha256-rsa-pkcs",	"CKM_SHA256_RSA_PKCS",		CKM_SHA256_RSA_PKCS,		CKK_RSA},
+	{"sha256-rsa-pkcs-pss",	"CKM_SHA256_RSA_PKCS_PSS",	CKM_SHA256_RSA_PKCS_PSS,	CKK_RSA},
+	{"ecdsa-sha256",	"CKM_ECDSA_SHA256",		CKM_ECDSA_SHA256,		CKK_EC},
+	{"eddsa",		"CKM_EDDSA",			CKM_EDDSA,			CKK_EC_EDWARDS}
+};
+SignMechanism *signMech = &signMechanisms[0];
+CK_RSA_PKCS_PSS_PARAMS pssParams = {CKM_SHA256, CKG_MGF1_SHA256, 32};
+
+
+// State owned by each signing thread.
+typedef struct
+{
+	LatencyRecorder latency;
+	unsigned long errors;
+	CK_RV lastError;
+	double started;
+	double finished;
+	CryptoBuffer signature;
+} SignWorker;
+
+
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+
+
+// Initializes the library and opens a session pool on every selected slot.
+void connectToLunaSlots()
+{
+	CK_RV rv = CKR_OK;
+	char *token = NULL;
+
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	if(strcmp(slotList, "all")==0)
+		slotCount = slotBalancerListSlots(p11Func, slotIds, MAX_SLOTS);
+	else
+	{
+		for(token = strtok(slotList, ","); token!=NULL && slotCount<MAX_SLOTS; token = strtok(NULL, ","))
+			slotIds[slotCount++] = strtoul(token, NULL, 10);
+	}
+	if(slotCount==0)
+	{
+		printf("No slot with a token present.\n");
+		exit(1);
+	}
+
+	balancer = slotBalancerCreate(p11Func, slotIds, slotCount, CKU_USER, slotPin, strlen(slotPin), sessionsPerSlot, &rv);
+	checkOperation(rv, "slotBalancerCreate");
+	printf("\n> Connected to Luna.\n");
+	for(int ctr=0; ctr<slotCount; ctr++)
+	{
+		BalancedSlotStats stats;
+		slotBalancerGetStats(balancer, ctr, &stats);
+		printf("  --> SLOT ID : %lu%s\n", stats.slotId, stats.available ? "." : " (could not log in, not used).");
+	}
+}
+
+
+
+// Closes every pool and finalizes the library.
+void disconnectFromLunaSlots()
+{
+	slotBalancerDestroy(balancer);
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slots.\n\n");
+}
+
+
+
+// Generates the session keypair used for signing on one slot.
+CK_RV generateKeyPair(CK_SESSION_HANDLE hSlotSession, CK_OBJECT_HANDLE *hPrivate)
+{
+	CK_MECHANISM rsaMech = {CKM_RSA_PKCS_KEY_PAIR_GEN};
+	CK_MECHANISM ecMech = {CKM_EC_KEY_PAIR_GEN};
+	CK_MECHANISM edMech = {CKM_EC_EDWARDS_KEY_PAIR_GEN};
+	CK_OBJECT_HANDLE hPublic = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_BYTE exp[] = {0x01, 0x00, 0x01};
+	CK_BYTE p256[] = {0x06,0x08,0x2A,0x86,0x48,0xCE,0x3D,0x03,0x01,0x07}; // secp256r1
+	CK_BYTE ed25519[] = {0x06,0x09,0x2B,0x06,0x01,0x04,0x01,0xDA,0x47,0x0F,0x01}; // Ed25519, oid 1.3.6.1.4.1.11591.15.1
+
+	CK_ATTRIBUTE rsaPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_MODULUS_BITS,	&keySize,	sizeof(CK_ULONG)},
+		{CKA_PUBLIC_EXPONENT,	&exp,		sizeof(exp)}
+	};
+	CK_ATTRIBUTE ecPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,		p256,		sizeof(p256)}
+	};
+	CK_ATTRIBUTE edPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,		ed25519,	sizeof(ed25519)}
+	};
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SIGN,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,		sizeof(CK_BBOOL)}
+	};
+
+	if(signMech->keyType==CKK_EC)
+		return p11Func->C_GenerateKeyPair(hSlotSession, &ecMech, ecPub, sizeof(ecPub)/sizeof(*ecPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, hPrivate);
+	if(signMech->keyType==CKK_EC_EDWARDS)
+		return p11Func->C_GenerateKeyPair(hSlotSession, &edMech, edPub, sizeof(edPub)/sizeof(*edPub),
+			attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, hPrivate);
+	return p11Func->C_GenerateKeyPair(hSlotSession, &rsaMech, rsaPub, sizeof(rsaPub)/sizeof(*rsaPub),
+		attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, hPrivate);
+}
+
+
+
+// Finds the private key named keyLabel on one slot.
+CK_RV findKeyByLabel(CK_SESSION_HANDLE hSlotSession, CK_OBJECT_HANDLE *hPrivate)
+{
+	CK_OBJECT_CLASS keyClass = CKO_PRIVATE_KEY;
+	CK_ULONG found = 0;
+	CK_RV rv;
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_LABEL,	keyLabel,	strlen(keyLabel)},
+		{CKA_CLASS,	&keyClass,	sizeof(keyClass)}
+	};
+
+	rv = p11Func->C_FindObjectsInit(hSlotSession, attrib, sizeof(attrib)/sizeof(*attrib));
+	if(rv!=CKR_OK)
+		return rv;
+	rv = p11Func->C_FindObjects(hSlotSession, hPrivate, 1, &found);
+	p11Func->C_FindObjectsFinal(hSlotSession);
+	if(rv==CKR_OK && found==0)
+		rv = CKR_KEY_HANDLE_INVALID;
+	return rv;
+}
+
+
+
+// Prepares the signing key of every usable slot.
+void prepareSlotKeys()
+{
+	BalancedSession session;
+	CK_OBJECT_HANDLE hPrivate = 0;
+	CK_RV rv;
+
+	printf("\n> %s signing keys.\n", (keyLabel!=NULL) ? "Finding" : "Generating");
+	for(int ctr=0; ctr<slotCount; ctr++)
+	{
+		if(slotBalancerAcquireSlot(balancer, ctr, &session)!=CKR_OK)
+			continue;
+		rv = (keyLabel!=NULL) ? findKeyByLabel(session.session->hSession, &hPrivate)
+			: generateKeyPair(session.session->hSession, &hPrivate);
+		if(rv==CKR_OK)
+			rv = cryptoKeyInfo(p11Func, session.session->hSession, hPrivate, &slotKeys[ctr]);
+		slotBalancerRelease(balancer, &session, CKR_OK);
+		checkOperation(rv, "key setup");
+		printf("  --> Slot %lu : key handle %lu.\n", slotIds[ctr], hPrivate);
+	}
+}
+
+
+
+// Signs once on whichever slot the balancer picks.
+CK_RV signOnBalancedSlot(SignWorker *worker, CK_MECHANISM *mech)
+{
+	BalancedSession session;
+	CK_ULONG sigLen = 0;
+	CK_RV rv = slotBalancerAcquire(balancer, &session);
+
+	if(rv!=CKR_OK)
+		return rv;
+	rv = cryptoSign(p11Func, session.session->hSession, mech, &slotKeys[session.slot],
+		plainText, sizeof(plainText)-1, &worker->signature, &sigLen);
+	slotBalancerRelease(balancer, &session, rv);
+	return rv;
+}
+
+
+
+// This function signs the plaintext and records the latency of every operation.
+void *signData(void *arg)
+{
+	SignWorker *worker = (SignWorker*)arg;
+	CK_MECHANISM mech = {signMech->type, NULL_PTR, 0};
+	double start = 0;
+	CK_RV rv;
+
+	if(signMech->type==CKM_SHA256_RSA_PKCS_PSS)
+	{
+		mech.pParameter = &pssParams;
+		mech.ulParameterLen = sizeof(pssParams);
+	}
+
+	for(int ctr=0;ctr<warmupOps;ctr++)
+		signOnBalancedSlot(worker, &mech);
+
+	pthread_barrier_wait(&startBarrier);
+	worker->started = benchNowMicros();
+	for(int ctr=0; (durationSec>0) ? !atomic_load(&stopSigning) : (ctr<ops); ctr++)
+	{
+		start = benchNowMicros();
+		rv = signOnBalancedSlot(worker, &mech);
+		if(rv==CKR_OK)
+			latencyRecord(&worker->latency, benchNowMicros() - start);
+		else
+		{
+			worker->errors++;
+			worker->lastError = rv;
+			usleep(1000); // do not spin while every slot is drained.
+		}
+	}
+	worker->finished = benchNowMicros();
+	return 0;
+}
+
+
+
+// Prints the state of every slot, with the throughput since the previous report.
+void printSlots(unsigned long *previousOps, double intervalSec)
+{
+	BalancedSlotStats stats;
+
+	for(int ctr=0; ctr<slotCount; ctr++)
+	{
+		slotBalancerGetStats(balancer, ctr, &stats);
+		printf("  slot %-4lu %-9s %8.1f ops/sec   latency %8.1f us   in flight %3d   errors %lu   drained %lu times\n",
+			stats.slotId, !stats.available ? "unused" : (stats.drained ? "drained" : "active"),
+			(stats.ops - previousOps[ctr]) / intervalSec, stats.latency, stats.inFlight, stats.errors, stats.drains);
+		previousOps[ctr] = stats.ops;
+	}
+}
+
+
+
+// Starts the signing threads, waits for them and reports the measured throughput and latency.
+void runBenchmark()
+{
+	pthread_t *sign = (pthread_t*)malloc(nThreads * sizeof(pthread_t));
+	SignWorker *workers = (SignWorker*)calloc(nThreads, sizeof(SignWorker));
+	unsigned long previousOps[MAX_SLOTS];
+	LatencyRecorder all;
+	BenchResult result;
+	double start = 0;
+	double end = 0;
+	double elapsed = 0;
+
+	memset(&result, 0, sizeof(result));
+	memset(previousOps, 0, sizeof(previousOps));
+	pthread_barrier_init(&startBarrier, NULL, nThreads+1);
+
+	printf("\n> Starting %d threads on %d slots.\n", nThreads, slotCount);
+	for(int ctr=0;ctr<nThreads;ctr++)
+	{
+		latencyInit(&workers[ctr].latency, (durationSec>0) ? 0 : ops);
+		pthread_create(&sign[ctr], NULL, &signData, &workers[ctr]);
+	}
+	pthread_barrier_wait(&startBarrier);
+
+	for(int sec=0; sec<durationSec; sec++)
+	{
+		sleep(1);
+		printf("\n> %d s\n", sec+1);
+		printSlots(previousOps, 1.0);
+	}
+	atomic_store(&stopSigning, 1);
+
+	for(int ctr=0;ctr<nThreads;ctr++)
+		pthread_join(sign[ctr], NULL);
+
+	latencyInit(&all, 0);
+	for(int ctr=0;ctr<nThreads;ctr++)
+	{
+		latencyMerge(&all, &workers[ctr].latency);
+		if(ctr==0 || workers[ctr].started<start)
+			start = workers[ctr].started;
+		if(workers[ctr].finished>end)
+			end = workers[ctr].finished;
+		result.errors += workers[ctr].errors;
+		if(workers[ctr].errors>0)
+			printf("  --> Thread %d : %lu sign operations failed, last error 0x%lX.\n", ctr, workers[ctr].errors, workers[ctr].lastError);
+		latencyFree(&workers[ctr].latency);
+		cryptoBufferFree(&workers[ctr].signature);
+	}
+
+	elapsed = (end - start) / 1e6;
+	snprintf(result.mechanism, sizeof(result.mechanism), "%s", signMech->name);
+	result.keySize = slotKeys[0].bits;
+	result.payload = sizeof(plainText)-1;
+	result.threads = nThreads;
+	benchSummarize(&all, elapsed, &result);
+	latencyFree(&all);
+
+	printf("\n> %lu sign operations completed on %d slots in %.2f seconds.\n", result.ops, slotCount, elapsed);
+	memset(previousOps, 0, sizeof(previousOps));
+	printSlots(previousOps, elapsed);
+	printf("\n");
+	benchPrintTable(stdout, &result, 1);
+	if(jsonPath!=NULL)
+		benchSaveJson(jsonPath, "Multi_Slot_Signing_Benchmark", &result, 1);
+	if(csvPath!=NULL)
+		benchSaveCsv(csvPath, &result, 1);
+
+	pthread_barrier_destroy(&startBarrier);
+	free(workers);
+	free(sign);
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char exeName[30])
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_list|all> <crypto_officer_password> [options]\n\n", exeName);
+	printf("slot_list is a comma separated list of slot ids, e.g. 0,1,2. 'all' uses every slot with a token present.\n");
+	printf("The password must be the same on every slot.\n\n");
+	printf("Options :-\n");
+	printf("  --threads <n>        number of signing threads (default 4).\n");
+	printf("  --ops <n>            sign operations per thread (default 1000).\n");
+	printf("  --duration <sec>     sign for this many seconds instead, printing every slot each second.\n");
+	printf("  --warmup <n>         unmeasured sign operations per thread before the run (default 0).\n");
+	printf("  --sessions <n>       maximum sessions per slot (default : one per thread).\n");
+	printf("  --mechanism <name>   sha256-rsa-pkcs (default), sha256-rsa-pkcs-pss, ecdsa-sha256, eddsa.\n");
+	printf("  --key-size <bits>    RSA modulus size of the generated keys (default 2048).\n");
+	printf("  --label <label>      sign with the existing private key with this label on every slot.\n");
+	printf("  --json <file>        write the results as JSON ('-' for stdout).\n");
+	printf("  --csv <file>         write the results as CSV ('-' for stdout).\n\n");
+}
+
+
+
+// Reads the benchmark options that follow the slot list and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"threads",	required_argument,	NULL,	't'},
+		{"ops",		required_argument,	NULL,	'o'},
+		{"duration",	required_argument,	NULL,	'd'},
+		{"warmup",	required_argument,	NULL,	'w'},
+		{"sessions",	required_argument,	NULL,	's'},
+		{"mechanism",	required_argument,	NULL,	'm'},
+		{"key-size",	required_argument,	NULL,	'k'},
+		{"label",	required_argument,	NULL,	'l'},
+		{"json",	required_argument,	NULL,	'j'},
+		{"csv",		required_argument,	NULL,	'c'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 't': nThreads = atoi(optarg); break;
+			case 'o': ops = atoi(optarg); break;
+			case 'd': durationSec = atoi(optarg); break;
+			case 'w': warmupOps = atoi(optarg); break;
+			case 's': sessionsPerSlot = atoi(optarg); break;
+			case 'k': keySize = strtoul(optarg, NULL, 10); break;
+			case 'l': keyLabel = optarg; break;
+			case 'j': jsonPath = optarg; break;
+			case 'c': csvPath = optarg; break;
+			case 'm':
+				signMech = NULL;
+				for(size_t ctr=0; ctr<sizeof(signMechanisms)/sizeof(*signMechanisms); ctr++)
+				{
+					if(strcmp(optarg, signMechanisms[ctr].option)==0)
+						signMech = &signMechanisms[ctr];
+				}
+				if(signMech==NULL)
+				{
+					printf("Unknown mechanism : %s\n", optarg);
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(nThreads<=0)
+		nThreads = 1;
+	if(sessionsPerSlot<=0)
+		sessionsPerSlot = nThreads;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotList = (char*)argv[1];
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlots();
+	prepareSlotKeys();
+	runBenchmark();
+
+	printf(">\nPlease wait ...\n");
+	disconnectFromLunaSlots();
+	freeMem();
+	return 0;
+}
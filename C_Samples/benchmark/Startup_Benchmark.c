@@ -0,0 +1,235 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This sample measures where the startup time of a short-lived PKCS#11 job goes.
+	- The sequence every sample runs before its first operation (load library, C_GetFunctionList, C_Initialize,
+	  C_OpenSession, C_Login) is repeated --iterations times with common/luna_connect.c, which times every step.
+	- The first iteration is printed on its own, since it is the only one that pays for a cold library load.
+	- Then every step is summarised over all iterations (mean, percentiles, max), including the teardown
+	  (C_Logout, C_CloseSession, C_Finalize) and the library unload.
+	- --keep-loaded loads the library once and only repeats C_Initialize to C_Finalize.
+	- Example :-
+		Startup_Benchmark 0 userpin --iterations 50 --json startup.json
+		Startup_Benchmark 0 userpin --iterations 20 --keep-loaded --no-login
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "../common/bench_stats.h"
+#include "../common/luna_connect.h"
+
+
+#define STEP_COUNT 7
+
+
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+int iterations = 10;
+int keepLoaded = 0;
+int noLogin = 0;
+char *jsonPath = NULL;
+char *csvPath = NULL;
+
+const char *stepNames[STEP_COUNT] = {"load library", "C_GetFunctionList", "C_Initialize", "C_OpenSession", "C_Login", "teardown", "unload library"};
+
+
+
+
+// Returns the time of one step from a StartupTiming.
+double stepTime(const StartupTiming *timing, int step)
+{
+	const double values[STEP_COUNT] = {timing->load, timing->getFunctionList, timing->initialize, timing->openSession,
+		timing->login, timing->teardown, timing->unload};
+	return values[step];
+}
+
+
+
+// Checks if a step was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		exit(1);
+	}
+}
+
+
+
+// Runs one startup and teardown. The library steps are skipped when it stays loaded.
+void runIteration(LunaConnection *conn, StartupTiming *timing)
+{
+	CK_RV rv = CKR_OK;
+
+	if(!keepLoaded)
+	{
+		rv = lunaLoadLibrary(conn, NULL);
+		if(rv==CKR_ARGUMENTS_BAD)
+		{
+			printf("P11_LIB environment variable not set.\n");
+			exit(1);
+		}
+		checkOperation(rv, "Loading the library from P11_LIB");
+	}
+	else
+		memset(&conn->timing, 0, sizeof(StartupTiming));
+
+	checkOperation(lunaConnect(conn, slotId, noLogin ? NULL : slotPin, noLogin ? 0 : strlen(slotPin)), "lunaConnect");
+	checkOperation(lunaDisconnect(conn), "lunaDisconnect");
+	if(!keepLoaded)
+		lunaUnloadLibrary(conn);
+	*timing = conn->timing;
+}
+
+
+
+// Repeats the startup sequence and reports every step.
+void runBenchmark()
+{
+	LunaConnection conn;
+	StartupTiming *timings = (StartupTiming*)calloc(iterations, sizeof(StartupTiming));
+	StartupTiming loaded;
+	BenchResult results[STEP_COUNT+1];
+	LatencyRecorder rec;
+	double sum = 0;
+
+	memset(results, 0, sizeof(results));
+	if(keepLoaded)
+	{
+		if(lunaLoadLibrary(&conn, NULL)!=CKR_OK)
+		{
+			printf("Failed to load the library from P11_LIB.\n");
+			exit(1);
+		}
+		loaded = conn.timing;
+		printf("\n> Library loaded once : %.3f ms, C_GetFunctionList %.3f ms.\n", loaded.load / 1000, loaded.getFunctionList / 1000);
+	}
+
+	printf("\n> Running the startup sequence %d times%s.\n", iterations, noLogin ? " without login" : "");
+	for(int ctr=0; ctr<iterations; ctr++)
+		runIteration(&conn, &timings[ctr]);
+	if(keepLoaded)
+		lunaUnloadLibrary(&conn);
+
+	printf("\n> First iteration :-\n");
+	lunaPrintTiming(stdout, &timings[0]);
+
+	// One row per step, and one for the whole startup, with the iterations as operations.
+	for(int step=0; step<=STEP_COUNT; step++)
+	{
+		latencyInit(&rec, iterations);
+		sum = 0;
+		for(int ctr=0; ctr<iterations; ctr++)
+		{
+			double micros = (step<STEP_COUNT) ? stepTime(&timings[ctr], step) : lunaStartupTotal(&timings[ctr]);
+			latencyRecord(&rec, micros);
+			sum += micros;
+		}
+		snprintf(results[step].mechanism, sizeof(results[step].mechanism), "%s", (step<STEP_COUNT) ? stepNames[step] : "startup total");
+		results[step].threads = 1;
+		benchSummarize(&rec, sum / 1e6, &results[step]);
+		latencyFree(&rec);
+	}
+
+	printf("\n> All iterations :-\n\n");
+	benchPrintTable(stdout, results, STEP_COUNT+1);
+	printf("\n");
+	if(jsonPath!=NULL)
+		benchSaveJson(jsonPath, "Startup_Benchmark", results, STEP_COUNT+1);
+	if(csvPath!=NULL)
+		benchSaveCsv(csvPath, results, STEP_COUNT+1);
+	free(timings);
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char exeName[30])
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_officer_password> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --iterations <n>     times the startup sequence is run (default 10).\n");
+	printf("  --keep-loaded        load the library once, and repeat only C_Initialize to C_Finalize.\n");
+	printf("  --no-login           open the session without logging in.\n");
+	printf("  --json <file>        write the results as JSON ('-' for stdout).\n");
+	printf("  --csv <file>         write the results as CSV ('-' for stdout).\n\n");
+}
+
+
+
+// Reads the benchmark options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"iterations",	required_argument,	NULL,	'i'},
+		{"keep-loaded",	no_argument,		NULL,	'k'},
+		{"no-login",	no_argument,		NULL,	'n'},
+		{"json",	required_argument,	NULL,	'j'},
+		{"csv",		required_argument,	NULL,	'c'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'i': iterations = atoi(optarg); break;
+			case 'k': keepLoaded = 1; break;
+			case 'n': noLogin = 1; break;
+			case 'j': jsonPath = optarg; break;
+			case 'c': csvPath = optarg; break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(iterations<=0)
+		iterations = 1;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	runBenchmark();
+
+	free(slotPin);
+	return 0;
+}
@@ -0,0 +1,303 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the asynchronous engine declared in async_p11.h.
+	- The submission queue and the completion queue are intrusive FIFO lists (AsyncJob.next), each behind a mutex.
+	- The eventfd is written while the completion queue lock is held, and cleared only when asyncReap empties the
+	  queue, so it is readable exactly while completions are waiting.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "async_p11.h"
+
+
+typedef struct
+{
+	AsyncJob *head;
+	AsyncJob *tail;
+	unsigned int count;
+} JobList;
+
+
+struct AsyncEngine
+{
+	CK_FUNCTION_LIST *p11;
+	SessionPool *pool;
+	int nWorkers;
+	pthread_t *workers;
+	unsigned int maxPending;
+
+	JobList submitted;
+	pthread_mutex_t submitLock;
+	pthread_cond_t submitReady;
+	int stopping;
+
+	JobList completed;
+	pthread_mutex_t completeLock;
+	int eventFd;
+
+	atomic_uint inFlight;
+};
+
+
+
+static double nowMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+
+static void listPush(JobList *list, AsyncJob *job)
+{
+	job->next = NULL;
+	if(list->tail!=NULL)
+		list->tail->next = job;
+	else
+		list->head = job;
+	list->tail = job;
+	list->count++;
+}
+
+
+
+static AsyncJob *listPop(JobList *list)
+{
+	AsyncJob *job = list->head;
+
+	if(job!=NULL)
+	{
+		list->head = job->next;
+		if(list->head==NULL)
+			list->tail = NULL;
+		list->count--;
+	}
+	return job;
+}
+
+
+
+// Makes the blocking PKCS#11 calls of one job with a pooled session.
+static CK_RV runJob(AsyncEngine *engine, AsyncJob *job)
+{
+	CK_FUNCTION_LIST *p11 = engine->p11;
+	PooledSession *session = NULL;
+	CK_SESSION_HANDLE hSession = 0;
+	CK_RV rv = sessionPoolAcquire(engine->pool, &session);
+
+	if(rv!=CKR_OK)
+		return rv;
+	hSession = session->hSession;
+
+	switch(job->op)
+	{
+		case ASYNC_SIGN:
+			rv = p11->C_SignInit(hSession, job->mech, job->hKey);
+			if(rv==CKR_OK)
+				rv = p11->C_Sign(hSession, job->input, job->inputLen, job->output, &job->outputLen);
+			break;
+		case ASYNC_VERIFY:
+			rv = p11->C_VerifyInit(hSession, job->mech, job->hKey);
+			if(rv==CKR_OK)
+				rv = p11->C_Verify(hSession, job->input, job->inputLen, job->output, job->outputLen);
+			break;
+		case ASYNC_ENCRYPT:
+			rv = p11->C_EncryptInit(hSession, job->mech, job->hKey);
+			if(rv==CKR_OK)
+				rv = p11->C_Encrypt(hSession, job->input, job->inputLen, job->output, &job->outputLen);
+			break;
+		case ASYNC_DECRYPT:
+			rv = p11->C_DecryptInit(hSession, job->mech, job->hKey);
+			if(rv==CKR_OK)
+				rv = p11->C_Decrypt(hSession, job->input, job->inputLen, job->output, &job->outputLen);
+			break;
+		default:
+			rv = CKR_FUNCTION_NOT_SUPPORTED;
+			break;
+	}
+
+	sessionPoolRelease(engine->pool, session, rv);
+	return rv;
+}
+
+
+
+// Reports a finished job through its callback, or the completion queue.
+static void completeJob(AsyncEngine *engine, AsyncJob *job)
+{
+	uint64_t one = 1;
+
+	job->completed = nowMicros();
+	if(job->callback!=NULL)
+	{
+		atomic_fetch_sub(&engine->inFlight, 1); // before the callback, so it can submit again.
+		job->callback(job);
+		return;
+	}
+
+	pthread_mutex_lock(&engine->completeLock);
+	listPush(&engine->completed, job);
+	(void)!write(engine->eventFd, &one, sizeof(one)); // the counter cannot overflow with one write per job.
+	pthread_mutex_unlock(&engine->completeLock);
+}
+
+
+
+// Worker thread : takes jobs until the engine stops and the submission queue is empty.
+static void *asyncWorker(void *arg)
+{
+	AsyncEngine *engine = (AsyncEngine*)arg;
+	AsyncJob *job = NULL;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&engine->submitLock);
+		while(engine->submitted.count==0 && !engine->stopping)
+			pthread_cond_wait(&engine->submitReady, &engine->submitLock);
+		job = listPop(&engine->submitted);
+		pthread_mutex_unlock(&engine->submitLock);
+		if(job==NULL)
+			break;
+
+		job->rv = runJob(engine, job);
+		completeJob(engine, job);
+	}
+	return 0;
+}
+
+
+
+AsyncEngine *asyncCreate(CK_FUNCTION_LIST *p11, SessionPool *pool, int nWorkers, unsigned int maxPending, CK_RV *rv)
+{
+	AsyncEngine *engine = NULL;
+	int started = 0;
+
+	*rv = CKR_ARGUMENTS_BAD;
+	if(pool==NULL || nWorkers<=0 || maxPending==0)
+		return NULL;
+
+	*rv = CKR_HOST_MEMORY;
+	engine = (AsyncEngine*)calloc(1, sizeof(AsyncEngine));
+	if(engine==NULL)
+		return NULL;
+	engine->p11 = p11;
+	engine->pool = pool;
+	engine->nWorkers = nWorkers;
+	engine->maxPending = maxPending;
+	engine->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(engine->eventFd<0)
+	{
+		free(engine);
+		*rv = CKR_GENERAL_ERROR;
+		return NULL;
+	}
+	pthread_mutex_init(&engine->submitLock, NULL);
+	pthread_cond_init(&engine->submitReady, NULL);
+	pthread_mutex_init(&engine->completeLock, NULL);
+
+	engine->workers = (pthread_t*)malloc(nWorkers * sizeof(pthread_t));
+	for(started=0; engine->workers!=NULL && started<nWorkers; started++)
+		if(pthread_create(&engine->workers[started], NULL, &asyncWorker, engine)!=0)
+			break;
+	if(started<nWorkers)
+	{
+		engine->nWorkers = started; // only these are stopped and joined.
+		asyncDestroy(engine);
+		return NULL;
+	}
+	*rv = CKR_OK;
+	return engine;
+}
+
+
+
+CK_RV asyncSubmit(AsyncEngine *engine, AsyncJob *job)
+{
+	pthread_mutex_lock(&engine->submitLock);
+	if(engine->stopping || engine->submitted.count>=engine->maxPending)
+	{
+		pthread_mutex_unlock(&engine->submitLock);
+		return CKR_FUNCTION_REJECTED;
+	}
+	job->rv = CKR_OK;
+	job->submitted = nowMicros();
+	atomic_fetch_add(&engine->inFlight, 1);
+	listPush(&engine->submitted, job);
+	pthread_cond_signal(&engine->submitReady);
+	pthread_mutex_unlock(&engine->submitLock);
+	return CKR_OK;
+}
+
+
+
+int asyncCompletionFd(AsyncEngine *engine)
+{
+	return engine->eventFd;
+}
+
+
+
+int asyncReap(AsyncEngine *engine, AsyncJob **jobs, int max)
+{
+	uint64_t counter = 0;
+	int count = 0;
+
+	pthread_mutex_lock(&engine->completeLock);
+	while(count<max && engine->completed.count>0)
+		jobs[count++] = listPop(&engine->completed);
+	if(engine->completed.count==0)
+		(void)!read(engine->eventFd, &counter, sizeof(counter)); // fails with EAGAIN if already cleared.
+	pthread_mutex_unlock(&engine->completeLock);
+
+	atomic_fetch_sub(&engine->inFlight, count);
+	return count;
+}
+
+
+
+unsigned int asyncInFlight(AsyncEngine *engine)
+{
+	return atomic_load(&engine->inFlight);
+}
+
+
+
+void asyncDestroy(AsyncEngine *engine)
+{
+	pthread_mutex_lock(&engine->submitLock);
+	engine->stopping = 1;
+	pthread_cond_broadcast(&engine->submitReady);
+	pthread_mutex_unlock(&engine->submitLock);
+	for(int ctr=0; ctr<engine->nWorkers; ctr++)
+		pthread_join(engine->workers[ctr], NULL);
+
+	close(engine->eventFd);
+	pthread_mutex_destroy(&engine->submitLock);
+	pthread_cond_destroy(&engine->submitReady);
+	pthread_mutex_destroy(&engine->completeLock);
+	free(engine->workers);
+	free(engine);
+}
@@ -0,0 +1,91 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Asynchronous sign / verify / encrypt / decrypt on top of the p11Func function table.
+	- The caller submits an AsyncJob and returns immediately; a fixed set of worker threads makes the blocking
+	  PKCS#11 calls with sessions from a session pool.
+	- A finished job is reported either through its callback (run on the worker thread), or through the
+	  completion queue : asyncCompletionFd is an eventfd that becomes readable when jobs are waiting in the
+	  queue, so an event loop can poll / epoll it next to its sockets and collect jobs with asyncReap.
+	- Jobs are allocated by the caller and linked into the queues directly, so submitting does not allocate.
+	- Linux only (eventfd).
+*/
+
+
+
+#ifndef LUNA_SAMPLES_ASYNC_P11_H
+#define LUNA_SAMPLES_ASYNC_P11_H
+
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+
+
+typedef enum
+{
+	ASYNC_SIGN = 1,
+	ASYNC_VERIFY = 2,
+	ASYNC_ENCRYPT = 3,
+	ASYNC_DECRYPT = 4
+} AsyncOp;
+
+
+typedef struct AsyncJob AsyncJob;
+
+// Called on a worker thread when a job finishes. It must not block for long.
+typedef void (*AsyncCallback)(AsyncJob *job);
+
+
+// One operation. Everything the job points to (mechanism, parameters, input, output) must stay valid until it completes.
+struct AsyncJob
+{
+	AsyncOp op;
+	CK_MECHANISM *mech;
+	CK_OBJECT_HANDLE hKey;
+	CK_BYTE *input; // data to sign / verify / encrypt / decrypt.
+	CK_ULONG inputLen;
+	CK_BYTE *output; // result buffer, or the signature for ASYNC_VERIFY.
+	CK_ULONG outputLen; // size of output on submit, length of the result on completion.
+	AsyncCallback callback; // NULL to report the job through the completion queue instead.
+	void *userData;
+
+	CK_RV rv; // result, set on completion.
+	double submitted; // timestamps in microseconds (CLOCK_MONOTONIC).
+	double completed;
+	AsyncJob *next; // used by the queues.
+};
+
+
+typedef struct AsyncEngine AsyncEngine;
+
+
+// Starts nWorkers threads taking sessions from pool. maxPending bounds the jobs waiting for a worker.
+AsyncEngine *asyncCreate(CK_FUNCTION_LIST *p11, SessionPool *pool, int nWorkers, unsigned int maxPending, CK_RV *rv);
+
+// Queues a job. Returns CKR_FUNCTION_REJECTED if maxPending jobs are already waiting (the caller should reap first).
+CK_RV asyncSubmit(AsyncEngine *engine, AsyncJob *job);
+
+// eventfd that is readable while finished jobs wait in the completion queue.
+int asyncCompletionFd(AsyncEngine *engine);
+
+// Takes up to max finished jobs from the completion queue without blocking. Returns the number taken.
+int asyncReap(AsyncEngine *engine, AsyncJob **jobs, int max);
+
+// Jobs submitted and not yet reaped or called back.
+unsigned int asyncInFlight(AsyncEngine *engine);
+
+// Finishes the queued jobs, stops the workers and frees the engine. Unreaped completions are dropped.
+void asyncDestroy(AsyncEngine *engine);
+
+#endif
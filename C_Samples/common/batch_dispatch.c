@@ -0,0 +1,398 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the micro-batching dispatcher declared in batch_dispatch.h.
+	- Only one worker at a time collects a batch. Idle workers wait on workReady ; the collecting worker waits on
+	  batchFull with a timeout at the end of the latency budget of the oldest request.
+	- When a worker leaves with its batch and requests are still queued, it wakes the next idle worker.
+	- The statistics are atomic histograms, so they can be read while the workers run.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <stdatomic.h>
+#include "batch_dispatch.h"
+
+
+struct BatchDispatcher
+{
+	CK_FUNCTION_LIST *p11;
+	SessionPool *pool;
+	int nWorkers;
+	pthread_t *workers;
+	unsigned int maxBatch;
+	unsigned int latencyBudget;
+	unsigned int maxPending;
+
+	BatchRequest *head;
+	BatchRequest *tail;
+	unsigned int count;
+	int collecting; // 1 while a worker is filling a batch.
+	int stopping;
+	pthread_mutex_t lock;
+	pthread_cond_t workReady;
+	pthread_cond_t batchFull;
+
+	atomic_ulong requests;
+	atomic_ulong batches;
+	atomic_ulong coalesced;
+	atomic_ulong *batchSizes; // batchSizes[n] : batches of n requests.
+	atomic_ulong delayBuckets[BATCH_DELAY_BUCKETS];
+	atomic_ullong delaySumNanos;
+	atomic_ullong delayMaxNanos;
+};
+
+
+
+static double nowMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+
+static int delayBucket(double micros)
+{
+	int bucket = (int)(4 * log2(micros + 1));
+
+	if(bucket<0)
+		return 0;
+	return (bucket<BATCH_DELAY_BUCKETS) ? bucket : BATCH_DELAY_BUCKETS-1;
+}
+
+
+
+// Largest delay that falls into a bucket.
+static double bucketLimit(int bucket)
+{
+	return pow(2, (bucket + 1) / 4.0) - 1;
+}
+
+
+
+static void recordDelay(BatchDispatcher *dispatcher, double micros)
+{
+	unsigned long long nanos = (unsigned long long)(micros * 1000);
+	unsigned long long max = atomic_load_explicit(&dispatcher->delayMaxNanos, memory_order_relaxed);
+
+	atomic_fetch_add_explicit(&dispatcher->delayBuckets[delayBucket(micros)], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&dispatcher->delaySumNanos, nanos, memory_order_relaxed);
+	while(nanos>max && !atomic_compare_exchange_weak(&dispatcher->delayMaxNanos, &max, nanos))
+		;
+}
+
+
+
+// Takes up to maxBatch requests from the queue, waiting for the batch to fill or the budget to run out.
+// Called with the lock held. Returns the number of requests linked from *batch, 0 when the dispatcher stops.
+static unsigned int collectBatch(BatchDispatcher *dispatcher, BatchRequest **batch)
+{
+	struct timespec deadline;
+	double expires = 0;
+	unsigned int taken = 0;
+	BatchRequest *last = NULL;
+
+	while((dispatcher->count==0 || dispatcher->collecting) && !dispatcher->stopping)
+		pthread_cond_wait(&dispatcher->workReady, &dispatcher->lock);
+	if(dispatcher->count==0)
+		return 0;
+
+	dispatcher->collecting = 1;
+	while(dispatcher->count<dispatcher->maxBatch && !dispatcher->stopping)
+	{
+		expires = dispatcher->head->queued + dispatcher->latencyBudget;
+		if(nowMicros()>=expires)
+			break;
+		deadline.tv_sec = (time_t)(expires / 1e6);
+		deadline.tv_nsec = (long)((expires - deadline.tv_sec * 1e6) * 1000);
+		pthread_cond_timedwait(&dispatcher->batchFull, &dispatcher->lock, &deadline);
+	}
+
+	*batch = dispatcher->head;
+	while(taken<dispatcher->maxBatch && dispatcher->head!=NULL)
+	{
+		last = dispatcher->head;
+		dispatcher->head = last->next;
+		taken++;
+	}
+	last->next = NULL;
+	if(dispatcher->head==NULL)
+		dispatcher->tail = NULL;
+	dispatcher->count -= taken;
+	dispatcher->collecting = 0;
+	if(dispatcher->count>0)
+		pthread_cond_signal(&dispatcher->workReady); // the next worker starts on what is left.
+	return taken;
+}
+
+
+
+// Tells if two mechanisms have the same type and parameter bytes, wherever the callers keep the parameters.
+static int sameMechanism(const CK_MECHANISM *a, const CK_MECHANISM *b)
+{
+	return a->mechanism==b->mechanism && a->ulParameterLen==b->ulParameterLen
+		&& (a->ulParameterLen==0 || memcmp(a->pParameter, b->pParameter, a->ulParameterLen)==0);
+}
+
+
+
+// Finds an earlier request of the batch with the same key, mechanism and data that was signed successfully.
+static BatchRequest *findIdentical(BatchRequest *batch, BatchRequest *request)
+{
+	for(BatchRequest *earlier = batch; earlier!=request; earlier = earlier->next)
+	{
+		if(earlier->rv==CKR_OK && earlier->hKey==request->hKey && sameMechanism(earlier->mech, request->mech)
+			&& earlier->dataLen==request->dataLen && earlier->signatureLen<=request->signatureLen
+			&& memcmp(earlier->data, request->data, request->dataLen)==0)
+			return earlier;
+	}
+	return NULL;
+}
+
+
+
+// Signs every request of a batch with the worker's session. Returns the last error, or CKR_OK.
+static CK_RV signBatch(BatchDispatcher *dispatcher, CK_SESSION_HANDLE hSession, BatchRequest *batch)
+{
+	CK_FUNCTION_LIST *p11 = dispatcher->p11;
+	BatchRequest *identical = NULL;
+	CK_RV lastError = CKR_OK;
+
+	for(BatchRequest *request = batch; request!=NULL; request = request->next)
+	{
+		identical = findIdentical(batch, request);
+		if(identical!=NULL)
+		{
+			memcpy(request->signature, identical->signature, identical->signatureLen);
+			request->signatureLen = identical->signatureLen;
+			request->rv = CKR_OK;
+			atomic_fetch_add_explicit(&dispatcher->coalesced, 1, memory_order_relaxed);
+			continue;
+		}
+		request->rv = p11->C_SignInit(hSession, request->mech, request->hKey);
+		if(request->rv==CKR_OK)
+			request->rv = p11->C_Sign(hSession, request->data, request->dataLen, request->signature, &request->signatureLen);
+		if(request->rv!=CKR_OK)
+			lastError = request->rv;
+	}
+	return lastError;
+}
+
+
+
+// Worker thread : owns a session and signs one batch at a time until the dispatcher stops.
+static void *batchWorker(void *arg)
+{
+	BatchDispatcher *dispatcher = (BatchDispatcher*)arg;
+	PooledSession *session = NULL;
+	BatchRequest *batch = NULL;
+	BatchRequest *next = NULL;
+	unsigned int size = 0;
+	double started = 0;
+	CK_RV rv = CKR_OK;
+
+	pthread_mutex_lock(&dispatcher->lock);
+	for(;;)
+	{
+		size = collectBatch(dispatcher, &batch);
+		pthread_mutex_unlock(&dispatcher->lock);
+		if(size==0)
+			break;
+
+		started = nowMicros();
+		atomic_fetch_add_explicit(&dispatcher->batches, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&dispatcher->batchSizes[size], 1, memory_order_relaxed);
+		for(BatchRequest *request = batch; request!=NULL; request = request->next)
+		{
+			request->dispatched = started;
+			recordDelay(dispatcher, started - request->queued);
+		}
+
+		rv = (session!=NULL) ? CKR_OK : sessionPoolAcquire(dispatcher->pool, &session);
+		if(rv==CKR_OK)
+			rv = signBatch(dispatcher, session->hSession, batch);
+		else
+		{
+			for(BatchRequest *request = batch; request!=NULL; request = request->next)
+				request->rv = rv;
+		}
+		if(rv!=CKR_OK && session!=NULL)
+		{
+			sessionPoolRelease(dispatcher->pool, session, rv); // a broken session is dropped, the next batch gets another.
+			session = NULL;
+		}
+
+		for(BatchRequest *request = batch; request!=NULL; request = next)
+		{
+			next = request->next; // the callback may reuse the request.
+			atomic_fetch_add_explicit(&dispatcher->requests, 1, memory_order_relaxed);
+			request->callback(request);
+		}
+		pthread_mutex_lock(&dispatcher->lock);
+	}
+
+	if(session!=NULL)
+		sessionPoolRelease(dispatcher->pool, session, CKR_OK);
+	return 0;
+}
+
+
+
+BatchDispatcher *batchCreate(CK_FUNCTION_LIST *p11, SessionPool *pool, int nWorkers, unsigned int maxBatch,
+	unsigned int latencyBudget, unsigned int maxPending, CK_RV *rv)
+{
+	BatchDispatcher *dispatcher = NULL;
+	pthread_condattr_t attr;
+	int started = 0;
+
+	*rv = CKR_ARGUMENTS_BAD;
+	if(pool==NULL || nWorkers<=0 || maxBatch==0 || maxPending==0)
+		return NULL;
+
+	*rv = CKR_HOST_MEMORY;
+	dispatcher = (BatchDispatcher*)calloc(1, sizeof(BatchDispatcher));
+	if(dispatcher==NULL)
+		return NULL;
+	dispatcher->p11 = p11;
+	dispatcher->pool = pool;
+	dispatcher->nWorkers = nWorkers;
+	dispatcher->maxBatch = maxBatch;
+	dispatcher->latencyBudget = latencyBudget;
+	dispatcher->maxPending = maxPending;
+	dispatcher->batchSizes = (atomic_ulong*)calloc(maxBatch + 1, sizeof(atomic_ulong));
+	pthread_mutex_init(&dispatcher->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC); // the budget deadline is a CLOCK_MONOTONIC time.
+	pthread_cond_init(&dispatcher->workReady, NULL);
+	pthread_cond_init(&dispatcher->batchFull, &attr);
+	pthread_condattr_destroy(&attr);
+
+	dispatcher->workers = (pthread_t*)malloc(nWorkers * sizeof(pthread_t));
+	for(started=0; dispatcher->batchSizes!=NULL && dispatcher->workers!=NULL && started<nWorkers; started++)
+		if(pthread_create(&dispatcher->workers[started], NULL, &batchWorker, dispatcher)!=0)
+			break;
+	if(started<nWorkers)
+	{
+		dispatcher->nWorkers = started; // only these are stopped and joined.
+		batchDestroy(dispatcher);
+		return NULL;
+	}
+	*rv = CKR_OK;
+	return dispatcher;
+}
+
+
+
+CK_RV batchSubmit(BatchDispatcher *dispatcher, BatchRequest *request)
+{
+	pthread_mutex_lock(&dispatcher->lock);
+	if(dispatcher->stopping || dispatcher->count>=dispatcher->maxPending)
+	{
+		pthread_mutex_unlock(&dispatcher->lock);
+		return CKR_FUNCTION_REJECTED;
+	}
+	request->rv = CKR_OK;
+	request->queued = nowMicros();
+	request->next = NULL;
+	if(dispatcher->tail!=NULL)
+		dispatcher->tail->next = request;
+	else
+		dispatcher->head = request;
+	dispatcher->tail = request;
+	dispatcher->count++;
+
+	if(!dispatcher->collecting)
+		pthread_cond_signal(&dispatcher->workReady);
+	else if(dispatcher->count>=dispatcher->maxBatch)
+		pthread_cond_signal(&dispatcher->batchFull);
+	pthread_mutex_unlock(&dispatcher->lock);
+	return CKR_OK;
+}
+
+
+
+void batchGetStats(BatchDispatcher *dispatcher, BatchStats *stats)
+{
+	unsigned long sizes = 0;
+	unsigned long delays = 0;
+	unsigned long seen = 0;
+	unsigned long count = 0;
+
+	memset(stats, 0, sizeof(BatchStats));
+	stats->requests = atomic_load(&dispatcher->requests);
+	stats->batches = atomic_load(&dispatcher->batches);
+	stats->coalesced = atomic_load(&dispatcher->coalesced);
+
+	for(unsigned int size=1; size<=dispatcher->maxBatch; size++)
+	{
+		count = atomic_load(&dispatcher->batchSizes[size]);
+		sizes += count * size;
+		if(count>0)
+			stats->maxBatch = size;
+	}
+	for(unsigned int size=1; size<=dispatcher->maxBatch && stats->batches>0; size++)
+	{
+		seen += atomic_load(&dispatcher->batchSizes[size]);
+		if(stats->p50Batch==0 && seen*2>=stats->batches)
+			stats->p50Batch = size;
+		if(stats->p99Batch==0 && seen*100>=stats->batches*99)
+			stats->p99Batch = size;
+	}
+
+	seen = 0;
+	for(int bucket=0; bucket<BATCH_DELAY_BUCKETS; bucket++)
+		delays += atomic_load(&dispatcher->delayBuckets[bucket]);
+	for(int bucket=0; bucket<BATCH_DELAY_BUCKETS && delays>0; bucket++)
+	{
+		seen += atomic_load(&dispatcher->delayBuckets[bucket]);
+		if(stats->p50Delay==0 && seen*2>=delays)
+			stats->p50Delay = bucketLimit(bucket);
+		if(stats->p99Delay==0 && seen*100>=delays*99)
+			stats->p99Delay = bucketLimit(bucket);
+	}
+
+	if(stats->batches>0)
+		stats->meanBatch = (double)sizes / stats->batches;
+	if(delays>0)
+		stats->meanDelay = atomic_load(&dispatcher->delaySumNanos) / 1000.0 / delays;
+	stats->maxDelay = atomic_load(&dispatcher->delayMaxNanos) / 1000.0;
+}
+
+
+
+void batchDestroy(BatchDispatcher *dispatcher)
+{
+	pthread_mutex_lock(&dispatcher->lock);
+	dispatcher->stopping = 1;
+	pthread_cond_broadcast(&dispatcher->workReady);
+	pthread_cond_broadcast(&dispatcher->batchFull);
+	pthread_mutex_unlock(&dispatcher->lock);
+	for(int ctr=0; ctr<dispatcher->nWorkers; ctr++)
+		pthread_join(dispatcher->workers[ctr], NULL);
+
+	pthread_mutex_destroy(&dispatcher->lock);
+	pthread_cond_destroy(&dispatcher->workReady);
+	pthread_cond_destroy(&dispatcher->batchFull);
+	free(dispatcher->batchSizes);
+	free(dispatcher->workers);
+	free(dispatcher);
+}
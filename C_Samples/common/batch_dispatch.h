@@ -0,0 +1,96 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Micro-batching dispatcher for many small, independent sign requests.
+	- Requests are queued without blocking. A worker that owns a session for its whole life wakes up once per batch,
+	  not once per request : it collects requests until maxBatch are waiting or the oldest one has waited
+	  latencyBudget microseconds, then signs them back to back and completes them.
+	- The latency budget is the knob : 0 sends whatever is queued right away (small batches, lowest latency), a larger
+	  budget gives bigger batches and fewer wake-ups at the cost of queueing delay.
+	- Identical requests in one batch (same key, mechanism and data) are coalesced : signed once, and the signature
+	  is copied to the others.
+	- Batch sizes and queueing delay (submit to start of the batch) are kept as histograms and can be read at any time.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_BATCH_DISPATCH_H
+#define LUNA_SAMPLES_BATCH_DISPATCH_H
+
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+
+
+#define BATCH_DELAY_BUCKETS 128 // queueing delay histogram : 4 buckets per power of two microseconds.
+
+
+typedef struct BatchRequest BatchRequest;
+
+// Called on the worker thread when a request is signed (or failed). It must not block for long.
+typedef void (*BatchCallback)(BatchRequest *request);
+
+
+// One sign request. The mechanism, data and signature buffer must stay valid until the callback.
+struct BatchRequest
+{
+	CK_MECHANISM *mech;
+	CK_OBJECT_HANDLE hKey;
+	CK_BYTE *data;
+	CK_ULONG dataLen;
+	CK_BYTE *signature;
+	CK_ULONG signatureLen; // size of signature on submit, length of the signature on completion.
+	BatchCallback callback;
+	void *userData;
+
+	CK_RV rv; // result, set on completion.
+	double queued; // timestamps in microseconds (CLOCK_MONOTONIC).
+	double dispatched; // time the batch holding the request started.
+	BatchRequest *next; // used by the queue.
+};
+
+
+// Dispatcher activity since it was created.
+typedef struct
+{
+	unsigned long requests; // requests completed.
+	unsigned long batches;
+	unsigned long coalesced; // requests answered with the signature of an identical request.
+	double meanBatch;
+	unsigned int p50Batch;
+	unsigned int p99Batch;
+	unsigned int maxBatch; // largest batch seen.
+	double meanDelay; // queueing delay in microseconds.
+	double p50Delay; // percentiles are the upper bound of their histogram bucket (within 19%).
+	double p99Delay;
+	double maxDelay;
+} BatchStats;
+
+
+typedef struct BatchDispatcher BatchDispatcher;
+
+
+// Starts nWorkers threads, each holding one session from pool. maxPending bounds the queued requests.
+BatchDispatcher *batchCreate(CK_FUNCTION_LIST *p11, SessionPool *pool, int nWorkers, unsigned int maxBatch,
+	unsigned int latencyBudget, unsigned int maxPending, CK_RV *rv);
+
+// Queues a request. Returns CKR_FUNCTION_REJECTED if maxPending requests are already waiting.
+CK_RV batchSubmit(BatchDispatcher *dispatcher, BatchRequest *request);
+
+void batchGetStats(BatchDispatcher *dispatcher, BatchStats *stats);
+
+// Signs the queued requests, stops the workers, returns their sessions and frees the dispatcher.
+void batchDestroy(BatchDispatcher *dispatcher);
+
+#endif
@@ -0,0 +1,522 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the batch verification declared in batch_verify.h.
+	- Every batch has a fixed data area; the reader closes a batch when it holds batchPairs pairs or when the
+	  longest possible pair would no longer fit, so no batch is ever reallocated.
+	- Workers take any filled batch, and give it back as soon as it is verified; failures of a batch are appended
+	  to the run under the lock and sorted by index at the end.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include "batch_verify.h"
+
+
+#define BATCH_VERIFY_PAIR_BYTES 256 // data room per pair of a batch, on top of one longest pair.
+
+
+typedef enum { BATCH_FREE, BATCH_FILLED, BATCH_BUSY } BatchState;
+
+
+typedef struct
+{
+	CK_ULONG messageOffset;
+	CK_ULONG messageLen;
+	CK_ULONG signatureOffset;
+	CK_ULONG signatureLen;
+	CK_RV rv; // CKR_OK, or why the pair was rejected while reading it.
+} VerifyPair;
+
+
+typedef struct
+{
+	unsigned long long index;
+	CK_RV rv;
+} VerifyFailure;
+
+
+typedef struct
+{
+	unsigned long long first; // index of the first pair.
+	unsigned int count;
+	VerifyPair *pairs;
+	CK_BYTE *data; // messages and signatures one after the other.
+	CK_ULONG dataUsed;
+	BatchState state;
+} VerifyBatch;
+
+
+typedef struct
+{
+	const BatchVerifyConfig *config;
+	FILE *in;
+	CK_ULONG dataSize; // data bytes of a batch.
+	unsigned int window;
+	VerifyBatch *batches;
+	int readerDone;
+	VerifyFailure *failures;
+	unsigned long long failureCount;
+	unsigned long long failureSize;
+	CK_RV rv; // first error, the run stops on it.
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} VerifyRun;
+
+
+// What each worker thread gets.
+typedef struct
+{
+	VerifyRun *run;
+	PubKeyVerifier *verifier;
+	VerifyFailure *failures; // room for one batch.
+} VerifyWorker;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static void failRun(VerifyRun *run, CK_RV rv)
+{
+	pthread_mutex_lock(&run->lock);
+	if(run->rv==CKR_OK)
+		run->rv = rv;
+	pthread_cond_broadcast(&run->changed);
+	pthread_mutex_unlock(&run->lock);
+}
+
+
+
+static int hexValue(int c)
+{
+	if(c>='0' && c<='9')
+		return c - '0';
+	if(c>='a' && c<='f')
+		return c - 'a' + 10;
+	if(c>='A' && c<='F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+
+
+// Reads one hex line into the data of batch. Blank lines are skipped. Returns 1 for a pair (pair->rv tells if it is
+// well formed), 0 at the end of the input, or -1 on a read error.
+static int readHexPair(VerifyRun *run, VerifyBatch *batch, VerifyPair *pair)
+{
+	CK_BYTE *out = NULL;
+	CK_ULONG limit = 0;
+	CK_ULONG len = 0;
+	int field = 0; // 0 for the message, 1 for the signature, 2 after it.
+	int c = 0, high = -1, low = 0, seen = 0;
+
+	do
+	{
+		memset(pair, 0, sizeof(VerifyPair));
+		pair->messageOffset = batch->dataUsed;
+		out = batch->data + batch->dataUsed;
+		limit = run->config->maxMessage;
+		len = 0;
+		field = 0;
+		high = -1;
+		while((c = getc_unlocked(run->in))!=EOF && c!='\n')
+		{
+			if(c=='\r' || pair->rv!=CKR_OK)
+				continue;
+			if(c==' ' || c=='\t')
+			{
+				if(high>=0)
+					pair->rv = CKR_DATA_INVALID;
+				else if(field==0 && seen)
+				{
+					pair->messageLen = len;
+					pair->signatureOffset = pair->messageOffset + len;
+					out += len;
+					len = 0;
+					limit = BATCH_VERIFY_MAX_SIGNATURE;
+					field = 1;
+				}
+				else if(field==1 && len>0)
+					field = 2;
+				continue;
+			}
+			seen = 1;
+			low = hexValue(c);
+			if(low<0 || field==2)
+				pair->rv = CKR_DATA_INVALID;
+			else if(high<0)
+				high = low;
+			else if(len==limit)
+				pair->rv = (field==0) ? CKR_DATA_LEN_RANGE : CKR_SIGNATURE_LEN_RANGE;
+			else
+			{
+				out[len++] = (CK_BYTE)((high << 4) | low);
+				high = -1;
+			}
+		}
+		if(ferror(run->in))
+			return -1;
+	}
+	while(!seen && c!=EOF);
+	if(!seen)
+		return 0;
+	if(pair->rv==CKR_OK && (high>=0 || field==0))
+		pair->rv = CKR_DATA_INVALID; // odd number of hex digits, or no signature.
+	if(pair->rv==CKR_OK)
+	{
+		pair->signatureLen = len;
+		batch->dataUsed = pair->signatureOffset + len;
+	}
+	return 1;
+}
+
+
+
+// Reads a 4 byte big-endian length. Returns 1, 0 at a clean end of the input, or -1 with *rv set.
+static int readLength(FILE *in, CK_ULONG *len, int endAllowed, CK_RV *rv)
+{
+	CK_BYTE prefix[4];
+	size_t got = fread(prefix, 1, 4, in);
+
+	if(got==0 && endAllowed && !ferror(in))
+		return 0;
+	if(got<4)
+	{
+		*rv = ferror(in) ? CKR_FUNCTION_FAILED : CKR_DATA_INVALID;
+		return -1;
+	}
+	*len = ((CK_ULONG)prefix[0] << 24) | ((CK_ULONG)prefix[1] << 16) | ((CK_ULONG)prefix[2] << 8) | prefix[3];
+	return 1;
+}
+
+
+
+// Reads len bytes into out, or skips them when out is NULL. Returns 0, or -1 with *rv set.
+static int readField(FILE *in, CK_BYTE *out, CK_ULONG len, CK_RV *rv)
+{
+	CK_BYTE skip[4096];
+	CK_ULONG part = 0;
+
+	while(len>0)
+	{
+		part = (out!=NULL || len<sizeof(skip)) ? len : sizeof(skip);
+		if(fread((out!=NULL) ? out : skip, 1, part, in)!=part)
+		{
+			*rv = ferror(in) ? CKR_FUNCTION_FAILED : CKR_DATA_INVALID;
+			return -1;
+		}
+		if(out!=NULL)
+			out += part;
+		len -= part;
+	}
+	return 0;
+}
+
+
+
+// Reads one length-prefixed pair. A field that is too long is skipped and the pair marked; the stream stays in
+// step. Returns 1 for a pair, 0 at the end of the input, or -1 with *rv set.
+static int readPrefixedPair(VerifyRun *run, VerifyBatch *batch, VerifyPair *pair, CK_RV *rv)
+{
+	int status = 0;
+
+	memset(pair, 0, sizeof(VerifyPair));
+	status = readLength(run->in, &pair->messageLen, 1, rv);
+	if(status<=0)
+		return status;
+	pair->messageOffset = batch->dataUsed;
+	if(pair->messageLen>run->config->maxMessage)
+		pair->rv = CKR_DATA_LEN_RANGE;
+	if(readField(run->in, (pair->rv==CKR_OK) ? batch->data + pair->messageOffset : NULL, pair->messageLen, rv)<0
+		|| readLength(run->in, &pair->signatureLen, 0, rv)<0)
+		return -1;
+	pair->signatureOffset = pair->messageOffset + ((pair->rv==CKR_OK) ? pair->messageLen : 0);
+	if(pair->rv==CKR_OK && pair->signatureLen>BATCH_VERIFY_MAX_SIGNATURE)
+		pair->rv = CKR_SIGNATURE_LEN_RANGE;
+	if(readField(run->in, (pair->rv==CKR_OK) ? batch->data + pair->signatureOffset : NULL, pair->signatureLen, rv)<0)
+		return -1;
+	if(pair->rv==CKR_OK)
+		batch->dataUsed = pair->signatureOffset + pair->signatureLen;
+	return 1;
+}
+
+
+
+// Fills batches until the end of the input, an error, or a stopped run.
+static void readBatches(VerifyRun *run, BatchVerifyStats *stats)
+{
+	CK_ULONG longest = run->config->maxMessage + BATCH_VERIFY_MAX_SIGNATURE;
+	unsigned long long index = 0;
+	VerifyBatch *batch = NULL;
+	CK_RV rv = CKR_OK;
+	int status = 1;
+
+	while(status>0)
+	{
+		pthread_mutex_lock(&run->lock);
+		for(batch=NULL; batch==NULL && run->rv==CKR_OK; )
+		{
+			for(unsigned int ctr=0; ctr<run->window && batch==NULL; ctr++)
+				if(run->batches[ctr].state==BATCH_FREE)
+					batch = &run->batches[ctr];
+			if(batch==NULL)
+				pthread_cond_wait(&run->changed, &run->lock);
+		}
+		pthread_mutex_unlock(&run->lock);
+		if(batch==NULL)
+			break;
+
+		batch->first = index;
+		batch->count = 0;
+		batch->dataUsed = 0;
+		while(batch->count<run->config->batchPairs && run->dataSize - batch->dataUsed>=longest)
+		{
+			VerifyPair *pair = &batch->pairs[batch->count];
+			if(run->config->format==VERIFY_PAIRS_HEX)
+			{
+				status = readHexPair(run, batch, pair);
+				if(status<0)
+					rv = CKR_FUNCTION_FAILED;
+			}
+			else
+				status = readPrefixedPair(run, batch, pair, &rv);
+			if(status<=0)
+				break;
+			stats->bytes += pair->messageLen;
+			batch->count++;
+		}
+		index += batch->count;
+		if(status<0)
+			failRun(run, rv);
+		else if(batch->count>0)
+		{
+			pthread_mutex_lock(&run->lock);
+			batch->state = BATCH_FILLED;
+			pthread_cond_broadcast(&run->changed);
+			pthread_mutex_unlock(&run->lock);
+		}
+	}
+
+	stats->pairs = index;
+	pthread_mutex_lock(&run->lock);
+	run->readerDone = 1;
+	pthread_cond_broadcast(&run->changed);
+	pthread_mutex_unlock(&run->lock);
+}
+
+
+
+// Appends the failures of one batch to the run.
+static CK_RV addFailures(VerifyRun *run, const VerifyFailure *failures, unsigned int count)
+{
+	VerifyFailure *grown = NULL;
+
+	if(run->failureCount + count>run->failureSize)
+	{
+		run->failureSize = (run->failureCount + count) * 2;
+		grown = (VerifyFailure*)realloc(run->failures, run->failureSize * sizeof(VerifyFailure));
+		if(grown==NULL)
+			return CKR_HOST_MEMORY;
+		run->failures = grown;
+	}
+	memcpy(run->failures + run->failureCount, failures, count * sizeof(VerifyFailure));
+	run->failureCount += count;
+	return CKR_OK;
+}
+
+
+
+static void *workerMain(void *arg)
+{
+	VerifyWorker *worker = (VerifyWorker*)arg;
+	VerifyRun *run = worker->run;
+	VerifyBatch *batch = NULL;
+	unsigned int failed = 0;
+	CK_RV rv = CKR_OK;
+
+	for(;;)
+	{
+		pthread_mutex_lock(&run->lock);
+		for(batch=NULL; batch==NULL && run->rv==CKR_OK; )
+		{
+			for(unsigned int ctr=0; ctr<run->window && batch==NULL; ctr++)
+				if(run->batches[ctr].state==BATCH_FILLED)
+					batch = &run->batches[ctr];
+			if(batch!=NULL)
+				batch->state = BATCH_BUSY;
+			else if(run->readerDone)
+				break;
+			else
+				pthread_cond_wait(&run->changed, &run->lock);
+		}
+		pthread_mutex_unlock(&run->lock);
+		if(batch==NULL)
+			break;
+
+		failed = 0;
+		for(unsigned int ctr=0; ctr<batch->count; ctr++)
+		{
+			const VerifyPair *pair = &batch->pairs[ctr];
+			rv = pair->rv;
+			if(rv==CKR_OK)
+				rv = pubKeyVerifierRun(worker->verifier, batch->data + pair->messageOffset, pair->messageLen,
+					batch->data + pair->signatureOffset, pair->signatureLen);
+			if(rv!=CKR_OK)
+			{
+				worker->failures[failed].index = batch->first + ctr;
+				worker->failures[failed].rv = rv;
+				failed++;
+			}
+		}
+
+		pthread_mutex_lock(&run->lock);
+		rv = addFailures(run, worker->failures, failed);
+		if(rv!=CKR_OK && run->rv==CKR_OK)
+			run->rv = rv;
+		batch->state = BATCH_FREE;
+		pthread_cond_broadcast(&run->changed);
+		pthread_mutex_unlock(&run->lock);
+	}
+	return 0;
+}
+
+
+
+static int compareFailures(const void *a, const void *b)
+{
+	unsigned long long left = ((const VerifyFailure*)a)->index;
+	unsigned long long right = ((const VerifyFailure*)b)->index;
+
+	return (left>right) - (left<right);
+}
+
+
+
+CK_RV batchVerifyRun(PubKeyCache *cache, CK_SESSION_HANDLE hSession, const BatchVerifyConfig *config, FILE *in,
+	BatchVerifyFailure onFailure, void *arg, BatchVerifyStats *stats)
+{
+	VerifyRun run;
+	VerifyWorker *workers = NULL;
+	pthread_t *threads = NULL;
+	unsigned int nWorkers = config->workers;
+	unsigned int started = 0;
+	double start = nowSeconds();
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(BatchVerifyStats));
+	if(config->batchPairs==0)
+		return CKR_ARGUMENTS_BAD;
+	if(nWorkers==0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nWorkers = (cpus>0) ? (unsigned int)cpus : 1;
+	}
+
+	memset(&run, 0, sizeof(run));
+	run.config = config;
+	run.in = in;
+	run.window = (config->window>0) ? config->window : 2 * nWorkers;
+	run.dataSize = config->batchPairs * BATCH_VERIFY_PAIR_BYTES + config->maxMessage + BATCH_VERIFY_MAX_SIGNATURE;
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.changed, NULL);
+
+	// Verifiers are created here, in the thread that owns hSession : the first one reads the key from the token,
+	// the others find it in the cache.
+	workers = (VerifyWorker*)calloc(nWorkers, sizeof(VerifyWorker));
+	threads = (pthread_t*)calloc(nWorkers, sizeof(pthread_t));
+	run.batches = (VerifyBatch*)calloc(run.window, sizeof(VerifyBatch));
+	if(workers==NULL || threads==NULL || run.batches==NULL)
+		rv = CKR_HOST_MEMORY;
+	for(unsigned int ctr=0; rv==CKR_OK && ctr<nWorkers; ctr++)
+	{
+		workers[ctr].run = &run;
+		workers[ctr].verifier = pubKeyVerifierCreate(cache, hSession, config->mech, config->hPublic, &rv);
+		workers[ctr].failures = (VerifyFailure*)malloc(config->batchPairs * sizeof(VerifyFailure));
+		if(rv==CKR_OK && workers[ctr].failures==NULL)
+			rv = CKR_HOST_MEMORY;
+	}
+	for(unsigned int ctr=0; rv==CKR_OK && ctr<run.window; ctr++)
+	{
+		run.batches[ctr].pairs = (VerifyPair*)malloc(config->batchPairs * sizeof(VerifyPair));
+		run.batches[ctr].data = (CK_BYTE*)malloc(run.dataSize);
+		if(run.batches[ctr].pairs==NULL || run.batches[ctr].data==NULL)
+			rv = CKR_HOST_MEMORY;
+	}
+
+	if(rv==CKR_OK)
+	{
+		for(started=0; started<nWorkers; started++)
+			if(pthread_create(&threads[started], NULL, &workerMain, &workers[started])!=0)
+				break;
+		if(started==0)
+			rv = CKR_HOST_MEMORY;
+	}
+	if(rv==CKR_OK)
+		readBatches(&run, stats);
+	for(unsigned int ctr=0; ctr<started; ctr++)
+		pthread_join(threads[ctr], NULL);
+	if(rv==CKR_OK)
+		rv = run.rv;
+
+	if(rv==CKR_OK)
+	{
+		qsort(run.failures, run.failureCount, sizeof(VerifyFailure), &compareFailures);
+		for(unsigned long long ctr=0; onFailure!=NULL && ctr<run.failureCount; ctr++)
+			onFailure(run.failures[ctr].index, run.failures[ctr].rv, arg);
+	}
+	stats->failed = run.failureCount;
+	stats->workers = started;
+	stats->seconds = nowSeconds() - start;
+
+	for(unsigned int ctr=0; workers!=NULL && ctr<nWorkers; ctr++)
+	{
+		pubKeyVerifierFree(workers[ctr].verifier);
+		free(workers[ctr].failures);
+	}
+	for(unsigned int ctr=0; run.batches!=NULL && ctr<run.window; ctr++)
+	{
+		free(run.batches[ctr].pairs);
+		free(run.batches[ctr].data);
+	}
+	free(run.batches);
+	free(run.failures);
+	free(workers);
+	free(threads);
+	pthread_cond_destroy(&run.changed);
+	pthread_mutex_destroy(&run.lock);
+	return rv;
+}
+
+
+
+void batchVerifyPrintStats(FILE *out, const BatchVerifyStats *stats)
+{
+	fprintf(out, "  --> %llu pairs, %llu failed, %u workers, %llu message bytes.\n", stats->pairs, stats->failed,
+		stats->workers, stats->bytes);
+	fprintf(out, "  --> %.3f seconds, %.0f verifications/sec.\n", stats->seconds,
+		(stats->seconds>0) ? stats->pairs / stats->seconds : 0);
+}
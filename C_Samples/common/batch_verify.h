@@ -0,0 +1,87 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Batch verification of signatures on the host, on all CPU cores : the public key is read once from the token
+	  (see pubkey_cache.h), and worker threads each verify whole batches of (message, signature) pairs with their
+	  own PubKeyVerifier, so no HSM call is made once the key is known.
+	- Pairs are read from a stream in one of two framings :-
+		hex      : one pair per line, the message and the signature in hex, separated by spaces or a tab.
+		prefixed : 4 byte big-endian message length, message, 4 byte big-endian signature length, signature.
+	- Pairs are numbered from 0 in input order. Failures are collected and reported by index once the whole input
+	  is verified, whatever the order the workers finished in. A hex line that is not two hex fields is a failure
+	  of its own (CKR_DATA_INVALID) and the run goes on; bad framing in a prefixed stream stops it, since the next
+	  pair cannot be found.
+	- The caller thread reads, and only --window batches exist at any time, so memory does not depend on the size
+	  of the input.
+	- Per key, everything that can be shared is prepared once : the decoded public key, the verification context
+	  with its padding and digest, and the fetched digest implementation. For ECDSA, OpenSSL also keeps the
+	  precomputed multiples of the generator that every verification uses.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_BATCH_VERIFY_H
+#define LUNA_SAMPLES_BATCH_VERIFY_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include "pubkey_cache.h"
+
+
+#define BATCH_VERIFY_MAX_SIGNATURE 1024 // 8192 bit RSA.
+
+
+typedef enum { VERIFY_PAIRS_HEX, VERIFY_PAIRS_PREFIXED } VerifyPairFormat;
+
+
+// What to verify, and how much of it at once.
+typedef struct
+{
+	CK_MECHANISM *mech; // verification mechanism, with its parameters.
+	CK_OBJECT_HANDLE hPublic;
+	VerifyPairFormat format;
+	unsigned int workers; // 0 for one per online CPU.
+	unsigned int window; // batches in memory at once; 0 for twice the workers.
+	unsigned int batchPairs; // most pairs in a batch.
+	CK_ULONG maxMessage; // longest message accepted, before hex encoding.
+} BatchVerifyConfig;
+
+
+// Activity of one run.
+typedef struct
+{
+	unsigned long long pairs;
+	unsigned long long failed; // pairs that did not verify, malformed lines included.
+	unsigned long long bytes; // message bytes.
+	unsigned int workers;
+	double seconds;
+} BatchVerifyStats;
+
+
+// Called once per failed pair, in index order, after every pair was verified. rv is CKR_SIGNATURE_INVALID,
+// CKR_SIGNATURE_LEN_RANGE, CKR_DATA_INVALID for a malformed line, or CKR_DATA_LEN_RANGE for a message above
+// maxMessage.
+typedef void (*BatchVerifyFailure)(unsigned long long index, CK_RV rv, void *arg);
+
+
+// Verifies every pair of in with hPublic. Failed pairs are results, not errors : the run returns CKR_OK and reports
+// them through onFailure (which may be NULL). Returns CKR_MECHANISM_INVALID if the mechanism or the key cannot be
+// used on the host, CKR_DATA_INVALID for bad framing in a prefixed stream, CKR_FUNCTION_FAILED on a read error.
+CK_RV batchVerifyRun(PubKeyCache *cache, CK_SESSION_HANDLE hSession, const BatchVerifyConfig *config, FILE *in,
+	BatchVerifyFailure onFailure, void *arg, BatchVerifyStats *stats);
+
+void batchVerifyPrintStats(FILE *out, const BatchVerifyStats *stats);
+
+#endif
@@ -0,0 +1,233 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the latency recorder and the report writers declared in bench_stats.h.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "bench_stats.h"
+
+
+
+// Returns a monotonic timestamp in microseconds.
+double benchNowMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1e6) + (ts.tv_nsec / 1e3);
+}
+
+
+
+// Prepares an empty recorder. Pre-sizing it keeps realloc out of the measured loop.
+void latencyInit(LatencyRecorder *rec, size_t initialCapacity)
+{
+	if(initialCapacity==0)
+		initialCapacity = 1024;
+	rec->samples = (double*)malloc(initialCapacity * sizeof(double));
+	rec->count = 0;
+	rec->capacity = (rec->samples==NULL) ? 0 : initialCapacity;
+}
+
+
+
+// Appends one latency sample, doubling the buffer when it is full.
+void latencyRecord(LatencyRecorder *rec, double micros)
+{
+	if(rec->count==rec->capacity)
+	{
+		size_t newCapacity = (rec->capacity==0) ? 1024 : rec->capacity * 2;
+		double *grown = (double*)realloc(rec->samples, newCapacity * sizeof(double));
+		if(grown==NULL)
+			return; // sample dropped; the run continues.
+		rec->samples = grown;
+		rec->capacity = newCapacity;
+	}
+	rec->samples[rec->count++] = micros;
+}
+
+
+
+// Appends all samples of src into dst.
+void latencyMerge(LatencyRecorder *dst, const LatencyRecorder *src)
+{
+	for(size_t ctr=0; ctr<src->count; ctr++)
+		latencyRecord(dst, src->samples[ctr]);
+}
+
+
+
+void latencyFree(LatencyRecorder *rec)
+{
+	free(rec->samples);
+	rec->samples = NULL;
+	rec->count = 0;
+	rec->capacity = 0;
+}
+
+
+
+static int compareDouble(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x>y) - (x<y);
+}
+
+
+
+// Nearest-rank percentile over sorted samples.
+static double percentile(const double *sorted, size_t count, double pct)
+{
+	size_t rank;
+	if(count==0)
+		return 0;
+	rank = (size_t)ceil((pct / 100.0) * count);
+	if(rank<1)
+		rank = 1;
+	if(rank>count)
+		rank = count;
+	return sorted[rank-1];
+}
+
+
+
+// Sorts the samples in rec and fills the throughput and percentile fields of result.
+void benchSummarize(LatencyRecorder *rec, double seconds, BenchResult *result)
+{
+	double total = 0;
+
+	qsort(rec->samples, rec->count, sizeof(double), compareDouble);
+	for(size_t ctr=0; ctr<rec->count; ctr++)
+		total += rec->samples[ctr];
+
+	result->ops = rec->count;
+	result->seconds = seconds;
+	result->opsPerSec = (seconds>0) ? rec->count / seconds : 0;
+	result->mbPerSec = result->opsPerSec * result->payload / (1024.0 * 1024.0);
+	result->mean = (rec->count>0) ? total / rec->count : 0;
+	result->min = (rec->count>0) ? rec->samples[0] : 0;
+	result->p50 = percentile(rec->samples, rec->count, 50.0);
+	result->p90 = percentile(rec->samples, rec->count, 90.0);
+	result->p99 = percentile(rec->samples, rec->count, 99.0);
+	result->p999 = percentile(rec->samples, rec->count, 99.9);
+	result->max = (rec->count>0) ? rec->samples[rec->count-1] : 0;
+}
+
+
+
+// Prints results as a human readable table. Latencies are shown in milliseconds.
+void benchPrintTable(FILE *out, const BenchResult *results, size_t count)
+{
+	fprintf(out, "\n%-26s %6s %8s %4s %10s %6s %11s %9s %9s %9s %9s %9s %9s\n",
+		"MECHANISM", "KEY", "PAYLOAD", "THR", "OPS", "ERR", "OPS/SEC", "MB/SEC",
+		"P50(ms)", "P90(ms)", "P99(ms)", "P99.9(ms)", "MAX(ms)");
+	for(size_t ctr=0; ctr<count; ctr++)
+	{
+		const BenchResult *r = &results[ctr];
+		fprintf(out, "%-26s %6lu %8lu %4d %10lu %6lu %11.1f %9.2f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+			r->mechanism, r->keySize, r->payload, r->threads, r->ops, r->errors, r->opsPerSec, r->mbPerSec,
+			r->p50/1000, r->p90/1000, r->p99/1000, r->p999/1000, r->max/1000);
+	}
+	fprintf(out, "\n");
+}
+
+
+
+// Writes results as a JSON document. Latencies are in microseconds.
+void benchWriteJson(FILE *out, const char *benchmark, const BenchResult *results, size_t count)
+{
+	fprintf(out, "{\n  \"benchmark\": \"%s\",\n  \"results\": [\n", benchmark);
+	for(size_t ctr=0; ctr<count; ctr++)
+	{
+		const BenchResult *r = &results[ctr];
+		fprintf(out, "    {\"mechanism\": \"%s\", \"keySize\": %lu, \"payload\": %lu, \"threads\": %d, "
+			"\"ops\": %lu, \"errors\": %lu, \"seconds\": %.6f, \"opsPerSec\": %.3f, \"mbPerSec\": %.3f, "
+			"\"latencyMicros\": {\"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, "
+			"\"p99\": %.3f, \"p99_9\": %.3f, \"max\": %.3f}}%s\n",
+			r->mechanism, r->keySize, r->payload, r->threads, r->ops, r->errors, r->seconds, r->opsPerSec, r->mbPerSec,
+			r->mean, r->min, r->p50, r->p90, r->p99, r->p999, r->max, (ctr+1<count) ? "," : "");
+	}
+	fprintf(out, "  ]\n}\n");
+}
+
+
+
+// Writes results as CSV with a header row. Latencies are in microseconds.
+void benchWriteCsv(FILE *out, const BenchResult *results, size_t count)
+{
+	fprintf(out, "mechanism,key_size,payload,threads,ops,errors,seconds,ops_per_sec,mb_per_sec,mean_us,min_us,p50_us,p90_us,p99_us,p99_9_us,max_us\n");
+	for(size_t ctr=0; ctr<count; ctr++)
+	{
+		const BenchResult *r = &results[ctr];
+		fprintf(out, "%s,%lu,%lu,%d,%lu,%lu,%.6f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+			r->mechanism, r->keySize, r->payload, r->threads, r->ops, r->errors, r->seconds, r->opsPerSec, r->mbPerSec,
+			r->mean, r->min, r->p50, r->p90, r->p99, r->p999, r->max);
+	}
+}
+
+
+
+static FILE *openReport(const char *path)
+{
+	if(strcmp(path, "-")==0)
+		return stdout;
+	return fopen(path, "w");
+}
+
+
+
+static void closeReport(FILE *out)
+{
+	if(out!=stdout)
+		fclose(out);
+	else
+		fflush(out);
+}
+
+
+
+int benchSaveJson(const char *path, const char *benchmark, const BenchResult *results, size_t count)
+{
+	FILE *out = openReport(path);
+	if(out==NULL)
+	{
+		printf("Failed to open %s for writing.\n", path);
+		return 1;
+	}
+	benchWriteJson(out, benchmark, results, count);
+	closeReport(out);
+	return 0;
+}
+
+
+
+int benchSaveCsv(const char *path, const BenchResult *results, size_t count)
+{
+	FILE *out = openReport(path);
+	if(out==NULL)
+	{
+		printf("Failed to open %s for writing.\n", path);
+		return 1;
+	}
+	benchWriteCsv(out, results, count);
+	closeReport(out);
+	return 0;
+}
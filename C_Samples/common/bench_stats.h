@@ -0,0 +1,82 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Helpers shared by the benchmark samples for recording per-operation latency.
+	- Each worker thread owns a LatencyRecorder, so recording a sample never takes a lock.
+	- Once the workers are joined, recorders are merged and summarised into a BenchResult.
+	- A BenchResult can be printed as a table, or written as JSON / CSV for regression tracking.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_BENCH_STATS_H
+#define LUNA_SAMPLES_BENCH_STATS_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+// Latency samples (in microseconds) collected by a single thread.
+typedef struct
+{
+	double *samples;
+	size_t count;
+	size_t capacity;
+} LatencyRecorder;
+
+
+// Summary of a single benchmark run.
+typedef struct
+{
+	char mechanism[48];	// mechanism name, e.g. CKM_SHA256_RSA_PKCS.
+	unsigned long keySize;	// key size in bits.
+	unsigned long payload;	// bytes processed per operation.
+	int threads;		// number of worker threads.
+	unsigned long ops;	// successful operations measured.
+	unsigned long errors;	// failed operations.
+	double seconds;		// wall time of the measured phase.
+	double opsPerSec;
+	double mbPerSec;	// payload throughput in MiB/s.
+	double mean;		// latencies below are in microseconds.
+	double min;
+	double p50;
+	double p90;
+	double p99;
+	double p999;
+	double max;
+} BenchResult;
+
+
+// Returns a monotonic timestamp in microseconds.
+double benchNowMicros();
+
+void latencyInit(LatencyRecorder *rec, size_t initialCapacity);
+void latencyRecord(LatencyRecorder *rec, double micros);
+void latencyMerge(LatencyRecorder *dst, const LatencyRecorder *src);
+void latencyFree(LatencyRecorder *rec);
+
+// Sorts the samples in rec and fills the throughput and percentile fields of result.
+// result->payload must already be set for mbPerSec to be computed.
+void benchSummarize(LatencyRecorder *rec, double seconds, BenchResult *result);
+
+void benchPrintTable(FILE *out, const BenchResult *results, size_t count);
+void benchWriteJson(FILE *out, const char *benchmark, const BenchResult *results, size_t count);
+void benchWriteCsv(FILE *out, const BenchResult *results, size_t count);
+
+// Writes results as JSON or CSV into the named file ("-" means stdout). Returns 0 on success.
+int benchSaveJson(const char *path, const char *benchmark, const BenchResult *results, size_t count);
+int benchSaveCsv(const char *path, const BenchResult *results, size_t count);
+
+#endif
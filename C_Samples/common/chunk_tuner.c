@@ -0,0 +1,365 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the chunk size calibration declared in chunk_tuner.h.
+	- A probe stops after probeBytes bytes or CHUNK_TUNER_PROBE_SECONDS, whichever comes first, but never before
+	  CHUNK_TUNER_MIN_UPDATES updates, so that small chunks on a slow link do not take minutes.
+	- Mechanisms the token cannot encrypt with (CKF_ENCRYPT missing from their C_GetMechanismInfo flags) are probed
+	  with C_SignInit / C_SignUpdate / C_SignFinal instead.
+	- CKM_AES_GCM only returns its output at the end of a multi-part operation, and its chunked users encrypt every
+	  chunk as an operation of its own, so it is probed with one C_EncryptInit / C_Encrypt per chunk.
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include "chunk_tuner.h"
+
+
+#define CHUNK_TUNER_PROBE_SECONDS 2.0
+#define CHUNK_TUNER_MIN_UPDATES 4
+#define CHUNK_TUNER_MAX_LINES 256
+#define CHUNK_TUNER_FINAL_ROOM 1024 // output of C_EncryptFinal or C_SignFinal, up to a 4096 bit RSA signature.
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+CK_RV chunkTunerSlotKey(CK_FUNCTION_LIST *p11, CK_SLOT_ID slotId, char key[CHUNK_TUNER_KEY_LEN])
+{
+	CK_TOKEN_INFO info;
+	int len = sizeof(info.serialNumber);
+	CK_RV rv = p11->C_GetTokenInfo(slotId, &info);
+
+	if(rv!=CKR_OK)
+		return rv;
+	while(len>0 && (info.serialNumber[len-1]==' ' || info.serialNumber[len-1]=='\0'))
+		len--;
+	if(len==0)
+		snprintf(key, CHUNK_TUNER_KEY_LEN, "slot-%lu", slotId); // no serial number : fall back on the slot.
+	else
+		snprintf(key, CHUNK_TUNER_KEY_LEN, "%.*s", len, (char*)info.serialNumber);
+	for(char *c=key; *c!='\0'; c++)
+		if(*c==' ')
+			*c = '_'; // keeps the file one word per field.
+	return CKR_OK;
+}
+
+
+
+// How a mechanism is probed.
+typedef enum { PROBE_ENCRYPT_UPDATE, PROBE_SIGN_UPDATE, PROBE_ENCRYPT_SINGLE } ProbeKind;
+
+
+
+static ProbeKind probeKind(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM_TYPE mechanism)
+{
+	CK_SESSION_INFO session;
+	CK_MECHANISM_INFO info;
+
+	if(mechanism==CKM_AES_GCM)
+		return PROBE_ENCRYPT_SINGLE;
+	if(p11->C_GetSessionInfo(hSession, &session)!=CKR_OK
+		|| p11->C_GetMechanismInfo(session.slotID, mechanism, &info)!=CKR_OK)
+		return PROBE_ENCRYPT_UPDATE; // let C_EncryptInit report the error.
+	return (!(info.flags & CKF_ENCRYPT) && (info.flags & CKF_SIGN)) ? PROBE_SIGN_UPDATE : PROBE_ENCRYPT_UPDATE;
+}
+
+
+
+// Starts the operation of a probe. Single-part probes start one operation per chunk instead.
+static CK_RV probeInit(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, ProbeKind kind, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hKey)
+{
+	if(kind==PROBE_SIGN_UPDATE)
+		return p11->C_SignInit(hSession, mech, hKey);
+	if(kind==PROBE_ENCRYPT_UPDATE)
+		return p11->C_EncryptInit(hSession, mech, hKey);
+	return CKR_OK;
+}
+
+
+
+// Processes one chunk of the probe.
+static CK_RV probeChunk(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, ProbeKind kind, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hKey, CK_BYTE *in, CK_ULONG len, CK_BYTE *out)
+{
+	CK_ULONG outLen = len + CHUNK_TUNER_FINAL_ROOM;
+	CK_RV rv = CKR_OK;
+
+	if(kind==PROBE_SIGN_UPDATE)
+		return p11->C_SignUpdate(hSession, in, len);
+	if(kind==PROBE_ENCRYPT_UPDATE)
+		return p11->C_EncryptUpdate(hSession, in, len, out, &outLen);
+	rv = p11->C_EncryptInit(hSession, mech, hKey);
+	if(rv==CKR_OK)
+		rv = p11->C_Encrypt(hSession, in, len, out, &outLen);
+	return rv;
+}
+
+
+
+// Ends the operation of a successful probe.
+static CK_RV probeFinal(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, ProbeKind kind, CK_BYTE *out, CK_ULONG outLen)
+{
+	if(kind==PROBE_SIGN_UPDATE)
+		return p11->C_SignFinal(hSession, out, &outLen);
+	if(kind==PROBE_ENCRYPT_UPDATE)
+		return p11->C_EncryptFinal(hSession, out, &outLen);
+	return CKR_OK;
+}
+
+
+
+CK_RV chunkTunerProbe(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	CK_ULONG chunkSize, CK_ULONG probeBytes, ChunkProbe *probe)
+{
+	CK_BYTE *in = (CK_BYTE*)calloc(chunkSize, 1);
+	CK_BYTE *out = (CK_BYTE*)malloc(chunkSize + CHUNK_TUNER_FINAL_ROOM);
+	unsigned long long done = 0;
+	double start = 0, elapsed = 0;
+	ProbeKind kind = probeKind(p11, hSession, mech->mechanism);
+	CK_RV rv = CKR_OK;
+
+	memset(probe, 0, sizeof(ChunkProbe));
+	probe->chunkSize = chunkSize;
+	if(in==NULL || out==NULL)
+		rv = CKR_HOST_MEMORY;
+
+	// One update before the clock starts, so the first round trip of the operation is not measured.
+	if(rv==CKR_OK)
+		rv = probeInit(p11, hSession, kind, mech, hKey);
+	if(rv==CKR_OK)
+		rv = probeChunk(p11, hSession, kind, mech, hKey, in, chunkSize, out);
+	start = nowSeconds();
+	while(rv==CKR_OK && (probe->updates<CHUNK_TUNER_MIN_UPDATES
+		|| (done<probeBytes && nowSeconds() - start<CHUNK_TUNER_PROBE_SECONDS)))
+	{
+		rv = probeChunk(p11, hSession, kind, mech, hKey, in, chunkSize, out);
+		done += chunkSize;
+		probe->updates++;
+	}
+	elapsed = nowSeconds() - start;
+	// A failed update has already ended the operation; only a successful one is left to finish.
+	if(rv==CKR_OK)
+		rv = probeFinal(p11, hSession, kind, out, chunkSize + CHUNK_TUNER_FINAL_ROOM);
+
+	probe->rv = rv;
+	if(rv==CKR_OK && elapsed>0)
+	{
+		probe->mbPerSec = done / elapsed / (1024*1024);
+		probe->updateMicros = elapsed * 1e6 / probe->updates;
+	}
+	free(in);
+	free(out);
+	return rv;
+}
+
+
+
+CK_RV chunkTunerCalibrate(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const CK_ULONG *sizes, int count, CK_ULONG probeBytes, ChunkProbe *probes, CK_ULONG *best)
+{
+	double top = 0;
+	CK_RV rv = CKR_FUNCTION_FAILED;
+
+	if(count<=0 || count>CHUNK_TUNER_MAX_SIZES || best==NULL)
+		return CKR_ARGUMENTS_BAD;
+	*best = 0;
+	for(int ctr=0; ctr<count; ctr++)
+	{
+		if(chunkTunerProbe(p11, hSession, mech, hKey, sizes[ctr], probeBytes, &probes[ctr])!=CKR_OK)
+			continue;
+		rv = CKR_OK;
+		if(probes[ctr].mbPerSec>top)
+			top = probes[ctr].mbPerSec;
+	}
+	if(rv!=CKR_OK)
+		return probes[0].rv;
+
+	for(int ctr=0; ctr<count && *best==0; ctr++)
+		if(probes[ctr].rv==CKR_OK && probes[ctr].mbPerSec * 100>=top * CHUNK_TUNER_KNEE)
+			*best = probes[ctr].chunkSize;
+	return CKR_OK;
+}
+
+
+
+CK_RV chunkTunerCalibrateAndSave(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_SLOT_ID slotId,
+	CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey, CK_ULONG probeBytes, FILE *report, ChunkTuning *tuning)
+{
+	CK_ULONG sizes[CHUNK_TUNER_MAX_SIZES];
+	ChunkProbe probes[CHUNK_TUNER_MAX_SIZES];
+	const char *path = chunkTunerDefaultPath();
+	int count = 0;
+	CK_RV rv = CKR_OK;
+
+	for(CK_ULONG size=CHUNK_TUNER_MIN_CHUNK; size<=CHUNK_TUNER_MAX_CHUNK; size*=2)
+		sizes[count++] = size;
+	memset(tuning, 0, sizeof(ChunkTuning));
+	rv = chunkTunerSlotKey(p11, slotId, tuning->slotKey);
+	if(rv!=CKR_OK)
+		return rv;
+	if(report!=NULL)
+		fprintf(report, "\n> Calibrating mechanism 0x%lX on token %s, about %lu bytes per chunk size.\n\n",
+			mech->mechanism, tuning->slotKey, probeBytes);
+	rv = chunkTunerCalibrate(p11, hSession, mech, hKey, sizes, count, probeBytes, probes, &tuning->chunkSize);
+	if(rv!=CKR_OK)
+		return rv;
+
+	if(report!=NULL)
+		fprintf(report, "%12s %10s %14s %10s\n", "chunk", "updates", "us / update", "MB/s");
+	for(int ctr=0; ctr<count; ctr++)
+	{
+		if(report!=NULL && probes[ctr].rv!=CKR_OK)
+			fprintf(report, "%12lu   failed with 0x%lX\n", probes[ctr].chunkSize, probes[ctr].rv);
+		else if(report!=NULL)
+			fprintf(report, "%12lu %10lu %14.1f %10.2f%s\n", probes[ctr].chunkSize, probes[ctr].updates,
+				probes[ctr].updateMicros, probes[ctr].mbPerSec, (probes[ctr].chunkSize==tuning->chunkSize) ? "   <- knee" : "");
+		if(probes[ctr].chunkSize==tuning->chunkSize)
+			tuning->mbPerSec = probes[ctr].mbPerSec;
+	}
+
+	tuning->mechanism = mech->mechanism;
+	tuning->calibrated = (long long)time(NULL);
+	if(chunkTunerSave(path, tuning)!=0)
+	{
+		if(report!=NULL)
+			fprintf(report, "\n> Cannot save the calibration into %s : %s\n", path, strerror(errno));
+		return CKR_FUNCTION_FAILED;
+	}
+	if(report!=NULL)
+		fprintf(report, "\n> Chunk size %lu (%d %% of the best throughput) saved into %s.\n", tuning->chunkSize,
+			CHUNK_TUNER_KNEE, path);
+	return CKR_OK;
+}
+
+
+
+CK_ULONG chunkTunerPick(CK_FUNCTION_LIST *p11, CK_SLOT_ID slotId, CK_MECHANISM_TYPE mechanism, CK_ULONG fallback,
+	FILE *report)
+{
+	ChunkTuning tuning;
+	char slotKey[CHUNK_TUNER_KEY_LEN];
+
+	if(chunkTunerSlotKey(p11, slotId, slotKey)==CKR_OK && chunkTunerLoad(chunkTunerDefaultPath(), slotKey, mechanism, &tuning))
+	{
+		if(report!=NULL)
+			fprintf(report, "\n> Chunk size %lu, calibrated for token %s (%.2f MB/s).\n", tuning.chunkSize, slotKey,
+				tuning.mbPerSec);
+		return tuning.chunkSize;
+	}
+	if(report!=NULL)
+		fprintf(report, "\n> Chunk size %lu, the default : the mechanism is not calibrated for this slot.\n", fallback);
+	return fallback;
+}
+
+
+
+const char *chunkTunerDefaultPath()
+{
+	static char path[1024];
+	const char *env = getenv("LUNA_CHUNK_TUNING");
+	const char *home = getenv("HOME");
+
+	if(env!=NULL && *env!='\0')
+		return env;
+	snprintf(path, sizeof(path), "%s/.luna_chunk_tuning", (home!=NULL) ? home : ".");
+	return path;
+}
+
+
+
+// Reads one line of the tuning file. Returns 1 if it holds a tuning.
+static int parseLine(const char *line, ChunkTuning *tuning)
+{
+	memset(tuning, 0, sizeof(ChunkTuning));
+	if(line[0]=='#')
+		return 0;
+	return sscanf(line, "%32s %lx %lu %lf %lld", tuning->slotKey, &tuning->mechanism, &tuning->chunkSize,
+		&tuning->mbPerSec, &tuning->calibrated)==5 && tuning->chunkSize>0;
+}
+
+
+
+int chunkTunerLoad(const char *path, const char *slotKey, CK_MECHANISM_TYPE mechanism, ChunkTuning *tuning)
+{
+	FILE *file = fopen(path, "r");
+	char line[256];
+	int found = 0;
+
+	if(file==NULL)
+		return 0;
+	while(!found && fgets(line, sizeof(line), file)!=NULL)
+		found = parseLine(line, tuning) && strcmp(tuning->slotKey, slotKey)==0 && tuning->mechanism==mechanism;
+	fclose(file);
+	return found;
+}
+
+
+
+int chunkTunerSave(const char *path, const ChunkTuning *tuning)
+{
+	ChunkTuning *kept = (ChunkTuning*)calloc(CHUNK_TUNER_MAX_LINES, sizeof(ChunkTuning));
+	char tmpPath[1100];
+	char line[256];
+	FILE *file = NULL;
+	int count = 0, failed = 0;
+
+	if(kept==NULL)
+		return -1;
+	file = fopen(path, "r");
+	if(file!=NULL)
+	{
+		while(count<CHUNK_TUNER_MAX_LINES-1 && fgets(line, sizeof(line), file)!=NULL)
+			if(parseLine(line, &kept[count])
+				&& (strcmp(kept[count].slotKey, tuning->slotKey)!=0 || kept[count].mechanism!=tuning->mechanism))
+				count++;
+		fclose(file);
+	}
+	kept[count++] = *tuning;
+
+	// Written next to the file then renamed over it, so a reader never sees half a file.
+	snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+	file = fopen(tmpPath, "w");
+	if(file==NULL)
+	{
+		free(kept);
+		return -1;
+	}
+	fprintf(file, "# Chunk sizes calibrated by the luna-samples : serial mechanism chunk MB/s time\n");
+	for(int ctr=0; ctr<count; ctr++)
+		fprintf(file, "%s 0x%lx %lu %.2f %lld\n", kept[ctr].slotKey, kept[ctr].mechanism, kept[ctr].chunkSize,
+			kept[ctr].mbPerSec, kept[ctr].calibrated);
+	failed = (fclose(file)!=0);
+	if(!failed)
+		failed = (rename(tmpPath, path)!=0);
+	if(failed)
+		remove(tmpPath);
+	free(kept);
+	return failed ? -1 : 0;
+}
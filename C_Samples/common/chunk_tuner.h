@@ -0,0 +1,97 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Finds the chunk size to give C_EncryptUpdate for a mechanism on a given HSM, and remembers it per slot.
+	- The best size depends on the firmware, the mechanism and the network between host and HSM, so it is
+	  measured : chunkTunerCalibrate streams data through C_EncryptInit / C_EncryptUpdate / C_EncryptFinal (or the
+	  C_Sign functions, for signature and MAC mechanisms) with a range of chunk sizes, and picks the knee of the
+	  throughput curve, i.e. the smallest chunk reaching CHUNK_TUNER_KNEE percent of the best throughput. Larger
+	  chunks than that only cost memory and latency.
+	- Results are kept in a text file (chunkTunerDefaultPath), one line per token serial number and mechanism, so
+	  that streaming samples pick the tuned size of their own mechanism with chunkTunerPick :-
+		<serial> <mechanism in hex> <chunk size> <MB/s> <time of calibration>
+*/
+
+
+
+#ifndef LUNA_SAMPLES_CHUNK_TUNER_H
+#define LUNA_SAMPLES_CHUNK_TUNER_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+
+
+#define CHUNK_TUNER_KNEE 90 // percent of the best throughput the chosen chunk size must reach.
+#define CHUNK_TUNER_KEY_LEN 33 // token serial number and terminating zero.
+#define CHUNK_TUNER_MAX_SIZES 32
+#define CHUNK_TUNER_MIN_CHUNK 1024 // range probed by chunkTunerCalibrateAndSave, in powers of two.
+#define CHUNK_TUNER_MAX_CHUNK (4*1024*1024)
+
+
+// Measure of one chunk size.
+typedef struct
+{
+	CK_ULONG chunkSize;
+	unsigned long updates; // C_EncryptUpdate calls measured.
+	double mbPerSec;
+	double updateMicros; // mean time of one C_EncryptUpdate.
+	CK_RV rv; // CKR_OK if the size could be measured.
+} ChunkProbe;
+
+
+// A chunk size remembered for a slot and a mechanism.
+typedef struct
+{
+	char slotKey[CHUNK_TUNER_KEY_LEN]; // serial number of the token in the slot.
+	CK_MECHANISM_TYPE mechanism;
+	CK_ULONG chunkSize;
+	double mbPerSec;
+	long long calibrated; // time of the calibration, in seconds since the epoch.
+} ChunkTuning;
+
+
+// Identifies the token in slotId by its serial number, which, unlike the slot number, follows the partition.
+CK_RV chunkTunerSlotKey(CK_FUNCTION_LIST *p11, CK_SLOT_ID slotId, char key[CHUNK_TUNER_KEY_LEN]);
+
+// Measures one chunk size : about probeBytes bytes are encrypted, or signed, in chunks of chunkSize bytes.
+// mech must take input by multiples of its block size (CKM_AES_ECB, CKM_AES_CBC_PAD, CKM_AES_CTR, ...), be
+// CKM_AES_GCM (one C_Encrypt per chunk), or be a multi-part signature or MAC mechanism (CKM_SHA256_RSA_PKCS, ...).
+CK_RV chunkTunerProbe(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	CK_ULONG chunkSize, CK_ULONG probeBytes, ChunkProbe *probe);
+
+// Probes count chunk sizes, in increasing order, and returns the knee in *best. Sizes the token refuses are
+// reported in their probe and skipped. Fails only if no size could be measured.
+CK_RV chunkTunerCalibrate(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const CK_ULONG *sizes, int count, CK_ULONG probeBytes, ChunkProbe *probes, CK_ULONG *best);
+
+// Calibrates mech from CHUNK_TUNER_MIN_CHUNK to CHUNK_TUNER_MAX_CHUNK and saves the knee for the token in slotId.
+// The probes are printed on report, which may be NULL. Returns CKR_FUNCTION_FAILED if the file cannot be written.
+CK_RV chunkTunerCalibrateAndSave(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_SLOT_ID slotId,
+	CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey, CK_ULONG probeBytes, FILE *report, ChunkTuning *tuning);
+
+// Returns the chunk size calibrated for the token in slotId and mechanism, or fallback, and says which on report.
+CK_ULONG chunkTunerPick(CK_FUNCTION_LIST *p11, CK_SLOT_ID slotId, CK_MECHANISM_TYPE mechanism, CK_ULONG fallback,
+	FILE *report);
+
+// The tuning file : $LUNA_CHUNK_TUNING if set, else .luna_chunk_tuning in the home directory.
+const char *chunkTunerDefaultPath();
+
+// Looks up the tuning of a slot and mechanism. Returns 1 if found, 0 otherwise.
+int chunkTunerLoad(const char *path, const char *slotKey, CK_MECHANISM_TYPE mechanism, ChunkTuning *tuning);
+
+// Adds or replaces the tuning of a slot and mechanism; the file is rewritten atomically. Returns 0 on success.
+int chunkTunerSave(const char *path, const ChunkTuning *tuning);
+
+#endif
@@ -0,0 +1,297 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the single-call sign, encrypt and decrypt helpers declared in crypto_ops.h.
+	- Curves are recognised from the DER encoded OID in CKA_EC_PARAMS; an unknown curve falls back to a growing buffer.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include "crypto_ops.h"
+
+
+// Named curves recognised in CKA_EC_PARAMS.
+typedef struct
+{
+	CK_BYTE oid[12]; // DER encoded OBJECT IDENTIFIER.
+	CK_ULONG oidLen;
+	CK_ULONG bits;
+	CK_ULONG curveBytes;
+} KnownCurve;
+
+static const KnownCurve knownCurves[] =
+{
+	{{0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07},		10,	256,	32}, // P-256
+	{{0x06, 0x05, 0x2B, 0x81, 0x04, 0x00, 0x22},				7,	384,	48}, // P-384
+	{{0x06, 0x05, 0x2B, 0x81, 0x04, 0x00, 0x23},				7,	521,	66}, // P-521
+	{{0x06, 0x05, 0x2B, 0x81, 0x04, 0x00, 0x21},				7,	224,	28}, // P-224
+	{{0x06, 0x05, 0x2B, 0x81, 0x04, 0x00, 0x0A},				7,	256,	32}, // secp256k1
+	{{0x06, 0x03, 0x2B, 0x65, 0x70},					5,	255,	32}, // Ed25519
+	{{0x06, 0x03, 0x2B, 0x65, 0x71},					5,	448,	57}, // Ed448
+	{{0x06, 0x09, 0x2B, 0x06, 0x01, 0x04, 0x01, 0xDA, 0x47, 0x0F, 0x01},	11,	255,	32}  // Ed25519, Luna OID
+};
+
+
+
+// Fills bits and curveBytes from the CKA_EC_PARAMS of an EC or Edwards key.
+static void readCurve(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CryptoKeyInfo *info)
+{
+	CK_BYTE params[64];
+	CK_ATTRIBUTE attrib = {CKA_EC_PARAMS, params, sizeof(params)};
+
+	if(p11->C_GetAttributeValue(hSession, info->hKey, &attrib, 1)!=CKR_OK)
+		return;
+	for(size_t ctr=0; ctr<sizeof(knownCurves)/sizeof(*knownCurves); ctr++)
+	{
+		if(attrib.ulValueLen==knownCurves[ctr].oidLen && memcmp(params, knownCurves[ctr].oid, attrib.ulValueLen)==0)
+		{
+			info->bits = knownCurves[ctr].bits;
+			info->curveBytes = knownCurves[ctr].curveBytes;
+			return;
+		}
+	}
+}
+
+
+
+// Reads the key type and size attributes of hKey.
+CK_RV cryptoKeyInfo(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, CryptoKeyInfo *info)
+{
+	CK_ATTRIBUTE attrib = {CKA_KEY_TYPE, NULL, sizeof(CK_KEY_TYPE)};
+	CK_ULONG valueLen = 0;
+	CK_RV rv;
+
+	memset(info, 0, sizeof(*info));
+	info->hKey = hKey;
+	attrib.pValue = &info->keyType;
+	rv = p11->C_GetAttributeValue(hSession, hKey, &attrib, 1);
+	if(rv!=CKR_OK)
+		return rv;
+
+	switch(info->keyType)
+	{
+		case CKK_RSA:
+			// Only the length of the modulus is needed, so no buffer is passed.
+			attrib.type = CKA_MODULUS;
+			attrib.pValue = NULL;
+			attrib.ulValueLen = 0;
+			rv = p11->C_GetAttributeValue(hSession, hKey, &attrib, 1);
+			if(rv==CKR_OK)
+				info->bits = attrib.ulValueLen * 8;
+			break;
+
+		case CKK_EC:
+		case CKK_EC_EDWARDS:
+			readCurve(p11, hSession, info);
+			break;
+
+		case CKK_DES3:
+			info->bits = 192;
+			break;
+
+		default:
+			attrib.type = CKA_VALUE_LEN;
+			attrib.pValue = &valueLen;
+			attrib.ulValueLen = sizeof(valueLen);
+			if(p11->C_GetAttributeValue(hSession, hKey, &attrib, 1)==CKR_OK)
+				info->bits = valueLen * 8;
+			break;
+	}
+	return CKR_OK;
+}
+
+
+
+// Largest signature produced with this key and mechanism. 0 means the size cannot be predicted.
+CK_ULONG cryptoSignatureSize(const CryptoKeyInfo *key, const CK_MECHANISM *mech)
+{
+	switch(mech->mechanism)
+	{
+		case CKM_RSA_PKCS:
+		case CKM_RSA_X_509:
+		case CKM_RSA_PKCS_PSS:
+		case CKM_SHA1_RSA_PKCS:
+		case CKM_SHA224_RSA_PKCS:
+		case CKM_SHA256_RSA_PKCS:
+		case CKM_SHA384_RSA_PKCS:
+		case CKM_SHA512_RSA_PKCS:
+		case CKM_SHA1_RSA_PKCS_PSS:
+		case CKM_SHA224_RSA_PKCS_PSS:
+		case CKM_SHA256_RSA_PKCS_PSS:
+		case CKM_SHA384_RSA_PKCS_PSS:
+		case CKM_SHA512_RSA_PKCS_PSS:
+			return (key->bits + 7) / 8;
+
+		case CKM_ECDSA:
+		case CKM_ECDSA_SHA1:
+		case CKM_ECDSA_SHA224:
+		case CKM_ECDSA_SHA256:
+		case CKM_ECDSA_SHA384:
+		case CKM_ECDSA_SHA512:
+		case CKM_EDDSA:
+			return key->curveBytes * 2; // r || s
+
+		case CKM_SHA_1_HMAC:	return 20;
+		case CKM_SHA224_HMAC:	return 28;
+		case CKM_SHA256_HMAC:	return 32;
+		case CKM_SHA384_HMAC:	return 48;
+		case CKM_SHA512_HMAC:	return 64;
+		case CKM_AES_CMAC:	return 16;
+		case CKM_DES3_CMAC:	return 8;
+
+		default:
+			return 0;
+	}
+}
+
+
+
+// Largest ciphertext produced with this key and mechanism for dataLen bytes. 0 means the size cannot be predicted.
+CK_ULONG cryptoCiphertextSize(const CryptoKeyInfo *key, const CK_MECHANISM *mech, CK_ULONG dataLen)
+{
+	CK_AES_GCM_PARAMS *gcm = NULL;
+
+	switch(mech->mechanism)
+	{
+		case CKM_RSA_PKCS:
+		case CKM_RSA_X_509:
+		case CKM_RSA_PKCS_OAEP:
+			return (key->bits + 7) / 8;
+
+		case CKM_AES_CBC_PAD:
+			return (dataLen / 16 + 1) * 16;
+		case CKM_DES3_CBC_PAD:
+			return (dataLen / 8 + 1) * 8;
+		case CKM_AES_ECB:
+		case CKM_AES_CBC:
+			return (dataLen + 15) / 16 * 16;
+		case CKM_DES3_ECB:
+		case CKM_DES3_CBC:
+			return (dataLen + 7) / 8 * 8;
+		case CKM_AES_CTR:
+			return dataLen;
+
+		case CKM_AES_GCM:
+			gcm = (CK_AES_GCM_PARAMS*)mech->pParameter;
+			if(gcm==NULL)
+				return 0;
+			return dataLen + (gcm->ulTagBits + 7) / 8;
+
+		default:
+			return 0;
+	}
+}
+
+
+
+// Makes sure buf holds at least size bytes.
+int cryptoBufferReserve(CryptoBuffer *buf, CK_ULONG size)
+{
+	CK_BYTE *data = NULL;
+
+	if(buf->size>=size)
+		return 0;
+	data = (CK_BYTE*)realloc(buf->data, size);
+	if(data==NULL)
+		return -1;
+	buf->data = data;
+	buf->size = size;
+	return 0;
+}
+
+
+
+void cryptoBufferFree(CryptoBuffer *buf)
+{
+	free(buf->data);
+	buf->data = NULL;
+	buf->size = 0;
+}
+
+
+
+// C_Sign, C_Encrypt or C_Decrypt.
+typedef CK_RV (*SinglePartFn)(CK_SESSION_HANDLE, CK_BYTE_PTR, CK_ULONG, CK_BYTE_PTR, CK_ULONG_PTR);
+
+
+
+// Runs the single-part call with the buffer as it is. The size probe is only made when the buffer is too small,
+// which PKCS#11 allows without restarting the operation, and the grown buffer is kept for the next call.
+static CK_RV singleCall(SinglePartFn call, CK_SESSION_HANDLE hSession,
+	CK_BYTE *data, CK_ULONG dataLen, CryptoBuffer *out, CK_ULONG *outLen)
+{
+	CK_RV rv;
+
+	*outLen = out->size;
+	rv = call(hSession, data, dataLen, out->data, outLen);
+	if(rv!=CKR_BUFFER_TOO_SMALL && !(rv==CKR_OK && out->data==NULL))
+		return rv;
+
+	// out->data was NULL (nothing reserved yet) or too small : *outLen now holds the required size.
+	if(cryptoBufferReserve(out, *outLen)!=0)
+		return CKR_HOST_MEMORY;
+	*outLen = out->size;
+	return call(hSession, data, dataLen, out->data, outLen);
+}
+
+
+
+// C_SignInit + C_Sign into out.
+CK_RV cryptoSign(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, const CryptoKeyInfo *key,
+	CK_BYTE *data, CK_ULONG dataLen, CryptoBuffer *out, CK_ULONG *outLen)
+{
+	CK_RV rv;
+
+	if(cryptoBufferReserve(out, cryptoSignatureSize(key, mech))!=0)
+		return CKR_HOST_MEMORY;
+	rv = p11->C_SignInit(hSession, mech, key->hKey);
+	if(rv!=CKR_OK)
+		return rv;
+	return singleCall(p11->C_Sign, hSession, data, dataLen, out, outLen);
+}
+
+
+
+// C_EncryptInit + C_Encrypt into out.
+CK_RV cryptoEncrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, const CryptoKeyInfo *key,
+	CK_BYTE *data, CK_ULONG dataLen, CryptoBuffer *out, CK_ULONG *outLen)
+{
+	CK_RV rv;
+
+	if(cryptoBufferReserve(out, cryptoCiphertextSize(key, mech, dataLen))!=0)
+		return CKR_HOST_MEMORY;
+	rv = p11->C_EncryptInit(hSession, mech, key->hKey);
+	if(rv!=CKR_OK)
+		return rv;
+	return singleCall(p11->C_Encrypt, hSession, data, dataLen, out, outLen);
+}
+
+
+
+// C_DecryptInit + C_Decrypt into out.
+CK_RV cryptoDecrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, const CryptoKeyInfo *key,
+	CK_BYTE *data, CK_ULONG dataLen, CryptoBuffer *out, CK_ULONG *outLen)
+{
+	CK_RV rv;
+
+	if(cryptoBufferReserve(out, dataLen)!=0)
+		return CKR_HOST_MEMORY;
+	rv = p11->C_DecryptInit(hSession, mech, key->hKey);
+	if(rv!=CKR_OK)
+		return rv;
+	return singleCall(p11->C_Decrypt, hSession, data, dataLen, out, outLen);
+}
@@ -0,0 +1,72 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Single-call sign, encrypt and decrypt helpers for code that runs the same operation many times.
+	- The samples size their output by calling C_Sign / C_Encrypt with a NULL buffer first, then allocate and call again.
+	- Here the output size is worked out once per key, from CKA_MODULUS, CKA_EC_PARAMS or CKA_VALUE_LEN and the mechanism rules.
+	- The output goes into a CryptoBuffer owned by the calling thread, so an operation is one round trip and no malloc.
+	- If a size cannot be predicted, or turns out too small, the buffer grows once and is reused from then on.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_CRYPTO_OPS_H
+#define LUNA_SAMPLES_CRYPTO_OPS_H
+
+#include <cryptoki_v2.h>
+
+
+// What the output sizing needs to know about a key. Read once with cryptoKeyInfo.
+typedef struct
+{
+	CK_OBJECT_HANDLE hKey;
+	CK_KEY_TYPE keyType;
+	CK_ULONG bits; // modulus bits, curve bits, or secret key bits. 0 when unknown.
+	CK_ULONG curveBytes; // EC and EdDSA : size of one signature half (r, s or R, S).
+} CryptoKeyInfo;
+
+
+// Output buffer reused for every operation of one thread.
+typedef struct
+{
+	CK_BYTE *data;
+	CK_ULONG size;
+} CryptoBuffer;
+
+
+// Reads the key type and size attributes of hKey.
+CK_RV cryptoKeyInfo(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, CryptoKeyInfo *info);
+
+// Largest output of C_Sign / C_Encrypt with this key and mechanism. 0 means the size cannot be predicted.
+CK_ULONG cryptoSignatureSize(const CryptoKeyInfo *key, const CK_MECHANISM *mech);
+CK_ULONG cryptoCiphertextSize(const CryptoKeyInfo *key, const CK_MECHANISM *mech, CK_ULONG dataLen);
+
+// Makes sure buf holds at least size bytes. Returns 0 on success, -1 if memory is exhausted.
+int cryptoBufferReserve(CryptoBuffer *buf, CK_ULONG size);
+void cryptoBufferFree(CryptoBuffer *buf);
+
+// C_SignInit + C_Sign into out. *outLen receives the signature length.
+CK_RV cryptoSign(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, const CryptoKeyInfo *key,
+	CK_BYTE *data, CK_ULONG dataLen, CryptoBuffer *out, CK_ULONG *outLen);
+
+// C_EncryptInit + C_Encrypt into out. *outLen receives the ciphertext length.
+CK_RV cryptoEncrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, const CryptoKeyInfo *key,
+	CK_BYTE *data, CK_ULONG dataLen, CryptoBuffer *out, CK_ULONG *outLen);
+
+// C_DecryptInit + C_Decrypt into out. The plaintext is never longer than the ciphertext, so out is sized from dataLen.
+CK_RV cryptoDecrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, const CryptoKeyInfo *key,
+	CK_BYTE *data, CK_ULONG dataLen, CryptoBuffer *out, CK_ULONG *outLen);
+
+#endif
@@ -0,0 +1,280 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the CTR engine declared in ctr_engine.h.
+	- A range that starts inside a block is handled by encrypting the partial first block on its own, with the bytes
+	  before the offset as filler, then the rest of the range from the next block in a single C_Encrypt.
+	- Segments are aligned on multiples of the segment size in the stream, so only the first one of a range can
+	  start inside a block.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "ctr_engine.h"
+
+
+// State shared by the workers of one ctrCryptFile call.
+typedef struct
+{
+	CK_FUNCTION_LIST *p11;
+	SessionPool *pool;
+	const CtrStream *stream;
+	int inFd;
+	off_t inStart;
+	int outFd;
+	off_t outStart;
+	unsigned long long streamOffset;
+	unsigned long long end; // stream offset just past the range.
+	unsigned long long segments;
+	CK_ULONG segmentSize;
+	atomic_ullong nextSegment;
+	atomic_ulong error; // first CK_RV that was not CKR_OK.
+} CtrRun;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// pread / pwrite until len bytes are done. Returns the bytes done, short only at end of file or on error.
+static size_t readAt(int fd, CK_BYTE *buffer, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t count = 0;
+
+	while(done<len && (count = pread(fd, buffer + done, len - done, offset + done))>0)
+		done += count;
+	return done;
+}
+
+
+
+static size_t writeAt(int fd, const CK_BYTE *buffer, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t count = 0;
+
+	while(done<len && (count = pwrite(fd, buffer + done, len - done, offset + done))>0)
+		done += count;
+	return done;
+}
+
+
+
+CK_RV ctrCounterAt(const CtrStream *stream, unsigned long long blockIndex, CK_BYTE out[CTR_BLOCK_LEN])
+{
+	unsigned long long add = blockIndex;
+	unsigned int carry = 0;
+	unsigned int sum = 0;
+	unsigned int mask = 0;
+	unsigned int width = 0;
+
+	if(stream->counterBits==0 || stream->counterBits>128)
+		return CKR_MECHANISM_PARAM_INVALID;
+
+	// Big-endian addition over the low counterBits bits only; the bits above them never change.
+	memcpy(out, stream->counter, CTR_BLOCK_LEN);
+	for(CK_ULONG bit=0, pos=CTR_BLOCK_LEN-1; bit<stream->counterBits; bit+=8, pos--)
+	{
+		width = (stream->counterBits - bit<8) ? stream->counterBits - bit : 8;
+		mask = (1u << width) - 1;
+		sum = (out[pos] & mask) + (add & mask) + carry;
+		add >>= width;
+		carry = sum >> width;
+		out[pos] = (CK_BYTE)((out[pos] & ~mask) | (sum & mask));
+	}
+	return (add!=0 || carry!=0) ? CKR_DATA_LEN_RANGE : CKR_OK;
+}
+
+
+
+// One C_EncryptInit / C_Encrypt from the counter block of blockIndex.
+static CK_RV cryptBlocks(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, const CtrStream *stream,
+	unsigned long long blockIndex, const CK_BYTE *in, CK_BYTE *out, CK_ULONG len)
+{
+	CK_AES_CTR_PARAMS param;
+	CK_MECHANISM mech = {CKM_AES_CTR, &param, sizeof(param)};
+	CK_ULONG outLen = len;
+	CK_RV rv = ctrCounterAt(stream, blockIndex, param.cb);
+
+	param.ulCounterBits = stream->counterBits;
+	if(rv==CKR_OK)
+		rv = p11->C_EncryptInit(hSession, &mech, stream->hKey);
+	if(rv==CKR_OK)
+		rv = p11->C_Encrypt(hSession, (CK_BYTE*)in, len, out, &outLen);
+	if(rv==CKR_OK && outLen!=len)
+		rv = CKR_GENERAL_ERROR;
+	return rv;
+}
+
+
+
+CK_RV ctrCryptBuffer(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, const CtrStream *stream,
+	unsigned long long streamOffset, const CK_BYTE *in, CK_BYTE *out, CK_ULONG len)
+{
+	unsigned long long blockIndex = streamOffset / CTR_BLOCK_LEN;
+	CK_ULONG skip = streamOffset % CTR_BLOCK_LEN;
+	CK_ULONG head = 0;
+	CK_BYTE block[CTR_BLOCK_LEN];
+	CK_BYTE result[CTR_BLOCK_LEN];
+	CK_RV rv = CKR_OK;
+
+	if(len==0)
+		return CKR_OK;
+	rv = ctrCounterAt(stream, (streamOffset + len - 1) / CTR_BLOCK_LEN, block);
+	if(rv!=CKR_OK)
+		return rv;
+
+	if(skip>0)
+	{
+		head = (len<CTR_BLOCK_LEN - skip) ? len : CTR_BLOCK_LEN - skip;
+		memset(block, 0, skip);
+		memcpy(block + skip, in, head);
+		rv = cryptBlocks(p11, hSession, stream, blockIndex, block, result, skip + head);
+		if(rv!=CKR_OK)
+			return rv;
+		memcpy(out, result + skip, head);
+		blockIndex++;
+	}
+	if(len>head)
+		rv = cryptBlocks(p11, hSession, stream, blockIndex, in + head, out + head, len - head);
+	return rv;
+}
+
+
+
+// Stream offset where segment index starts. Segment 0 starts at the range start, the others on segment boundaries.
+static unsigned long long segmentStart(const CtrRun *run, unsigned long long index)
+{
+	unsigned long long start = 0;
+
+	if(index==0)
+		return run->streamOffset;
+	start = (run->streamOffset / run->segmentSize + index) * run->segmentSize;
+	return (start<run->end) ? start : run->end;
+}
+
+
+
+static void *workerMain(void *arg)
+{
+	CtrRun *run = (CtrRun*)arg;
+	PooledSession *session = NULL;
+	CK_BYTE *in = (CK_BYTE*)malloc(run->segmentSize);
+	CK_BYTE *out = (CK_BYTE*)malloc(run->segmentSize);
+	unsigned long long index = 0, start = 0, len = 0;
+	off_t relative = 0;
+	CK_RV rv = (in!=NULL && out!=NULL) ? sessionPoolAcquire(run->pool, &session) : CKR_HOST_MEMORY;
+
+	while(rv==CKR_OK && atomic_load(&run->error)==CKR_OK)
+	{
+		index = atomic_fetch_add(&run->nextSegment, 1);
+		if(index>=run->segments)
+			break;
+		start = segmentStart(run, index);
+		len = segmentStart(run, index + 1) - start;
+		relative = (off_t)(start - run->streamOffset);
+
+		if(readAt(run->inFd, in, len, run->inStart + relative)!=len)
+			rv = CKR_FUNCTION_FAILED;
+		if(rv==CKR_OK)
+			rv = ctrCryptBuffer(run->p11, session->hSession, run->stream, start, in, out, len);
+		if(rv==CKR_OK && writeAt(run->outFd, out, len, run->outStart + relative)!=len)
+			rv = CKR_FUNCTION_FAILED;
+	}
+
+	if(session!=NULL)
+		sessionPoolRelease(run->pool, session, rv);
+	if(rv!=CKR_OK)
+	{
+		CK_ULONG expected = CKR_OK;
+		atomic_compare_exchange_strong(&run->error, &expected, rv);
+	}
+	free(in);
+	free(out);
+	return 0;
+}
+
+
+
+CK_RV ctrCryptFile(CK_FUNCTION_LIST *p11, SessionPool *pool, const CtrStream *stream, int inFd, off_t inStart,
+	int outFd, off_t outStart, unsigned long long streamOffset, unsigned long long length, CK_ULONG segmentSize,
+	unsigned int nWorkers, CtrStats *stats)
+{
+	CtrRun run;
+	pthread_t *threads = NULL;
+	unsigned int started = 0;
+	CK_BYTE last[CTR_BLOCK_LEN];
+	double start = nowSeconds();
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(CtrStats));
+	if(segmentSize==0)
+		return CKR_ARGUMENTS_BAD;
+	if(length==0)
+		return CKR_OK;
+	rv = ctrCounterAt(stream, (streamOffset + length - 1) / CTR_BLOCK_LEN, last);
+	if(rv!=CKR_OK)
+		return rv;
+
+	memset(&run, 0, sizeof(run));
+	run.p11 = p11;
+	run.pool = pool;
+	run.stream = stream;
+	run.inFd = inFd;
+	run.inStart = inStart;
+	run.outFd = outFd;
+	run.outStart = outStart;
+	run.streamOffset = streamOffset;
+	run.end = streamOffset + length;
+	run.segmentSize = (segmentSize + CTR_BLOCK_LEN - 1) / CTR_BLOCK_LEN * CTR_BLOCK_LEN;
+	run.segments = (run.end - 1) / run.segmentSize - streamOffset / run.segmentSize + 1;
+	atomic_init(&run.nextSegment, 0);
+	atomic_init(&run.error, CKR_OK);
+
+	if(nWorkers==0)
+		nWorkers = 1;
+	if(nWorkers>run.segments)
+		nWorkers = (unsigned int)run.segments;
+	threads = (pthread_t*)calloc(nWorkers, sizeof(pthread_t));
+	if(threads==NULL)
+		return CKR_HOST_MEMORY;
+	for(started=0; started<nWorkers; started++)
+		if(pthread_create(&threads[started], NULL, &workerMain, &run)!=0)
+			break;
+	if(started==0)
+		atomic_store(&run.error, CKR_HOST_MEMORY);
+	for(unsigned int ctr=0; ctr<started; ctr++)
+		pthread_join(threads[ctr], NULL);
+	free(threads);
+
+	stats->seconds = nowSeconds() - start;
+	stats->workers = started;
+	stats->segments = run.segments;
+	stats->bytes = length;
+	return atomic_load(&run.error);
+}
@@ -0,0 +1,71 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Random-access, parallel CKM_AES_CTR.
+	- Byte n of a CTR stream only depends on the key and on the counter block n / 16 blocks after the initial one,
+	  so any part of the stream can be processed on its own : ctrCounterAt computes the counter block of a block
+	  index, and ctrCryptBuffer encrypts or decrypts (the same operation in CTR) bytes starting at any offset.
+	- ctrCryptFile cuts a byte range into segments and spreads them over the pooled sessions of several worker
+	  threads, each segment read and written at its own offset with pread / pwrite.
+	- Only the low counterBits bits of the counter block are incremented, as CK_AES_CTR_PARAMS specifies; a range
+	  that would wrap them is rejected with CKR_DATA_LEN_RANGE.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_CTR_ENGINE_H
+#define LUNA_SAMPLES_CTR_ENGINE_H
+
+#include <sys/types.h>
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+
+
+#define CTR_BLOCK_LEN 16
+
+
+// Key and initial counter block of a CTR stream.
+typedef struct
+{
+	CK_OBJECT_HANDLE hKey;
+	CK_BYTE counter[CTR_BLOCK_LEN]; // counter block of byte 0.
+	CK_ULONG counterBits; // low bits of the block used as the counter, 1 to 128.
+} CtrStream;
+
+
+// Activity of one ctrCryptFile call.
+typedef struct
+{
+	unsigned long long bytes;
+	unsigned long long segments;
+	unsigned int workers;
+	double seconds;
+} CtrStats;
+
+
+// Computes the counter block blockIndex blocks after the initial one. Returns CKR_DATA_LEN_RANGE if the counter wraps.
+CK_RV ctrCounterAt(const CtrStream *stream, unsigned long long blockIndex, CK_BYTE out[CTR_BLOCK_LEN]);
+
+// Encrypts or decrypts len bytes found at byte offset streamOffset of the stream, with one session.
+CK_RV ctrCryptBuffer(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, const CtrStream *stream,
+	unsigned long long streamOffset, const CK_BYTE *in, CK_BYTE *out, CK_ULONG len);
+
+// Processes length bytes of the stream from streamOffset : they are read from inFd at inStart and written to outFd
+// at outStart, in segments of segmentSize bytes (rounded up to a whole block) spread over nWorkers threads.
+CK_RV ctrCryptFile(CK_FUNCTION_LIST *p11, SessionPool *pool, const CtrStream *stream, int inFd, off_t inStart,
+	int outFd, off_t outStart, unsigned long long streamOffset, unsigned long long length, CK_ULONG segmentSize,
+	unsigned int nWorkers, CtrStats *stats);
+
+#endif
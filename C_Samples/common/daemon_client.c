@@ -0,0 +1,353 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the daemon client and wire format declared in daemon_client.h.
+	- Requests are sent with one sendmsg (gather I/O), so label, IV and data are never copied into a frame buffer.
+	- Responses are read straight into the caller's output buffer.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "daemon_client.h"
+
+
+// Client CLI mechanism names.
+typedef struct
+{
+	const char *name;
+	CK_MECHANISM_TYPE type;
+} DaemonMechanismName;
+
+static const DaemonMechanismName mechanismNames[] =
+{
+	{"sha256-rsa-pkcs",	CKM_SHA256_RSA_PKCS},
+	{"sha256-rsa-pkcs-pss",	CKM_SHA256_RSA_PKCS_PSS},
+	{"rsa-pkcs",		CKM_RSA_PKCS},
+	{"rsa-pkcs-oaep",	CKM_RSA_PKCS_OAEP},
+	{"ecdsa",		CKM_ECDSA},
+	{"ecdsa-sha256",	CKM_ECDSA_SHA256},
+	{"eddsa",		CKM_EDDSA},
+	{"sha256-hmac",		CKM_SHA256_HMAC},
+	{"aes-cmac",		CKM_AES_CMAC},
+	{"aes-cbc-pad",		CKM_AES_CBC_PAD},
+	{"aes-ctr",		CKM_AES_CTR},
+	{"aes-gcm",		CKM_AES_GCM},
+	{"aes-ecb",		CKM_AES_ECB},
+	{"des3-cbc-pad",	CKM_DES3_CBC_PAD}
+};
+
+
+
+static void put32(CK_BYTE *p, CK_ULONG value)
+{
+	p[0] = (CK_BYTE)(value >> 24);
+	p[1] = (CK_BYTE)(value >> 16);
+	p[2] = (CK_BYTE)(value >> 8);
+	p[3] = (CK_BYTE)value;
+}
+
+
+
+static CK_ULONG get32(const CK_BYTE *p)
+{
+	return ((CK_ULONG)p[0] << 24) | ((CK_ULONG)p[1] << 16) | ((CK_ULONG)p[2] << 8) | (CK_ULONG)p[3];
+}
+
+
+
+// Reads exactly len bytes.
+static int readFull(int fd, CK_BYTE *buf, CK_ULONG len)
+{
+	ssize_t got = 0;
+
+	while(len>0)
+	{
+		got = read(fd, buf, len);
+		if(got<0 && errno==EINTR)
+			continue;
+		if(got<=0)
+			return -1;
+		buf += got;
+		len -= got;
+	}
+	return 0;
+}
+
+
+
+// Writes every iovec, resuming after partial writes. MSG_NOSIGNAL keeps a closed peer from raising SIGPIPE.
+static int writeFull(int fd, struct iovec *iov, int count)
+{
+	struct msghdr msg;
+	ssize_t sent = 0;
+
+	while(count>0)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if(sent<0 && errno==EINTR)
+			continue;
+		if(sent<0)
+			return -1;
+		while(count>0 && (size_t)sent>=iov->iov_len)
+		{
+			sent -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if(count>0)
+		{
+			iov->iov_base = (char*)iov->iov_base + sent;
+			iov->iov_len -= sent;
+		}
+	}
+	return 0;
+}
+
+
+
+// Discards len bytes of a frame that is not wanted.
+static int skipBytes(int fd, CK_ULONG len)
+{
+	CK_BYTE scratch[512];
+	CK_ULONG chunk = 0;
+
+	while(len>0)
+	{
+		chunk = (len<sizeof(scratch)) ? len : sizeof(scratch);
+		if(readFull(fd, scratch, chunk)!=0)
+			return -1;
+		len -= chunk;
+	}
+	return 0;
+}
+
+
+
+int daemonWriteResponse(int fd, CK_RV rv, const CK_BYTE *out, CK_ULONG outLen)
+{
+	CK_BYTE header[12];
+	struct iovec iov[2] = {{header, sizeof(header)}, {(void*)out, outLen}};
+
+	put32(header, 8 + outLen);
+	put32(header + 4, rv);
+	put32(header + 8, outLen);
+	return writeFull(fd, iov, 2);
+}
+
+
+
+int daemonReadFrame(int fd, CK_BYTE **buf, CK_ULONG *bufSize, CK_ULONG *len)
+{
+	CK_BYTE header[4];
+	CK_BYTE *grown = NULL;
+
+	if(readFull(fd, header, 4)!=0)
+		return -1;
+	*len = get32(header);
+	if(*len>DAEMON_MAX_FRAME)
+		return -1;
+	if(*len>*bufSize)
+	{
+		grown = (CK_BYTE*)realloc(*buf, *len);
+		if(grown==NULL)
+			return -1;
+		*buf = grown;
+		*bufSize = *len;
+	}
+	return readFull(fd, *buf, *len);
+}
+
+
+
+// Reads one length-prefixed field of a request.
+static int parseField(const CK_BYTE **pos, const CK_BYTE *end, const CK_BYTE **field, CK_ULONG *fieldLen)
+{
+	if(end - *pos < 4)
+		return -1;
+	*fieldLen = get32(*pos);
+	*pos += 4;
+	if((CK_ULONG)(end - *pos) < *fieldLen)
+		return -1;
+	*field = *pos;
+	*pos += *fieldLen;
+	return 0;
+}
+
+
+
+int daemonParseRequest(const CK_BYTE *frame, CK_ULONG len, DaemonRequest *req)
+{
+	const CK_BYTE *pos = NULL;
+	const CK_BYTE *end = frame + len;
+
+	memset(req, 0, sizeof(*req));
+	if(len<12)
+		return -1;
+	pos = frame + 12;
+	req->version = frame[0];
+	req->op = frame[1];
+	req->mechanism = get32(frame + 4);
+	req->outLen = get32(frame + 8);
+	if(parseField(&pos, end, &req->label, &req->labelLen)!=0
+		|| parseField(&pos, end, &req->iv, &req->ivLen)!=0
+		|| parseField(&pos, end, &req->data, &req->dataLen)!=0)
+		return -1;
+	return (pos==end && req->labelLen<=DAEMON_MAX_LABEL) ? 0 : -1;
+}
+
+
+
+CK_MECHANISM_TYPE daemonMechanismByName(const char *name)
+{
+	for(size_t ctr=0; ctr<sizeof(mechanismNames)/sizeof(*mechanismNames); ctr++)
+	{
+		if(strcmp(name, mechanismNames[ctr].name)==0)
+			return mechanismNames[ctr].type;
+	}
+	return 0;
+}
+
+
+
+int daemonConnect(const char *socketPath)
+{
+	struct sockaddr_un addr;
+	int fd = -1;
+
+	if(strlen(socketPath)>=sizeof(addr.sun_path))
+		return -1;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd<0)
+		return -1;
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr))!=0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+
+void daemonClose(int fd)
+{
+	if(fd>=0)
+		close(fd);
+}
+
+
+
+// Sends one request and reads its response into out.
+static CK_RV daemonCall(int fd, DaemonOp op, CK_MECHANISM_TYPE mech, CK_ULONG requestedLen, const char *label,
+	const CK_BYTE *iv, CK_ULONG ivLen, const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	CK_BYTE header[20]; // frame length + fixed request fields + label length.
+	CK_BYTE ivHeader[4];
+	CK_BYTE dataHeader[4];
+	CK_BYTE response[12]; // frame length, rv, output length.
+	CK_ULONG labelLen = (label!=NULL) ? strlen(label) : 0;
+	CK_ULONG frameLen = 12 + 4 + labelLen + 4 + ivLen + 4 + dataLen;
+	CK_ULONG resultLen = 0;
+	CK_RV rv;
+	struct iovec iov[6] =
+	{
+		{header, sizeof(header)}, {(void*)label, labelLen},
+		{ivHeader, 4}, {(void*)iv, ivLen},
+		{dataHeader, 4}, {(void*)data, dataLen}
+	};
+
+	if(labelLen>DAEMON_MAX_LABEL || frameLen>DAEMON_MAX_FRAME)
+		return CKR_ARGUMENTS_BAD;
+
+	put32(header, frameLen);
+	header[4] = DAEMON_PROTOCOL_VERSION;
+	header[5] = (CK_BYTE)op;
+	header[6] = 0;
+	header[7] = 0;
+	put32(header + 8, mech);
+	put32(header + 12, requestedLen);
+	put32(header + 16, labelLen);
+	put32(ivHeader, ivLen);
+	put32(dataHeader, dataLen);
+	if(writeFull(fd, iov, 6)!=0)
+		return CKR_DEVICE_ERROR;
+
+	if(readFull(fd, response, sizeof(response))!=0)
+		return CKR_DEVICE_ERROR;
+	rv = get32(response + 4);
+	resultLen = get32(response + 8);
+	if(get32(response)!=8 + resultLen)
+		return CKR_DEVICE_ERROR;
+
+	if(resultLen>*outLen)
+	{
+		*outLen = resultLen;
+		return (skipBytes(fd, resultLen)==0) ? CKR_BUFFER_TOO_SMALL : CKR_DEVICE_ERROR;
+	}
+	*outLen = resultLen;
+	if(readFull(fd, out, resultLen)!=0)
+		return CKR_DEVICE_ERROR;
+	return rv;
+}
+
+
+
+CK_RV daemonSign(int fd, CK_MECHANISM_TYPE mech, const char *label,
+	const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	return daemonCall(fd, DAEMON_OP_SIGN, mech, 0, label, NULL, 0, data, dataLen, out, outLen);
+}
+
+
+
+CK_RV daemonEncrypt(int fd, CK_MECHANISM_TYPE mech, const char *label, const CK_BYTE *iv, CK_ULONG ivLen,
+	const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	return daemonCall(fd, DAEMON_OP_ENCRYPT, mech, 0, label, iv, ivLen, data, dataLen, out, outLen);
+}
+
+
+
+CK_RV daemonDecrypt(int fd, CK_MECHANISM_TYPE mech, const char *label, const CK_BYTE *iv, CK_ULONG ivLen,
+	const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	return daemonCall(fd, DAEMON_OP_DECRYPT, mech, 0, label, iv, ivLen, data, dataLen, out, outLen);
+}
+
+
+
+CK_RV daemonRandom(int fd, CK_BYTE *out, CK_ULONG len)
+{
+	CK_ULONG outLen = len;
+	CK_RV rv = daemonCall(fd, DAEMON_OP_RANDOM, 0, len, NULL, NULL, 0, NULL, 0, out, &outLen);
+
+	if(rv==CKR_OK && outLen!=len)
+		return CKR_DEVICE_ERROR;
+	return rv;
+}
@@ -0,0 +1,92 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Client side of the signing daemon (service/Signing_Daemon.c), and the wire format both sides use.
+	- A client connects once to the daemon's UNIX socket and sends any number of requests on that connection.
+	- Every message is a frame : a 4 byte big-endian length followed by that many bytes.
+	- Request  : version(1) op(1) reserved(2) mechanism(4) outLen(4) | label(4+n) | iv(4+n) | data(4+n)
+	- Response : rv(4) | output(4+n)
+	- All integers are big-endian. Keys are referred to by CKA_LABEL; the daemon finds and caches their handles.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_DAEMON_CLIENT_H
+#define LUNA_SAMPLES_DAEMON_CLIENT_H
+
+#include <cryptoki_v2.h>
+
+
+#define DAEMON_PROTOCOL_VERSION 1
+#define DAEMON_DEFAULT_SOCKET "/tmp/luna_signing_daemon.sock"
+#define DAEMON_MAX_FRAME (16*1024*1024) // requests and responses larger than this are refused.
+#define DAEMON_MAX_LABEL 128
+#define DAEMON_MAX_RANDOM 65536
+
+
+// Operations understood by the daemon.
+typedef enum
+{
+	DAEMON_OP_SIGN = 1,
+	DAEMON_OP_ENCRYPT = 2,
+	DAEMON_OP_DECRYPT = 3,
+	DAEMON_OP_RANDOM = 4
+} DaemonOp;
+
+
+// A decoded request. label, iv and data point into the frame they were read from.
+typedef struct
+{
+	unsigned char version;
+	unsigned char op;
+	CK_MECHANISM_TYPE mechanism;
+	CK_ULONG outLen; // bytes requested by DAEMON_OP_RANDOM.
+	const CK_BYTE *label;
+	CK_ULONG labelLen;
+	const CK_BYTE *iv;
+	CK_ULONG ivLen;
+	const CK_BYTE *data;
+	CK_ULONG dataLen;
+} DaemonRequest;
+
+
+// Daemon side of the frame I/O. Both return 0 on success and -1 on a broken or closed connection.
+// daemonReadFrame grows *buf (malloc'd, *bufSize bytes) when the frame does not fit.
+int daemonReadFrame(int fd, CK_BYTE **buf, CK_ULONG *bufSize, CK_ULONG *len);
+int daemonWriteResponse(int fd, CK_RV rv, const CK_BYTE *out, CK_ULONG outLen);
+
+// Decodes a request frame. Returns 0 on success, -1 if the frame is malformed.
+int daemonParseRequest(const CK_BYTE *frame, CK_ULONG len, DaemonRequest *req);
+
+// Mechanism names accepted by the client CLI, e.g. "sha256-rsa-pkcs". Returns 0 if the name is unknown.
+CK_MECHANISM_TYPE daemonMechanismByName(const char *name);
+
+
+// Connects to the daemon. Returns the connected socket, or -1.
+int daemonConnect(const char *socketPath);
+void daemonClose(int fd);
+
+// Each call is one request / response on the connection. On success *outLen is the output length.
+// If out is too small, CKR_BUFFER_TOO_SMALL is returned and *outLen holds the size needed.
+// A broken connection is reported as CKR_DEVICE_ERROR.
+CK_RV daemonSign(int fd, CK_MECHANISM_TYPE mech, const char *label,
+	const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *out, CK_ULONG *outLen);
+CK_RV daemonEncrypt(int fd, CK_MECHANISM_TYPE mech, const char *label, const CK_BYTE *iv, CK_ULONG ivLen,
+	const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *out, CK_ULONG *outLen);
+CK_RV daemonDecrypt(int fd, CK_MECHANISM_TYPE mech, const char *label, const CK_BYTE *iv, CK_ULONG ivLen,
+	const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *out, CK_ULONG *outLen);
+CK_RV daemonRandom(int fd, CK_BYTE *out, CK_ULONG len);
+
+#endif
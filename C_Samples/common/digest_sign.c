@@ -0,0 +1,351 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the local digest signing declared in digest_sign.h.
+	- The EVP_MD of every plan is fetched once per process, the first time a plan is looked up, so hashing a message
+	  costs no lookup of the algorithm; OpenSSL picks the fastest SHA-2 code the CPU runs (SHA-NI, AVX2, ...) on its
+	  own. The fetched digests are kept until the process exits.
+	- The hashing is only compiled with HOST_CRYPTO defined (make HOST_CRYPTO=1, OpenSSL 3.0 or later). Without it,
+	  digestSignerCreate and digestVerify return CKR_FUNCTION_NOT_SUPPORTED; digestSignDigest needs no OpenSSL.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef HOST_CRYPTO
+#include <openssl/evp.h>
+#endif
+#include "digest_sign.h"
+
+
+struct DigestSigner
+{
+	CK_FUNCTION_LIST *p11;
+	const DigestSignPlan *plan;
+	CK_MECHANISM raw; // the raw mechanism, with the parameters of the hash-and-sign one.
+	CK_OBJECT_HANDLE hKey;
+#ifdef HOST_CRYPTO
+	EVP_MD_CTX *ctx;
+#endif
+	DigestSignStats stats;
+};
+
+
+// DER of the DigestInfo before the digest, for SHA-256, SHA-384 and SHA-512.
+static const CK_BYTE digestInfoSha256[] = {0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04,
+	0x02, 0x01, 0x05, 0x00, 0x04, 0x20};
+static const CK_BYTE digestInfoSha384[] = {0x30, 0x41, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04,
+	0x02, 0x02, 0x05, 0x00, 0x04, 0x30};
+static const CK_BYTE digestInfoSha512[] = {0x30, 0x51, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04,
+	0x02, 0x03, 0x05, 0x00, 0x04, 0x40};
+
+
+static DigestSignPlan plans[] = // md is filled by fetchDigests.
+{
+	{CKM_SHA256_RSA_PKCS,		CKM_RSA_PKCS,		"SHA256",	32,	digestInfoSha256,	sizeof(digestInfoSha256),	NULL},
+	{CKM_SHA384_RSA_PKCS,		CKM_RSA_PKCS,		"SHA384",	48,	digestInfoSha384,	sizeof(digestInfoSha384),	NULL},
+	{CKM_SHA512_RSA_PKCS,		CKM_RSA_PKCS,		"SHA512",	64,	digestInfoSha512,	sizeof(digestInfoSha512),	NULL},
+	{CKM_SHA256_RSA_PKCS_PSS,	CKM_RSA_PKCS_PSS,	"SHA256",	32,	NULL,			0,				NULL},
+	{CKM_SHA384_RSA_PKCS_PSS,	CKM_RSA_PKCS_PSS,	"SHA384",	48,	NULL,			0,				NULL},
+	{CKM_SHA512_RSA_PKCS_PSS,	CKM_RSA_PKCS_PSS,	"SHA512",	64,	NULL,			0,				NULL},
+	{CKM_ECDSA_SHA256,		CKM_ECDSA,		"SHA256",	32,	NULL,			0,				NULL},
+	{CKM_ECDSA_SHA384,		CKM_ECDSA,		"SHA384",	48,	NULL,			0,				NULL},
+	{CKM_ECDSA_SHA512,		CKM_ECDSA,		"SHA512",	64,	NULL,			0,				NULL}
+};
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Fetches the EVP_MD of every plan. Run once, by the first digestSignPlan.
+static void fetchDigests()
+{
+#ifdef HOST_CRYPTO
+	for(unsigned int ctr=0; ctr<sizeof(plans)/sizeof(*plans); ctr++)
+		plans[ctr].md = EVP_MD_fetch(NULL, plans[ctr].digest, NULL);
+#endif
+}
+
+
+
+const DigestSignPlan *digestSignPlan(CK_MECHANISM_TYPE combined)
+{
+	static pthread_once_t fetched = PTHREAD_ONCE_INIT;
+
+	pthread_once(&fetched, &fetchDigests);
+	for(unsigned int ctr=0; ctr<sizeof(plans)/sizeof(*plans); ctr++)
+		if(plans[ctr].combined==combined)
+			return &plans[ctr];
+	return NULL;
+}
+
+
+
+// Builds the input of the raw mechanism : the DigestInfo, if any, then the digest. Returns its length, 0 if the
+// digest does not have the length of the plan.
+static CK_ULONG encodeDigest(const DigestSignPlan *plan, const CK_BYTE *digest, CK_ULONG digestLen,
+	CK_BYTE out[DIGEST_SIGN_MAX_INPUT])
+{
+	if(digestLen!=plan->digestLen)
+		return 0;
+	if(plan->prefixLen>0)
+		memcpy(out, plan->prefix, plan->prefixLen);
+	memcpy(out + plan->prefixLen, digest, digestLen);
+	return plan->prefixLen + digestLen;
+}
+
+
+
+CK_RV digestSignDigest(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const CK_BYTE *digest, CK_ULONG digestLen, CK_BYTE *signature, CK_ULONG *signatureLen)
+{
+	const DigestSignPlan *plan = digestSignPlan(mech->mechanism);
+	CK_MECHANISM raw = *mech;
+	CK_BYTE input[DIGEST_SIGN_MAX_INPUT];
+	CK_ULONG inputLen = 0;
+	CK_RV rv = CKR_OK;
+
+	if(plan==NULL)
+		return CKR_MECHANISM_INVALID;
+	inputLen = encodeDigest(plan, digest, digestLen, input);
+	if(inputLen==0)
+		return CKR_DATA_LEN_RANGE;
+	raw.mechanism = plan->raw;
+	rv = p11->C_SignInit(hSession, &raw, hKey);
+	if(rv==CKR_OK)
+		rv = p11->C_Sign(hSession, input, inputLen, signature, signatureLen);
+	return rv;
+}
+
+
+
+#ifdef HOST_CRYPTO
+CK_RV digestVerify(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *message, CK_ULONG messageLen, const CK_BYTE *signature, CK_ULONG signatureLen)
+{
+	const DigestSignPlan *plan = digestSignPlan(mech->mechanism);
+	CK_MECHANISM raw = *mech;
+	CK_BYTE digest[DIGEST_SIGN_MAX_DIGEST];
+	CK_BYTE input[DIGEST_SIGN_MAX_INPUT];
+	unsigned int digestLen = 0;
+	CK_RV rv = CKR_OK;
+
+	if(plan==NULL)
+		return CKR_MECHANISM_INVALID;
+	if(plan->md==NULL || EVP_Digest(message, messageLen, digest, &digestLen, plan->md, NULL)!=1)
+		return CKR_FUNCTION_FAILED;
+	raw.mechanism = plan->raw;
+	rv = p11->C_VerifyInit(hSession, &raw, hPublic);
+	if(rv==CKR_OK)
+		rv = p11->C_Verify(hSession, input, encodeDigest(plan, digest, digestLen, input), (CK_BYTE*)signature,
+			signatureLen);
+	return rv;
+}
+
+
+
+DigestSigner *digestSignerCreate(CK_FUNCTION_LIST *p11, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey, CK_RV *rv)
+{
+	const DigestSignPlan *plan = digestSignPlan(mech->mechanism);
+	DigestSigner *signer = NULL;
+
+	*rv = CKR_MECHANISM_INVALID;
+	if(plan==NULL)
+		return NULL;
+	*rv = CKR_HOST_MEMORY;
+	if(plan->md==NULL)
+		return NULL;
+	signer = (DigestSigner*)calloc(1, sizeof(DigestSigner));
+	if(signer==NULL)
+		return NULL;
+	signer->p11 = p11;
+	signer->plan = plan;
+	signer->raw = *mech;
+	signer->raw.mechanism = plan->raw;
+	signer->hKey = hKey;
+	signer->ctx = EVP_MD_CTX_new();
+	if(signer->ctx==NULL)
+	{
+		digestSignerFree(signer);
+		return NULL;
+	}
+	*rv = CKR_OK;
+	return signer;
+}
+
+
+
+// Hashes one message into digest, which holds plan->digestLen bytes.
+static CK_RV hashMessage(DigestSigner *signer, const CK_BYTE *message, CK_ULONG messageLen, CK_BYTE *digest)
+{
+	unsigned int digestLen = 0;
+
+	if(EVP_DigestInit_ex(signer->ctx, signer->plan->md, NULL)!=1 || EVP_DigestUpdate(signer->ctx, message, messageLen)!=1
+		|| EVP_DigestFinal_ex(signer->ctx, digest, &digestLen)!=1)
+		return CKR_FUNCTION_FAILED;
+	signer->stats.bytes += messageLen;
+	return CKR_OK;
+}
+#else
+
+
+
+CK_RV digestVerify(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *message, CK_ULONG messageLen, const CK_BYTE *signature, CK_ULONG signatureLen)
+{
+	(void)p11;
+	(void)hSession;
+	(void)mech;
+	(void)hPublic;
+	(void)message;
+	(void)messageLen;
+	(void)signature;
+	(void)signatureLen;
+	return CKR_FUNCTION_NOT_SUPPORTED; // nothing to hash with.
+}
+
+
+
+DigestSigner *digestSignerCreate(CK_FUNCTION_LIST *p11, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey, CK_RV *rv)
+{
+	(void)p11;
+	(void)hKey;
+	*rv = (digestSignPlan(mech->mechanism)==NULL) ? CKR_MECHANISM_INVALID : CKR_FUNCTION_NOT_SUPPORTED;
+	return NULL;
+}
+
+
+
+// Never called : no signer is created without HOST_CRYPTO.
+static CK_RV hashMessage(DigestSigner *signer, const CK_BYTE *message, CK_ULONG messageLen, CK_BYTE *digest)
+{
+	(void)signer;
+	(void)message;
+	(void)messageLen;
+	(void)digest;
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+#endif
+
+
+
+// Sends one encoded digest to the HSM.
+static CK_RV signEncoded(DigestSigner *signer, CK_SESSION_HANDLE hSession, CK_BYTE *input, CK_BYTE *signature,
+	CK_ULONG *signatureLen)
+{
+	CK_FUNCTION_LIST *p11 = signer->p11;
+	CK_RV rv = p11->C_SignInit(hSession, &signer->raw, signer->hKey);
+
+	if(rv==CKR_OK)
+		rv = p11->C_Sign(hSession, input, signer->plan->prefixLen + signer->plan->digestLen, signature, signatureLen);
+	if(rv==CKR_OK)
+		signer->stats.messages++;
+	return rv;
+}
+
+
+
+CK_RV digestSign(DigestSigner *signer, CK_SESSION_HANDLE hSession, const CK_BYTE *message, CK_ULONG messageLen,
+	CK_BYTE *signature, CK_ULONG *signatureLen)
+{
+	const DigestSignPlan *plan = signer->plan;
+	CK_BYTE input[DIGEST_SIGN_MAX_INPUT];
+	double start = nowSeconds();
+	double hashed = 0;
+	CK_RV rv = CKR_OK;
+
+	if(plan->prefixLen>0)
+		memcpy(input, plan->prefix, plan->prefixLen);
+	rv = hashMessage(signer, message, messageLen, input + plan->prefixLen);
+	hashed = nowSeconds();
+	signer->stats.hashSeconds += hashed - start;
+	if(rv==CKR_OK)
+		rv = signEncoded(signer, hSession, input, signature, signatureLen);
+	signer->stats.hsmSeconds += nowSeconds() - hashed;
+	return rv;
+}
+
+
+
+CK_RV digestSignBatch(DigestSigner *signer, CK_SESSION_HANDLE hSession, unsigned long count,
+	const CK_BYTE *const *messages, const CK_ULONG *messageLens, CK_BYTE *signatures, CK_ULONG stride,
+	CK_ULONG *signatureLens, unsigned long *failed)
+{
+	const DigestSignPlan *plan = signer->plan;
+	CK_ULONG inputLen = plan->prefixLen + plan->digestLen;
+	CK_BYTE *inputs = NULL;
+	double start = nowSeconds();
+	double hashed = 0;
+	unsigned long ctr = 0;
+	CK_RV rv = CKR_OK;
+
+	*failed = 0;
+	if(count==0)
+		return CKR_OK;
+	inputs = (CK_BYTE*)malloc(count * inputLen);
+	if(inputs==NULL)
+		return CKR_HOST_MEMORY;
+
+	// Every digest first : the hashing runs back to back in the cache of the host, and the HSM then sees a burst
+	// of small C_Sign calls.
+	for(ctr=0; ctr<count && rv==CKR_OK; ctr++)
+	{
+		if(plan->prefixLen>0)
+			memcpy(inputs + ctr * inputLen, plan->prefix, plan->prefixLen);
+		rv = hashMessage(signer, messages[ctr], messageLens[ctr], inputs + ctr * inputLen + plan->prefixLen);
+		*failed = ctr;
+	}
+	hashed = nowSeconds();
+	signer->stats.hashSeconds += hashed - start;
+
+	for(ctr=0; ctr<count && rv==CKR_OK; ctr++)
+	{
+		signatureLens[ctr] = stride;
+		rv = signEncoded(signer, hSession, inputs + ctr * inputLen, signatures + ctr * stride, &signatureLens[ctr]);
+		*failed = ctr;
+	}
+	signer->stats.hsmSeconds += nowSeconds() - hashed;
+	free(inputs);
+	return rv;
+}
+
+
+
+void digestSignerGetStats(DigestSigner *signer, DigestSignStats *stats)
+{
+	*stats = signer->stats;
+}
+
+
+
+void digestSignerFree(DigestSigner *signer)
+{
+	if(signer==NULL)
+		return;
+#ifdef HOST_CRYPTO
+	EVP_MD_CTX_free(signer->ctx);
+#endif
+	free(signer);
+}
@@ -0,0 +1,99 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Signs with a hash-and-sign mechanism (CKM_SHA256_RSA_PKCS, CKM_SHA256_RSA_PKCS_PSS, CKM_ECDSA_SHA256, ...)
+	  without sending the message to the HSM : the message is hashed on the host with OpenSSL, which uses the SHA
+	  extensions or the AVX2 code of the CPU, and only the digest goes to the HSM, signed with the raw mechanism :-
+		CKM_SHA*_RSA_PKCS     : CKM_RSA_PKCS over DigestInfo || digest
+		CKM_SHA*_RSA_PKCS_PSS : CKM_RSA_PKCS_PSS over the digest, with the same CK_RSA_PKCS_PSS_PARAMS
+		CKM_ECDSA_SHA*        : CKM_ECDSA over the digest
+	  The signatures verify with the hash-and-sign mechanism, and PKCS #1 v1.5 ones are byte for byte the same, so
+	  the HSM link only carries 32 to 83 bytes per signature whatever the size of the message.
+	- A DigestSigner keeps the digest context of a key and mechanism between messages. digestSignBatch hashes every
+	  pending message first, in one pass over the batch, then sends the digests to the HSM one after the other.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_DIGEST_SIGN_H
+#define LUNA_SAMPLES_DIGEST_SIGN_H
+
+#include <cryptoki_v2.h>
+
+
+#define DIGEST_SIGN_MAX_DIGEST 64
+#define DIGEST_SIGN_MAX_INPUT (19 + DIGEST_SIGN_MAX_DIGEST) // DigestInfo of SHA-512 and the digest.
+#define DIGEST_SIGN_MAX_SIGNATURE 1024 // RSA keys up to 8192 bits.
+
+
+// A hash-and-sign mechanism, and how to sign a digest in its place.
+typedef struct
+{
+	CK_MECHANISM_TYPE combined;
+	CK_MECHANISM_TYPE raw;
+	const char *digest; // OpenSSL name.
+	CK_ULONG digestLen;
+	const CK_BYTE *prefix; // DER of the DigestInfo before the digest, NULL if the digest is signed alone.
+	CK_ULONG prefixLen;
+	const struct evp_md_st *md; // EVP_MD of digest, fetched once per process; NULL in a build without HOST_CRYPTO.
+} DigestSignPlan;
+
+
+typedef struct DigestSigner DigestSigner;
+
+
+// Activity of a DigestSigner.
+typedef struct
+{
+	unsigned long messages;
+	unsigned long long bytes; // message bytes hashed.
+	double hashSeconds; // time spent hashing on the host.
+	double hsmSeconds; // time spent in C_SignInit / C_Sign.
+} DigestSignStats;
+
+
+// Returns the plan of a hash-and-sign mechanism, or NULL if it has none.
+const DigestSignPlan *digestSignPlan(CK_MECHANISM_TYPE combined);
+
+// Signs a digest computed by the caller as mech, a hash-and-sign mechanism, would sign its message.
+// *signatureLen is the room in signature on entry.
+CK_RV digestSignDigest(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const CK_BYTE *digest, CK_ULONG digestLen, CK_BYTE *signature, CK_ULONG *signatureLen);
+
+// Verifies on the HSM, from a digest computed on the host, a signature made with the hash-and-sign mechanism mech.
+// Returns CKR_FUNCTION_NOT_SUPPORTED in a build without HOST_CRYPTO.
+CK_RV digestVerify(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *message, CK_ULONG messageLen, const CK_BYTE *signature, CK_ULONG signatureLen);
+
+// Prepares to sign messages with hKey and mech. Returns NULL with CKR_MECHANISM_INVALID if mech has no plan, or
+// with CKR_FUNCTION_NOT_SUPPORTED in a build without HOST_CRYPTO.
+// mech->pParameter must stay valid while the signer is used. A signer is used by one thread at a time.
+DigestSigner *digestSignerCreate(CK_FUNCTION_LIST *p11, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey, CK_RV *rv);
+
+// Signs one message.
+CK_RV digestSign(DigestSigner *signer, CK_SESSION_HANDLE hSession, const CK_BYTE *message, CK_ULONG messageLen,
+	CK_BYTE *signature, CK_ULONG *signatureLen);
+
+// Signs count messages. Signature i is written at signatures + i * stride, its length in signatureLens[i]. On error,
+// *failed is the index of the message that failed.
+CK_RV digestSignBatch(DigestSigner *signer, CK_SESSION_HANDLE hSession, unsigned long count,
+	const CK_BYTE *const *messages, const CK_ULONG *messageLens, CK_BYTE *signatures, CK_ULONG stride,
+	CK_ULONG *signatureLens, unsigned long *failed);
+
+void digestSignerGetStats(DigestSigner *signer, DigestSignStats *stats);
+
+void digestSignerFree(DigestSigner *signer);
+
+#endif
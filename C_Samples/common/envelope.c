@@ -0,0 +1,631 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the envelope encryption declared in envelope.h.
+	- Locked memory is mapped in whole pages, locked with mlock, and excluded from core dumps; it is cleared with
+	  OPENSSL_cleanse, which the compiler cannot optimise away, before being unmapped.
+	- The cache is a small array searched linearly under a mutex and evicting the least recently used key : with a
+	  few hundred entries this costs far less than one HSM round trip. Entries are found by the SHA-256 of the
+	  wrapped key, so KWP and RSA wrapped keys take the same room.
+	- RSA-OAEP (SHA-256, MGF1-SHA-256) is done by OpenSSL on the public key when encrypting, with the same
+	  parameters as the CKM_RSA_PKCS_OAEP the HSM runs on the private key when decrypting.
+	- When decrypting, the last 16 bytes read are held back until the end of the input, since they may be the tag.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+#include <openssl/crypto.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+#include <openssl/pem.h>
+#include <openssl/param_build.h>
+#include <openssl/core_names.h>
+#include "envelope.h"
+
+
+#define ENVELOPE_IO_CHUNK (64*1024)
+#define ENVELOPE_ID_LEN 32 // SHA-256 of a wrapped key.
+
+
+typedef enum { ENVELOPE_KWP, ENVELOPE_RSA } EnvelopeType;
+
+
+typedef struct
+{
+	CK_BYTE id[ENVELOPE_ID_LEN]; // SHA-256 of the wrapped key.
+	int used; // 0 for a free entry.
+	CK_BYTE key[ENVELOPE_KEY_LEN];
+	unsigned long long lastUsed;
+} CacheEntry;
+
+
+struct EnvelopeKeyCache
+{
+	CacheEntry *entries; // locked memory.
+	size_t mapped;
+	int locked;
+	unsigned int capacity;
+	unsigned long long clock;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	pthread_mutex_t lock;
+};
+
+
+struct EnvelopeRsaKey
+{
+	EVP_PKEY *pkey;
+};
+
+
+// Header fields of one object.
+typedef struct
+{
+	EnvelopeType type;
+	CK_BYTE raw[ENVELOPE_MAX_HEADER];
+	CK_ULONG len;
+	CK_BYTE *iv; // points into raw.
+	CK_BYTE *wrapped; // points into raw.
+	CK_ULONG wrappedLen;
+} EnvelopeHeader;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Maps len bytes of locked memory. *locked is 0 if mlock was refused, the memory is usable anyway.
+static void *lockedAlloc(size_t len, size_t *mapped, int *locked)
+{
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	void *memory = NULL;
+
+	*mapped = (len + page - 1) / page * page;
+	memory = mmap(NULL, *mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(memory==MAP_FAILED)
+		return NULL;
+	*locked = (mlock(memory, *mapped)==0);
+#ifdef MADV_DONTDUMP
+	madvise(memory, *mapped, MADV_DONTDUMP);
+#endif
+	return memory;
+}
+
+
+
+static void lockedFree(void *memory, size_t mapped, int locked)
+{
+	if(memory==NULL)
+		return;
+	OPENSSL_cleanse(memory, mapped);
+	if(locked)
+		munlock(memory, mapped);
+	munmap(memory, mapped);
+}
+
+
+
+EnvelopeKeyCache *envelopeCacheCreate(unsigned int capacity, CK_RV *rv)
+{
+	EnvelopeKeyCache *cache = (EnvelopeKeyCache*)calloc(1, sizeof(EnvelopeKeyCache));
+
+	*rv = CKR_HOST_MEMORY;
+	if(cache==NULL)
+		return NULL;
+	if(capacity==0)
+		capacity = 1;
+	cache->entries = (CacheEntry*)lockedAlloc(capacity * sizeof(CacheEntry), &cache->mapped, &cache->locked);
+	if(cache->entries==NULL)
+	{
+		free(cache);
+		return NULL;
+	}
+	cache->capacity = capacity;
+	pthread_mutex_init(&cache->lock, NULL);
+	*rv = CKR_OK;
+	return cache;
+}
+
+
+
+void envelopeCacheGetStats(EnvelopeKeyCache *cache, EnvelopeCacheStats *stats)
+{
+	memset(stats, 0, sizeof(EnvelopeCacheStats));
+	pthread_mutex_lock(&cache->lock);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->capacity = cache->capacity;
+	stats->locked = cache->locked;
+	for(unsigned int ctr=0; ctr<cache->capacity; ctr++)
+		if(cache->entries[ctr].used)
+			stats->entries++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+
+void envelopeCacheDestroy(EnvelopeKeyCache *cache)
+{
+	if(cache==NULL)
+		return;
+	lockedFree(cache->entries, cache->mapped, cache->locked);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+
+
+// Computes the cache entry id of a wrapped key.
+static void wrappedId(const CK_BYTE *wrapped, CK_ULONG wrappedLen, CK_BYTE id[ENVELOPE_ID_LEN])
+{
+	unsigned int idLen = ENVELOPE_ID_LEN;
+	EVP_Digest(wrapped, wrappedLen, id, &idLen, EVP_sha256(), NULL);
+}
+
+
+
+// Copies the data key of a wrapped key into key. Returns 1 on a hit.
+static int cacheLookup(EnvelopeKeyCache *cache, const CK_BYTE *wrapped, CK_ULONG wrappedLen, CK_BYTE *key)
+{
+	CK_BYTE id[ENVELOPE_ID_LEN];
+	int found = 0;
+
+	wrappedId(wrapped, wrappedLen, id);
+	pthread_mutex_lock(&cache->lock);
+	for(unsigned int ctr=0; ctr<cache->capacity && !found; ctr++)
+	{
+		CacheEntry *entry = &cache->entries[ctr];
+		if(entry->used && memcmp(entry->id, id, ENVELOPE_ID_LEN)==0)
+		{
+			memcpy(key, entry->key, ENVELOPE_KEY_LEN);
+			entry->lastUsed = ++cache->clock;
+			found = 1;
+		}
+	}
+	if(found)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+	return found;
+}
+
+
+
+// Stores a data key in a free entry, or in place of the least recently used one.
+static void cacheInsert(EnvelopeKeyCache *cache, const CK_BYTE *wrapped, CK_ULONG wrappedLen, const CK_BYTE *key)
+{
+	CacheEntry *victim = NULL;
+	CK_BYTE id[ENVELOPE_ID_LEN];
+
+	wrappedId(wrapped, wrappedLen, id);
+	pthread_mutex_lock(&cache->lock);
+	for(unsigned int ctr=0; ctr<cache->capacity; ctr++)
+	{
+		CacheEntry *entry = &cache->entries[ctr];
+		if(!entry->used)
+		{
+			victim = entry;
+			break;
+		}
+		if(victim==NULL || entry->lastUsed<victim->lastUsed)
+			victim = entry;
+	}
+	if(victim->used)
+	{
+		cache->evictions++;
+		OPENSSL_cleanse(victim, sizeof(CacheEntry));
+	}
+	memcpy(victim->id, id, ENVELOPE_ID_LEN);
+	victim->used = 1;
+	memcpy(victim->key, key, ENVELOPE_KEY_LEN);
+	victim->lastUsed = ++cache->clock;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+
+// Lays out the header in raw, from an IV and a wrapped key.
+// KWP : "LENV" | 1 | wrapped length (1) | 0 (2); RSA : "LENR" | 1 | 0 | wrapped length (2, big-endian).
+static void encodeHeader(EnvelopeHeader *header, EnvelopeType type, const CK_BYTE *iv, const CK_BYTE *wrapped, CK_ULONG wrappedLen)
+{
+	memset(header->raw, 0, sizeof(header->raw));
+	memcpy(header->raw, (type==ENVELOPE_KWP) ? "LENV" : "LENR", 4);
+	header->raw[4] = 1;
+	if(type==ENVELOPE_KWP)
+		header->raw[5] = (CK_BYTE)wrappedLen;
+	else
+	{
+		header->raw[6] = (CK_BYTE)(wrappedLen >> 8);
+		header->raw[7] = (CK_BYTE)wrappedLen;
+	}
+	header->type = type;
+	header->iv = header->raw + 8;
+	header->wrapped = header->iv + ENVELOPE_IV_LEN;
+	header->wrappedLen = wrappedLen;
+	memcpy(header->iv, iv, ENVELOPE_IV_LEN);
+	memcpy(header->wrapped, wrapped, wrappedLen);
+	header->len = 8 + ENVELOPE_IV_LEN + wrappedLen;
+}
+
+
+
+// Reads the header of an object wrapped the given way.
+static CK_RV readHeader(FILE *in, EnvelopeType type, EnvelopeHeader *header)
+{
+	CK_BYTE *raw = header->raw;
+
+	if(fread(raw, 1, 8, in)!=8 || raw[4]!=1)
+		return CKR_DATA_INVALID;
+	header->type = type;
+	if(type==ENVELOPE_KWP)
+	{
+		if(memcmp(raw, "LENV", 4)!=0 || raw[5]==0 || raw[5]>ENVELOPE_MAX_WRAPPED)
+			return CKR_DATA_INVALID;
+		header->wrappedLen = raw[5];
+	}
+	else
+	{
+		header->wrappedLen = ((CK_ULONG)raw[6] << 8) | raw[7];
+		if(memcmp(raw, "LENR", 4)!=0 || header->wrappedLen==0 || header->wrappedLen>ENVELOPE_MAX_RSA_WRAPPED)
+			return CKR_DATA_INVALID;
+	}
+	header->iv = raw + 8;
+	header->wrapped = header->iv + ENVELOPE_IV_LEN;
+	header->len = 8 + ENVELOPE_IV_LEN + header->wrappedLen;
+	if(fread(header->iv, 1, header->len - 8, in)!=header->len - 8)
+		return CKR_DATA_INVALID;
+	return CKR_OK;
+}
+
+
+
+// Encrypts or decrypts the payload with the data key. When decrypting, the tag is the last 16 bytes of in.
+static CK_RV cryptPayload(const CK_BYTE *key, const EnvelopeHeader *header, int encrypt, FILE *in, FILE *out, unsigned long long *bytes)
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	CK_BYTE *inBuffer = (CK_BYTE*)malloc(ENVELOPE_IO_CHUNK + ENVELOPE_TAG_LEN);
+	CK_BYTE *outBuffer = (CK_BYTE*)malloc(ENVELOPE_IO_CHUNK + ENVELOPE_TAG_LEN);
+	CK_BYTE tag[ENVELOPE_TAG_LEN];
+	size_t have = 0, count = 0, ready = 0;
+	int outLen = 0;
+	CK_RV rv = CKR_OK;
+
+	*bytes = 0;
+	if(ctx==NULL || inBuffer==NULL || outBuffer==NULL
+		|| !EVP_CipherInit_ex(ctx, EVP_aes_256_gcm(), NULL, NULL, NULL, encrypt)
+		|| !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_IVLEN, ENVELOPE_IV_LEN, NULL)
+		|| !EVP_CipherInit_ex(ctx, NULL, NULL, key, header->iv, encrypt)
+		|| !EVP_CipherUpdate(ctx, NULL, &outLen, header->raw, (int)header->len))
+		rv = CKR_HOST_MEMORY;
+
+	// When decrypting, `have` keeps up to ENVELOPE_TAG_LEN unprocessed bytes at the start of inBuffer.
+	while(rv==CKR_OK && (count = fread(inBuffer + have, 1, ENVELOPE_IO_CHUNK, in))>0)
+	{
+		have += count;
+		ready = encrypt ? have : ((have>ENVELOPE_TAG_LEN) ? have - ENVELOPE_TAG_LEN : 0);
+		if(!EVP_CipherUpdate(ctx, outBuffer, &outLen, inBuffer, (int)ready))
+			rv = CKR_FUNCTION_FAILED;
+		else if(fwrite(outBuffer, 1, outLen, out)!=(size_t)outLen)
+			rv = CKR_FUNCTION_FAILED;
+		memmove(inBuffer, inBuffer + ready, have - ready);
+		have -= ready;
+		*bytes += ready;
+	}
+	if(rv==CKR_OK && ferror(in))
+		rv = CKR_FUNCTION_FAILED;
+
+	if(rv==CKR_OK && encrypt)
+	{
+		if(!EVP_CipherFinal_ex(ctx, outBuffer, &outLen) || !EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, ENVELOPE_TAG_LEN, tag))
+			rv = CKR_FUNCTION_FAILED;
+		else if(fwrite(tag, 1, ENVELOPE_TAG_LEN, out)!=ENVELOPE_TAG_LEN)
+			rv = CKR_FUNCTION_FAILED;
+	}
+	else if(rv==CKR_OK)
+	{
+		if(have!=ENVELOPE_TAG_LEN)
+			rv = CKR_ENCRYPTED_DATA_LEN_RANGE;
+		else if(!EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, ENVELOPE_TAG_LEN, inBuffer) || EVP_CipherFinal_ex(ctx, outBuffer, &outLen)<=0)
+			rv = CKR_ENCRYPTED_DATA_INVALID;
+	}
+	if(rv==CKR_OK && fflush(out)!=0)
+		rv = CKR_FUNCTION_FAILED;
+
+	EVP_CIPHER_CTX_free(ctx);
+	free(inBuffer);
+	free(outBuffer);
+	return rv;
+}
+
+
+
+CK_RV envelopeEncrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hWrapKey,
+	EnvelopeKeyCache *cache, FILE *in, FILE *out, EnvelopeStats *stats)
+{
+	CK_MECHANISM mech = {CKM_AES_KWP, NULL_PTR, 0};
+	EnvelopeHeader header;
+	CK_BYTE iv[ENVELOPE_IV_LEN];
+	CK_BYTE wrapped[ENVELOPE_MAX_WRAPPED];
+	CK_ULONG wrappedLen = sizeof(wrapped);
+	size_t mapped = 0;
+	int locked = 0;
+	double start = nowSeconds();
+	CK_BYTE *key = (CK_BYTE*)lockedAlloc(ENVELOPE_KEY_LEN, &mapped, &locked);
+	CK_RV rv = (key!=NULL) ? CKR_OK : CKR_HOST_MEMORY;
+
+	memset(stats, 0, sizeof(EnvelopeStats));
+	if(rv==CKR_OK)
+		rv = p11->C_GenerateRandom(hSession, key, ENVELOPE_KEY_LEN);
+	if(rv==CKR_OK)
+		rv = p11->C_GenerateRandom(hSession, iv, ENVELOPE_IV_LEN);
+	if(rv==CKR_OK)
+		rv = p11->C_EncryptInit(hSession, &mech, hWrapKey);
+	if(rv==CKR_OK)
+		rv = p11->C_Encrypt(hSession, key, ENVELOPE_KEY_LEN, wrapped, &wrappedLen);
+	stats->hsmSeconds = nowSeconds() - start;
+
+	if(rv==CKR_OK)
+	{
+		if(cache!=NULL)
+			cacheInsert(cache, wrapped, wrappedLen, key);
+		encodeHeader(&header, ENVELOPE_KWP, iv, wrapped, wrappedLen);
+		if(fwrite(header.raw, 1, header.len, out)!=header.len)
+			rv = CKR_FUNCTION_FAILED;
+	}
+	if(rv==CKR_OK)
+		rv = cryptPayload(key, &header, 1, in, out, &stats->bytes);
+
+	lockedFree(key, mapped, locked);
+	stats->seconds = nowSeconds() - start;
+	return rv;
+}
+
+
+
+CK_RV envelopeDecrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hWrapKey,
+	EnvelopeKeyCache *cache, FILE *in, FILE *out, EnvelopeStats *stats)
+{
+	CK_MECHANISM mech = {CKM_AES_KWP, NULL_PTR, 0};
+	EnvelopeHeader header;
+	CK_ULONG keyLen = ENVELOPE_MAX_WRAPPED; // some tokens want room for the whole input.
+	size_t mapped = 0;
+	int locked = 0;
+	double start = nowSeconds();
+	double hsmStart = 0;
+	CK_BYTE *key = (CK_BYTE*)lockedAlloc(ENVELOPE_MAX_WRAPPED, &mapped, &locked);
+	CK_RV rv = (key!=NULL) ? CKR_OK : CKR_HOST_MEMORY;
+
+	memset(stats, 0, sizeof(EnvelopeStats));
+	if(rv==CKR_OK)
+		rv = readHeader(in, ENVELOPE_KWP, &header);
+	if(rv==CKR_OK && cache!=NULL)
+		stats->cacheHit = cacheLookup(cache, header.wrapped, header.wrappedLen, key);
+
+	if(rv==CKR_OK && !stats->cacheHit)
+	{
+		hsmStart = nowSeconds();
+		rv = p11->C_DecryptInit(hSession, &mech, hWrapKey);
+		if(rv==CKR_OK)
+			rv = p11->C_Decrypt(hSession, header.wrapped, header.wrappedLen, key, &keyLen);
+		if(rv==CKR_OK && keyLen!=ENVELOPE_KEY_LEN)
+			rv = CKR_WRAPPED_KEY_INVALID;
+		stats->hsmSeconds = nowSeconds() - hsmStart;
+		if(rv==CKR_OK && cache!=NULL)
+			cacheInsert(cache, header.wrapped, header.wrappedLen, key);
+	}
+	if(rv==CKR_OK)
+		rv = cryptPayload(key, &header, 0, in, out, &stats->bytes);
+
+	lockedFree(key, mapped, locked);
+	stats->seconds = nowSeconds() - start;
+	return rv;
+}
+
+
+
+EnvelopeRsaKey *envelopeRsaKeyFromToken(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPublic, CK_RV *rv)
+{
+	CK_BYTE modulus[ENVELOPE_MAX_RSA_WRAPPED];
+	CK_BYTE exponent[16];
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_MODULUS,		modulus,	sizeof(modulus)},
+		{CKA_PUBLIC_EXPONENT,	exponent,	sizeof(exponent)}
+	};
+	EnvelopeRsaKey *key = NULL;
+	OSSL_PARAM_BLD *build = NULL;
+	OSSL_PARAM *params = NULL;
+	EVP_PKEY_CTX *ctx = NULL;
+	BIGNUM *n = NULL, *e = NULL;
+
+	*rv = p11->C_GetAttributeValue(hSession, hPublic, attrib, 2);
+	if(*rv!=CKR_OK)
+		return NULL;
+
+	*rv = CKR_HOST_MEMORY;
+	key = (EnvelopeRsaKey*)calloc(1, sizeof(EnvelopeRsaKey));
+	n = BN_bin2bn(modulus, (int)attrib[0].ulValueLen, NULL);
+	e = BN_bin2bn(exponent, (int)attrib[1].ulValueLen, NULL);
+	build = OSSL_PARAM_BLD_new();
+	if(key!=NULL && n!=NULL && e!=NULL && build!=NULL
+		&& OSSL_PARAM_BLD_push_BN(build, OSSL_PKEY_PARAM_RSA_N, n)
+		&& OSSL_PARAM_BLD_push_BN(build, OSSL_PKEY_PARAM_RSA_E, e)
+		&& (params = OSSL_PARAM_BLD_to_param(build))!=NULL
+		&& (ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL))!=NULL
+		&& EVP_PKEY_fromdata_init(ctx)>0
+		&& EVP_PKEY_fromdata(ctx, &key->pkey, EVP_PKEY_PUBLIC_KEY, params)>0)
+		*rv = CKR_OK;
+
+	EVP_PKEY_CTX_free(ctx);
+	OSSL_PARAM_free(params);
+	OSSL_PARAM_BLD_free(build);
+	BN_free(n);
+	BN_free(e);
+	if(*rv!=CKR_OK)
+	{
+		envelopeRsaKeyFree(key);
+		return NULL;
+	}
+	return key;
+}
+
+
+
+EnvelopeRsaKey *envelopeRsaKeyLoad(const char *path, CK_RV *rv)
+{
+	EnvelopeRsaKey *key = (EnvelopeRsaKey*)calloc(1, sizeof(EnvelopeRsaKey));
+	FILE *file = fopen(path, "r");
+
+	*rv = CKR_OK;
+	if(key==NULL || file==NULL)
+		*rv = (key==NULL) ? CKR_HOST_MEMORY : CKR_FUNCTION_FAILED;
+	else if((key->pkey = PEM_read_PUBKEY(file, NULL, NULL, NULL))==NULL || EVP_PKEY_get_base_id(key->pkey)!=EVP_PKEY_RSA)
+		*rv = CKR_KEY_TYPE_INCONSISTENT;
+	if(file!=NULL)
+		fclose(file);
+	if(*rv!=CKR_OK)
+	{
+		envelopeRsaKeyFree(key);
+		return NULL;
+	}
+	return key;
+}
+
+
+
+CK_RV envelopeRsaKeySave(const EnvelopeRsaKey *key, const char *path)
+{
+	FILE *file = fopen(path, "w");
+	int written = 0;
+
+	if(file==NULL)
+		return CKR_FUNCTION_FAILED;
+	written = PEM_write_PUBKEY(file, key->pkey);
+	if(fclose(file)!=0 || !written)
+		return CKR_FUNCTION_FAILED;
+	return CKR_OK;
+}
+
+
+
+void envelopeRsaKeyFree(EnvelopeRsaKey *key)
+{
+	if(key==NULL)
+		return;
+	EVP_PKEY_free(key->pkey);
+	free(key);
+}
+
+
+
+CK_RV envelopeEncryptRsa(const EnvelopeRsaKey *publicKey, FILE *in, FILE *out, EnvelopeStats *stats)
+{
+	EnvelopeHeader header;
+	EVP_PKEY_CTX *ctx = NULL;
+	CK_BYTE iv[ENVELOPE_IV_LEN];
+	CK_BYTE wrapped[ENVELOPE_MAX_RSA_WRAPPED];
+	size_t wrappedLen = sizeof(wrapped);
+	size_t mapped = 0;
+	int locked = 0;
+	double start = nowSeconds();
+	CK_BYTE *key = (CK_BYTE*)lockedAlloc(ENVELOPE_KEY_LEN, &mapped, &locked);
+	CK_RV rv = (key!=NULL) ? CKR_OK : CKR_HOST_MEMORY;
+
+	memset(stats, 0, sizeof(EnvelopeStats));
+	if(rv==CKR_OK && (RAND_bytes(key, ENVELOPE_KEY_LEN)!=1 || RAND_bytes(iv, ENVELOPE_IV_LEN)!=1))
+		rv = CKR_RANDOM_NO_RNG;
+	if(rv==CKR_OK)
+	{
+		ctx = EVP_PKEY_CTX_new(publicKey->pkey, NULL);
+		if(ctx==NULL || EVP_PKEY_encrypt_init(ctx)<=0
+			|| EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING)<=0
+			|| EVP_PKEY_CTX_set_rsa_oaep_md(ctx, EVP_sha256())<=0
+			|| EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, EVP_sha256())<=0
+			|| EVP_PKEY_encrypt(ctx, wrapped, &wrappedLen, key, ENVELOPE_KEY_LEN)<=0)
+			rv = CKR_KEY_SIZE_RANGE; // no room for the key, or a modulus above ENVELOPE_MAX_RSA_WRAPPED bytes.
+		EVP_PKEY_CTX_free(ctx);
+	}
+
+	if(rv==CKR_OK)
+	{
+		encodeHeader(&header, ENVELOPE_RSA, iv, wrapped, wrappedLen);
+		if(fwrite(header.raw, 1, header.len, out)!=header.len)
+			rv = CKR_FUNCTION_FAILED;
+	}
+	if(rv==CKR_OK)
+		rv = cryptPayload(key, &header, 1, in, out, &stats->bytes);
+
+	lockedFree(key, mapped, locked);
+	stats->seconds = nowSeconds() - start;
+	return rv;
+}
+
+
+
+CK_RV envelopeDecryptRsa(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPrivate,
+	EnvelopeKeyCache *cache, FILE *in, FILE *out, EnvelopeStats *stats)
+{
+	CK_RSA_PKCS_OAEP_PARAMS oaep = {CKM_SHA256, CKG_MGF1_SHA256, CKZ_DATA_SPECIFIED, NULL_PTR, 0};
+	CK_MECHANISM mech = {CKM_RSA_PKCS_OAEP, &oaep, sizeof(oaep)};
+	EnvelopeHeader header;
+	CK_ULONG keyLen = ENVELOPE_MAX_RSA_WRAPPED; // room for a whole modulus.
+	size_t mapped = 0;
+	int locked = 0;
+	double start = nowSeconds();
+	double hsmStart = 0;
+	CK_BYTE *key = (CK_BYTE*)lockedAlloc(ENVELOPE_MAX_RSA_WRAPPED, &mapped, &locked);
+	CK_RV rv = (key!=NULL) ? CKR_OK : CKR_HOST_MEMORY;
+
+	memset(stats, 0, sizeof(EnvelopeStats));
+	if(rv==CKR_OK)
+		rv = readHeader(in, ENVELOPE_RSA, &header);
+	if(rv==CKR_OK && cache!=NULL)
+		stats->cacheHit = cacheLookup(cache, header.wrapped, header.wrappedLen, key);
+
+	if(rv==CKR_OK && !stats->cacheHit)
+	{
+		hsmStart = nowSeconds();
+		rv = p11->C_DecryptInit(hSession, &mech, hPrivate);
+		if(rv==CKR_OK)
+			rv = p11->C_Decrypt(hSession, header.wrapped, header.wrappedLen, key, &keyLen);
+		if(rv==CKR_OK && keyLen!=ENVELOPE_KEY_LEN)
+			rv = CKR_WRAPPED_KEY_INVALID;
+		stats->hsmSeconds = nowSeconds() - hsmStart;
+		if(rv==CKR_OK && cache!=NULL)
+			cacheInsert(cache, header.wrapped, header.wrappedLen, key);
+	}
+	if(rv==CKR_OK)
+		rv = cryptPayload(key, &header, 0, in, out, &stats->bytes);
+
+	lockedFree(key, mapped, locked);
+	stats->seconds = nowSeconds() - start;
+	return rv;
+}
@@ -0,0 +1,109 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Envelope encryption : every object gets its own AES-256 data key, drawn from the HSM random generator and
+	  wrapped by an HSM-resident key with CKM_AES_KWP (C_Encrypt / C_Decrypt of the key bytes). The payload itself is
+	  encrypted on the host with AES-256-GCM from OpenSSL, which uses AES-NI where the CPU has it, so bulk data never
+	  crosses the HSM link.
+	- Layout :-
+		"LENV" | version (1) | wrapped key length (1) | 0 (2) | IV (12) | wrapped key | ciphertext | tag (16)
+	  Everything before the ciphertext is the header, authenticated as the GCM AAD.
+	- Hybrid mode : the data key can instead be wrapped with RSA-OAEP (SHA-256) under the public key of an HSM key
+	  pair. Encryption then runs entirely on the host, from the CKA_MODULUS and CKA_PUBLIC_EXPONENT read once from
+	  the token or from a PEM file, for payloads of any size; the HSM is only needed to unwrap with the private key.
+		"LENR" | version (1) | 0 | wrapped key length (2) | IV (12) | wrapped key | ciphertext | tag (16)
+	- Unwrapped data keys are kept in an EnvelopeKeyCache, looked up by their wrapped form, so reading the same
+	  object again costs no HSM call. Data keys only live in memory that is locked (mlock, excluded from core dumps)
+	  and zeroized when released.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_ENVELOPE_H
+#define LUNA_SAMPLES_ENVELOPE_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+
+
+#define ENVELOPE_KEY_LEN 32
+#define ENVELOPE_IV_LEN 12
+#define ENVELOPE_TAG_LEN 16
+#define ENVELOPE_MAX_WRAPPED 48 // KWP output for a 32 byte key is 40 bytes.
+#define ENVELOPE_MAX_RSA_WRAPPED 512 // RSA-OAEP output, up to 4096 bit keys.
+#define ENVELOPE_MAX_HEADER (8 + ENVELOPE_IV_LEN + ENVELOPE_MAX_RSA_WRAPPED)
+
+
+typedef struct EnvelopeKeyCache EnvelopeKeyCache;
+typedef struct EnvelopeRsaKey EnvelopeRsaKey; // RSA public key held by OpenSSL.
+
+
+// Activity of a key cache.
+typedef struct
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned int entries;
+	unsigned int capacity;
+	int locked; // 1 if the cache memory could be locked, 0 if mlock failed (RLIMIT_MEMLOCK).
+} EnvelopeCacheStats;
+
+
+// Activity of one envelope operation.
+typedef struct
+{
+	unsigned long long bytes; // payload bytes.
+	double seconds; // wall time of the whole operation.
+	double hsmSeconds; // time spent in C_GenerateRandom, and in the KWP wrap or the unwrap. 0 for an RSA encryption.
+	int cacheHit; // 1 if the data key came from the cache.
+} EnvelopeStats;
+
+
+// Allocates a cache of capacity data keys in locked memory. On failure NULL is returned and *rv holds the error.
+EnvelopeKeyCache *envelopeCacheCreate(unsigned int capacity, CK_RV *rv);
+
+void envelopeCacheGetStats(EnvelopeKeyCache *cache, EnvelopeCacheStats *stats);
+
+// Zeroizes every key and releases the cache.
+void envelopeCacheDestroy(EnvelopeKeyCache *cache);
+
+// Encrypts in into out with a new data key wrapped by hWrapKey. cache may be NULL; otherwise the new key is added to it.
+CK_RV envelopeEncrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hWrapKey,
+	EnvelopeKeyCache *cache, FILE *in, FILE *out, EnvelopeStats *stats);
+
+// Decrypts in into out. Returns CKR_ENCRYPTED_DATA_INVALID if the tag does not verify; the output written so far
+// must then be discarded by the caller.
+CK_RV envelopeDecrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hWrapKey,
+	EnvelopeKeyCache *cache, FILE *in, FILE *out, EnvelopeStats *stats);
+
+// Reads the modulus and public exponent of an RSA public key object.
+EnvelopeRsaKey *envelopeRsaKeyFromToken(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPublic, CK_RV *rv);
+
+// Reads or writes an RSA public key as a PEM file (SubjectPublicKeyInfo).
+EnvelopeRsaKey *envelopeRsaKeyLoad(const char *path, CK_RV *rv);
+CK_RV envelopeRsaKeySave(const EnvelopeRsaKey *key, const char *path);
+
+void envelopeRsaKeyFree(EnvelopeRsaKey *key);
+
+// Encrypts in into out with a new data key wrapped by publicKey, without any HSM call.
+CK_RV envelopeEncryptRsa(const EnvelopeRsaKey *publicKey, FILE *in, FILE *out, EnvelopeStats *stats);
+
+// Decrypts an object of envelopeEncryptRsa, unwrapping its data key with CKM_RSA_PKCS_OAEP on hPrivate unless the
+// cache holds it. Tag failures are reported as by envelopeDecrypt.
+CK_RV envelopeDecryptRsa(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPrivate,
+	EnvelopeKeyCache *cache, FILE *in, FILE *out, EnvelopeStats *stats);
+
+#endif
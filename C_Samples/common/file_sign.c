@@ -0,0 +1,325 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the file signing declared in file_sign.h.
+	- feedFile hands the file to an update function chunk by chunk, from a mapping or through the stream pipeline;
+	  the sign, verify and digest operations only differ by that function and by how they finish.
+	- fileSignDigestLocally hashes with OpenSSL and is only compiled with HOST_CRYPTO defined (make HOST_CRYPTO=1).
+	  Without it, it returns CKR_FUNCTION_NOT_SUPPORTED.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HOST_CRYPTO
+#include <openssl/evp.h>
+#endif
+#include "file_sign.h"
+#include "stream_pipeline.h"
+#include "digest_sign.h"
+
+
+// Takes one chunk of the file.
+typedef CK_RV (*FeedFn)(void *context, CK_BYTE *data, CK_ULONG len);
+
+
+// Adapts a FeedFn to the stream pipeline, which calls it once more at the end with nothing to feed.
+typedef struct
+{
+	FeedFn feed;
+	void *context;
+} FeedStream;
+
+
+// The multi-part operation in progress.
+typedef struct
+{
+	CK_FUNCTION_LIST *p11;
+	CK_SESSION_HANDLE hSession;
+} HsmFeed;
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static CK_RV streamFeed(void *context, CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen, int last)
+{
+	FeedStream *stream = (FeedStream*)context;
+
+	(void)out;
+	*outLen = 0;
+	return last ? CKR_OK : stream->feed(stream->context, in, inLen);
+}
+
+
+
+// Hands the whole file to feed in chunks of chunkSize bytes. The time spent in feed goes to *busySeconds.
+static CK_RV feedFile(const char *path, CK_ULONG chunkSize, int useMap, FeedFn feed, void *context,
+	FileSignStats *stats, double *busySeconds)
+{
+	FeedStream stream = {feed, context};
+	StreamStats streamStats;
+	struct stat info;
+	long pageSize = sysconf(_SC_PAGESIZE);
+	CK_BYTE *map = NULL;
+	FILE *in = NULL;
+	unsigned long long done = 0, released = 0, cut = 0;
+	CK_ULONG len = 0;
+	double start = 0;
+	int fd = 0;
+	CK_RV rv = CKR_OK;
+
+	stats->chunkSize = chunkSize;
+	if(chunkSize==0)
+		return CKR_ARGUMENTS_BAD;
+	fd = (strcmp(path, "-")==0) ? dup(0) : open(path, O_RDONLY);
+	if(fd<0 || fstat(fd, &info)!=0)
+	{
+		stats->ioError = errno;
+		if(fd>=0)
+			close(fd);
+		return CKR_FUNCTION_FAILED;
+	}
+
+	if(useMap && S_ISREG(info.st_mode) && info.st_size>0)
+	{
+		map = (CK_BYTE*)mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map==MAP_FAILED)
+			map = NULL; // read it instead.
+	}
+	if(map!=NULL)
+	{
+		stats->mapped = 1;
+		madvise(map, info.st_size, MADV_SEQUENTIAL);
+		for(done=0; done<(unsigned long long)info.st_size; done+=len)
+		{
+			len = (info.st_size - done<chunkSize) ? (CK_ULONG)(info.st_size - done) : chunkSize;
+			start = nowSeconds();
+			rv = feed(context, map + done, len);
+			*busySeconds += nowSeconds() - start;
+			stats->chunks++;
+			if(rv!=CKR_OK)
+				break; // done stays the bytes fed.
+
+			// Pages already sent are dropped, so the resident size stays around one chunk whatever the file size.
+			cut = (done + len) / pageSize * pageSize;
+			if(cut>released)
+			{
+				madvise(map + released, cut - released, MADV_DONTNEED);
+				released = cut;
+			}
+		}
+		stats->bytes = done;
+		munmap(map, info.st_size);
+		close(fd);
+		return rv;
+	}
+
+	in = fdopen(fd, "rb");
+	if(in==NULL)
+	{
+		stats->ioError = errno;
+		close(fd);
+		return CKR_HOST_MEMORY;
+	}
+	rv = streamRun(in, NULL, chunkSize, 0, &streamFeed, &stream, &streamStats);
+	fclose(in);
+	stats->bytes = streamStats.bytesIn;
+	stats->chunks = streamStats.chunks;
+	stats->readSeconds = streamStats.readSeconds;
+	stats->ioError = streamStats.ioError;
+	*busySeconds += streamStats.processSeconds;
+	return rv;
+}
+
+
+
+static CK_RV signFeed(void *context, CK_BYTE *data, CK_ULONG len)
+{
+	HsmFeed *hsm = (HsmFeed*)context;
+	return hsm->p11->C_SignUpdate(hsm->hSession, data, len);
+}
+
+
+
+static CK_RV verifyFeed(void *context, CK_BYTE *data, CK_ULONG len)
+{
+	HsmFeed *hsm = (HsmFeed*)context;
+	return hsm->p11->C_VerifyUpdate(hsm->hSession, data, len);
+}
+
+
+
+#ifdef HOST_CRYPTO
+static CK_RV digestFeed(void *context, CK_BYTE *data, CK_ULONG len)
+{
+	return EVP_DigestUpdate((EVP_MD_CTX*)context, data, len)==1 ? CKR_OK : CKR_FUNCTION_FAILED;
+}
+#endif
+
+
+
+CK_RV fileSign(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const char *path, CK_ULONG chunkSize, int useMap, CK_BYTE *signature, CK_ULONG *signatureLen, FileSignStats *stats)
+{
+	HsmFeed hsm = {p11, hSession};
+	CK_BYTE scratch[FILE_SIGN_MAX_SIGNATURE];
+	CK_ULONG scratchLen = sizeof(scratch);
+	double started = nowSeconds();
+	double start = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(FileSignStats));
+	start = nowSeconds();
+	rv = p11->C_SignInit(hSession, mech, hKey);
+	stats->hsmSeconds += nowSeconds() - start;
+	if(rv!=CKR_OK)
+		return rv;
+	rv = feedFile(path, chunkSize, useMap, &signFeed, &hsm, stats, &stats->hsmSeconds);
+
+	start = nowSeconds();
+	if(rv==CKR_OK)
+		rv = p11->C_SignFinal(hSession, signature, signatureLen);
+	else
+		p11->C_SignFinal(hSession, scratch, &scratchLen); // ends the operation.
+	stats->hsmSeconds += nowSeconds() - start;
+	stats->seconds = nowSeconds() - started;
+	return rv;
+}
+
+
+
+CK_RV fileVerify(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const char *path, CK_ULONG chunkSize, int useMap, const CK_BYTE *signature, CK_ULONG signatureLen,
+	FileSignStats *stats)
+{
+	HsmFeed hsm = {p11, hSession};
+	CK_BYTE scratch[1] = {0};
+	double started = nowSeconds();
+	double start = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(FileSignStats));
+	start = nowSeconds();
+	rv = p11->C_VerifyInit(hSession, mech, hKey);
+	stats->hsmSeconds += nowSeconds() - start;
+	if(rv!=CKR_OK)
+		return rv;
+	rv = feedFile(path, chunkSize, useMap, &verifyFeed, &hsm, stats, &stats->hsmSeconds);
+
+	start = nowSeconds();
+	if(rv==CKR_OK)
+		rv = p11->C_VerifyFinal(hSession, (CK_BYTE*)signature, signatureLen);
+	else
+		p11->C_VerifyFinal(hSession, scratch, sizeof(scratch)); // ends the operation.
+	stats->hsmSeconds += nowSeconds() - start;
+	stats->seconds = nowSeconds() - started;
+	return rv;
+}
+
+
+
+#ifdef HOST_CRYPTO
+CK_RV fileSignDigestLocally(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hKey, const char *path, CK_ULONG chunkSize, int useMap, CK_BYTE *signature,
+	CK_ULONG *signatureLen, FileSignStats *stats)
+{
+	const DigestSignPlan *plan = digestSignPlan(mech->mechanism);
+	CK_BYTE digest[EVP_MAX_MD_SIZE];
+	unsigned int digestLen = 0;
+	EVP_MD_CTX *md = NULL;
+	double started = nowSeconds();
+	double start = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(FileSignStats));
+	if(plan==NULL)
+		return CKR_MECHANISM_INVALID;
+
+	md = EVP_MD_CTX_new();
+	if(md==NULL || plan->md==NULL || EVP_DigestInit_ex(md, plan->md, NULL)!=1)
+		rv = CKR_HOST_MEMORY;
+	if(rv==CKR_OK)
+		rv = feedFile(path, chunkSize, useMap, &digestFeed, md, stats, &stats->hashSeconds);
+	if(rv==CKR_OK)
+	{
+		start = nowSeconds();
+		if(EVP_DigestFinal_ex(md, digest, &digestLen)!=1)
+			rv = CKR_FUNCTION_FAILED;
+		stats->hashSeconds += nowSeconds() - start;
+	}
+	EVP_MD_CTX_free(md);
+
+	start = nowSeconds();
+	if(rv==CKR_OK)
+		rv = digestSignDigest(p11, hSession, mech, hKey, digest, digestLen, signature, signatureLen);
+	stats->hsmSeconds += nowSeconds() - start;
+	stats->seconds = nowSeconds() - started;
+	return rv;
+}
+#else
+CK_RV fileSignDigestLocally(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hKey, const char *path, CK_ULONG chunkSize, int useMap, CK_BYTE *signature,
+	CK_ULONG *signatureLen, FileSignStats *stats)
+{
+	(void)p11;
+	(void)hSession;
+	(void)mech;
+	(void)hKey;
+	(void)path;
+	(void)chunkSize;
+	(void)useMap;
+	(void)signature;
+	(void)signatureLen;
+	memset(stats, 0, sizeof(FileSignStats));
+	return CKR_FUNCTION_NOT_SUPPORTED; // nothing to hash with.
+}
+#endif
+
+
+
+void fileSignPrintStats(FILE *out, const FileSignStats *stats)
+{
+	fprintf(out, "  --> %llu bytes in %lu chunks of %lu bytes, %s.\n", stats->bytes, stats->chunks, stats->chunkSize,
+		stats->mapped ? "memory-mapped" : "read through the stream pipeline");
+	fprintf(out, "  --> %.3f seconds, %.2f MB/s.\n", stats->seconds,
+		(stats->seconds>0) ? stats->bytes / stats->seconds / (1024*1024) : 0);
+	fprintf(out, "  --> Busy time : read %.3f s, hash on the host %.3f s, HSM %.3f s.\n", stats->readSeconds,
+		stats->hashSeconds, stats->hsmSeconds);
+}
+
+
+
+void fileSignPrintComparison(FILE *out, const FileSignStats *hsm, const FileSignStats *local)
+{
+	double hsmRate = (hsm->seconds>0) ? hsm->bytes / hsm->seconds / (1024*1024) : 0;
+	double localRate = (local->seconds>0) ? local->bytes / local->seconds / (1024*1024) : 0;
+
+	fprintf(out, "  --> Multi-part on the HSM : %.2f MB/s; digest on the host : %.2f MB/s (%.1fx), %.3f s of HSM time instead of %.3f s.\n",
+		hsmRate, localRate, (hsmRate>0) ? localRate / hsmRate : 0, local->hsmSeconds, hsm->hsmSeconds);
+}
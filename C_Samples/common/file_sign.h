@@ -0,0 +1,77 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Signs and verifies files of any size with the multi-part C_SignUpdate / C_SignFinal and C_VerifyUpdate /
+	  C_VerifyFinal of a hash-and-sign mechanism (CKM_SHA256_RSA_PKCS, CKM_SHA256_RSA_PKCS_PSS, CKM_ECDSA_SHA256,
+	  ...) or of a MAC (CKM_SHA256_HMAC, CKM_AES_CMAC), in chunks of a chosen size, at constant memory.
+	- A regular file is memory-mapped and handed to the HSM straight from the mapping, with the pages already sent
+	  released as it goes. Pipes, or files when mapping is turned off, are read through common/stream_pipeline.c,
+	  so the next chunk is read while the HSM works on the current one.
+	- fileSignDigestLocally signs the same file the other way : the digest is computed on the host with OpenSSL,
+	  and only the digest goes to the HSM, signed with the matching raw mechanism by common/digest_sign.c. The
+	  signatures verify with the hash-and-sign mechanism, and are byte for byte the same for CKM_SHA*_RSA_PKCS.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_FILE_SIGN_H
+#define LUNA_SAMPLES_FILE_SIGN_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+
+
+#define FILE_SIGN_MAX_SIGNATURE 1024 // RSA keys up to 8192 bits.
+
+
+// Activity of one file operation.
+typedef struct
+{
+	unsigned long long bytes;
+	unsigned long chunks;
+	CK_ULONG chunkSize;
+	int mapped; // 1 if the file was memory-mapped, 0 if it was read in chunks.
+	double seconds; // wall time of the whole operation.
+	double readSeconds; // time spent in fread; the page faults of a mapped file count in the next stage instead.
+	double hashSeconds; // time spent hashing on the host.
+	double hsmSeconds; // time spent in the HSM calls.
+	int ioError; // errno of a failed open, map or read, 0 otherwise.
+} FileSignStats;
+
+
+// Signs the file at path ("-" for stdin) with a multi-part mechanism. useMap lets a regular file be memory-mapped.
+// *signatureLen is the room in signature on entry. Returns CKR_FUNCTION_FAILED for an I/O error (see stats->ioError).
+CK_RV fileSign(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const char *path, CK_ULONG chunkSize, int useMap, CK_BYTE *signature, CK_ULONG *signatureLen, FileSignStats *stats);
+
+// Verifies a signature of the file at path with a multi-part mechanism. Returns CKR_SIGNATURE_INVALID if it fails.
+CK_RV fileVerify(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hKey,
+	const char *path, CK_ULONG chunkSize, int useMap, const CK_BYTE *signature, CK_ULONG signatureLen,
+	FileSignStats *stats);
+
+// Signs the file as fileSign does, but hashes it on the host and only sends the digest to the HSM. Returns
+// CKR_MECHANISM_INVALID for a mechanism without a raw counterpart, and CKR_FUNCTION_NOT_SUPPORTED in a build
+// without HOST_CRYPTO.
+CK_RV fileSignDigestLocally(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hKey, const char *path, CK_ULONG chunkSize, int useMap, CK_BYTE *signature,
+	CK_ULONG *signatureLen, FileSignStats *stats);
+
+// Prints the stats as a few lines, with MB/s computed on the file.
+void fileSignPrintStats(FILE *out, const FileSignStats *stats);
+
+// Prints the throughput of a multi-part operation on the HSM next to the one of the same file hashed locally.
+void fileSignPrintComparison(FILE *out, const FileSignStats *hsm, const FileSignStats *local);
+
+#endif
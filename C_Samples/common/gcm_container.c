@@ -0,0 +1,408 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the chunked AES-GCM container declared in gcm_container.h.
+	- A worker keeps one pooled session for its whole run and stops taking chunks as soon as any worker fails.
+	- When the HSM generates the IV, C_Encrypt returns ciphertext || tag || IV; the IV is moved in front so that
+	  every record has the same layout.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include "gcm_container.h"
+
+
+// State shared by the workers of one run.
+typedef struct
+{
+	CK_FUNCTION_LIST *p11;
+	SessionPool *pool;
+	CK_OBJECT_HANDLE hKey;
+	int inFd;
+	int outFd;
+	int encrypt;
+	int hsmIv;
+	const GcmContainerHeader *header;
+	atomic_ullong nextChunk;
+	atomic_ulong error; // first CK_RV that was not CKR_OK.
+} ContainerRun;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+static void putBigEndian(CK_BYTE *out, unsigned long long value, int len)
+{
+	for(int ctr=len-1; ctr>=0; ctr--, value>>=8)
+		out[ctr] = (CK_BYTE)value;
+}
+
+
+
+static unsigned long long getBigEndian(const CK_BYTE *in, int len)
+{
+	unsigned long long value = 0;
+	for(int ctr=0; ctr<len; ctr++)
+		value = (value << 8) | in[ctr];
+	return value;
+}
+
+
+
+// pread / pwrite until len bytes are done. Returns the bytes done, short only at end of file or on error.
+static size_t readAt(int fd, CK_BYTE *buffer, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t count = 0;
+
+	while(done<len && (count = pread(fd, buffer + done, len - done, offset + done))>0)
+		done += count;
+	return done;
+}
+
+
+
+static size_t writeAt(int fd, const CK_BYTE *buffer, size_t len, off_t offset)
+{
+	size_t done = 0;
+	ssize_t count = 0;
+
+	while(done<len && (count = pwrite(fd, buffer + done, len - done, offset + done))>0)
+		done += count;
+	return done;
+}
+
+
+
+static void encodeHeader(GcmContainerHeader *header)
+{
+	CK_BYTE *raw = header->raw;
+
+	memset(raw, 0, GCM_CONTAINER_HEADER_LEN);
+	memcpy(raw, "LGCM", 4);
+	raw[4] = 1;
+	raw[5] = (CK_BYTE)header->ivLen;
+	raw[6] = GCM_CONTAINER_TAG_LEN;
+	putBigEndian(raw + 8, header->chunkSize, 4);
+	putBigEndian(raw + 16, header->plainSize, 8);
+	putBigEndian(raw + 24, header->chunks, 8);
+	memcpy(raw + 32, header->noncePrefix, 8);
+}
+
+
+
+static CK_ULONG chunkLength(const GcmContainerHeader *header, unsigned long long index)
+{
+	unsigned long long start = index * header->chunkSize;
+	unsigned long long left = header->plainSize - start;
+	return (left<header->chunkSize) ? (CK_ULONG)left : header->chunkSize;
+}
+
+
+
+static off_t recordOffset(const GcmContainerHeader *header, unsigned long long index)
+{
+	return GCM_CONTAINER_HEADER_LEN + index * (header->ivLen + header->chunkSize + GCM_CONTAINER_TAG_LEN);
+}
+
+
+
+// Fills the GCM parameters of a chunk. aad must hold GCM_CONTAINER_HEADER_LEN + 8 bytes.
+static void initParams(const GcmContainerHeader *header, unsigned long long index, CK_BYTE *iv, CK_BYTE *aad, CK_AES_GCM_PARAMS *param)
+{
+	memcpy(aad, header->raw, GCM_CONTAINER_HEADER_LEN);
+	putBigEndian(aad + GCM_CONTAINER_HEADER_LEN, index, 8);
+	param->pIv = iv;
+	param->ulIvLen = (iv!=NULL) ? header->ivLen : 0;
+	param->ulIvBits = param->ulIvLen * 8;
+	param->pAAD = aad;
+	param->ulAADLen = GCM_CONTAINER_HEADER_LEN + 8;
+	param->ulTagBits = GCM_CONTAINER_TAG_LEN * 8;
+}
+
+
+
+// Encrypts chunk index into its record. record holds ivLen + chunkSize + tag + 16 bytes.
+static CK_RV encryptChunk(ContainerRun *run, CK_SESSION_HANDLE hSession, unsigned long long index, CK_BYTE *plain, CK_BYTE *record)
+{
+	const GcmContainerHeader *header = run->header;
+	CK_ULONG len = chunkLength(header, index);
+	CK_ULONG ivLen = header->ivLen;
+	CK_ULONG outLen = len + GCM_CONTAINER_TAG_LEN + (run->hsmIv ? ivLen : 0);
+	CK_BYTE aad[GCM_CONTAINER_HEADER_LEN + 8];
+	CK_AES_GCM_PARAMS param;
+	CK_MECHANISM mech = {CKM_AES_GCM, &param, sizeof(param)};
+	CK_RV rv = CKR_OK;
+
+	if(readAt(run->inFd, plain, len, (off_t)(index * header->chunkSize))!=len)
+		return CKR_FUNCTION_FAILED;
+	if(!run->hsmIv)
+	{
+		memcpy(record, header->noncePrefix, 8);
+		putBigEndian(record + 8, index, 4);
+	}
+	initParams(header, index, run->hsmIv ? NULL : record, aad, &param);
+
+	rv = run->p11->C_EncryptInit(hSession, &mech, run->hKey);
+	if(rv==CKR_OK)
+		rv = run->p11->C_Encrypt(hSession, plain, len, record + ivLen, &outLen);
+	if(rv!=CKR_OK)
+		return rv;
+	if(outLen!=len + GCM_CONTAINER_TAG_LEN + (run->hsmIv ? ivLen : 0))
+		return CKR_GENERAL_ERROR;
+	if(run->hsmIv)
+		memcpy(record, record + ivLen + len + GCM_CONTAINER_TAG_LEN, ivLen);
+
+	if(writeAt(run->outFd, record, ivLen + len + GCM_CONTAINER_TAG_LEN, recordOffset(header, index))!=ivLen + len + GCM_CONTAINER_TAG_LEN)
+		return CKR_FUNCTION_FAILED;
+	return CKR_OK;
+}
+
+
+
+// Reads and decrypts the record of chunk index. record holds ivLen + chunkSize + tag bytes, out chunkSize + tag.
+static CK_RV decryptRecord(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, int inFd,
+	const GcmContainerHeader *header, unsigned long long index, CK_BYTE *record, CK_BYTE *out, CK_ULONG *outLen)
+{
+	CK_ULONG len = chunkLength(header, index);
+	CK_ULONG recordLen = header->ivLen + len + GCM_CONTAINER_TAG_LEN;
+	CK_BYTE aad[GCM_CONTAINER_HEADER_LEN + 8];
+	CK_AES_GCM_PARAMS param;
+	CK_MECHANISM mech = {CKM_AES_GCM, &param, sizeof(param)};
+	CK_RV rv = CKR_OK;
+
+	if(index>=header->chunks)
+		return CKR_ARGUMENTS_BAD;
+	if(readAt(inFd, record, recordLen, recordOffset(header, index))!=recordLen)
+		return CKR_ENCRYPTED_DATA_LEN_RANGE;
+	initParams(header, index, record, aad, &param);
+
+	*outLen = len + GCM_CONTAINER_TAG_LEN; // some tokens want room for the tag too.
+	rv = p11->C_DecryptInit(hSession, &mech, hKey);
+	if(rv==CKR_OK)
+		rv = p11->C_Decrypt(hSession, record + header->ivLen, len + GCM_CONTAINER_TAG_LEN, out, outLen);
+	if(rv==CKR_OK && *outLen!=len)
+		rv = CKR_GENERAL_ERROR;
+	return rv;
+}
+
+
+
+static void *workerMain(void *arg)
+{
+	ContainerRun *run = (ContainerRun*)arg;
+	const GcmContainerHeader *header = run->header;
+	PooledSession *session = NULL;
+	CK_BYTE *plain = (CK_BYTE*)malloc(header->chunkSize + GCM_CONTAINER_TAG_LEN);
+	CK_BYTE *record = (CK_BYTE*)malloc(header->ivLen + header->chunkSize + GCM_CONTAINER_TAG_LEN + 16);
+	unsigned long long index = 0;
+	CK_ULONG plainLen = 0;
+	CK_RV rv = (plain!=NULL && record!=NULL) ? sessionPoolAcquire(run->pool, &session) : CKR_HOST_MEMORY;
+
+	while(rv==CKR_OK && atomic_load(&run->error)==CKR_OK)
+	{
+		index = atomic_fetch_add(&run->nextChunk, 1);
+		if(index>=header->chunks)
+			break;
+		if(run->encrypt)
+			rv = encryptChunk(run, session->hSession, index, plain, record);
+		else
+		{
+			rv = decryptRecord(run->p11, session->hSession, run->hKey, run->inFd, header, index, record, plain, &plainLen);
+			if(rv==CKR_OK && writeAt(run->outFd, plain, plainLen, (off_t)(index * header->chunkSize))!=plainLen)
+				rv = CKR_FUNCTION_FAILED;
+		}
+	}
+
+	if(session!=NULL)
+		sessionPoolRelease(run->pool, session, rv);
+	if(rv!=CKR_OK)
+	{
+		CK_ULONG expected = CKR_OK;
+		atomic_compare_exchange_strong(&run->error, &expected, rv);
+	}
+	free(plain);
+	free(record);
+	return 0;
+}
+
+
+
+// Runs the workers over every chunk of run->header.
+static CK_RV runWorkers(ContainerRun *run, unsigned int nWorkers, GcmContainerStats *stats)
+{
+	pthread_t *threads = NULL;
+	unsigned int started = 0;
+	double start = nowSeconds();
+
+	if(nWorkers==0)
+		nWorkers = 1;
+	if(nWorkers>run->header->chunks)
+		nWorkers = (unsigned int)run->header->chunks;
+	threads = (pthread_t*)calloc(nWorkers, sizeof(pthread_t));
+	if(threads==NULL)
+		return CKR_HOST_MEMORY;
+
+	atomic_init(&run->nextChunk, 0);
+	atomic_init(&run->error, CKR_OK);
+	for(started=0; started<nWorkers; started++)
+		if(pthread_create(&threads[started], NULL, &workerMain, run)!=0)
+			break;
+	if(started==0)
+		atomic_store(&run->error, CKR_HOST_MEMORY);
+	for(unsigned int ctr=0; ctr<started; ctr++)
+		pthread_join(threads[ctr], NULL);
+	free(threads);
+
+	stats->seconds = nowSeconds() - start;
+	stats->workers = started;
+	stats->chunks = run->header->chunks;
+	stats->bytes = run->header->plainSize;
+	return atomic_load(&run->error);
+}
+
+
+
+CK_RV gcmContainerEncrypt(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_OBJECT_HANDLE hKey, int inFd, int outFd,
+	CK_ULONG chunkSize, unsigned int nWorkers, int hsmIv, GcmContainerStats *stats)
+{
+	GcmContainerHeader header;
+	ContainerRun run;
+	PooledSession *session = NULL;
+	struct stat info;
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(GcmContainerStats));
+	if(chunkSize==0 || chunkSize>0xFFFFFFFFUL || fstat(inFd, &info)!=0 || !S_ISREG(info.st_mode))
+		return CKR_ARGUMENTS_BAD;
+
+	memset(&header, 0, sizeof(header));
+	header.chunkSize = chunkSize;
+	header.plainSize = info.st_size;
+	header.chunks = (header.plainSize + chunkSize - 1) / chunkSize;
+	if(header.chunks==0)
+		header.chunks = 1;
+	if(header.chunks>GCM_CONTAINER_MAX_CHUNKS)
+		return CKR_DATA_LEN_RANGE;
+	header.ivLen = hsmIv ? 16 : 12;
+
+	// The nonce prefix makes host IVs unique across files encrypted with the same key.
+	rv = sessionPoolAcquire(pool, &session);
+	if(rv!=CKR_OK)
+		return rv;
+	rv = p11->C_GenerateRandom(session->hSession, header.noncePrefix, sizeof(header.noncePrefix));
+	sessionPoolRelease(pool, session, rv);
+	if(rv!=CKR_OK)
+		return rv;
+	encodeHeader(&header);
+	if(writeAt(outFd, header.raw, GCM_CONTAINER_HEADER_LEN, 0)!=GCM_CONTAINER_HEADER_LEN)
+		return CKR_FUNCTION_FAILED;
+
+	memset(&run, 0, sizeof(run));
+	run.p11 = p11;
+	run.pool = pool;
+	run.hKey = hKey;
+	run.inFd = inFd;
+	run.outFd = outFd;
+	run.encrypt = 1;
+	run.hsmIv = hsmIv;
+	run.header = &header;
+	return runWorkers(&run, nWorkers, stats);
+}
+
+
+
+CK_RV gcmContainerReadHeader(int inFd, GcmContainerHeader *header)
+{
+	CK_BYTE *raw = header->raw;
+	unsigned long long expected = 0;
+
+	memset(header, 0, sizeof(GcmContainerHeader));
+	if(readAt(inFd, raw, GCM_CONTAINER_HEADER_LEN, 0)!=GCM_CONTAINER_HEADER_LEN)
+		return CKR_DATA_INVALID;
+	if(memcmp(raw, "LGCM", 4)!=0 || raw[4]!=1 || (raw[5]!=12 && raw[5]!=16) || raw[6]!=GCM_CONTAINER_TAG_LEN)
+		return CKR_DATA_INVALID;
+
+	header->ivLen = raw[5];
+	header->chunkSize = (CK_ULONG)getBigEndian(raw + 8, 4);
+	header->plainSize = getBigEndian(raw + 16, 8);
+	header->chunks = getBigEndian(raw + 24, 8);
+	memcpy(header->noncePrefix, raw + 32, 8);
+	if(header->chunkSize==0)
+		return CKR_DATA_INVALID;
+	expected = (header->plainSize + header->chunkSize - 1) / header->chunkSize;
+	if(header->chunks!=((expected==0) ? 1 : expected) || header->chunks>GCM_CONTAINER_MAX_CHUNKS)
+		return CKR_DATA_INVALID;
+	return CKR_OK;
+}
+
+
+
+CK_RV gcmContainerDecrypt(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_OBJECT_HANDLE hKey, int inFd, int outFd,
+	unsigned int nWorkers, GcmContainerStats *stats)
+{
+	GcmContainerHeader header;
+	ContainerRun run;
+	struct stat info;
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(GcmContainerStats));
+	rv = gcmContainerReadHeader(inFd, &header);
+	if(rv!=CKR_OK)
+		return rv;
+
+	// Trailing or missing bytes are caught before any work is done.
+	if(fstat(inFd, &info)!=0)
+		return CKR_FUNCTION_FAILED;
+	if((unsigned long long)info.st_size!=GCM_CONTAINER_HEADER_LEN + header.plainSize + header.chunks * (header.ivLen + GCM_CONTAINER_TAG_LEN))
+		return CKR_ENCRYPTED_DATA_LEN_RANGE;
+
+	memset(&run, 0, sizeof(run));
+	run.p11 = p11;
+	run.pool = pool;
+	run.hKey = hKey;
+	run.inFd = inFd;
+	run.outFd = outFd;
+	run.header = &header;
+	return runWorkers(&run, nWorkers, stats);
+}
+
+
+
+CK_RV gcmContainerDecryptChunk(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, int inFd,
+	const GcmContainerHeader *header, unsigned long long index, CK_BYTE *out, CK_ULONG *outLen)
+{
+	CK_BYTE *record = (CK_BYTE*)malloc(header->ivLen + header->chunkSize + GCM_CONTAINER_TAG_LEN);
+	CK_RV rv = CKR_HOST_MEMORY;
+
+	if(record!=NULL)
+		rv = decryptRecord(p11, hSession, hKey, inFd, header, index, record, out, outLen);
+	free(record);
+	return rv;
+}
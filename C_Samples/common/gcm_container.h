@@ -0,0 +1,85 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- A chunked AES-GCM container for large files : the input is cut into fixed-size chunks, and every chunk is
+	  encrypted on its own with CKM_AES_GCM, so chunks can be processed in parallel and decrypted independently.
+	- Layout :-
+		header (GCM_CONTAINER_HEADER_LEN bytes, see below)
+		record 0 : IV || ciphertext of chunk 0 || 16 byte tag
+		record 1 : ...
+	  Every record but the last holds a full chunk, so the position of any record follows from its index.
+	- Header, big-endian :-
+		"LGCM" | version (1) | IV length | tag length | 0 | chunk size (4) | 0 (4) | plain size (8) |
+		chunk count (8) | nonce prefix (8)
+	- The AAD of every chunk is the header followed by the chunk index (8 bytes), so a chunk cannot be moved,
+	  swapped between files, or dropped from the end without its tag failing.
+	- IVs are either the random nonce prefix of the file followed by the chunk index (12 bytes), or generated by the
+	  HSM (16 bytes, as required when the HSM runs in FIPS mode).
+	- Workers each hold a pooled session and take the next chunk from a shared counter; records are read and written
+	  with pread / pwrite at their own offsets, so the output comes out in order whatever the completion order.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_GCM_CONTAINER_H
+#define LUNA_SAMPLES_GCM_CONTAINER_H
+
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+
+
+#define GCM_CONTAINER_HEADER_LEN 40
+#define GCM_CONTAINER_TAG_LEN 16
+#define GCM_CONTAINER_MAX_CHUNKS 0xFFFFFFFFULL // the chunk index is 4 bytes of the IV.
+
+
+// Decoded container header.
+typedef struct
+{
+	CK_ULONG chunkSize;
+	unsigned long long plainSize;
+	unsigned long long chunks; // at least 1, an empty file is one empty chunk.
+	CK_ULONG ivLen; // 12 for host IVs, 16 for IVs generated by the HSM.
+	CK_BYTE noncePrefix[8];
+	CK_BYTE raw[GCM_CONTAINER_HEADER_LEN]; // the encoded header, part of every AAD.
+} GcmContainerHeader;
+
+
+// Activity of one encryption or decryption.
+typedef struct
+{
+	unsigned long long bytes; // plaintext bytes.
+	unsigned long long chunks;
+	unsigned int workers;
+	double seconds;
+} GcmContainerStats;
+
+
+// Encrypts the regular file inFd into outFd with nWorkers threads. hsmIv lets the HSM generate the IVs.
+CK_RV gcmContainerEncrypt(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_OBJECT_HANDLE hKey, int inFd, int outFd,
+	CK_ULONG chunkSize, unsigned int nWorkers, int hsmIv, GcmContainerStats *stats);
+
+// Decrypts a whole container. Fails with the error of the first chunk whose tag does not verify.
+CK_RV gcmContainerDecrypt(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_OBJECT_HANDLE hKey, int inFd, int outFd,
+	unsigned int nWorkers, GcmContainerStats *stats);
+
+// Reads and checks the header. Returns CKR_DATA_INVALID if inFd is not a container.
+CK_RV gcmContainerReadHeader(int inFd, GcmContainerHeader *header);
+
+// Decrypts one chunk without touching the others. out must hold header->chunkSize + GCM_CONTAINER_TAG_LEN bytes.
+CK_RV gcmContainerDecryptChunk(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, int inFd,
+	const GcmContainerHeader *header, unsigned long long index, CK_BYTE *out, CK_ULONG *outLen);
+
+#endif
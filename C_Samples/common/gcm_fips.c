@@ -0,0 +1,98 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the FIPS mode CKM_AES_GCM helpers declared in gcm_fips.h.
+*/
+
+
+
+#include <string.h>
+#include "gcm_fips.h"
+
+
+
+CK_RV gcmFipsEncrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, const CK_BYTE *aad,
+	CK_ULONG aadLen, const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *record, CK_ULONG *recordLen)
+{
+	CK_AES_GCM_PARAMS param = {NULL_PTR, 0, 0, (CK_BYTE*)aad, aadLen, GCM_FIPS_TAG_LEN * 8}; // NULL IV : generated by the HSM.
+	CK_MECHANISM mech = {CKM_AES_GCM, &param, sizeof(param)};
+	CK_RV rv = CKR_OK;
+
+	if(recordLen==NULL || (data==NULL && dataLen>0))
+		return CKR_ARGUMENTS_BAD;
+	if(record==NULL)
+	{
+		*recordLen = dataLen + GCM_FIPS_OVERHEAD;
+		return CKR_OK;
+	}
+	if(*recordLen<dataLen + GCM_FIPS_OVERHEAD)
+	{
+		*recordLen = dataLen + GCM_FIPS_OVERHEAD;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	rv = p11->C_EncryptInit(hSession, &mech, hKey);
+	if(rv==CKR_OK)
+		rv = p11->C_Encrypt(hSession, (CK_BYTE*)data, dataLen, record, recordLen);
+	if(rv==CKR_OK && *recordLen!=dataLen + GCM_FIPS_OVERHEAD)
+		rv = CKR_GENERAL_ERROR; // no IV appended : the HSM is not in FIPS mode.
+	return rv;
+}
+
+
+
+CK_RV gcmFipsParse(const CK_BYTE *record, CK_ULONG recordLen, GcmFipsRecord *parsed)
+{
+	if(record==NULL || parsed==NULL)
+		return CKR_ARGUMENTS_BAD;
+	if(recordLen<GCM_FIPS_OVERHEAD)
+		return CKR_ENCRYPTED_DATA_LEN_RANGE;
+	parsed->ciphertext = record;
+	parsed->ciphertextLen = recordLen - GCM_FIPS_IV_LEN;
+	parsed->iv = record + parsed->ciphertextLen;
+	return CKR_OK;
+}
+
+
+
+CK_RV gcmFipsDecrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, const CK_BYTE *aad,
+	CK_ULONG aadLen, const CK_BYTE *record, CK_ULONG recordLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	GcmFipsRecord parsed;
+	CK_AES_GCM_PARAMS param;
+	CK_MECHANISM mech = {CKM_AES_GCM, &param, sizeof(param)};
+	CK_RV rv = gcmFipsParse(record, recordLen, &parsed);
+
+	if(rv!=CKR_OK)
+		return rv;
+	if(out==NULL || outLen==NULL)
+		return CKR_ARGUMENTS_BAD;
+	if(*outLen<parsed.ciphertextLen)
+	{
+		*outLen = parsed.ciphertextLen;
+		return CKR_BUFFER_TOO_SMALL;
+	}
+
+	param.pIv = (CK_BYTE*)parsed.iv;
+	param.ulIvLen = GCM_FIPS_IV_LEN;
+	param.ulIvBits = GCM_FIPS_IV_LEN * 8;
+	param.pAAD = (CK_BYTE*)aad;
+	param.ulAADLen = aadLen;
+	param.ulTagBits = GCM_FIPS_TAG_LEN * 8;
+	rv = p11->C_DecryptInit(hSession, &mech, hKey);
+	if(rv==CKR_OK)
+		rv = p11->C_Decrypt(hSession, (CK_BYTE*)parsed.ciphertext, parsed.ciphertextLen, out, outLen);
+	return rv;
+}
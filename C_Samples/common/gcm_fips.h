@@ -0,0 +1,60 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- CKM_AES_GCM as a Luna HSM in FIPS mode runs it : encryption is given a NULL IV, the HSM generates one and
+	  appends it to the output, which then reads ciphertext || tag (16) || IV (16).
+	- A record is never copied to handle that IV. gcmFipsParse only sets pointers into the caller's buffer : the IV
+	  is given to CK_AES_GCM_PARAMS.pIv where it lies, and C_Decrypt is given the start of the record with a length
+	  that leaves the IV out.
+	- The record buffer is only read, so it can be a mapped file or a network buffer.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_GCM_FIPS_H
+#define LUNA_SAMPLES_GCM_FIPS_H
+
+#include <cryptoki_v2.h>
+
+
+#define GCM_FIPS_IV_LEN 16
+#define GCM_FIPS_TAG_LEN 16
+#define GCM_FIPS_OVERHEAD (GCM_FIPS_TAG_LEN + GCM_FIPS_IV_LEN) // record length minus plaintext length.
+
+
+// Parts of a record, pointing into the record itself.
+typedef struct
+{
+	const CK_BYTE *ciphertext; // ciphertext followed by the tag.
+	CK_ULONG ciphertextLen; // tag included.
+	const CK_BYTE *iv;
+} GcmFipsRecord;
+
+
+// Encrypts dataLen bytes into record, which must hold dataLen + GCM_FIPS_OVERHEAD bytes. *recordLen gives the size
+// of record and receives the length of the record. With record NULL, only the length is returned.
+CK_RV gcmFipsEncrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, const CK_BYTE *aad,
+	CK_ULONG aadLen, const CK_BYTE *data, CK_ULONG dataLen, CK_BYTE *record, CK_ULONG *recordLen);
+
+// Locates the IV and the ciphertext of a record, without copying. Returns CKR_ENCRYPTED_DATA_LEN_RANGE if the record
+// is too short to hold a tag and an IV.
+CK_RV gcmFipsParse(const CK_BYTE *record, CK_ULONG recordLen, GcmFipsRecord *parsed);
+
+// Decrypts a record into out, using the IV in place. *outLen gives the size of out, which must be at least
+// recordLen - GCM_FIPS_IV_LEN bytes (the token may need room for the tag), and receives the plaintext length.
+CK_RV gcmFipsDecrypt(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey, const CK_BYTE *aad,
+	CK_ULONG aadLen, const CK_BYTE *record, CK_ULONG recordLen, CK_BYTE *out, CK_ULONG *outLen);
+
+#endif
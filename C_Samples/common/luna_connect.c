@@ -0,0 +1,187 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the timed connection steps declared in luna_connect.h.
+	- Every step is measured with a monotonic clock around the single call it makes.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "luna_connect.h"
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+	#include <dlfcn.h>
+#endif
+
+
+
+static double nowMicros()
+{
+#ifdef OS_UNIX
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+#else
+	LARGE_INTEGER counter, frequency;
+	QueryPerformanceCounter(&counter);
+	QueryPerformanceFrequency(&frequency);
+	return counter.QuadPart * 1e6 / frequency.QuadPart;
+#endif
+}
+
+
+
+CK_RV lunaLoadLibrary(LunaConnection *conn, const char *libPath)
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+	double start = 0;
+
+	memset(conn, 0, sizeof(LunaConnection));
+	if(libPath==NULL)
+		libPath = getenv("P11_LIB");
+	if(libPath==NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	start = nowMicros();
+	#ifdef OS_UNIX
+		conn->libHandle = dlopen(libPath, RTLD_NOW);
+	#else
+		conn->libHandle = LoadLibrary(libPath);
+	#endif
+	conn->timing.load = nowMicros() - start;
+	if(!conn->libHandle)
+		return CKR_GENERAL_ERROR;
+
+	start = nowMicros();
+	#ifdef OS_UNIX
+		C_GetFunctionList = (CK_C_GetFunctionList)dlsym(conn->libHandle, "C_GetFunctionList");
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(conn->libHandle, "C_GetFunctionList");
+	#endif
+	if(C_GetFunctionList!=NULL)
+		C_GetFunctionList(&conn->p11);
+	conn->timing.getFunctionList = nowMicros() - start;
+	if(conn->p11==NULL)
+	{
+		lunaUnloadLibrary(conn);
+		return CKR_GENERAL_ERROR;
+	}
+	return CKR_OK;
+}
+
+
+
+CK_RV lunaConnect(LunaConnection *conn, CK_SLOT_ID slotId, CK_BYTE *pin, CK_ULONG pinLen)
+{
+	double start = nowMicros();
+	CK_RV rv = conn->p11->C_Initialize(NULL);
+
+	conn->timing.initialize = nowMicros() - start;
+	if(rv!=CKR_OK)
+		return rv;
+	conn->initialized = 1;
+	conn->slotId = slotId;
+
+	start = nowMicros();
+	rv = conn->p11->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &conn->hSession);
+	conn->timing.openSession = nowMicros() - start;
+	if(rv!=CKR_OK || pin==NULL)
+		return rv;
+
+	start = nowMicros();
+	rv = conn->p11->C_Login(conn->hSession, CKU_USER, pin, pinLen);
+	conn->timing.login = nowMicros() - start;
+	conn->loggedIn = (rv==CKR_OK);
+	return rv;
+}
+
+
+
+CK_RV lunaDisconnect(LunaConnection *conn)
+{
+	double start = nowMicros();
+	CK_RV rv = CKR_OK;
+
+	if(conn->loggedIn)
+		rv = conn->p11->C_Logout(conn->hSession);
+	if(conn->hSession!=0 && rv==CKR_OK)
+		rv = conn->p11->C_CloseSession(conn->hSession);
+	if(conn->initialized)
+	{
+		CK_RV finalizeRv = conn->p11->C_Finalize(NULL);
+		if(rv==CKR_OK)
+			rv = finalizeRv;
+	}
+	conn->timing.teardown = nowMicros() - start;
+	conn->loggedIn = 0;
+	conn->hSession = 0;
+	conn->initialized = 0;
+	return rv;
+}
+
+
+
+void lunaUnloadLibrary(LunaConnection *conn)
+{
+	double start = nowMicros();
+
+	if(conn->libHandle)
+	{
+		#ifdef OS_UNIX
+			dlclose(conn->libHandle);
+		#else
+			FreeLibrary(conn->libHandle);
+		#endif
+	}
+	conn->timing.unload = nowMicros() - start;
+	conn->libHandle = 0;
+	conn->p11 = NULL;
+}
+
+
+
+double lunaStartupTotal(const StartupTiming *timing)
+{
+	return timing->load + timing->getFunctionList + timing->initialize + timing->openSession + timing->login;
+}
+
+
+
+void lunaPrintTiming(FILE *out, const StartupTiming *timing)
+{
+	double total = lunaStartupTotal(timing);
+	const char *names[] = {"load library", "C_GetFunctionList", "C_Initialize", "C_OpenSession", "C_Login"};
+	double values[] = {timing->load, timing->getFunctionList, timing->initialize, timing->openSession, timing->login};
+
+	for(int ctr=0; ctr<5; ctr++)
+		fprintf(out, "  %-20s %12.3f ms  %5.1f %%\n", names[ctr], values[ctr] / 1000, (total>0) ? 100 * values[ctr] / total : 0);
+	fprintf(out, "  %-20s %12.3f ms\n", "startup total", total / 1000);
+	fprintf(out, "  %-20s %12.3f ms\n", "teardown", timing->teardown / 1000);
+	fprintf(out, "  %-20s %12.3f ms\n", "unload library", timing->unload / 1000);
+}
+
+
+
+void lunaWriteTimingJson(FILE *out, const StartupTiming *timing)
+{
+	fprintf(out, "{\"loadMicros\": %.3f, \"getFunctionListMicros\": %.3f, \"initializeMicros\": %.3f, "
+		"\"openSessionMicros\": %.3f, \"loginMicros\": %.3f, \"startupMicros\": %.3f, \"teardownMicros\": %.3f, "
+		"\"unloadMicros\": %.3f}\n", timing->load, timing->getFunctionList, timing->initialize, timing->openSession,
+		timing->login, lunaStartupTotal(timing), timing->teardown, timing->unload);
+}
@@ -0,0 +1,83 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- The loadLunaLibrary / connectToLunaSlot / disconnectFromLunaSlot steps of the samples, with every step timed.
+	- The wall time of dlopen (LoadLibrary on Windows), C_GetFunctionList, C_Initialize, C_OpenSession and C_Login
+	  is kept separately, so the part of a cold start spent in each step can be seen and tracked.
+	- The timings can be printed as a table or written as JSON.
+	- Functions return CK_RV like the PKCS#11 calls they wrap. A library that cannot be loaded is CKR_GENERAL_ERROR.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_LUNA_CONNECT_H
+#define LUNA_SAMPLES_LUNA_CONNECT_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+
+#ifndef OS_UNIX
+	#include <windows.h>
+#endif
+
+
+// Wall time of every step in microseconds. Steps that were not run stay at 0.
+typedef struct
+{
+	double load; // dlopen / LoadLibrary.
+	double getFunctionList; // dlsym + C_GetFunctionList.
+	double initialize; // C_Initialize.
+	double openSession; // C_OpenSession.
+	double login; // C_Login.
+	double teardown; // C_Logout + C_CloseSession + C_Finalize.
+	double unload; // dlclose / FreeLibrary.
+} StartupTiming;
+
+
+// A loaded library and, once connected, a logged in session.
+typedef struct
+{
+#ifdef OS_UNIX
+	void *libHandle;
+#else
+	HINSTANCE libHandle;
+#endif
+	CK_FUNCTION_LIST *p11;
+	CK_SLOT_ID slotId;
+	CK_SESSION_HANDLE hSession;
+	int initialized;
+	int loggedIn;
+	StartupTiming timing;
+} LunaConnection;
+
+
+// Loads the library from libPath (from the P11_LIB environment variable if NULL) and gets its function list.
+CK_RV lunaLoadLibrary(LunaConnection *conn, const char *libPath);
+
+// C_Initialize, C_OpenSession (read / write) and C_Login as CKU_USER. With a NULL pin the login is skipped.
+CK_RV lunaConnect(LunaConnection *conn, CK_SLOT_ID slotId, CK_BYTE *pin, CK_ULONG pinLen);
+
+// Logs out, closes the session and finalizes the library, whichever of these were done.
+CK_RV lunaDisconnect(LunaConnection *conn);
+
+void lunaUnloadLibrary(LunaConnection *conn);
+
+// load + getFunctionList + initialize + openSession + login.
+double lunaStartupTotal(const StartupTiming *timing);
+
+void lunaPrintTiming(FILE *out, const StartupTiming *timing);
+void lunaWriteTimingJson(FILE *out, const StartupTiming *timing);
+
+#endif
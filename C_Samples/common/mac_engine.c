@@ -0,0 +1,243 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the MAC engine declared in mac_engine.h.
+	- macTagBatch and macVerifyBatch share one run : only the per-record call differs.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "mac_engine.h"
+
+
+// State shared by the workers of one batch.
+typedef struct
+{
+	CK_FUNCTION_LIST *p11;
+	SessionPool *pool;
+	CK_MECHANISM_TYPE mechanism;
+	CK_OBJECT_HANDLE hKey;
+	CK_ULONG tagLen;
+	unsigned long count;
+	const CK_BYTE *const *records;
+	const CK_ULONG *lens;
+	CK_BYTE *tags; // written when tagging.
+	const CK_BYTE *expected; // read when verifying.
+	CK_RV *results;
+	atomic_ulong nextSlice;
+	atomic_ullong failed;
+	atomic_ulong error; // first CK_RV that was not CKR_OK.
+} MacRun;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+CK_ULONG macTagLength(CK_MECHANISM_TYPE mechanism)
+{
+	switch(mechanism)
+	{
+		case CKM_SHA256_HMAC: return 32;
+		case CKM_AES_CMAC: return 16;
+		default: return 0;
+	}
+}
+
+
+
+CK_RV macTag(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	const CK_BYTE *record, CK_ULONG len, CK_BYTE *tag)
+{
+	CK_MECHANISM mech = {mechanism, NULL, 0};
+	CK_ULONG tagLen = macTagLength(mechanism);
+	CK_RV rv = (tagLen>0) ? p11->C_SignInit(hSession, &mech, hKey) : CKR_MECHANISM_INVALID;
+
+	if(rv==CKR_OK)
+		rv = p11->C_Sign(hSession, (CK_BYTE*)record, len, tag, &tagLen);
+	if(rv==CKR_OK && tagLen!=macTagLength(mechanism))
+		rv = CKR_GENERAL_ERROR;
+	return rv;
+}
+
+
+
+CK_RV macVerify(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	const CK_BYTE *record, CK_ULONG len, const CK_BYTE *tag)
+{
+	CK_MECHANISM mech = {mechanism, NULL, 0};
+	CK_ULONG tagLen = macTagLength(mechanism);
+	CK_RV rv = (tagLen>0) ? p11->C_VerifyInit(hSession, &mech, hKey) : CKR_MECHANISM_INVALID;
+
+	if(rv==CKR_OK)
+		rv = p11->C_Verify(hSession, (CK_BYTE*)record, len, (CK_BYTE*)tag, tagLen);
+	return rv;
+}
+
+
+
+static void *workerMain(void *arg)
+{
+	MacRun *run = (MacRun*)arg;
+	PooledSession *session = NULL;
+	unsigned long first = 0, last = 0;
+	CK_RV rv = sessionPoolAcquire(run->pool, &session);
+
+	while(rv==CKR_OK && atomic_load(&run->error)==CKR_OK)
+	{
+		first = atomic_fetch_add(&run->nextSlice, 1) * MAC_SLICE_RECORDS;
+		if(first>=run->count)
+			break;
+		last = (run->count - first>MAC_SLICE_RECORDS) ? first + MAC_SLICE_RECORDS : run->count;
+		for(unsigned long ctr=first; ctr<last && rv==CKR_OK; ctr++)
+		{
+			if(run->tags!=NULL)
+			{
+				rv = macTag(run->p11, session->hSession, run->mechanism, run->hKey, run->records[ctr], run->lens[ctr],
+					run->tags + ctr * run->tagLen);
+				continue;
+			}
+			rv = macVerify(run->p11, session->hSession, run->mechanism, run->hKey, run->records[ctr], run->lens[ctr],
+				run->expected + ctr * run->tagLen);
+			if(run->results!=NULL)
+				run->results[ctr] = rv;
+			if(rv==CKR_SIGNATURE_INVALID)
+			{
+				atomic_fetch_add(&run->failed, 1);
+				rv = CKR_OK;
+			}
+		}
+	}
+
+	if(session!=NULL)
+		sessionPoolRelease(run->pool, session, rv);
+	if(rv!=CKR_OK)
+	{
+		CK_ULONG expected = CKR_OK;
+		atomic_compare_exchange_strong(&run->error, &expected, rv);
+	}
+	return 0;
+}
+
+
+
+// Spreads the slices of run over nWorkers threads and waits for them.
+static CK_RV runBatch(MacRun *run, unsigned int nWorkers, MacBatchStats *stats)
+{
+	unsigned long slices = (run->count + MAC_SLICE_RECORDS - 1) / MAC_SLICE_RECORDS;
+	pthread_t *threads = NULL;
+	unsigned int started = 0;
+	double start = nowSeconds();
+
+	memset(stats, 0, sizeof(MacBatchStats));
+	if(run->tagLen==0)
+		return CKR_MECHANISM_INVALID;
+	if(run->count==0)
+		return CKR_OK;
+	atomic_init(&run->nextSlice, 0);
+	atomic_init(&run->failed, 0);
+	atomic_init(&run->error, CKR_OK);
+
+	if(nWorkers==0)
+		nWorkers = 1;
+	if(nWorkers>slices)
+		nWorkers = (unsigned int)slices;
+	threads = (pthread_t*)calloc(nWorkers, sizeof(pthread_t));
+	if(threads==NULL)
+		return CKR_HOST_MEMORY;
+	for(started=0; started<nWorkers; started++)
+		if(pthread_create(&threads[started], NULL, &workerMain, run)!=0)
+			break;
+	if(started==0)
+		atomic_store(&run->error, CKR_HOST_MEMORY);
+	for(unsigned int ctr=0; ctr<started; ctr++)
+		pthread_join(threads[ctr], NULL);
+	free(threads);
+
+	stats->seconds = nowSeconds() - start;
+	stats->workers = started;
+	stats->records = run->count;
+	stats->failed = atomic_load(&run->failed);
+	for(unsigned long ctr=0; ctr<run->count; ctr++)
+		stats->bytes += run->lens[ctr];
+	return atomic_load(&run->error);
+}
+
+
+
+CK_RV macTagBatch(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	unsigned long count, const CK_BYTE *const *records, const CK_ULONG *lens, CK_BYTE *tags, unsigned int nWorkers,
+	MacBatchStats *stats)
+{
+	MacRun run;
+
+	memset(&run, 0, sizeof(run));
+	run.p11 = p11;
+	run.pool = pool;
+	run.mechanism = mechanism;
+	run.hKey = hKey;
+	run.tagLen = macTagLength(mechanism);
+	run.count = count;
+	run.records = records;
+	run.lens = lens;
+	run.tags = tags;
+	return runBatch(&run, nWorkers, stats);
+}
+
+
+
+CK_RV macVerifyBatch(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	unsigned long count, const CK_BYTE *const *records, const CK_ULONG *lens, const CK_BYTE *tags, CK_RV *results,
+	unsigned int nWorkers, MacBatchStats *stats)
+{
+	MacRun run;
+
+	memset(&run, 0, sizeof(run));
+	run.p11 = p11;
+	run.pool = pool;
+	run.mechanism = mechanism;
+	run.hKey = hKey;
+	run.tagLen = macTagLength(mechanism);
+	run.count = count;
+	run.records = records;
+	run.lens = lens;
+	run.expected = tags;
+	run.results = results;
+	return runBatch(&run, nWorkers, stats);
+}
+
+
+
+void macPrintStats(FILE *out, const char *what, const MacBatchStats *stats)
+{
+	double seconds = (stats->seconds>0) ? stats->seconds : 1e-9;
+
+	fprintf(out, "  --> %llu records %s by %u workers in %.3f s : %.0f tags/sec, %.2f MB/s", stats->records, what,
+		stats->workers, stats->seconds, stats->records / seconds, stats->bytes / seconds / (1024*1024));
+	if(stats->failed>0)
+		fprintf(out, ", %llu failed", stats->failed);
+	fprintf(out, ".\n");
+}
@@ -0,0 +1,78 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Tags and verifies many short records, such as the lines of a log, with CKM_SHA256_HMAC or CKM_AES_CMAC.
+	- The cost of a short record is the round trip, not the bytes, so everything that can be done once is : each
+	  worker thread holds one pooled session for the whole batch, and the tag length is known from the mechanism,
+	  so a record costs exactly C_SignInit + C_Sign (or C_VerifyInit + C_Verify), without a length query.
+	- Workers take the next slice of MAC_SLICE_RECORDS records from a shared counter, and write the tags at the
+	  index of their record, so the tags come out in record order whatever the completion order.
+	- A record whose tag does not verify is a result, not an error : it is reported in the results array and
+	  counted, and the batch goes on.
+	- Inputs too large to hold in memory are MACed with the multi-part C_SignUpdate of common/file_sign.c.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_MAC_ENGINE_H
+#define LUNA_SAMPLES_MAC_ENGINE_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+
+
+#define MAC_MAX_TAG 32
+#define MAC_SLICE_RECORDS 64 // records a worker takes at once.
+
+
+// Activity of one batch.
+typedef struct
+{
+	unsigned long long records;
+	unsigned long long failed; // records whose tag did not verify.
+	unsigned long long bytes;
+	unsigned int workers;
+	double seconds;
+} MacBatchStats;
+
+
+// Length of the tags of a mechanism : 32 for CKM_SHA256_HMAC, 16 for CKM_AES_CMAC, 0 if it is not supported.
+CK_ULONG macTagLength(CK_MECHANISM_TYPE mechanism);
+
+// Tags one record with one session. tag must hold macTagLength(mechanism) bytes.
+CK_RV macTag(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	const CK_BYTE *record, CK_ULONG len, CK_BYTE *tag);
+
+// Verifies the tag of one record. Returns CKR_SIGNATURE_INVALID if it does not match.
+CK_RV macVerify(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	const CK_BYTE *record, CK_ULONG len, const CK_BYTE *tag);
+
+// Tags count records over nWorkers threads. The tag of record n is written at tags + n * macTagLength(mechanism).
+// Returns the first error of a worker; tags of the records that were not reached are left as they were.
+CK_RV macTagBatch(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	unsigned long count, const CK_BYTE *const *records, const CK_ULONG *lens, CK_BYTE *tags, unsigned int nWorkers,
+	MacBatchStats *stats);
+
+// Verifies count records against tags laid out as macTagBatch writes them. results (which may be NULL) receives
+// CKR_OK or CKR_SIGNATURE_INVALID per record, and stats->failed counts the latter. Any other error stops the batch.
+CK_RV macVerifyBatch(CK_FUNCTION_LIST *p11, SessionPool *pool, CK_MECHANISM_TYPE mechanism, CK_OBJECT_HANDLE hKey,
+	unsigned long count, const CK_BYTE *const *records, const CK_ULONG *lens, const CK_BYTE *tags, CK_RV *results,
+	unsigned int nWorkers, MacBatchStats *stats);
+
+// Prints the stats as one line, with tags/sec and MB/s. what names the operation ("tagged", "verified").
+void macPrintStats(FILE *out, const char *what, const MacBatchStats *stats);
+
+#endif
@@ -0,0 +1,919 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the public-key cache declared in pubkey_cache.h.
+	- The cache is a small array searched linearly under a mutex, evicting the least recently used key. Entries hold
+	  a reference on their EVP_PKEY, and every operation takes its own reference, so a key evicted while in use by
+	  another thread stays valid until that thread is done with it.
+	- A key that cannot be used on the host (another key type, unknown curve, attributes that could not be read) is
+	  cached as such for PUBKEY_RETRY_SECONDS, so later operations go straight to the HSM; its attributes are read
+	  again once that time is up, so a transient failure does not send the key to the HSM for good.
+	- pubKeyVerify parks the verifier it used in the entry of the key, and the next call with the same mechanism
+	  takes it back : the fetched digest and the verification context are set up once per key, not per signature.
+	  A thread finding the parked verifier taken builds its own, which is parked or freed when it is done.
+	- Attributes are read outside the lock; two threads missing on the same key at once both read it, and the
+	  second one inserted replaces the first.
+	- The host side needs OpenSSL 3.0 or later and is only compiled with HOST_CRYPTO defined (make HOST_CRYPTO=1).
+	  Without it a cache is always created with local set to 0, and every operation goes to the HSM.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#ifdef HOST_CRYPTO
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/objects.h>
+#include <openssl/asn1.h>
+#include <openssl/param_build.h>
+#include <openssl/core_names.h>
+#endif
+#include "pubkey_cache.h"
+
+
+#define PUBKEY_MAX_MODULUS 1024 // 8192 bit RSA.
+#define PUBKEY_MAX_EC 256 // DER curve OID, or DER wrapped EC point.
+#define PUBKEY_MAX_ECDSA_DER 160 // ECDSA-Sig-Value of P-521.
+#define PUBKEY_RETRY_SECONDS 60 // how long a key is left to the HSM before its attributes are read again.
+
+
+typedef struct
+{
+	CK_OBJECT_HANDLE handle;
+	int used; // 0 for a free entry.
+#ifdef HOST_CRYPTO
+	EVP_PKEY *pkey; // NULL if the key can only be used on the HSM.
+	PubKeyVerifier *idle; // parked by pubKeyVerify, NULL if none or in use.
+	time_t retryAt; // when pkey is NULL, time after which the attributes are read again.
+#endif
+	unsigned long long lastUsed;
+} PubKeyEntry;
+
+
+struct PubKeyCache
+{
+	CK_FUNCTION_LIST *p11;
+	PubKeyEntry *entries;
+	unsigned int capacity;
+	int local;
+	unsigned long long clock;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	atomic_ulong localOps;
+	atomic_ulong hsmOps;
+	pthread_mutex_t lock;
+};
+
+
+#ifdef HOST_CRYPTO
+// What a verification mechanism does : the hash applied to the data first (NULL when the data is the input of the
+// signature primitive), and the padding.
+typedef struct
+{
+	int keyType; // EVP_PKEY_RSA, EVP_PKEY_EC, or EVP_PKEY_ED25519 for both Edwards curves.
+	int padding; // RSA_PKCS1_PADDING or RSA_PKCS1_PSS_PADDING for RSA.
+	const EVP_MD *dataHash;
+} VerifyPlan;
+
+
+struct PubKeyVerifier
+{
+	PubKeyCache *cache;
+	EVP_PKEY *pkey;
+	EVP_PKEY_CTX *ctx; // initialized once, used for every signature.
+	EVP_MD_CTX *edTemplate; // EdDSA only, which OpenSSL 3.0 verifies through EVP_DigestVerify : initialized once,
+	EVP_MD_CTX *edCtx; // and copied into edCtx for every signature, since an EdDSA context takes one message.
+	VerifyPlan plan;
+	EVP_MD *dataHash; // fetched once; NULL when the data is not hashed.
+	EVP_MD_CTX *hashCtx;
+	CK_ULONG signatureLen; // the only length accepted.
+	CK_OBJECT_HANDLE handle;
+	CK_MECHANISM_TYPE mechanism; // with its parameters, what a parked verifier can be reused for.
+	CK_BYTE parameter[sizeof(CK_RSA_PKCS_PSS_PARAMS)];
+	CK_ULONG parameterLen;
+	int reusable; // 0 if the parameters did not fit, and the verifier cannot be parked.
+};
+#endif
+
+
+
+PubKeyCache *pubKeyCacheCreate(CK_FUNCTION_LIST *p11, unsigned int capacity, int local, CK_RV *rv)
+{
+	PubKeyCache *cache = (PubKeyCache*)calloc(1, sizeof(PubKeyCache));
+
+	*rv = CKR_HOST_MEMORY;
+	if(cache==NULL)
+		return NULL;
+	if(capacity==0)
+		capacity = 1;
+	cache->entries = (PubKeyEntry*)calloc(capacity, sizeof(PubKeyEntry));
+	if(cache->entries==NULL)
+	{
+		free(cache);
+		return NULL;
+	}
+	cache->p11 = p11;
+	cache->capacity = capacity;
+#ifdef HOST_CRYPTO
+	cache->local = local;
+#else
+	(void)local;
+	cache->local = 0; // built without OpenSSL.
+#endif
+	atomic_init(&cache->localOps, 0);
+	atomic_init(&cache->hsmOps, 0);
+	pthread_mutex_init(&cache->lock, NULL);
+	*rv = CKR_OK;
+	return cache;
+}
+
+
+
+void pubKeyCacheGetStats(PubKeyCache *cache, PubKeyCacheStats *stats)
+{
+	memset(stats, 0, sizeof(PubKeyCacheStats));
+	pthread_mutex_lock(&cache->lock);
+	stats->hits = cache->hits;
+	stats->misses = cache->misses;
+	stats->evictions = cache->evictions;
+	stats->capacity = cache->capacity;
+	stats->local = cache->local;
+	for(unsigned int ctr=0; ctr<cache->capacity; ctr++)
+		if(cache->entries[ctr].used)
+			stats->entries++;
+	pthread_mutex_unlock(&cache->lock);
+	stats->localOps = atomic_load(&cache->localOps);
+	stats->hsmOps = atomic_load(&cache->hsmOps);
+}
+
+
+
+// Releases what an entry holds and marks it free.
+static void clearEntry(PubKeyEntry *entry)
+{
+#ifdef HOST_CRYPTO
+	pubKeyVerifierFree(entry->idle);
+	EVP_PKEY_free(entry->pkey);
+#endif
+	memset(entry, 0, sizeof(PubKeyEntry));
+}
+
+
+
+void pubKeyCacheForget(PubKeyCache *cache, CK_OBJECT_HANDLE hPublic)
+{
+	pthread_mutex_lock(&cache->lock);
+	for(unsigned int ctr=0; ctr<cache->capacity; ctr++)
+	{
+		PubKeyEntry *entry = &cache->entries[ctr];
+		if(entry->used && entry->handle==hPublic)
+		{
+			clearEntry(entry);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+
+
+void pubKeyCacheDestroy(PubKeyCache *cache)
+{
+	if(cache==NULL)
+		return;
+	for(unsigned int ctr=0; ctr<cache->capacity; ctr++)
+		clearEntry(&cache->entries[ctr]);
+	free(cache->entries);
+	pthread_mutex_destroy(&cache->lock);
+	free(cache);
+}
+
+
+
+// C_Encrypt on the HSM. A size query, or a buffer too small, leaves a PKCS#11 operation active : it is finished
+// into a scratch buffer so the session can take the next one.
+static CK_RV hsmEncrypt(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	CK_FUNCTION_LIST *p11 = cache->p11;
+	CK_BYTE *scratch = NULL;
+	CK_ULONG scratchLen = 0;
+	CK_RV rv = p11->C_EncryptInit(hSession, mech, hPublic);
+
+	atomic_fetch_add(&cache->hsmOps, 1);
+	if(rv==CKR_OK)
+		rv = p11->C_Encrypt(hSession, (CK_BYTE*)in, inLen, out, outLen);
+	if((rv==CKR_OK && out==NULL) || rv==CKR_BUFFER_TOO_SMALL)
+	{
+		scratchLen = *outLen;
+		scratch = (CK_BYTE*)malloc(scratchLen);
+		if(scratch!=NULL)
+			p11->C_Encrypt(hSession, (CK_BYTE*)in, inLen, scratch, &scratchLen);
+		free(scratch);
+	}
+	return rv;
+}
+
+
+
+#ifdef HOST_CRYPTO
+// Builds an EVP_PKEY from OpenSSL parameters of the given type ("RSA" or "EC").
+static EVP_PKEY *keyFromParams(const char *type, OSSL_PARAM_BLD *build)
+{
+	OSSL_PARAM *params = OSSL_PARAM_BLD_to_param(build);
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_name(NULL, type, NULL);
+	EVP_PKEY *pkey = NULL;
+
+	if(params==NULL || ctx==NULL || EVP_PKEY_fromdata_init(ctx)<=0
+		|| EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params)<=0)
+		pkey = NULL;
+	EVP_PKEY_CTX_free(ctx);
+	OSSL_PARAM_free(params);
+	return pkey;
+}
+
+
+
+static EVP_PKEY *readRsaKey(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPublic)
+{
+	CK_BYTE modulus[PUBKEY_MAX_MODULUS];
+	CK_BYTE exponent[16];
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_MODULUS,		modulus,	sizeof(modulus)},
+		{CKA_PUBLIC_EXPONENT,	exponent,	sizeof(exponent)}
+	};
+	OSSL_PARAM_BLD *build = NULL;
+	BIGNUM *n = NULL, *e = NULL;
+	EVP_PKEY *pkey = NULL;
+
+	if(p11->C_GetAttributeValue(hSession, hPublic, attrib, 2)!=CKR_OK)
+		return NULL;
+	n = BN_bin2bn(modulus, (int)attrib[0].ulValueLen, NULL);
+	e = BN_bin2bn(exponent, (int)attrib[1].ulValueLen, NULL);
+	build = OSSL_PARAM_BLD_new();
+	if(n!=NULL && e!=NULL && build!=NULL
+		&& OSSL_PARAM_BLD_push_BN(build, OSSL_PKEY_PARAM_RSA_N, n)
+		&& OSSL_PARAM_BLD_push_BN(build, OSSL_PKEY_PARAM_RSA_E, e))
+		pkey = keyFromParams("RSA", build);
+	OSSL_PARAM_BLD_free(build);
+	BN_free(n);
+	BN_free(e);
+	return pkey;
+}
+
+
+
+// CKA_EC_PARAMS holds the DER OID of a named curve, and CKA_EC_POINT the point wrapped in a DER OCTET STRING (some
+// tokens return the bare point, which is accepted too).
+static EVP_PKEY *readEcKey(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPublic)
+{
+	CK_BYTE ecParams[PUBKEY_MAX_EC];
+	CK_BYTE ecPoint[PUBKEY_MAX_EC];
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_EC_PARAMS,	ecParams,	sizeof(ecParams)},
+		{CKA_EC_POINT,	ecPoint,	sizeof(ecPoint)}
+	};
+	const unsigned char *cursor = NULL;
+	const unsigned char *point = ecPoint;
+	size_t pointLen = 0;
+	ASN1_OBJECT *oid = NULL;
+	ASN1_OCTET_STRING *wrapped = NULL;
+	const char *curve = NULL;
+	OSSL_PARAM_BLD *build = NULL;
+	EVP_PKEY *pkey = NULL;
+
+	if(p11->C_GetAttributeValue(hSession, hPublic, attrib, 2)!=CKR_OK)
+		return NULL;
+	cursor = ecParams;
+	oid = d2i_ASN1_OBJECT(NULL, &cursor, (long)attrib[0].ulValueLen);
+	if(oid!=NULL && OBJ_obj2nid(oid)!=NID_undef)
+		curve = OBJ_nid2sn(OBJ_obj2nid(oid));
+	pointLen = attrib[1].ulValueLen;
+	cursor = ecPoint;
+	wrapped = d2i_ASN1_OCTET_STRING(NULL, &cursor, (long)attrib[1].ulValueLen);
+	if(wrapped!=NULL && cursor==ecPoint + attrib[1].ulValueLen)
+	{
+		point = ASN1_STRING_get0_data(wrapped);
+		pointLen = (size_t)ASN1_STRING_length(wrapped);
+	}
+
+	build = OSSL_PARAM_BLD_new();
+	if(curve!=NULL && build!=NULL
+		&& OSSL_PARAM_BLD_push_utf8_string(build, OSSL_PKEY_PARAM_GROUP_NAME, curve, 0)
+		&& OSSL_PARAM_BLD_push_octet_string(build, OSSL_PKEY_PARAM_PUB_KEY, point, pointLen))
+		pkey = keyFromParams("EC", build);
+	OSSL_PARAM_BLD_free(build);
+	ASN1_OCTET_STRING_free(wrapped);
+	ASN1_OBJECT_free(oid);
+	return pkey;
+}
+
+
+
+// CKA_EC_PARAMS of an Edwards key is the DER OID of Ed25519 or Ed448 (or the Luna OID of Ed25519), or a
+// PrintableString naming the curve; CKA_EC_POINT is the raw public key, wrapped in a DER OCTET STRING or bare.
+static EVP_PKEY *readEdwardsKey(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPublic)
+{
+	static const CK_BYTE lunaEd25519[] = {0x06, 0x09, 0x2B, 0x06, 0x01, 0x04, 0x01, 0xDA, 0x47, 0x0F, 0x01};
+	CK_BYTE ecParams[PUBKEY_MAX_EC];
+	CK_BYTE ecPoint[PUBKEY_MAX_EC];
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_EC_PARAMS,	ecParams,	sizeof(ecParams)},
+		{CKA_EC_POINT,	ecPoint,	sizeof(ecPoint)}
+	};
+	const unsigned char *cursor = NULL;
+	const unsigned char *point = ecPoint;
+	size_t pointLen = 0;
+	ASN1_OBJECT *oid = NULL;
+	ASN1_OCTET_STRING *wrapped = NULL;
+	int type = EVP_PKEY_NONE;
+	EVP_PKEY *pkey = NULL;
+
+	if(p11->C_GetAttributeValue(hSession, hPublic, attrib, 2)!=CKR_OK)
+		return NULL;
+	if(attrib[0].ulValueLen==sizeof(lunaEd25519) && memcmp(ecParams, lunaEd25519, sizeof(lunaEd25519))==0)
+		type = EVP_PKEY_ED25519;
+	else if(attrib[0].ulValueLen>2 && ecParams[0]==0x13 && ecParams[1]==attrib[0].ulValueLen - 2)
+	{
+		if(ecParams[1]==12 && memcmp(ecParams + 2, "edwards25519", 12)==0)
+			type = EVP_PKEY_ED25519;
+		else if(ecParams[1]==10 && memcmp(ecParams + 2, "edwards448", 10)==0)
+			type = EVP_PKEY_ED448;
+	}
+	else
+	{
+		cursor = ecParams;
+		oid = d2i_ASN1_OBJECT(NULL, &cursor, (long)attrib[0].ulValueLen);
+		if(oid!=NULL && OBJ_obj2nid(oid)==NID_ED25519)
+			type = EVP_PKEY_ED25519;
+		else if(oid!=NULL && OBJ_obj2nid(oid)==NID_ED448)
+			type = EVP_PKEY_ED448;
+		ASN1_OBJECT_free(oid);
+	}
+	pointLen = attrib[1].ulValueLen;
+	cursor = ecPoint;
+	wrapped = d2i_ASN1_OCTET_STRING(NULL, &cursor, (long)attrib[1].ulValueLen);
+	if(wrapped!=NULL && cursor==ecPoint + attrib[1].ulValueLen)
+	{
+		point = ASN1_STRING_get0_data(wrapped);
+		pointLen = (size_t)ASN1_STRING_length(wrapped);
+	}
+	if(type!=EVP_PKEY_NONE)
+		pkey = EVP_PKEY_new_raw_public_key(type, NULL, point, pointLen);
+	ASN1_OCTET_STRING_free(wrapped);
+	return pkey;
+}
+
+
+
+// Reads a public key from the token. NULL if it is not an RSA, EC or Edwards key OpenSSL can use.
+static EVP_PKEY *readKey(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPublic)
+{
+	CK_KEY_TYPE keyType = 0;
+	CK_ATTRIBUTE attrib = {CKA_KEY_TYPE, &keyType, sizeof(keyType)};
+
+	if(p11->C_GetAttributeValue(hSession, hPublic, &attrib, 1)!=CKR_OK)
+		return NULL;
+	if(keyType==CKK_RSA)
+		return readRsaKey(p11, hSession, hPublic);
+	if(keyType==CKK_EC)
+		return readEcKey(p11, hSession, hPublic);
+	if(keyType==CKK_EC_EDWARDS)
+		return readEdwardsKey(p11, hSession, hPublic);
+	return NULL;
+}
+
+
+
+// Returns a new reference on the key of hPublic, reading it on a miss. NULL means the HSM must do the operation.
+static EVP_PKEY *acquireKey(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hPublic)
+{
+	PubKeyEntry *victim = NULL;
+	EVP_PKEY *pkey = NULL;
+	time_t now = time(NULL);
+	int found = 0;
+
+	if(!cache->local)
+		return NULL;
+	pthread_mutex_lock(&cache->lock);
+	for(unsigned int ctr=0; ctr<cache->capacity && !found; ctr++)
+	{
+		PubKeyEntry *entry = &cache->entries[ctr];
+		if(entry->used && entry->handle==hPublic && (entry->pkey!=NULL || now<entry->retryAt))
+		{
+			pkey = entry->pkey;
+			if(pkey!=NULL)
+				EVP_PKEY_up_ref(pkey);
+			entry->lastUsed = ++cache->clock;
+			found = 1;
+		}
+	}
+	if(found)
+		cache->hits++;
+	else
+		cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+	if(found)
+		return pkey;
+
+	pkey = readKey(cache->p11, hSession, hPublic);
+
+	pthread_mutex_lock(&cache->lock);
+	for(unsigned int ctr=0; ctr<cache->capacity; ctr++)
+	{
+		PubKeyEntry *entry = &cache->entries[ctr];
+		if(!entry->used || entry->handle==hPublic)
+		{
+			victim = entry;
+			break;
+		}
+		if(victim==NULL || entry->lastUsed<victim->lastUsed)
+			victim = entry;
+	}
+	if(victim->used && victim->handle!=hPublic)
+		cache->evictions++;
+	clearEntry(victim);
+	victim->handle = hPublic;
+	victim->used = 1;
+	victim->pkey = pkey;
+	if(pkey!=NULL)
+		EVP_PKEY_up_ref(pkey);
+	else
+		victim->retryAt = now + PUBKEY_RETRY_SECONDS;
+	victim->lastUsed = ++cache->clock;
+	pthread_mutex_unlock(&cache->lock);
+	return pkey;
+}
+
+
+
+static const EVP_MD *digestOf(CK_MECHANISM_TYPE hashAlg)
+{
+	switch(hashAlg)
+	{
+		case CKM_SHA_1: return EVP_sha1();
+		case CKM_SHA224: return EVP_sha224();
+		case CKM_SHA256: return EVP_sha256();
+		case CKM_SHA384: return EVP_sha384();
+		case CKM_SHA512: return EVP_sha512();
+	}
+	return NULL;
+}
+
+
+
+static const EVP_MD *mgfDigestOf(CK_RSA_PKCS_MGF_TYPE mgf)
+{
+	switch(mgf)
+	{
+		case CKG_MGF1_SHA1: return EVP_sha1();
+		case CKG_MGF1_SHA224: return EVP_sha224();
+		case CKG_MGF1_SHA256: return EVP_sha256();
+		case CKG_MGF1_SHA384: return EVP_sha384();
+		case CKG_MGF1_SHA512: return EVP_sha512();
+	}
+	return NULL;
+}
+
+
+
+// Fills plan for a verification mechanism. Returns 0 if the mechanism is not done on the host.
+static int planVerify(CK_MECHANISM_TYPE mechanism, VerifyPlan *plan)
+{
+	memset(plan, 0, sizeof(VerifyPlan));
+	plan->keyType = EVP_PKEY_RSA;
+	plan->padding = RSA_PKCS1_PADDING;
+	switch(mechanism)
+	{
+		case CKM_RSA_PKCS: return 1;
+		case CKM_SHA1_RSA_PKCS: plan->dataHash = EVP_sha1(); return 1;
+		case CKM_SHA224_RSA_PKCS: plan->dataHash = EVP_sha224(); return 1;
+		case CKM_SHA256_RSA_PKCS: plan->dataHash = EVP_sha256(); return 1;
+		case CKM_SHA384_RSA_PKCS: plan->dataHash = EVP_sha384(); return 1;
+		case CKM_SHA512_RSA_PKCS: plan->dataHash = EVP_sha512(); return 1;
+	}
+	plan->padding = RSA_PKCS1_PSS_PADDING;
+	switch(mechanism)
+	{
+		case CKM_RSA_PKCS_PSS: return 1;
+		case CKM_SHA1_RSA_PKCS_PSS: plan->dataHash = EVP_sha1(); return 1;
+		case CKM_SHA224_RSA_PKCS_PSS: plan->dataHash = EVP_sha224(); return 1;
+		case CKM_SHA256_RSA_PKCS_PSS: plan->dataHash = EVP_sha256(); return 1;
+		case CKM_SHA384_RSA_PKCS_PSS: plan->dataHash = EVP_sha384(); return 1;
+		case CKM_SHA512_RSA_PKCS_PSS: plan->dataHash = EVP_sha512(); return 1;
+	}
+	plan->keyType = EVP_PKEY_EC;
+	plan->padding = 0;
+	switch(mechanism)
+	{
+		case CKM_ECDSA: return 1;
+		case CKM_ECDSA_SHA1: plan->dataHash = EVP_sha1(); return 1;
+		case CKM_ECDSA_SHA224: plan->dataHash = EVP_sha224(); return 1;
+		case CKM_ECDSA_SHA256: plan->dataHash = EVP_sha256(); return 1;
+		case CKM_ECDSA_SHA384: plan->dataHash = EVP_sha384(); return 1;
+		case CKM_ECDSA_SHA512: plan->dataHash = EVP_sha512(); return 1;
+	}
+	plan->keyType = EVP_PKEY_ED25519;
+	return mechanism==CKM_EDDSA; // the curve comes from the key, and EdDSA hashes the data itself.
+}
+
+
+
+// Sets up ctx for RSA encryption with the padding of mech. Returns 0 if OpenSSL cannot do it.
+static int setupEncrypt(EVP_PKEY_CTX *ctx, const CK_MECHANISM *mech)
+{
+	const CK_RSA_PKCS_OAEP_PARAMS *oaep = (const CK_RSA_PKCS_OAEP_PARAMS*)mech->pParameter;
+	const EVP_MD *hash = NULL;
+	const EVP_MD *mgf = NULL;
+	unsigned char *label = NULL;
+
+	if(EVP_PKEY_encrypt_init(ctx)<=0)
+		return 0;
+	if(mech->mechanism==CKM_RSA_PKCS)
+		return EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_PADDING)>0;
+
+	if(oaep==NULL || mech->ulParameterLen!=sizeof(CK_RSA_PKCS_OAEP_PARAMS))
+		return 0;
+	hash = digestOf(oaep->hashAlg);
+	mgf = mgfDigestOf(oaep->mgf);
+	if(hash==NULL || mgf==NULL || (oaep->source!=CKZ_DATA_SPECIFIED && oaep->ulSourceDataLen>0))
+		return 0;
+	if(EVP_PKEY_CTX_set_rsa_padding(ctx, RSA_PKCS1_OAEP_PADDING)<=0
+		|| EVP_PKEY_CTX_set_rsa_oaep_md(ctx, hash)<=0
+		|| EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, mgf)<=0)
+		return 0;
+	if(oaep->ulSourceDataLen==0)
+		return 1;
+	label = (unsigned char*)OPENSSL_memdup(oaep->pSourceData, oaep->ulSourceDataLen); // owned by ctx from here.
+	if(label==NULL || EVP_PKEY_CTX_set0_rsa_oaep_label(ctx, label, (int)oaep->ulSourceDataLen)<=0)
+	{
+		OPENSSL_free(label);
+		return 0;
+	}
+	return 1;
+}
+
+
+
+CK_RV pubKeyEncrypt(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *ctx = NULL;
+	CK_BYTE *result = NULL;
+	size_t resultLen = 0;
+	CK_RV rv = CKR_OK;
+
+	if(mech->mechanism==CKM_RSA_PKCS || mech->mechanism==CKM_RSA_PKCS_OAEP)
+		pkey = acquireKey(cache, hSession, hPublic);
+	if(pkey!=NULL && EVP_PKEY_get_base_id(pkey)==EVP_PKEY_RSA)
+		ctx = EVP_PKEY_CTX_new(pkey, NULL);
+	if(ctx==NULL || !setupEncrypt(ctx, mech))
+	{
+		EVP_PKEY_CTX_free(ctx);
+		EVP_PKEY_free(pkey);
+		return hsmEncrypt(cache, hSession, mech, hPublic, in, inLen, out, outLen);
+	}
+
+	atomic_fetch_add(&cache->localOps, 1);
+	resultLen = (size_t)EVP_PKEY_get_size(pkey);
+	if(out==NULL)
+		*outLen = (CK_ULONG)resultLen;
+	else if(*outLen<resultLen)
+	{
+		*outLen = (CK_ULONG)resultLen;
+		rv = CKR_BUFFER_TOO_SMALL;
+	}
+	else
+	{
+		result = (CK_BYTE*)malloc(resultLen); // out may be short of a full modulus while the result is not.
+		if(result==NULL)
+			rv = CKR_HOST_MEMORY;
+		else if(EVP_PKEY_encrypt(ctx, result, &resultLen, in, inLen)<=0)
+			rv = CKR_DATA_LEN_RANGE;
+		else
+		{
+			memcpy(out, result, resultLen);
+			*outLen = (CK_ULONG)resultLen;
+		}
+		free(result);
+	}
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(pkey);
+	return rv;
+}
+
+
+
+// Sets up ctx for an RSA verification of a hash, with the signature hash and padding of plan and mech.
+static int setupRsaVerify(EVP_PKEY_CTX *ctx, const VerifyPlan *plan, const CK_MECHANISM *mech)
+{
+	const CK_RSA_PKCS_PSS_PARAMS *pss = (const CK_RSA_PKCS_PSS_PARAMS*)mech->pParameter;
+	const EVP_MD *hash = plan->dataHash;
+	const EVP_MD *mgf = NULL;
+
+	if(EVP_PKEY_CTX_set_rsa_padding(ctx, plan->padding)<=0)
+		return 0;
+	if(plan->padding==RSA_PKCS1_PADDING)
+		return hash==NULL || EVP_PKEY_CTX_set_signature_md(ctx, hash)>0;
+
+	if(pss==NULL || mech->ulParameterLen!=sizeof(CK_RSA_PKCS_PSS_PARAMS))
+		return 0;
+	if(hash==NULL)
+		hash = digestOf(pss->hashAlg);
+	mgf = mgfDigestOf(pss->mgf);
+	return hash!=NULL && mgf!=NULL && digestOf(pss->hashAlg)==hash
+		&& EVP_PKEY_CTX_set_signature_md(ctx, hash)>0
+		&& EVP_PKEY_CTX_set_rsa_mgf1_md(ctx, mgf)>0
+		&& EVP_PKEY_CTX_set_rsa_pss_saltlen(ctx, (int)pss->usSaltLen)>0;
+}
+
+
+
+PubKeyVerifier *pubKeyVerifierCreate(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hPublic, CK_RV *rv)
+{
+	PubKeyVerifier *verifier = NULL;
+	VerifyPlan plan;
+	EVP_PKEY *pkey = NULL;
+	int usable = 0;
+
+	*rv = CKR_MECHANISM_INVALID;
+	if(!planVerify(mech->mechanism, &plan) || (plan.keyType==EVP_PKEY_ED25519 && mech->pParameter!=NULL)
+		|| (pkey = acquireKey(cache, hSession, hPublic))==NULL)
+		return NULL; // Ed25519ph / Ed25519ctx (CK_EDDSA_PARAMS) are left to the HSM.
+	verifier = (PubKeyVerifier*)calloc(1, sizeof(PubKeyVerifier));
+	if(verifier==NULL)
+	{
+		EVP_PKEY_free(pkey);
+		*rv = CKR_HOST_MEMORY;
+		return NULL;
+	}
+	verifier->cache = cache;
+	verifier->pkey = pkey;
+	verifier->plan = plan;
+	verifier->handle = hPublic;
+	verifier->mechanism = mech->mechanism;
+	verifier->reusable = mech->ulParameterLen<=sizeof(verifier->parameter);
+	if(verifier->reusable && mech->ulParameterLen>0)
+	{
+		memcpy(verifier->parameter, mech->pParameter, mech->ulParameterLen);
+		verifier->parameterLen = mech->ulParameterLen;
+	}
+	if(plan.dataHash!=NULL)
+	{
+		// An explicitly fetched digest skips the implicit provider lookup OpenSSL 3 does on every EVP_Digest.
+		verifier->dataHash = EVP_MD_fetch(NULL, EVP_MD_get0_name(plan.dataHash), NULL);
+		verifier->hashCtx = EVP_MD_CTX_new();
+	}
+	if(plan.keyType==EVP_PKEY_ED25519)
+		usable = (EVP_PKEY_get_base_id(pkey)==EVP_PKEY_ED25519 || EVP_PKEY_get_base_id(pkey)==EVP_PKEY_ED448)
+			&& (verifier->edTemplate = EVP_MD_CTX_new())!=NULL && (verifier->edCtx = EVP_MD_CTX_new())!=NULL
+			&& EVP_DigestVerifyInit_ex(verifier->edTemplate, NULL, NULL, NULL, NULL, pkey, NULL)==1;
+	else if(EVP_PKEY_get_base_id(pkey)==plan.keyType && (plan.dataHash==NULL || (verifier->dataHash!=NULL && verifier->hashCtx!=NULL))
+		&& (verifier->ctx = EVP_PKEY_CTX_new(pkey, NULL))!=NULL && EVP_PKEY_verify_init(verifier->ctx)>0)
+		usable = (plan.keyType==EVP_PKEY_EC) || setupRsaVerify(verifier->ctx, &plan, mech);
+	if(!usable)
+	{
+		pubKeyVerifierFree(verifier);
+		return NULL;
+	}
+	verifier->signatureLen = (plan.keyType==EVP_PKEY_EC) ? 2 * (CK_ULONG)((EVP_PKEY_get_bits(pkey) + 7) / 8)
+		: (CK_ULONG)EVP_PKEY_get_size(pkey);
+	*rv = CKR_OK;
+	return verifier;
+}
+
+
+
+void pubKeyVerifierFree(PubKeyVerifier *verifier)
+{
+	if(verifier==NULL)
+		return;
+	EVP_PKEY_CTX_free(verifier->ctx);
+	EVP_MD_CTX_free(verifier->edCtx);
+	EVP_MD_CTX_free(verifier->edTemplate);
+	EVP_MD_CTX_free(verifier->hashCtx);
+	EVP_MD_free(verifier->dataHash);
+	EVP_PKEY_free(verifier->pkey);
+	free(verifier);
+}
+
+
+
+// Appends the DER INTEGER of a big-endian unsigned number to der. Returns the bytes written.
+static size_t derInteger(const CK_BYTE *number, CK_ULONG len, unsigned char *der)
+{
+	size_t pos = 0;
+
+	while(len>1 && number[0]==0)
+	{
+		number++;
+		len--;
+	}
+	der[pos++] = 0x02;
+	der[pos++] = (unsigned char)(len + (number[0] & 0x80 ? 1 : 0));
+	if(number[0] & 0x80)
+		der[pos++] = 0;
+	memcpy(der + pos, number, len);
+	return pos + len;
+}
+
+
+
+// Turns an r || s signature into the DER ECDSA-Sig-Value OpenSSL verifies, without going through BIGNUMs.
+// der must hold PUBKEY_MAX_ECDSA_DER bytes. Returns its length.
+static size_t ecdsaToDer(const CK_BYTE *signature, CK_ULONG signatureLen, unsigned char *der)
+{
+	unsigned char body[PUBKEY_MAX_ECDSA_DER];
+	CK_ULONG half = signatureLen / 2;
+	size_t bodyLen = derInteger(signature, half, body);
+	size_t pos = 0;
+
+	bodyLen += derInteger(signature + half, half, body + bodyLen);
+	der[pos++] = 0x30;
+	if(bodyLen>=0x80)
+		der[pos++] = 0x81;
+	der[pos++] = (unsigned char)bodyLen;
+	memcpy(der + pos, body, bodyLen);
+	return pos + bodyLen;
+}
+
+
+
+CK_RV pubKeyVerifierRun(PubKeyVerifier *verifier, const CK_BYTE *data, CK_ULONG dataLen, const CK_BYTE *signature,
+	CK_ULONG signatureLen)
+{
+	unsigned char hash[EVP_MAX_MD_SIZE];
+	unsigned int hashLen = 0;
+	unsigned char der[PUBKEY_MAX_ECDSA_DER];
+	const unsigned char *tbs = data;
+	size_t tbsLen = dataLen;
+	int verified = 0;
+
+	atomic_fetch_add_explicit(&verifier->cache->localOps, 1, memory_order_relaxed);
+	if(signatureLen!=verifier->signatureLen)
+		return CKR_SIGNATURE_LEN_RANGE;
+	if(verifier->dataHash!=NULL)
+	{
+		if(EVP_DigestInit_ex(verifier->hashCtx, verifier->dataHash, NULL)!=1
+			|| EVP_DigestUpdate(verifier->hashCtx, data, dataLen)!=1
+			|| EVP_DigestFinal_ex(verifier->hashCtx, hash, &hashLen)!=1)
+			return CKR_FUNCTION_FAILED;
+		tbs = hash;
+		tbsLen = hashLen;
+	}
+	if(verifier->plan.keyType==EVP_PKEY_ED25519)
+		verified = EVP_MD_CTX_copy_ex(verifier->edCtx, verifier->edTemplate)==1
+			&& EVP_DigestVerify(verifier->edCtx, signature, signatureLen, data, dataLen)==1;
+	else if(verifier->plan.keyType==EVP_PKEY_EC)
+		verified = EVP_PKEY_verify(verifier->ctx, der, ecdsaToDer(signature, signatureLen, der), tbs, tbsLen);
+	else
+		verified = EVP_PKEY_verify(verifier->ctx, signature, signatureLen, tbs, tbsLen);
+	return (verified==1) ? CKR_OK : CKR_SIGNATURE_INVALID;
+}
+
+
+
+// Takes the verifier parked in the entry of hPublic if it was set up for mech. NULL if there is none.
+static PubKeyVerifier *takeVerifier(PubKeyCache *cache, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic)
+{
+	PubKeyVerifier *verifier = NULL;
+
+	pthread_mutex_lock(&cache->lock);
+	for(unsigned int ctr=0; ctr<cache->capacity && verifier==NULL; ctr++)
+	{
+		PubKeyEntry *entry = &cache->entries[ctr];
+		PubKeyVerifier *idle = entry->idle;
+		if(entry->used && entry->handle==hPublic && idle!=NULL && idle->mechanism==mech->mechanism
+			&& idle->parameterLen==mech->ulParameterLen
+			&& (mech->ulParameterLen==0 || memcmp(idle->parameter, mech->pParameter, mech->ulParameterLen)==0))
+		{
+			verifier = idle;
+			entry->idle = NULL;
+			entry->lastUsed = ++cache->clock;
+			cache->hits++;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return verifier;
+}
+
+
+
+// Parks a verifier of pubKeyVerify in the entry of its key, or frees it if the entry already has one or no longer
+// holds that key.
+static void parkVerifier(PubKeyCache *cache, PubKeyVerifier *verifier)
+{
+	PubKeyVerifier *unused = verifier;
+
+	pthread_mutex_lock(&cache->lock);
+	for(unsigned int ctr=0; ctr<cache->capacity && verifier->reusable && unused!=NULL; ctr++)
+	{
+		PubKeyEntry *entry = &cache->entries[ctr];
+		if(entry->used && entry->handle==verifier->handle && entry->pkey==verifier->pkey)
+		{
+			unused = entry->idle;
+			entry->idle = verifier;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	pubKeyVerifierFree(unused);
+}
+
+
+
+#else
+
+
+
+CK_RV pubKeyEncrypt(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	return hsmEncrypt(cache, hSession, mech, hPublic, in, inLen, out, outLen);
+}
+
+
+
+PubKeyVerifier *pubKeyVerifierCreate(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hPublic, CK_RV *rv)
+{
+	(void)cache;
+	(void)hSession;
+	(void)mech;
+	(void)hPublic;
+	*rv = CKR_MECHANISM_INVALID; // nothing can be verified on the host.
+	return NULL;
+}
+
+
+
+void pubKeyVerifierFree(PubKeyVerifier *verifier)
+{
+	(void)verifier;
+}
+
+
+
+CK_RV pubKeyVerifierRun(PubKeyVerifier *verifier, const CK_BYTE *data, CK_ULONG dataLen, const CK_BYTE *signature,
+	CK_ULONG signatureLen)
+{
+	(void)verifier;
+	(void)data;
+	(void)dataLen;
+	(void)signature;
+	(void)signatureLen;
+	return CKR_FUNCTION_NOT_SUPPORTED;
+}
+#endif
+
+
+
+CK_RV pubKeyVerify(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *data, CK_ULONG dataLen, const CK_BYTE *signature, CK_ULONG signatureLen)
+{
+	CK_FUNCTION_LIST *p11 = cache->p11;
+	PubKeyVerifier *verifier = NULL;
+	CK_RV rv = CKR_OK;
+
+#ifdef HOST_CRYPTO
+	verifier = takeVerifier(cache, mech, hPublic);
+#endif
+	if(verifier==NULL)
+		verifier = pubKeyVerifierCreate(cache, hSession, mech, hPublic, &rv);
+	if(verifier!=NULL)
+	{
+		rv = pubKeyVerifierRun(verifier, data, dataLen, signature, signatureLen);
+#ifdef HOST_CRYPTO
+		parkVerifier(cache, verifier);
+#endif
+		return rv;
+	}
+	if(rv!=CKR_MECHANISM_INVALID)
+		return rv;
+
+	atomic_fetch_add(&cache->hsmOps, 1);
+	rv = p11->C_VerifyInit(hSession, mech, hPublic);
+	if(rv==CKR_OK)
+		rv = p11->C_Verify(hSession, (CK_BYTE*)data, dataLen, (CK_BYTE*)signature, signatureLen);
+	return rv;
+}
@@ -0,0 +1,94 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Public-key operations on the host. Public keys are not secret, so there is no need to spend HSM capacity on
+	  them : a PubKeyCache reads CKA_MODULUS / CKA_PUBLIC_EXPONENT, or CKA_EC_PARAMS / CKA_EC_POINT, once per key
+	  handle, and then runs C_Encrypt and C_Verify equivalents in process with OpenSSL. The HSM is left with the
+	  private-key work only.
+	- pubKeyEncrypt and pubKeyVerify take the same mechanism and arguments as C_EncryptInit / C_Encrypt and
+	  C_VerifyInit / C_Verify, and return the same codes (CKR_SIGNATURE_INVALID, CKR_SIGNATURE_LEN_RANGE,
+	  CKR_DATA_LEN_RANGE, CKR_BUFFER_TOO_SMALL).
+	- Done locally :-
+		encryption : CKM_RSA_PKCS, CKM_RSA_PKCS_OAEP (SHA-1 to SHA-512, with or without a label).
+		verification : CKM_RSA_PKCS, CKM_SHA<n>_RSA_PKCS, CKM_RSA_PKCS_PSS, CKM_SHA<n>_RSA_PKCS_PSS, CKM_ECDSA,
+		CKM_ECDSA_SHA<n>, for n in 1, 224, 256, 384, 512, and CKM_EDDSA (Ed25519 and Ed448, without
+		CK_EDDSA_PARAMS).
+	  Any other mechanism, a key whose attributes cannot be read, or a cache created with local set to 0, goes to the
+	  HSM through the session given, so callers never need a second code path.
+	- The host side needs OpenSSL 3.0 or later, and is only built with HOST_CRYPTO defined (make HOST_CRYPTO=1).
+	  Without it every cache behaves as one created with local set to 0.
+	- Entries are found by object handle. A handle can be reused once its object is destroyed, so call
+	  pubKeyCacheForget when destroying a public key that may be cached.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_PUBKEY_CACHE_H
+#define LUNA_SAMPLES_PUBKEY_CACHE_H
+
+#include <cryptoki_v2.h>
+
+
+typedef struct PubKeyCache PubKeyCache;
+typedef struct PubKeyVerifier PubKeyVerifier; // repeated verifications with one key, by one thread.
+
+
+// Activity of a cache.
+typedef struct
+{
+	unsigned long hits; // key found in the cache.
+	unsigned long misses; // key attributes read from the token.
+	unsigned long evictions;
+	unsigned long localOps; // operations done on the host.
+	unsigned long hsmOps; // operations sent to the HSM.
+	unsigned int entries;
+	unsigned int capacity;
+	int local; // 0 if every operation goes to the HSM.
+} PubKeyCacheStats;
+
+
+// Creates a cache of capacity public keys. With local set to 0 nothing is cached and every operation is sent to the
+// HSM. On failure NULL is returned and *rv holds the error.
+PubKeyCache *pubKeyCacheCreate(CK_FUNCTION_LIST *p11, unsigned int capacity, int local, CK_RV *rv);
+
+void pubKeyCacheGetStats(PubKeyCache *cache, PubKeyCacheStats *stats);
+
+// Drops the entry of hPublic, if any.
+void pubKeyCacheForget(PubKeyCache *cache, CK_OBJECT_HANDLE hPublic);
+
+void pubKeyCacheDestroy(PubKeyCache *cache);
+
+// Encrypts as C_EncryptInit + C_Encrypt on hPublic would. out may be NULL to get the output length.
+CK_RV pubKeyEncrypt(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen);
+
+// Verifies as C_VerifyInit + C_Verify on hPublic would. ECDSA signatures are r || s, as the HSM returns them, and
+// EdDSA signatures R || S as RFC 8032 defines them.
+CK_RV pubKeyVerify(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech, CK_OBJECT_HANDLE hPublic,
+	const CK_BYTE *data, CK_ULONG dataLen, const CK_BYTE *signature, CK_ULONG signatureLen);
+
+// Prepares many host verifications with one key and mechanism : the key, the verification context and the digest
+// are set up once instead of once per signature. Returns NULL with *rv set to CKR_MECHANISM_INVALID if they cannot
+// be done on the host. A verifier must only be used by one thread at a time; each thread creates its own.
+PubKeyVerifier *pubKeyVerifierCreate(PubKeyCache *cache, CK_SESSION_HANDLE hSession, CK_MECHANISM *mech,
+	CK_OBJECT_HANDLE hPublic, CK_RV *rv);
+
+// Verifies one signature as pubKeyVerify would.
+CK_RV pubKeyVerifierRun(PubKeyVerifier *verifier, const CK_BYTE *data, CK_ULONG dataLen, const CK_BYTE *signature,
+	CK_ULONG signatureLen);
+
+void pubKeyVerifierFree(PubKeyVerifier *verifier);
+
+#endif
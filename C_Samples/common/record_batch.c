@@ -0,0 +1,674 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the record batches declared in record_batch.h.
+	- A batch slot goes FREE -> FILLED (reader) -> BUSY -> DONE (worker) -> FREE (writer). Batches are numbered, and
+	  batch n always sits in slot n % window, so workers take them and the writer writes them in number order.
+	- The reader counts the input bytes of every record, framing included, and closes each batch with the input
+	  offset just past its last record; the writer does the same for the output before calling onProgress.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "record_batch.h"
+
+
+#define NO_BATCH_COUNT (~0ULL) // batch count before the end of the input is reached.
+
+
+typedef enum { BATCH_FREE, BATCH_FILLED, BATCH_BUSY, BATCH_DONE } BatchState;
+
+
+typedef struct
+{
+	unsigned long long first; // index of the first record.
+	unsigned int count;
+	CK_BYTE *in; // records one after the other.
+	CK_ULONG inUsed;
+	CK_ULONG *inLens;
+	CK_BYTE *out;
+	CK_ULONG *outLens;
+	CK_BYTE *ivs;
+	unsigned long long inEnd; // input offset just past the last record.
+	BatchState state;
+} RecordBatch;
+
+
+typedef struct
+{
+	CK_FUNCTION_LIST *p11;
+	SessionPool *pool;
+	const RecordBatchConfig *config;
+	FILE *in;
+	FILE *out;
+	CK_ULONG batchBytes; // input bytes a batch holds, at least one record of maxRecord bytes.
+	CK_ULONG cutBytes; // input bytes after which a batch is closed, unless it is still empty.
+	CK_ULONG outIvLen; // IV in front of the records written, when encrypting or re-encrypting.
+	unsigned long long inPos; // input bytes in the batches filled so far (reader).
+	unsigned long long outPos; // output bytes written so far (writer).
+	RecordBatch *batches;
+	unsigned long long batchCount; // NO_BATCH_COUNT until the reader reaches the end.
+	unsigned long long nextBatch; // next batch for a worker.
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	CK_RV rv; // first error, the run stops on it.
+	RecordBatchStats *stats;
+} RecordRun;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Stops the run on its first error. record is the index of the failing record, or NO_BATCH_COUNT.
+static void failRun(RecordRun *run, CK_RV rv, unsigned long long record, int ioError)
+{
+	pthread_mutex_lock(&run->lock);
+	if(run->rv==CKR_OK)
+	{
+		run->rv = rv;
+		run->stats->failedRecord = record;
+		run->stats->ioError = ioError;
+	}
+	pthread_cond_broadcast(&run->changed);
+	pthread_mutex_unlock(&run->lock);
+}
+
+
+
+static int runFailed(RecordRun *run)
+{
+	CK_RV rv = CKR_OK;
+
+	pthread_mutex_lock(&run->lock);
+	rv = run->rv;
+	pthread_mutex_unlock(&run->lock);
+	return rv!=CKR_OK;
+}
+
+
+
+static void setState(RecordRun *run, RecordBatch *batch, BatchState state)
+{
+	pthread_mutex_lock(&run->lock);
+	batch->state = state;
+	pthread_cond_broadcast(&run->changed);
+	pthread_mutex_unlock(&run->lock);
+}
+
+
+
+// IV length of a record encrypted with mechanism.
+static CK_ULONG ivLength(CK_MECHANISM_TYPE mechanism)
+{
+	switch(mechanism)
+	{
+		case CKM_AES_GCM: return 12;
+		case CKM_AES_CBC_PAD: return 16;
+		case CKM_DES3_CBC_PAD: return 8;
+		default: return 0;
+	}
+}
+
+
+
+static int hexValue(int c)
+{
+	if(c>='0' && c<='9')
+		return c - '0';
+	if(c>='a' && c<='f')
+		return c - 'a' + 10;
+	if(c>='A' && c<='F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+
+
+// Reads the next record into buffer. Returns 1 for a record, 0 at the end of the input, or -1 with *rv set.
+// *consumed is set to the input bytes of the record, framing included.
+static int readRecord(RecordRun *run, CK_BYTE *buffer, CK_ULONG *len, CK_ULONG *consumed, CK_RV *rv)
+{
+	CK_ULONG max = run->config->maxRecord;
+	CK_BYTE prefix[4];
+	size_t got = 0;
+	int c = 0, high = -1, low = 0;
+
+	*len = 0;
+	*consumed = 0;
+	if(run->config->inFormat==RECORD_PREFIXED)
+	{
+		got = fread(prefix, 1, 4, run->in);
+		if(got==0 && !ferror(run->in))
+			return 0;
+		if(got<4)
+		{
+			*rv = ferror(run->in) ? CKR_FUNCTION_FAILED : CKR_DATA_INVALID;
+			return -1;
+		}
+		*len = ((CK_ULONG)prefix[0] << 24) | ((CK_ULONG)prefix[1] << 16) | ((CK_ULONG)prefix[2] << 8) | prefix[3];
+		if(*len>max)
+		{
+			*rv = CKR_DATA_LEN_RANGE;
+			return -1;
+		}
+		if(fread(buffer, 1, *len, run->in)!=*len)
+		{
+			*rv = ferror(run->in) ? CKR_FUNCTION_FAILED : CKR_DATA_INVALID;
+			return -1;
+		}
+		*consumed = 4 + *len;
+		return 1;
+	}
+
+	// One record per line; the last line may lack its newline.
+	while((c = getc_unlocked(run->in))!=EOF && c!='\n')
+	{
+		(*consumed)++;
+		if(run->config->inFormat==RECORD_LINES)
+		{
+			if(*len==max)
+			{
+				*rv = CKR_DATA_LEN_RANGE;
+				return -1;
+			}
+			buffer[(*len)++] = (CK_BYTE)c;
+			continue;
+		}
+		if(c=='\r')
+			continue;
+		low = hexValue(c);
+		if(low<0)
+		{
+			*rv = CKR_DATA_INVALID;
+			return -1;
+		}
+		if(high<0)
+		{
+			high = low;
+			continue;
+		}
+		if(*len==max)
+		{
+			*rv = CKR_DATA_LEN_RANGE;
+			return -1;
+		}
+		buffer[(*len)++] = (CK_BYTE)((high << 4) | low);
+		high = -1;
+	}
+	if(ferror(run->in))
+	{
+		*rv = CKR_FUNCTION_FAILED;
+		return -1;
+	}
+	if(high>=0)
+	{
+		*rv = CKR_DATA_INVALID; // odd number of hex digits.
+		return -1;
+	}
+	if(c=='\n')
+		(*consumed)++;
+	return (c==EOF && *len==0) ? 0 : 1;
+}
+
+
+
+// Writes one record with the output framing. Returns 0 on success.
+static int writeRecord(RecordRun *run, const CK_BYTE *record, CK_ULONG len)
+{
+	static const char digits[] = "0123456789abcdef";
+	char hex[512];
+	CK_BYTE prefix[4] = {(CK_BYTE)(len >> 24), (CK_BYTE)(len >> 16), (CK_BYTE)(len >> 8), (CK_BYTE)len};
+	CK_ULONG done = 0, part = 0;
+
+	switch(run->config->outFormat)
+	{
+		case RECORD_PREFIXED:
+			if(fwrite(prefix, 1, 4, run->out)!=4)
+				return -1;
+			if(len>0 && fwrite(record, 1, len, run->out)!=len)
+				return -1;
+			run->outPos += 4 + len;
+			return 0;
+		case RECORD_LINES:
+			if(len>0 && fwrite(record, 1, len, run->out)!=len)
+				return -1;
+			break;
+		case RECORD_HEX:
+			for(done=0; done<len; done+=part)
+			{
+				part = (len - done<sizeof(hex)/2) ? len - done : sizeof(hex)/2;
+				for(CK_ULONG ctr=0; ctr<part; ctr++)
+				{
+					hex[2*ctr] = digits[record[done+ctr] >> 4];
+					hex[2*ctr+1] = digits[record[done+ctr] & 0x0F];
+				}
+				if(fwrite(hex, 1, 2*part, run->out)!=2*part)
+					return -1;
+			}
+			break;
+	}
+	if(putc_unlocked('\n', run->out)==EOF)
+		return -1;
+	run->outPos += ((run->config->outFormat==RECORD_HEX) ? 2 * len : len) + 1;
+	return 0;
+}
+
+
+
+// Encrypts or decrypts one record with mechanism and hKey. iv is the fresh IV of an encryption; *outLen is the room
+// left in out.
+static CK_RV cryptRecord(CK_FUNCTION_LIST *p11, CK_SESSION_HANDLE hSession, CK_MECHANISM_TYPE mechanism,
+	CK_OBJECT_HANDLE hKey, int encrypt, const CK_BYTE *iv, const CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out,
+	CK_ULONG *outLen)
+{
+	CK_AES_GCM_PARAMS gcm = {NULL_PTR, 12, 96, NULL_PTR, 0, 128};
+	CK_MECHANISM mech = {mechanism, NULL_PTR, 0};
+	CK_ULONG ivLen = ivLength(mechanism);
+	CK_ULONG room = *outLen;
+	CK_RV rv = CKR_OK;
+
+	if(mechanism==CKM_AES_ECB && inLen%16!=0)
+		return encrypt ? CKR_DATA_LEN_RANGE : CKR_ENCRYPTED_DATA_LEN_RANGE;
+	if(mechanism==CKM_AES_ECB && inLen==0)
+	{
+		*outLen = 0;
+		return CKR_OK;
+	}
+	if(!encrypt && inLen<ivLen + ((mechanism==CKM_AES_ECB) ? 0 : (mechanism==CKM_DES3_CBC_PAD) ? 8 : 16))
+		return CKR_ENCRYPTED_DATA_LEN_RANGE;
+
+	if(encrypt)
+	{
+		// The IV goes first in the output, and the mechanism reads it there.
+		memcpy(out, iv, ivLen);
+		iv = out;
+		out += ivLen;
+		room -= ivLen;
+	}
+	else
+	{
+		iv = in;
+		in += ivLen;
+		inLen -= ivLen;
+	}
+	if(mechanism==CKM_AES_GCM)
+	{
+		gcm.pIv = (CK_BYTE*)iv;
+		mech.pParameter = &gcm;
+		mech.ulParameterLen = sizeof(gcm);
+	}
+	else if(ivLen>0)
+	{
+		mech.pParameter = (CK_BYTE*)iv;
+		mech.ulParameterLen = ivLen;
+	}
+
+	*outLen = room;
+	if(encrypt)
+	{
+		rv = p11->C_EncryptInit(hSession, &mech, hKey);
+		if(rv==CKR_OK)
+			rv = p11->C_Encrypt(hSession, (CK_BYTE*)in, inLen, out, outLen);
+		*outLen += ivLen;
+	}
+	else
+	{
+		rv = p11->C_DecryptInit(hSession, &mech, hKey);
+		if(rv==CKR_OK)
+			rv = p11->C_Decrypt(hSession, (CK_BYTE*)in, inLen, out, outLen);
+	}
+	return rv;
+}
+
+
+
+// Decrypts one record into plain, then encrypts plain again under the target key; plain is wiped either way.
+static CK_RV reencryptRecord(RecordRun *run, CK_SESSION_HANDLE hSession, CK_BYTE *plain, const CK_BYTE *iv,
+	const CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen)
+{
+	const RecordBatchConfig *config = run->config;
+	CK_ULONG plainLen = inLen;
+	CK_RV rv = cryptRecord(run->p11, hSession, config->mechanism, config->hKey, 0, NULL, in, inLen, plain, &plainLen);
+
+	if(rv==CKR_OK)
+		rv = cryptRecord(run->p11, hSession, config->targetMechanism, config->hTargetKey, 1, iv, plain, plainLen,
+			out, outLen);
+	explicit_bzero(plain, inLen);
+	return rv;
+}
+
+
+
+static CK_RV cryptBatch(RecordRun *run, CK_SESSION_HANDLE hSession, RecordBatch *batch, CK_BYTE *plain,
+	unsigned int *failed)
+{
+	const RecordBatchConfig *config = run->config;
+	CK_ULONG inPos = 0, outPos = 0;
+	CK_RV rv = CKR_OK;
+
+	if(run->outIvLen>0)
+		rv = run->p11->C_GenerateRandom(hSession, batch->ivs, run->outIvLen * batch->count);
+	for(unsigned int ctr=0; ctr<batch->count && rv==CKR_OK; ctr++)
+	{
+		batch->outLens[ctr] = batch->inLens[ctr] + RECORD_BATCH_OVERHEAD;
+		if(config->targetMechanism!=0)
+			rv = reencryptRecord(run, hSession, plain, batch->ivs + ctr * run->outIvLen, batch->in + inPos,
+				batch->inLens[ctr], batch->out + outPos, &batch->outLens[ctr]);
+		else
+			rv = cryptRecord(run->p11, hSession, config->mechanism, config->hKey, config->encrypt,
+				batch->ivs + ctr * run->outIvLen, batch->in + inPos, batch->inLens[ctr], batch->out + outPos,
+				&batch->outLens[ctr]);
+		*failed = ctr;
+		inPos += batch->inLens[ctr];
+		outPos += batch->outLens[ctr];
+	}
+	return rv;
+}
+
+
+
+static void *workerMain(void *arg)
+{
+	RecordRun *run = (RecordRun*)arg;
+	PooledSession *session = NULL;
+	RecordBatch *batch = NULL;
+	CK_BYTE *plain = NULL;
+	unsigned int failed = 0;
+	CK_RV rv = sessionPoolAcquire(run->pool, &session);
+
+	// Plaintext of a re-encryption, one record at a time. mlock may fail under RLIMIT_MEMLOCK; it is only a bonus.
+	if(rv==CKR_OK && run->config->targetMechanism!=0)
+	{
+		plain = (CK_BYTE*)malloc(run->config->maxRecord);
+		if(plain==NULL)
+			rv = CKR_HOST_MEMORY;
+		else
+			mlock(plain, run->config->maxRecord);
+	}
+	if(rv!=CKR_OK)
+		failRun(run, rv, NO_BATCH_COUNT, 0);
+	while(rv==CKR_OK)
+	{
+		pthread_mutex_lock(&run->lock);
+		while(run->rv==CKR_OK && run->nextBatch<run->batchCount
+			&& run->batches[run->nextBatch % run->config->window].state!=BATCH_FILLED)
+			pthread_cond_wait(&run->changed, &run->lock);
+		if(run->rv!=CKR_OK || run->nextBatch>=run->batchCount)
+		{
+			pthread_mutex_unlock(&run->lock);
+			break;
+		}
+		batch = &run->batches[run->nextBatch % run->config->window];
+		batch->state = BATCH_BUSY;
+		run->nextBatch++;
+		pthread_mutex_unlock(&run->lock);
+
+		rv = cryptBatch(run, session->hSession, batch, plain, &failed);
+		if(rv!=CKR_OK)
+			failRun(run, rv, batch->first + failed, 0);
+		else
+			setState(run, batch, BATCH_DONE);
+	}
+	if(session!=NULL)
+		sessionPoolRelease(run->pool, session, rv);
+	if(plain!=NULL)
+	{
+		munlock(plain, run->config->maxRecord);
+		free(plain);
+	}
+	return 0;
+}
+
+
+
+static void *writerMain(void *arg)
+{
+	RecordRun *run = (RecordRun*)arg;
+	const RecordBatchConfig *config = run->config;
+	RecordBatch *batch = NULL;
+	RecordBatchProgress progress;
+	CK_ULONG outPos = 0;
+	CK_RV rv = CKR_OK;
+
+	for(unsigned long long seq=0; ; seq++)
+	{
+		batch = &run->batches[seq % run->config->window];
+		pthread_mutex_lock(&run->lock);
+		while(run->rv==CKR_OK && seq<run->batchCount && batch->state!=BATCH_DONE)
+			pthread_cond_wait(&run->changed, &run->lock);
+		if(run->rv!=CKR_OK || seq>=run->batchCount)
+		{
+			pthread_mutex_unlock(&run->lock);
+			break;
+		}
+		pthread_mutex_unlock(&run->lock);
+
+		outPos = 0;
+		for(unsigned int ctr=0; ctr<batch->count; ctr++)
+		{
+			if(writeRecord(run, batch->out + outPos, batch->outLens[ctr])!=0)
+			{
+				failRun(run, CKR_FUNCTION_FAILED, batch->first + ctr, errno ? errno : EIO);
+				return 0;
+			}
+			outPos += batch->outLens[ctr];
+			run->stats->bytesOut += batch->outLens[ctr];
+		}
+		run->stats->records += batch->count;
+		run->stats->batches++;
+		progress.records = config->firstRecord + run->stats->records;
+		progress.inOffset = batch->inEnd;
+		progress.outOffset = run->outPos;
+		setState(run, batch, BATCH_FREE);
+		if(config->onProgress!=NULL && (rv = config->onProgress(&progress, config->progressArg))!=CKR_OK)
+		{
+			failRun(run, rv, NO_BATCH_COUNT, (rv==CKR_FUNCTION_FAILED) ? (errno ? errno : EIO) : 0);
+			return 0;
+		}
+	}
+	if(fflush(run->out)!=0)
+		failRun(run, CKR_FUNCTION_FAILED, NO_BATCH_COUNT, errno ? errno : EIO);
+	return 0;
+}
+
+
+
+// Fills batches from the input until its end, in the caller thread.
+static void readBatches(RecordRun *run)
+{
+	const RecordBatchConfig *config = run->config;
+	CK_BYTE *pending = (CK_BYTE*)malloc(config->maxRecord ? config->maxRecord : 1);
+	CK_ULONG pendingLen = 0, pendingBytes = 0;
+	int havePending = 0, end = 0, got = 0;
+	unsigned long long records = config->firstRecord;
+	RecordBatch *batch = NULL;
+	CK_RV rv = CKR_OK;
+
+	if(pending==NULL)
+	{
+		failRun(run, CKR_HOST_MEMORY, NO_BATCH_COUNT, 0);
+		return;
+	}
+	for(unsigned long long seq=0; !end; seq++)
+	{
+		batch = &run->batches[seq % config->window];
+		pthread_mutex_lock(&run->lock);
+		while(run->rv==CKR_OK && batch->state!=BATCH_FREE)
+			pthread_cond_wait(&run->changed, &run->lock);
+		rv = run->rv;
+		pthread_mutex_unlock(&run->lock);
+		if(rv!=CKR_OK)
+			break;
+
+		batch->first = records;
+		batch->count = 0;
+		batch->inUsed = 0;
+		while(batch->count<config->batchRecords)
+		{
+			if(!havePending)
+			{
+				got = readRecord(run, pending, &pendingLen, &pendingBytes, &rv);
+				if(got<0)
+				{
+					failRun(run, rv, records, (rv==CKR_FUNCTION_FAILED) ? (errno ? errno : EIO) : 0);
+					break;
+				}
+				if(got==0)
+				{
+					end = 1;
+					break;
+				}
+				havePending = 1;
+			}
+			if(batch->count>0 && batch->inUsed + pendingLen>run->cutBytes)
+				break; // goes into the next batch.
+			memcpy(batch->in + batch->inUsed, pending, pendingLen);
+			batch->inLens[batch->count++] = pendingLen;
+			batch->inUsed += pendingLen;
+			run->stats->bytesIn += pendingLen;
+			run->inPos += pendingBytes;
+			havePending = 0;
+			records++;
+		}
+		if(runFailed(run))
+			break;
+
+		batch->inEnd = run->inPos;
+		pthread_mutex_lock(&run->lock);
+		if(batch->count>0)
+			batch->state = BATCH_FILLED;
+		if(end)
+			run->batchCount = (batch->count>0) ? seq + 1 : seq;
+		pthread_cond_broadcast(&run->changed);
+		pthread_mutex_unlock(&run->lock);
+	}
+	free(pending);
+}
+
+
+
+CK_RV recordBatchRun(CK_FUNCTION_LIST *p11, SessionPool *pool, const RecordBatchConfig *config, FILE *in, FILE *out,
+	RecordBatchStats *stats)
+{
+	RecordRun run;
+	pthread_t *workers = NULL;
+	pthread_t writer;
+	unsigned int started = 0;
+	double start = nowSeconds();
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(RecordBatchStats));
+	stats->failedRecord = NO_BATCH_COUNT;
+	if(config->workers==0 || config->window==0 || config->batchRecords==0 || config->maxRecord==0)
+		return CKR_ARGUMENTS_BAD;
+	if(config->mechanism!=CKM_AES_GCM && config->mechanism!=CKM_AES_CBC_PAD && config->mechanism!=CKM_AES_ECB
+		&& config->mechanism!=CKM_DES3_CBC_PAD)
+		return CKR_MECHANISM_INVALID;
+	if(config->targetMechanism!=0 && config->targetMechanism!=CKM_AES_GCM && config->targetMechanism!=CKM_AES_CBC_PAD)
+		return CKR_MECHANISM_INVALID;
+	if(config->targetMechanism!=0 && config->encrypt)
+		return CKR_ARGUMENTS_BAD;
+
+	memset(&run, 0, sizeof(run));
+	run.p11 = p11;
+	run.pool = pool;
+	run.config = config;
+	run.in = in;
+	run.out = out;
+	run.stats = stats;
+	run.batchCount = NO_BATCH_COUNT;
+	run.outIvLen = config->encrypt ? ivLength(config->mechanism) : ivLength(config->targetMechanism);
+	run.cutBytes = (config->batchBytes!=0) ? config->batchBytes : RECORD_BATCH_BYTES;
+	run.batchBytes = (run.cutBytes>config->maxRecord) ? run.cutBytes : config->maxRecord;
+	run.batches = (RecordBatch*)calloc(config->window, sizeof(RecordBatch));
+	if(run.batches==NULL)
+		return CKR_HOST_MEMORY;
+	for(unsigned int ctr=0; ctr<config->window; ctr++)
+	{
+		RecordBatch *batch = &run.batches[ctr];
+		batch->in = (CK_BYTE*)malloc(run.batchBytes);
+		batch->inLens = (CK_ULONG*)calloc(config->batchRecords, sizeof(CK_ULONG));
+		batch->out = (CK_BYTE*)malloc(run.batchBytes + (CK_ULONG)config->batchRecords * RECORD_BATCH_OVERHEAD);
+		batch->outLens = (CK_ULONG*)calloc(config->batchRecords, sizeof(CK_ULONG));
+		batch->ivs = (CK_BYTE*)malloc(run.outIvLen * config->batchRecords + 1);
+		if(batch->in==NULL || batch->inLens==NULL || batch->out==NULL || batch->outLens==NULL || batch->ivs==NULL)
+			rv = CKR_HOST_MEMORY;
+	}
+	stats->memory = (unsigned long long)config->window * (2 * run.batchBytes + config->batchRecords
+		* (RECORD_BATCH_OVERHEAD + 2 * sizeof(CK_ULONG) + run.outIvLen));
+	pthread_mutex_init(&run.lock, NULL);
+	pthread_cond_init(&run.changed, NULL);
+
+	workers = (pthread_t*)calloc(config->workers, sizeof(pthread_t));
+	if(rv==CKR_OK && workers==NULL)
+		rv = CKR_HOST_MEMORY;
+	if(rv==CKR_OK && pthread_create(&writer, NULL, &writerMain, &run)!=0)
+		rv = CKR_HOST_MEMORY;
+	if(rv==CKR_OK)
+	{
+		for(started=0; started<config->workers; started++)
+			if(pthread_create(&workers[started], NULL, &workerMain, &run)!=0)
+				break;
+		if(started==0)
+			failRun(&run, CKR_HOST_MEMORY, NO_BATCH_COUNT, 0);
+		else
+			readBatches(&run);
+		for(unsigned int ctr=0; ctr<started; ctr++)
+			pthread_join(workers[ctr], NULL);
+		pthread_join(writer, NULL);
+		rv = run.rv;
+	}
+
+	stats->workers = started;
+	stats->seconds = nowSeconds() - start;
+	for(unsigned int ctr=0; ctr<config->window; ctr++)
+	{
+		free(run.batches[ctr].in);
+		free(run.batches[ctr].inLens);
+		free(run.batches[ctr].out);
+		free(run.batches[ctr].outLens);
+		free(run.batches[ctr].ivs);
+	}
+	free(run.batches);
+	free(workers);
+	pthread_mutex_destroy(&run.lock);
+	pthread_cond_destroy(&run.changed);
+	return rv;
+}
+
+
+
+void recordBatchPrintStats(FILE *out, const RecordBatchStats *stats)
+{
+	fprintf(out, "  --> %llu records in %llu batches, %u workers, %llu bytes in, %llu bytes out.\n", stats->records,
+		stats->batches, stats->workers, stats->bytesIn, stats->bytesOut);
+	fprintf(out, "  --> %.3f seconds, %.0f records/sec, %.2f MB/s.\n", stats->seconds,
+		(stats->seconds>0) ? stats->records / stats->seconds : 0,
+		(stats->seconds>0) ? stats->bytesIn / stats->seconds / (1024*1024) : 0);
+	fprintf(out, "  --> %llu bytes of memory for the batch window, whatever the input size.\n", stats->memory);
+}
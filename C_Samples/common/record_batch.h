@@ -0,0 +1,111 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Batch encryption and decryption of many short records (tokens, card numbers, identifiers), each record on its
+	  own, with CKM_AES_GCM, CKM_AES_CBC_PAD, CKM_AES_ECB or, for legacy data, CKM_DES3_CBC_PAD.
+	- Records are read from a stream in one of three framings : a 4 byte big-endian length before every record,
+	  one record per line, or one hex-encoded record per line. The output uses any of the three as well.
+	- The caller thread reads records into batches, worker threads each holding a pooled session encrypt whole
+	  batches, and a writer thread writes the batches in input order. Only --window batches exist at any time, so
+	  the memory used does not depend on the size of the input.
+	- Encrypted records :-
+		CKM_AES_GCM     : IV (12) || ciphertext || tag (16)
+		CKM_AES_CBC_PAD : IV (16) || ciphertext
+		CKM_AES_ECB     : ciphertext only; records must be a multiple of 16 bytes.
+		CKM_DES3_CBC_PAD : IV (8) || ciphertext
+	  The IVs of a batch come from one C_GenerateRandom call.
+	- Re-encryption : with a target mechanism and key, every record is decrypted and encrypted again under the
+	  target key by the same worker, in the same session. The plaintext only exists in a buffer of that worker,
+	  locked in memory where possible and wiped as soon as its record is encrypted again.
+	- A progress callback runs in the writer thread after each batch is written, with the number of records done and
+	  the input and output bytes they account for, which is what a checkpoint needs to resume the run later.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_RECORD_BATCH_H
+#define LUNA_SAMPLES_RECORD_BATCH_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+
+
+#define RECORD_BATCH_OVERHEAD 32 // most an encrypted record grows, and room left for the padding of CBC.
+#define RECORD_BATCH_BYTES (256*1024) // default input bytes of a batch.
+
+
+typedef enum { RECORD_PREFIXED, RECORD_LINES, RECORD_HEX } RecordFormat;
+
+
+// Position of a run after a batch is written.
+typedef struct
+{
+	unsigned long long records; // records written, counted from firstRecord.
+	unsigned long long inOffset; // input bytes they were read from, framing included, since the run started.
+	unsigned long long outOffset; // output bytes written for them, framing included, since the run started.
+} RecordBatchProgress;
+
+
+// Called by the writer thread, which alone writes to the output stream; a result other than CKR_OK stops the run.
+typedef CK_RV (*RecordBatchProgressFn)(const RecordBatchProgress *progress, void *arg);
+
+
+// What to run, and how much of it at once.
+typedef struct
+{
+	CK_MECHANISM_TYPE mechanism; // CKM_AES_GCM, CKM_AES_CBC_PAD, CKM_AES_ECB or CKM_DES3_CBC_PAD.
+	int encrypt; // 1 to encrypt, 0 to decrypt.
+	CK_OBJECT_HANDLE hKey;
+	CK_MECHANISM_TYPE targetMechanism; // 0, or CKM_AES_GCM or CKM_AES_CBC_PAD to re-encrypt what is decrypted.
+	CK_OBJECT_HANDLE hTargetKey;
+	RecordFormat inFormat;
+	RecordFormat outFormat;
+	unsigned int workers;
+	unsigned int window; // batches in memory at once, read, in the workers or waiting to be written.
+	unsigned int batchRecords; // most records in a batch.
+	CK_ULONG batchBytes; // most record bytes in a batch, 0 for RECORD_BATCH_BYTES; a longer record gets a batch alone.
+	CK_ULONG maxRecord; // longest record accepted, before hex encoding.
+	unsigned long long firstRecord; // index of the first record read, when a run resumes an earlier one.
+	RecordBatchProgressFn onProgress; // may be NULL.
+	void *progressArg;
+} RecordBatchConfig;
+
+
+// Activity of one run.
+typedef struct
+{
+	unsigned long long records; // records of this run.
+	unsigned long long bytesIn; // record bytes, without framing.
+	unsigned long long bytesOut;
+	unsigned long long batches;
+	unsigned int workers;
+	unsigned long long memory; // bytes allocated for the window.
+	double seconds;
+	unsigned long long failedRecord; // index of the record that failed, if the run failed on a record.
+	int ioError; // errno of a failed read or write, 0 otherwise.
+} RecordBatchStats;
+
+
+// Processes every record of in into out. Returns CKR_DATA_LEN_RANGE for a record longer than maxRecord (or of the
+// wrong length for CKM_AES_ECB), CKR_DATA_INVALID for bad framing or hex, CKR_FUNCTION_FAILED for an I/O error, or
+// the error of the HSM; stats->failedRecord then tells which record failed. The output of a failed run is incomplete.
+// A re-encryption needs encrypt at 0, the records being decrypted with mechanism and hKey first.
+CK_RV recordBatchRun(CK_FUNCTION_LIST *p11, SessionPool *pool, const RecordBatchConfig *config, FILE *in, FILE *out,
+	RecordBatchStats *stats);
+
+void recordBatchPrintStats(FILE *out, const RecordBatchStats *stats);
+
+#endif
@@ -0,0 +1,313 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the record migration declared in record_migration.h.
+	- Checkpoints are saved from the progress callback of recordBatchRun, in the writer thread, which is the only
+	  thread writing the output, so flushing and syncing it there cannot race with a write.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "record_migration.h"
+
+
+#define MIGRATION_MAGIC "LUNA-MIGRATION 1"
+
+
+// State of one migrationRun call, shared with the progress callback.
+typedef struct
+{
+	const MigrationConfig *config;
+	FILE *out;
+	MigrationCheckpoint base; // where this run started.
+	MigrationStats *stats;
+	double lastSave;
+} MigrationRun;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Pushes the buffered output to the file and the file to the disk. Returns 0 on success.
+static int syncFile(FILE *file)
+{
+	if(fflush(file)!=0)
+		return -1;
+	return fdatasync(fileno(file));
+}
+
+
+
+// Syncs the directory holding path, so that a rename into it survives a crash.
+static int syncDirectory(const char *path)
+{
+	char *copy = strdup(path);
+	int fd = -1, result = -1;
+
+	if(copy==NULL)
+		return -1;
+	fd = open(dirname(copy), O_RDONLY);
+	if(fd>=0)
+	{
+		result = fsync(fd);
+		close(fd);
+	}
+	free(copy);
+	return result;
+}
+
+
+
+// Writes the checkpoint to <path>.tmp, syncs it, and renames it over path.
+static CK_RV saveCheckpoint(const MigrationConfig *config, const MigrationCheckpoint *checkpoint)
+{
+	size_t len = strlen(config->checkpointPath);
+	char *tmpPath = (char*)malloc(len + 5);
+	FILE *file = NULL;
+	int failed = 0;
+
+	if(tmpPath==NULL)
+		return CKR_HOST_MEMORY;
+	memcpy(tmpPath, config->checkpointPath, len);
+	memcpy(tmpPath + len, ".tmp", 5);
+	file = fopen(tmpPath, "w");
+	if(file==NULL)
+	{
+		free(tmpPath);
+		return CKR_FUNCTION_FAILED;
+	}
+	fprintf(file, "%s\nmechanisms 0x%08lX 0x%08lX\ninput-size %llu\nrecords %llu\ninput-offset %llu\n"
+		"output-offset %llu\ncomplete %d\n", MIGRATION_MAGIC, config->batch.mechanism, config->batch.targetMechanism,
+		checkpoint->inputSize, checkpoint->records, checkpoint->inOffset, checkpoint->outOffset, checkpoint->complete);
+	failed = (syncFile(file)!=0);
+	failed |= (fclose(file)!=0);
+	if(!failed)
+		failed = (rename(tmpPath, config->checkpointPath)!=0 || syncDirectory(config->checkpointPath)!=0);
+	else
+		unlink(tmpPath);
+	free(tmpPath);
+	return failed ? CKR_FUNCTION_FAILED : CKR_OK;
+}
+
+
+
+CK_RV migrationLoadCheckpoint(const MigrationConfig *config, MigrationCheckpoint *checkpoint, int *found)
+{
+	FILE *file = fopen(config->checkpointPath, "r");
+	char magic[32];
+	unsigned long source = 0, target = 0;
+	int fields = 0;
+
+	memset(checkpoint, 0, sizeof(MigrationCheckpoint));
+	*found = 0;
+	if(file==NULL)
+		return (errno==ENOENT) ? CKR_OK : CKR_FUNCTION_FAILED;
+	*found = 1;
+	if(fgets(magic, sizeof(magic), file)!=NULL && strncmp(magic, MIGRATION_MAGIC "\n", sizeof(magic))==0)
+		fields = fscanf(file, "mechanisms %lx %lx input-size %llu records %llu input-offset %llu output-offset %llu "
+			"complete %d", &source, &target, &checkpoint->inputSize, &checkpoint->records, &checkpoint->inOffset,
+			&checkpoint->outOffset, &checkpoint->complete);
+	fclose(file);
+	if(fields!=7 || source!=config->batch.mechanism || target!=config->batch.targetMechanism)
+		return CKR_SAVED_STATE_INVALID;
+	return CKR_OK;
+}
+
+
+
+// Progress callback of recordBatchRun : saves a checkpoint at most every checkpointSeconds.
+static CK_RV onBatchWritten(const RecordBatchProgress *progress, void *arg)
+{
+	MigrationRun *run = (MigrationRun*)arg;
+	MigrationCheckpoint checkpoint = run->base;
+	double start = nowSeconds();
+	CK_RV rv = CKR_OK;
+
+	if(start - run->lastSave<run->config->checkpointSeconds)
+		return CKR_OK;
+	checkpoint.records = progress->records;
+	checkpoint.inOffset = run->base.inOffset + progress->inOffset;
+	checkpoint.outOffset = run->base.outOffset + progress->outOffset;
+
+	// The output the checkpoint accounts for must be on disk before the checkpoint is.
+	if(syncFile(run->out)!=0)
+		return CKR_FUNCTION_FAILED;
+	rv = saveCheckpoint(run->config, &checkpoint);
+	if(rv==CKR_OK)
+	{
+		run->stats->reached = checkpoint;
+		run->stats->checkpoints++;
+	}
+	run->lastSave = nowSeconds();
+	run->stats->syncSeconds += run->lastSave - start;
+	return rv;
+}
+
+
+
+// Opens the files of a run positioned at the checkpoint base, which may be a fresh start.
+static CK_RV openFiles(const MigrationConfig *config, const MigrationCheckpoint *base, int resumed, FILE *in,
+	FILE **out)
+{
+	struct stat info;
+	int fd = -1;
+
+	fd = open(config->outPath, O_WRONLY | O_CREAT | (resumed ? 0 : O_TRUNC), 0666);
+	if(fd<0)
+		return CKR_FUNCTION_FAILED;
+	if(fstat(fd, &info)!=0 || !S_ISREG(info.st_mode))
+	{
+		close(fd);
+		return CKR_ARGUMENTS_BAD;
+	}
+	if((unsigned long long)info.st_size<base->outOffset)
+	{
+		close(fd);
+		return CKR_SAVED_STATE_INVALID; // the output lost records the checkpoint counts as done.
+	}
+	if(ftruncate(fd, (off_t)base->outOffset)!=0 || lseek(fd, (off_t)base->outOffset, SEEK_SET)<0)
+	{
+		close(fd);
+		return CKR_FUNCTION_FAILED;
+	}
+	*out = fdopen(fd, "wb");
+	if(*out==NULL)
+	{
+		close(fd);
+		return CKR_HOST_MEMORY;
+	}
+	return (fseeko(in, (off_t)base->inOffset, SEEK_SET)==0) ? CKR_OK : CKR_FUNCTION_FAILED;
+}
+
+
+
+CK_RV migrationRun(CK_FUNCTION_LIST *p11, SessionPool *pool, const MigrationConfig *config, MigrationStats *stats)
+{
+	MigrationRun run;
+	RecordBatchConfig batchConfig = config->batch;
+	struct stat info;
+	FILE *in = NULL, *out = NULL;
+	int found = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(stats, 0, sizeof(MigrationStats));
+	stats->batch.failedRecord = ~0ULL;
+	if(config->batch.targetMechanism==0 || config->inPath==NULL || config->outPath==NULL
+		|| config->checkpointPath==NULL)
+		return CKR_ARGUMENTS_BAD;
+
+	memset(&run, 0, sizeof(run));
+	run.config = config;
+	run.stats = stats;
+	in = fopen(config->inPath, "rb");
+	if(in==NULL)
+	{
+		stats->batch.ioError = errno;
+		return CKR_FUNCTION_FAILED;
+	}
+	if(fstat(fileno(in), &info)!=0 || !S_ISREG(info.st_mode))
+	{
+		fclose(in);
+		return CKR_ARGUMENTS_BAD;
+	}
+	if(config->resume)
+		rv = migrationLoadCheckpoint(config, &run.base, &found);
+	if(rv==CKR_OK && found && (run.base.inputSize!=(unsigned long long)info.st_size
+		|| run.base.inOffset>run.base.inputSize))
+		rv = CKR_SAVED_STATE_INVALID;
+	if(rv!=CKR_OK || (found && run.base.complete))
+	{
+		if(rv==CKR_FUNCTION_FAILED)
+			stats->batch.ioError = errno;
+		stats->resumedFrom = run.base;
+		stats->reached = run.base;
+		fclose(in);
+		return rv;
+	}
+	run.base.inputSize = info.st_size;
+	stats->resumedFrom = run.base;
+	stats->reached = run.base;
+
+	errno = 0;
+	rv = openFiles(config, &run.base, found, in, &out);
+	run.out = out;
+	if(rv==CKR_OK && !found)
+		rv = saveCheckpoint(config, &run.base); // a fresh start replaces any older checkpoint.
+	if(rv==CKR_FUNCTION_FAILED)
+		stats->batch.ioError = errno ? errno : EIO;
+	if(rv==CKR_OK)
+	{
+		run.lastSave = nowSeconds();
+		batchConfig.firstRecord = run.base.records;
+		batchConfig.onProgress = &onBatchWritten;
+		batchConfig.progressArg = &run;
+		rv = recordBatchRun(p11, pool, &batchConfig, in, out, &stats->batch);
+	}
+	if(rv==CKR_OK)
+	{
+		// The last checkpoint, covering every record.
+		MigrationCheckpoint done = run.base;
+		done.records = run.base.records + stats->batch.records;
+		done.inOffset = (unsigned long long)ftello(in);
+		done.outOffset = (unsigned long long)ftello(out);
+		done.complete = 1;
+		if(syncFile(out)!=0)
+			rv = CKR_FUNCTION_FAILED;
+		if(rv==CKR_OK)
+			rv = saveCheckpoint(config, &done);
+		if(rv==CKR_OK)
+		{
+			stats->reached = done;
+			stats->checkpoints++;
+		}
+		else
+			stats->batch.ioError = errno ? errno : EIO;
+	}
+	if(out!=NULL && fclose(out)!=0 && rv==CKR_OK)
+	{
+		stats->batch.ioError = errno;
+		rv = CKR_FUNCTION_FAILED;
+	}
+	fclose(in);
+	return rv;
+}
+
+
+
+void migrationPrintStats(FILE *out, const MigrationStats *stats)
+{
+	if(stats->resumedFrom.records>0 || stats->resumedFrom.inOffset>0)
+		fprintf(out, "  --> resumed after record %llu, at input offset %llu and output offset %llu.\n",
+			stats->resumedFrom.records, stats->resumedFrom.inOffset, stats->resumedFrom.outOffset);
+	recordBatchPrintStats(out, &stats->batch);
+	fprintf(out, "  --> %lu checkpoints saved in %.3f seconds; the last one covers %llu records%s.\n",
+		stats->checkpoints, stats->syncSeconds, stats->reached.records,
+		stats->reached.complete ? ", the whole input" : "");
+}
@@ -0,0 +1,93 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Migration of legacy encrypted records to a new key : every record is decrypted with the old mechanism and key
+	  (CKM_DES3_CBC_PAD for 3DES data) and encrypted again with the new one (CKM_AES_GCM), record by record, in one
+	  session, through the re-encryption mode of record_batch.c, so the work is spread over the pooled sessions and
+	  no plaintext outlives its record.
+	- The run is resumable : a checkpoint file records how many records are done and the input and output offsets
+	  they end at. Before a checkpoint is saved the output is flushed and synced to disk, and the checkpoint is
+	  written to a temporary file, synced and renamed over the previous one, so whatever the moment a run is killed,
+	  the checkpoint on disk never claims output that is not there.
+	- Resuming seeks the input to the checkpoint, cuts the output back to the checkpoint (dropping what was written
+	  after it) and carries on, with records numbered as in one uninterrupted run. Input and output must therefore
+	  be regular files.
+	- Checkpoint file, text :-
+		LUNA-MIGRATION 1
+		mechanisms <source> <target>
+		input-size <bytes>
+		records <n>
+		input-offset <bytes>
+		output-offset <bytes>
+		complete <0|1>
+	  The mechanisms and the input size must match to resume, so a checkpoint cannot be applied to another input.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_RECORD_MIGRATION_H
+#define LUNA_SAMPLES_RECORD_MIGRATION_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+#include "record_batch.h"
+
+
+// A point a migration can resume from.
+typedef struct
+{
+	unsigned long long records;
+	unsigned long long inOffset;
+	unsigned long long outOffset;
+	unsigned long long inputSize;
+	int complete; // 1 once every record is migrated and the output synced.
+} MigrationCheckpoint;
+
+
+typedef struct
+{
+	RecordBatchConfig batch; // mechanism and hKey decrypt the records, targetMechanism and hTargetKey encrypt them.
+	const char *inPath;
+	const char *outPath;
+	const char *checkpointPath;
+	double checkpointSeconds; // least time between two checkpoints, 0 to save one after every batch.
+	int resume; // 1 to carry on from the checkpoint when there is one, 0 to start over.
+} MigrationConfig;
+
+
+// Activity of one migrationRun call.
+typedef struct
+{
+	MigrationCheckpoint resumedFrom; // all 0 for a fresh start.
+	MigrationCheckpoint reached; // last checkpoint saved.
+	unsigned long checkpoints; // saved by this run.
+	double syncSeconds; // spent syncing the output and saving checkpoints.
+	RecordBatchStats batch;
+} MigrationStats;
+
+
+// Migrates config->inPath into config->outPath. Returns CKR_SAVED_STATE_INVALID if the checkpoint is unreadable or
+// does not belong to this input and these mechanisms, CKR_ARGUMENTS_BAD if a file is not a regular file, and the
+// errors of recordBatchRun otherwise (stats->batch.ioError is the errno of a failed checkpoint). A failed run can be
+// resumed from stats->reached. Resuming a complete migration returns CKR_OK at once.
+CK_RV migrationRun(CK_FUNCTION_LIST *p11, SessionPool *pool, const MigrationConfig *config, MigrationStats *stats);
+
+// Reads a checkpoint file. Returns CKR_OK with *found at 0 if there is none.
+CK_RV migrationLoadCheckpoint(const MigrationConfig *config, MigrationCheckpoint *checkpoint, int *found);
+
+void migrationPrintStats(FILE *out, const MigrationStats *stats);
+
+#endif
@@ -0,0 +1,396 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the session pool declared in session_pool.h.
+	- Idle sessions and empty places are kept in two lock-free stacks (Treiber stacks).
+	- The top of each stack is stored with a version tag in the upper 32 bits, which protects the compare-and-swap from the ABA problem.
+	- The mutex and condition variable are only used by threads that have to wait for a release.
+	- Restoring the login is serialised by its own mutex, since any worker can find the slot logged out on release.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "session_pool.h"
+
+
+#define INDEX_MASK 0xFFFFFFFFULL
+#define NO_INDEX 0 // stack entries store index+1, so 0 means empty.
+
+
+struct SessionPool
+{
+	CK_FUNCTION_LIST *p11;
+	CK_SLOT_ID slotId;
+	CK_USER_TYPE userType;
+	CK_BYTE *pin;
+	CK_ULONG pinLen;
+	CK_SESSION_HANDLE hLoginSession; // keeps the slot logged in while the pool exists.
+	int ownsLogin; // 1 when the pool performed the login and must log out.
+	pthread_mutex_t loginLock; // guards hLoginSession while the login is restored.
+
+	unsigned int maxSessions;
+	PooledSession *sessions;
+	atomic_ullong idleTop; // sessions that are open and free.
+	atomic_ullong emptyTop; // places without an open session.
+
+	pthread_mutex_t waitLock;
+	pthread_cond_t released;
+	atomic_int waiters;
+
+	atomic_ulong acquired;
+	atomic_ulong waited;
+	atomic_ulong opened;
+	atomic_ulong dropped;
+	atomic_uint open;
+};
+
+
+
+// Pushes a pool entry onto one of the stacks.
+static void pushEntry(atomic_ullong *top, PooledSession *session)
+{
+	unsigned long long oldTop = atomic_load(top);
+	unsigned long long newTop;
+	do
+	{
+		atomic_store_explicit(&session->next, (unsigned int)(oldTop & INDEX_MASK), memory_order_relaxed);
+		newTop = (((oldTop >> 32) + 1) << 32) | (session->index + 1);
+	} while(!atomic_compare_exchange_weak(top, &oldTop, newTop));
+}
+
+
+
+// Pops an entry from one of the stacks, or returns NULL when it is empty.
+static PooledSession *popEntry(SessionPool *pool, atomic_ullong *top)
+{
+	unsigned long long oldTop = atomic_load(top);
+	unsigned long long newTop;
+	unsigned int index;
+	do
+	{
+		index = (unsigned int)(oldTop & INDEX_MASK);
+		if(index==NO_INDEX)
+			return NULL;
+		newTop = (((oldTop >> 32) + 1) << 32) | atomic_load_explicit(&pool->sessions[index-1].next, memory_order_relaxed);
+	} while(!atomic_compare_exchange_weak(top, &oldTop, newTop));
+	return &pool->sessions[index-1];
+}
+
+
+
+// Wakes one waiting thread, if any.
+static void signalWaiter(SessionPool *pool)
+{
+	if(atomic_load(&pool->waiters)>0)
+	{
+		pthread_mutex_lock(&pool->waitLock);
+		pthread_cond_signal(&pool->released);
+		pthread_mutex_unlock(&pool->waitLock);
+	}
+}
+
+
+
+// Errors after which a session can no longer be used.
+static int isFatal(CK_RV rv)
+{
+	switch(rv)
+	{
+		case CKR_SESSION_HANDLE_INVALID:
+		case CKR_SESSION_CLOSED:
+		case CKR_DEVICE_ERROR:
+		case CKR_DEVICE_REMOVED:
+		case CKR_TOKEN_NOT_PRESENT:
+		case CKR_USER_NOT_LOGGED_IN:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+
+
+// Makes sure the slot is still logged in, logging in again through the login session if needed.
+// Threads that find the login lost at the same time restore it one after the other; the later ones see it restored.
+static CK_RV ensureLogin(SessionPool *pool)
+{
+	CK_SESSION_INFO info;
+	CK_RV rv = CKR_OK;
+
+	pthread_mutex_lock(&pool->loginLock);
+	rv = pool->p11->C_GetSessionInfo(pool->hLoginSession, &info);
+	if(rv==CKR_OK && (info.state==CKS_RO_USER_FUNCTIONS || info.state==CKS_RW_USER_FUNCTIONS || info.state==CKS_RW_SO_FUNCTIONS))
+	{
+		pthread_mutex_unlock(&pool->loginLock);
+		return CKR_OK;
+	}
+
+	if(rv!=CKR_OK)
+		rv = pool->p11->C_OpenSession(pool->slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL_PTR, NULL_PTR, &pool->hLoginSession);
+	if(rv==CKR_OK)
+		rv = pool->p11->C_Login(pool->hLoginSession, pool->userType, pool->pin, pool->pinLen);
+	if(rv==CKR_USER_ALREADY_LOGGED_IN)
+		rv = CKR_OK;
+	pthread_mutex_unlock(&pool->loginLock);
+	return rv;
+}
+
+
+
+// Closes a session and returns its place to the empty stack.
+static void dropSession(SessionPool *pool, PooledSession *session)
+{
+	pool->p11->C_CloseSession(session->hSession);
+	session->hSession = CK_INVALID_HANDLE;
+	atomic_fetch_add(&pool->dropped, 1);
+	atomic_fetch_sub(&pool->open, 1);
+	pushEntry(&pool->emptyTop, session);
+	signalWaiter(pool);
+}
+
+
+
+// Opens a session in an empty place of the pool.
+static CK_RV openSession(SessionPool *pool, PooledSession *session)
+{
+	CK_RV rv = pool->p11->C_OpenSession(pool->slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL_PTR, NULL_PTR, &session->hSession);
+	if(rv!=CKR_OK)
+	{
+		// No signal here : the caller may be a waiter that holds waitLock, and the place is no more usable than before.
+		pushEntry(&pool->emptyTop, session);
+		return rv;
+	}
+	atomic_fetch_add(&pool->opened, 1);
+	atomic_fetch_add(&pool->open, 1);
+	return CKR_OK;
+}
+
+
+
+SessionPool *sessionPoolCreate(CK_FUNCTION_LIST *p11, CK_SLOT_ID slotId, CK_USER_TYPE userType,
+	CK_BYTE *pin, CK_ULONG pinLen, unsigned int maxSessions, CK_RV *rv)
+{
+	SessionPool *pool = NULL;
+
+	if(maxSessions==0)
+	{
+		*rv = CKR_ARGUMENTS_BAD;
+		return NULL;
+	}
+
+	pool = (SessionPool*)calloc(1, sizeof(SessionPool));
+	pool->sessions = (PooledSession*)calloc(maxSessions, sizeof(PooledSession));
+	pool->pin = (CK_BYTE*)malloc(pinLen);
+	memcpy(pool->pin, pin, pinLen);
+	pool->pinLen = pinLen;
+	pool->p11 = p11;
+	pool->slotId = slotId;
+	pool->userType = userType;
+	pool->maxSessions = maxSessions;
+	pthread_mutex_init(&pool->waitLock, NULL);
+	pthread_mutex_init(&pool->loginLock, NULL);
+	pthread_cond_init(&pool->released, NULL);
+
+	for(unsigned int ctr=maxSessions; ctr>0; ctr--)
+	{
+		pool->sessions[ctr-1].index = ctr-1;
+		pool->sessions[ctr-1].hSession = CK_INVALID_HANDLE;
+		pushEntry(&pool->emptyTop, &pool->sessions[ctr-1]);
+	}
+
+	*rv = p11->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL_PTR, NULL_PTR, &pool->hLoginSession);
+	if(*rv==CKR_OK)
+	{
+		*rv = p11->C_Login(pool->hLoginSession, userType, pin, pinLen);
+		if(*rv==CKR_OK)
+			pool->ownsLogin = 1;
+		else if(*rv==CKR_USER_ALREADY_LOGGED_IN) // the application is already logged in on this slot.
+			*rv = CKR_OK;
+		else
+			p11->C_CloseSession(pool->hLoginSession);
+	}
+
+	if(*rv!=CKR_OK)
+	{
+		pthread_mutex_destroy(&pool->waitLock);
+		pthread_mutex_destroy(&pool->loginLock);
+		pthread_cond_destroy(&pool->released);
+		free(pool->sessions);
+		free(pool->pin);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+
+
+// Takes an idle session or opens one. *tokenFull is set when CKR_SESSION_COUNT came from the token itself rather
+// than from a pool with no room left.
+static CK_RV tryAcquire(SessionPool *pool, PooledSession **session, int *tokenFull)
+{
+	PooledSession *found = popEntry(pool, &pool->idleTop);
+	CK_RV rv = CKR_OK;
+
+	*tokenFull = 0;
+	if(found==NULL)
+	{
+		found = popEntry(pool, &pool->emptyTop);
+		if(found==NULL)
+			return CKR_SESSION_COUNT;
+		rv = openSession(pool, found);
+		*tokenFull = (rv==CKR_SESSION_COUNT);
+		if(rv!=CKR_OK)
+			return rv;
+	}
+
+	atomic_fetch_add_explicit(&pool->acquired, 1, memory_order_relaxed);
+	*session = found;
+	return CKR_OK;
+}
+
+
+
+CK_RV sessionPoolTryAcquire(SessionPool *pool, PooledSession **session)
+{
+	int tokenFull = 0;
+	return tryAcquire(pool, session, &tokenFull);
+}
+
+
+
+CK_RV sessionPoolAcquire(SessionPool *pool, PooledSession **session)
+{
+	struct timespec deadline;
+	int tokenFull = 0;
+	CK_RV rv = tryAcquire(pool, session, &tokenFull);
+	if(rv!=CKR_SESSION_COUNT)
+		return rv;
+
+	// Slow path : every session is in use, or the token allows fewer sessions than maxSessions. In the second case
+	// waiting only makes sense while the pool holds sessions that can be released.
+	atomic_fetch_add(&pool->waited, 1);
+	pthread_mutex_lock(&pool->waitLock);
+	atomic_fetch_add(&pool->waiters, 1);
+	while((rv = tryAcquire(pool, session, &tokenFull))==CKR_SESSION_COUNT)
+	{
+		if(tokenFull && atomic_load(&pool->open)==0)
+			break;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 100 * 1000 * 1000; // re-check periodically in case a wakeup was missed.
+		if(deadline.tv_nsec>=1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+		pthread_cond_timedwait(&pool->released, &pool->waitLock, &deadline);
+	}
+	atomic_fetch_sub(&pool->waiters, 1);
+	pthread_mutex_unlock(&pool->waitLock);
+	return rv;
+}
+
+
+
+void sessionPoolRelease(SessionPool *pool, PooledSession *session, CK_RV lastRv)
+{
+	if(lastRv==CKR_USER_NOT_LOGGED_IN && ensureLogin(pool)==CKR_OK)
+		lastRv = CKR_OK; // login restored, the session itself is fine.
+
+	if(isFatal(lastRv))
+	{
+		dropSession(pool, session);
+		return;
+	}
+	pushEntry(&pool->idleTop, session);
+	signalWaiter(pool);
+}
+
+
+
+int sessionPoolCheck(SessionPool *pool)
+{
+	PooledSession *checked = NULL;
+	PooledSession *session = NULL;
+	CK_SESSION_INFO info;
+	int dropped = 0;
+
+	ensureLogin(pool);
+
+	// Take the idle sessions out, check them, then put the healthy ones back.
+	while((session = popEntry(pool, &pool->idleTop))!=NULL)
+	{
+		if(pool->p11->C_GetSessionInfo(session->hSession, &info)!=CKR_OK || info.slotID!=pool->slotId)
+		{
+			dropSession(pool, session);
+			dropped++;
+			continue;
+		}
+		atomic_store_explicit(&session->next, (checked==NULL) ? NO_INDEX : checked->index + 1, memory_order_relaxed);
+		checked = session;
+	}
+	while(checked!=NULL)
+	{
+		unsigned int next = atomic_load_explicit(&checked->next, memory_order_relaxed);
+		pushEntry(&pool->idleTop, checked);
+		signalWaiter(pool);
+		checked = (next==NO_INDEX) ? NULL : &pool->sessions[next-1];
+	}
+	return dropped;
+}
+
+
+
+void sessionPoolGetStats(SessionPool *pool, SessionPoolStats *stats)
+{
+	stats->acquired = atomic_load(&pool->acquired);
+	stats->waited = atomic_load(&pool->waited);
+	stats->opened = atomic_load(&pool->opened);
+	stats->dropped = atomic_load(&pool->dropped);
+	stats->open = atomic_load(&pool->open);
+	stats->maxSessions = pool->maxSessions;
+}
+
+
+
+CK_SLOT_ID sessionPoolSlot(SessionPool *pool)
+{
+	return pool->slotId;
+}
+
+
+
+void sessionPoolDestroy(SessionPool *pool)
+{
+	PooledSession *session = NULL;
+
+	while((session = popEntry(pool, &pool->idleTop))!=NULL)
+		pool->p11->C_CloseSession(session->hSession);
+	if(pool->ownsLogin)
+		pool->p11->C_Logout(pool->hLoginSession);
+	pool->p11->C_CloseSession(pool->hLoginSession);
+
+	pthread_mutex_destroy(&pool->waitLock);
+	pthread_mutex_destroy(&pool->loginLock);
+	pthread_cond_destroy(&pool->released);
+	memset(pool->pin, 0, pool->pinLen);
+	free(pool->pin);
+	free(pool->sessions);
+	free(pool);
+}
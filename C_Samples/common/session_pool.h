@@ -0,0 +1,79 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- A bounded pool of logged-in sessions on one slot, shared by worker threads.
+	- Sessions are opened lazily, up to maxSessions, and stay open between operations.
+	- Acquiring an idle session and releasing it are lock-free; a thread only blocks when every session is in use.
+	- A session that reports a fatal error on release is closed and its place is reused for a new session.
+	- The pool keeps one extra session open that holds the login, so pooled sessions never need C_Login.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_SESSION_POOL_H
+#define LUNA_SAMPLES_SESSION_POOL_H
+
+#include <cryptoki_v2.h>
+#include <stdatomic.h>
+
+
+// A session handed out by the pool.
+typedef struct
+{
+	CK_SESSION_HANDLE hSession;
+	unsigned int index; // position in the pool.
+	atomic_uint next; // link used by the pool's free lists.
+} PooledSession;
+
+
+// Counters describing the pool activity.
+typedef struct
+{
+	unsigned long acquired; // successful acquisitions.
+	unsigned long waited; // acquisitions that had to wait for a release.
+	unsigned long opened; // C_OpenSession calls made by the pool.
+	unsigned long dropped; // sessions closed after a fatal error or a failed health check.
+	unsigned int open; // sessions currently open (idle or in use).
+	unsigned int maxSessions;
+} SessionPoolStats;
+
+
+typedef struct SessionPool SessionPool;
+
+
+// Opens the login session and returns an empty pool. On failure NULL is returned and *rv holds the error.
+SessionPool *sessionPoolCreate(CK_FUNCTION_LIST *p11, CK_SLOT_ID slotId, CK_USER_TYPE userType,
+	CK_BYTE *pin, CK_ULONG pinLen, unsigned int maxSessions, CK_RV *rv);
+
+// Hands out an idle session, opening a new one if the pool has room, otherwise waits for a release. Returns
+// CKR_SESSION_COUNT when the token refuses new sessions and the pool holds none that could be released.
+CK_RV sessionPoolAcquire(SessionPool *pool, PooledSession **session);
+
+// Same as sessionPoolAcquire, but returns CKR_SESSION_COUNT instead of waiting, whether the pool or the token is full.
+CK_RV sessionPoolTryAcquire(SessionPool *pool, PooledSession **session);
+
+// Returns a session to the pool. lastRv is the result of the last call made with it; fatal errors drop the session.
+void sessionPoolRelease(SessionPool *pool, PooledSession *session, CK_RV lastRv);
+
+// Checks idle sessions with C_GetSessionInfo, drops broken ones and restores the login if needed. Returns sessions dropped.
+int sessionPoolCheck(SessionPool *pool);
+
+void sessionPoolGetStats(SessionPool *pool, SessionPoolStats *stats);
+CK_SLOT_ID sessionPoolSlot(SessionPool *pool);
+
+// Closes every session. All sessions must have been released.
+void sessionPoolDestroy(SessionPool *pool);
+
+#endif
@@ -0,0 +1,363 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the slot balancer declared in slot_balancer.h.
+	- Slot state is kept in atomics, so choosing a slot and releasing a session never take a lock.
+	- The latency average is kept in nanoseconds and updated with compare-and-swap (weight 1/8 for the newest sample).
+	- The scan over the slots starts at a rotating index, so slots with the same score share the work.
+	- A slot that stopped getting work because it once looked slow is re-measured every BALANCER_REFRESH_MS, so a
+	  stale average cannot starve it forever.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "slot_balancer.h"
+
+
+typedef struct
+{
+	CK_SLOT_ID slotId;
+	SessionPool *pool; // NULL when the slot could not be opened.
+	atomic_int inFlight;
+	atomic_ullong latencyNanos; // moving average, 0 until the first operation completes.
+	atomic_ullong lastCompleted; // monotonic time in microseconds of the last successful operation.
+	atomic_int consecutiveErrors;
+	atomic_int drained;
+	atomic_int probing; // 1 while the single probe operation of a drained slot is running.
+	atomic_ullong drainedUntil; // monotonic time in microseconds.
+	atomic_ulong ops;
+	atomic_ulong errors;
+	atomic_ulong drains;
+} BalancedSlot;
+
+
+struct SlotBalancer
+{
+	int slotCount;
+	BalancedSlot *slots;
+	atomic_uint nextStart;
+};
+
+
+
+static unsigned long long nowMicros()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+
+
+// Errors caused by the request rather than the slot. They do not count towards draining.
+static int isRequestError(CK_RV rv)
+{
+	switch(rv)
+	{
+		case CKR_ARGUMENTS_BAD:
+		case CKR_BUFFER_TOO_SMALL:
+		case CKR_DATA_INVALID:
+		case CKR_DATA_LEN_RANGE:
+		case CKR_ENCRYPTED_DATA_INVALID:
+		case CKR_ENCRYPTED_DATA_LEN_RANGE:
+		case CKR_MECHANISM_INVALID:
+		case CKR_MECHANISM_PARAM_INVALID:
+		case CKR_SIGNATURE_INVALID:
+		case CKR_SIGNATURE_LEN_RANGE:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+
+
+int slotBalancerListSlots(CK_FUNCTION_LIST *p11, CK_SLOT_ID *slots, int maxSlots)
+{
+	CK_SLOT_ID *all = NULL;
+	CK_ULONG count = 0;
+
+	if(p11->C_GetSlotList(CK_TRUE, NULL, &count)!=CKR_OK || count==0)
+		return 0;
+	all = (CK_SLOT_ID*)calloc(count, sizeof(CK_SLOT_ID));
+	if(all==NULL)
+		return 0;
+	if(p11->C_GetSlotList(CK_TRUE, all, &count)!=CKR_OK)
+		count = 0;
+	if(count>(CK_ULONG)maxSlots)
+		count = maxSlots;
+	memcpy(slots, all, count * sizeof(CK_SLOT_ID));
+	free(all);
+	return (int)count;
+}
+
+
+
+SlotBalancer *slotBalancerCreate(CK_FUNCTION_LIST *p11, const CK_SLOT_ID *slots, int slotCount, CK_USER_TYPE userType,
+	CK_BYTE *pin, CK_ULONG pinLen, unsigned int sessionsPerSlot, CK_RV *rv)
+{
+	SlotBalancer *balancer = NULL;
+	CK_RV slotRv = CKR_OK;
+	int opened = 0;
+
+	*rv = CKR_ARGUMENTS_BAD;
+	if(slotCount<=0)
+		return NULL;
+	*rv = CKR_HOST_MEMORY;
+	balancer = (SlotBalancer*)calloc(1, sizeof(SlotBalancer));
+	if(balancer==NULL)
+		return NULL;
+	balancer->slots = (BalancedSlot*)calloc(slotCount, sizeof(BalancedSlot));
+	if(balancer->slots==NULL)
+	{
+		free(balancer);
+		return NULL;
+	}
+	balancer->slotCount = slotCount;
+
+	for(int ctr=0; ctr<slotCount; ctr++)
+	{
+		balancer->slots[ctr].slotId = slots[ctr];
+		balancer->slots[ctr].pool = sessionPoolCreate(p11, slots[ctr], userType, pin, pinLen, sessionsPerSlot, &slotRv);
+		if(balancer->slots[ctr].pool!=NULL)
+			opened++;
+		else
+			*rv = slotRv; // reported if no slot can be used.
+	}
+
+	if(opened==0)
+	{
+		free(balancer->slots);
+		free(balancer);
+		return NULL;
+	}
+	*rv = CKR_OK;
+	return balancer;
+}
+
+
+
+// Lower is better : the slot latency (1 us minimum) multiplied by the requests it already has.
+static unsigned long long slotScore(BalancedSlot *slot)
+{
+	unsigned long long latency = atomic_load_explicit(&slot->latencyNanos, memory_order_relaxed);
+	int inFlight = atomic_load_explicit(&slot->inFlight, memory_order_relaxed);
+	return (latency + 1000) * (unsigned long long)(inFlight + 1);
+}
+
+
+
+// Chooses the slot for the next operation, or -1 if none can take work. *probe is set to 1 if the operation is the
+// probe of a drained slot.
+static int pickSlot(SlotBalancer *balancer, int *probe)
+{
+	unsigned int start = atomic_fetch_add_explicit(&balancer->nextStart, 1, memory_order_relaxed);
+	unsigned long long bestScore = 0;
+	unsigned long long score = 0;
+	unsigned long long now = nowMicros();
+	unsigned long long last = 0;
+	int expected = 0;
+	int best = -1;
+
+	*probe = 0;
+	for(int ctr=0; ctr<balancer->slotCount; ctr++)
+	{
+		int index = (start + ctr) % balancer->slotCount;
+		BalancedSlot *slot = &balancer->slots[index];
+
+		if(slot->pool==NULL)
+			continue;
+		if(atomic_load(&slot->drained))
+		{
+			// After the cooldown, the first caller to claim the probe sends one operation to the slot.
+			expected = 0;
+			if(now>=atomic_load(&slot->drainedUntil) && atomic_compare_exchange_strong(&slot->probing, &expected, 1))
+			{
+				*probe = 1;
+				return index;
+			}
+			continue;
+		}
+		last = atomic_load_explicit(&slot->lastCompleted, memory_order_relaxed);
+		if(atomic_load_explicit(&slot->inFlight, memory_order_relaxed)==0 && now > last + BALANCER_REFRESH_MS * 1000ULL
+			&& atomic_compare_exchange_strong(&slot->lastCompleted, &last, now))
+			return index; // stale average : refresh it with this operation.
+		score = slotScore(slot);
+		if(best<0 || score<bestScore)
+		{
+			best = index;
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+
+
+// Folds one operation latency into the slot average.
+static void recordLatency(BalancedSlot *slot, unsigned long long nanos)
+{
+	unsigned long long old = atomic_load_explicit(&slot->latencyNanos, memory_order_relaxed);
+	unsigned long long updated = 0;
+
+	do
+	{
+		if(old==0)
+			updated = nanos;
+		else if(nanos>old)
+			updated = old + (nanos - old) / 8;
+		else
+			updated = old - (old - nanos) / 8;
+	} while(!atomic_compare_exchange_weak_explicit(&slot->latencyNanos, &old, updated, memory_order_relaxed, memory_order_relaxed));
+}
+
+
+
+// Updates the counters and drain state of a slot after an operation (or a failed acquisition). Only the probe
+// operation ends or extends a drain : operations already in flight when the slot was drained just count.
+static void recordResult(BalancedSlot *slot, CK_RV rv, double started, int probe)
+{
+	unsigned long long now = nowMicros();
+
+	atomic_fetch_sub(&slot->inFlight, 1);
+	if(rv==CKR_OK || isRequestError(rv))
+	{
+		if(rv==CKR_OK)
+		{
+			atomic_fetch_add_explicit(&slot->ops, 1, memory_order_relaxed);
+			recordLatency(slot, (unsigned long long)((now - started) * 1000));
+			atomic_store_explicit(&slot->lastCompleted, now, memory_order_relaxed);
+		}
+		else
+			atomic_fetch_add_explicit(&slot->errors, 1, memory_order_relaxed);
+		if(probe)
+		{
+			atomic_store(&slot->consecutiveErrors, 0);
+			atomic_store(&slot->drained, 0); // the probe went through, the slot is back.
+			atomic_store(&slot->probing, 0);
+		}
+		else if(!atomic_load(&slot->drained))
+			atomic_store(&slot->consecutiveErrors, 0);
+		return;
+	}
+
+	atomic_fetch_add_explicit(&slot->errors, 1, memory_order_relaxed);
+	if(probe)
+	{
+		// Failed probe : wait another cooldown.
+		atomic_store(&slot->drainedUntil, now + BALANCER_COOLDOWN_MS * 1000ULL);
+		atomic_store(&slot->probing, 0);
+		return;
+	}
+	if(atomic_load(&slot->drained))
+		return;
+	if(atomic_fetch_add(&slot->consecutiveErrors, 1) + 1 >= BALANCER_DRAIN_ERRORS)
+	{
+		atomic_store(&slot->drainedUntil, now + BALANCER_COOLDOWN_MS * 1000ULL);
+		atomic_store(&slot->probing, 0);
+		if(atomic_exchange(&slot->drained, 1)==0)
+			atomic_fetch_add(&slot->drains, 1);
+	}
+}
+
+
+
+// Takes a session from a slot; probe marks the operation that decides whether a drained slot comes back.
+static CK_RV acquireFrom(SlotBalancer *balancer, int slot, int probe, BalancedSession *session)
+{
+	BalancedSlot *target = &balancer->slots[slot];
+	CK_RV rv;
+
+	session->slot = slot;
+	session->probe = probe;
+	atomic_fetch_add(&target->inFlight, 1);
+	rv = sessionPoolAcquire(target->pool, &session->session);
+	session->started = (double)nowMicros(); // waiting for a session is queueing, not slot latency.
+	if(rv!=CKR_OK)
+		recordResult(target, rv, session->started, probe);
+	return rv;
+}
+
+
+
+CK_RV slotBalancerAcquireSlot(SlotBalancer *balancer, int slot, BalancedSession *session)
+{
+	if(slot<0 || slot>=balancer->slotCount || balancer->slots[slot].pool==NULL)
+		return CKR_SLOT_ID_INVALID;
+	return acquireFrom(balancer, slot, 0, session);
+}
+
+
+
+CK_RV slotBalancerAcquire(SlotBalancer *balancer, BalancedSession *session)
+{
+	int probe = 0;
+	int slot = pickSlot(balancer, &probe);
+
+	if(slot<0)
+		return CKR_DEVICE_ERROR;
+	return acquireFrom(balancer, slot, probe, session);
+}
+
+
+
+void slotBalancerRelease(SlotBalancer *balancer, BalancedSession *session, CK_RV lastRv)
+{
+	BalancedSlot *slot = &balancer->slots[session->slot];
+
+	sessionPoolRelease(slot->pool, session->session, lastRv);
+	recordResult(slot, lastRv, session->started, session->probe);
+	session->session = NULL;
+}
+
+
+
+int slotBalancerSlotCount(SlotBalancer *balancer)
+{
+	return balancer->slotCount;
+}
+
+
+
+void slotBalancerGetStats(SlotBalancer *balancer, int slot, BalancedSlotStats *stats)
+{
+	BalancedSlot *source = &balancer->slots[slot];
+
+	stats->slotId = source->slotId;
+	stats->available = (source->pool!=NULL);
+	stats->drained = atomic_load(&source->drained);
+	stats->ops = atomic_load(&source->ops);
+	stats->errors = atomic_load(&source->errors);
+	stats->drains = atomic_load(&source->drains);
+	stats->inFlight = atomic_load(&source->inFlight);
+	stats->latency = atomic_load(&source->latencyNanos) / 1000.0;
+}
+
+
+
+void slotBalancerDestroy(SlotBalancer *balancer)
+{
+	for(int ctr=0; ctr<balancer->slotCount; ctr++)
+	{
+		if(balancer->slots[ctr].pool!=NULL)
+			sessionPoolDestroy(balancer->slots[ctr].pool);
+	}
+	free(balancer->slots);
+	free(balancer);
+}
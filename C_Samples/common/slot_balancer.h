@@ -0,0 +1,88 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Spreads operations over the session pools of several slots (HSM partitions) to scale throughput horizontally.
+	- Each operation goes to the slot with the lowest (measured latency x requests in flight), so a slower or busier
+	  partition gets proportionally less work.
+	- The latency of every slot is a moving average of the operations it completed, updated on release.
+	- A slot that returns several errors in a row is drained : it gets no work until a cooldown has passed, then a
+	  single probe operation decides whether it comes back.
+	- Keys are per slot : callers keep one key handle per slot index (for example, the same key cloned to each partition).
+*/
+
+
+
+#ifndef LUNA_SAMPLES_SLOT_BALANCER_H
+#define LUNA_SAMPLES_SLOT_BALANCER_H
+
+#include <cryptoki_v2.h>
+#include "session_pool.h"
+
+
+#define BALANCER_DRAIN_ERRORS 3 // consecutive errors that drain a slot.
+#define BALANCER_COOLDOWN_MS 5000 // time a drained slot waits before it is probed.
+#define BALANCER_REFRESH_MS 250 // an idle slot whose latency is older than this gets the next operation, to re-measure it.
+
+
+// A session handed out by the balancer, with the slot it belongs to.
+typedef struct
+{
+	int slot; // index in the slot list given to slotBalancerCreate.
+	PooledSession *session;
+	double started; // time the session was handed out, used to measure the operation.
+	int probe; // 1 for the single operation sent to a drained slot after its cooldown.
+} BalancedSession;
+
+
+// Activity of one slot.
+typedef struct
+{
+	CK_SLOT_ID slotId;
+	int available; // 0 if the slot could not be opened or logged in.
+	int drained;
+	unsigned long ops; // operations released with CKR_OK.
+	unsigned long errors;
+	unsigned long drains; // times the slot was drained.
+	int inFlight;
+	double latency; // moving average in microseconds.
+} BalancedSlotStats;
+
+
+typedef struct SlotBalancer SlotBalancer;
+
+
+// Lists the slots with a token present. Returns the number written to slots (at most maxSlots).
+int slotBalancerListSlots(CK_FUNCTION_LIST *p11, CK_SLOT_ID *slots, int maxSlots);
+
+// Opens a session pool on every slot. Slots that fail are kept but never used ; NULL is returned if none work.
+SlotBalancer *slotBalancerCreate(CK_FUNCTION_LIST *p11, const CK_SLOT_ID *slots, int slotCount, CK_USER_TYPE userType,
+	CK_BYTE *pin, CK_ULONG pinLen, unsigned int sessionsPerSlot, CK_RV *rv);
+
+// Picks the best slot and takes a session from it. CKR_DEVICE_ERROR means every slot is drained or unavailable.
+CK_RV slotBalancerAcquire(SlotBalancer *balancer, BalancedSession *session);
+
+// Takes a session from one particular slot, e.g. to find or create the keys of that slot.
+CK_RV slotBalancerAcquireSlot(SlotBalancer *balancer, int slot, BalancedSession *session);
+
+// Gives the session back with the result of the operation; updates the slot latency, error count and drain state.
+void slotBalancerRelease(SlotBalancer *balancer, BalancedSession *session, CK_RV lastRv);
+
+int slotBalancerSlotCount(SlotBalancer *balancer);
+void slotBalancerGetStats(SlotBalancer *balancer, int slot, BalancedSlotStats *stats);
+
+// Closes every pool. All sessions must have been released.
+void slotBalancerDestroy(SlotBalancer *balancer);
+
+#endif
@@ -0,0 +1,261 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Implementation of the streaming pipeline declared in stream_pipeline.h.
+	- Buffer i goes FREE -> FILLED (reader) -> PROCESSED (caller) -> FREE (writer), and each stage walks the ring in
+	  order, so chunks are written in the order they were read.
+	- End of input is passed down the ring as an empty buffer marked last.
+*/
+
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include "stream_pipeline.h"
+
+
+typedef enum { BUFFER_FREE, BUFFER_FILLED, BUFFER_PROCESSED } BufferState;
+
+
+typedef struct
+{
+	CK_BYTE *in;
+	CK_ULONG inLen;
+	CK_BYTE *out;
+	CK_ULONG outLen;
+	int last;
+	BufferState state;
+} StreamBuffer;
+
+
+typedef struct
+{
+	FILE *in;
+	FILE *out;
+	CK_ULONG chunkSize;
+	StreamBuffer buffers[STREAM_BUFFERS];
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int aborted;
+	StreamStats *stats;
+} Stream;
+
+
+
+static double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Waits until a buffer reaches a state. Returns 0 if the stream was aborted instead.
+static int waitFor(Stream *stream, StreamBuffer *buffer, BufferState state)
+{
+	pthread_mutex_lock(&stream->lock);
+	while(buffer->state!=state && !stream->aborted)
+		pthread_cond_wait(&stream->changed, &stream->lock);
+	pthread_mutex_unlock(&stream->lock);
+	return !stream->aborted;
+}
+
+
+
+static void setState(Stream *stream, StreamBuffer *buffer, BufferState state)
+{
+	pthread_mutex_lock(&stream->lock);
+	buffer->state = state;
+	pthread_cond_broadcast(&stream->changed);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+
+
+static void abortStream(Stream *stream, int ioError)
+{
+	pthread_mutex_lock(&stream->lock);
+	stream->aborted = 1;
+	if(ioError!=0 && stream->stats->ioError==0)
+		stream->stats->ioError = ioError;
+	pthread_cond_broadcast(&stream->changed);
+	pthread_mutex_unlock(&stream->lock);
+}
+
+
+
+static void *readStage(void *arg)
+{
+	Stream *stream = (Stream*)arg;
+	StreamBuffer *buffer = NULL;
+	double start = 0;
+	int last = 0;
+
+	for(unsigned long ctr=0; !last; ctr++)
+	{
+		buffer = &stream->buffers[ctr % STREAM_BUFFERS];
+		if(!waitFor(stream, buffer, BUFFER_FREE))
+			break;
+		start = nowSeconds();
+		buffer->inLen = fread(buffer->in, 1, stream->chunkSize, stream->in);
+		stream->stats->readSeconds += nowSeconds() - start;
+		if(buffer->inLen==0 && ferror(stream->in))
+		{
+			abortStream(stream, errno ? errno : EIO);
+			break;
+		}
+		buffer->last = last = (buffer->inLen==0);
+		setState(stream, buffer, BUFFER_FILLED);
+	}
+	return 0;
+}
+
+
+
+static void *writeStage(void *arg)
+{
+	Stream *stream = (Stream*)arg;
+	StreamBuffer *buffer = NULL;
+	double start = 0;
+	int last = 0;
+
+	for(unsigned long ctr=0; !last; ctr++)
+	{
+		buffer = &stream->buffers[ctr % STREAM_BUFFERS];
+		if(!waitFor(stream, buffer, BUFFER_PROCESSED))
+			break;
+		start = nowSeconds();
+		if(stream->out==NULL)
+			buffer->outLen = 0;
+		if(buffer->outLen>0 && fwrite(buffer->out, 1, buffer->outLen, stream->out)!=buffer->outLen)
+		{
+			abortStream(stream, errno ? errno : EIO);
+			break;
+		}
+		if(buffer->last && stream->out!=NULL && fflush(stream->out)!=0)
+		{
+			abortStream(stream, errno ? errno : EIO);
+			break;
+		}
+		stream->stats->writeSeconds += nowSeconds() - start;
+		stream->stats->bytesOut += buffer->outLen;
+		last = buffer->last;
+		setState(stream, buffer, BUFFER_FREE);
+	}
+	return 0;
+}
+
+
+
+CK_RV streamRun(FILE *in, FILE *out, CK_ULONG chunkSize, CK_ULONG outSlack, StreamProcessFn process, void *context, StreamStats *stats)
+{
+	Stream stream;
+	StreamBuffer *buffer = NULL;
+	pthread_t reader, writer;
+	double started = nowSeconds();
+	double start = 0;
+	CK_ULONG outSize = (out!=NULL) ? chunkSize + outSlack : outSlack;
+	CK_RV rv = CKR_OK;
+	int last = 0;
+	int readerStarted = 0;
+	int writerStarted = 0;
+
+	memset(stats, 0, sizeof(StreamStats));
+	memset(&stream, 0, sizeof(stream));
+	stats->chunkSize = chunkSize;
+	stream.in = in;
+	stream.out = out;
+	stream.chunkSize = chunkSize;
+	stream.stats = stats;
+	for(int ctr=0; ctr<STREAM_BUFFERS; ctr++)
+	{
+		stream.buffers[ctr].in = (CK_BYTE*)malloc(chunkSize);
+		stream.buffers[ctr].out = (CK_BYTE*)malloc(outSize + 1);
+		if(stream.buffers[ctr].in==NULL || stream.buffers[ctr].out==NULL)
+			rv = CKR_HOST_MEMORY;
+	}
+	pthread_mutex_init(&stream.lock, NULL);
+	pthread_cond_init(&stream.changed, NULL);
+
+	if(rv==CKR_OK)
+	{
+		readerStarted = (pthread_create(&reader, NULL, &readStage, &stream)==0);
+		writerStarted = readerStarted && pthread_create(&writer, NULL, &writeStage, &stream)==0;
+		if(!writerStarted)
+		{
+			abortStream(&stream, 0); // stops the reader, if it started.
+			rv = CKR_HOST_MEMORY;
+			last = 1;
+		}
+
+		// A buffer belongs to the next stage as soon as its state is set : read what is needed from it before.
+		for(unsigned long ctr=0; !last; ctr++)
+		{
+			buffer = &stream.buffers[ctr % STREAM_BUFFERS];
+			if(!waitFor(&stream, buffer, BUFFER_FILLED))
+				break;
+			buffer->outLen = outSize;
+			start = nowSeconds();
+			rv = process(context, buffer->in, buffer->inLen, buffer->out, &buffer->outLen, buffer->last);
+			stats->processSeconds += nowSeconds() - start;
+			if(rv!=CKR_OK)
+			{
+				abortStream(&stream, 0);
+				break;
+			}
+			stats->bytesIn += buffer->inLen;
+			last = buffer->last;
+			if(!last)
+				stats->chunks++;
+			setState(&stream, buffer, BUFFER_PROCESSED);
+		}
+
+		if(readerStarted)
+			pthread_join(reader, NULL);
+		if(writerStarted)
+			pthread_join(writer, NULL);
+		if(rv==CKR_OK && stats->ioError!=0)
+			rv = CKR_FUNCTION_FAILED;
+	}
+
+	stats->seconds = nowSeconds() - started;
+	for(int ctr=0; ctr<STREAM_BUFFERS; ctr++)
+	{
+		free(stream.buffers[ctr].in);
+		free(stream.buffers[ctr].out);
+	}
+	pthread_mutex_destroy(&stream.lock);
+	pthread_cond_destroy(&stream.changed);
+	return rv;
+}
+
+
+
+void streamPrintStats(FILE *out, const StreamStats *stats)
+{
+	double busy = stats->readSeconds + stats->processSeconds + stats->writeSeconds;
+	double saved = (busy>stats->seconds) ? 100 * (1 - stats->seconds / busy) : 0;
+
+	fprintf(out, "  --> %llu bytes in, %llu bytes out, %lu chunks of %lu bytes.\n", stats->bytesIn, stats->bytesOut,
+		stats->chunks, stats->chunkSize);
+	fprintf(out, "  --> %.3f seconds, %.2f MB/s.\n", stats->seconds,
+		(stats->seconds>0) ? stats->bytesIn / stats->seconds / (1024*1024) : 0);
+	fprintf(out, "  --> Busy time : read %.3f s, HSM %.3f s, write %.3f s (%.0f %% of the sequential time saved by overlapping).\n",
+		stats->readSeconds, stats->processSeconds, stats->writeSeconds, saved);
+}
@@ -0,0 +1,67 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- Streams a file or a pipe through a multi-part operation (C_EncryptUpdate, C_DecryptUpdate, ...) in chunks, at
+	  constant memory.
+	- A reader thread and a writer thread run next to the caller, over a ring of buffers : while the caller makes
+	  the HSM call for one chunk, the next chunk is being read and the previous result is being written.
+	- The caller supplies a StreamProcessFn, called once per chunk in order, and once more with no input at the end
+	  of the stream for the final part (C_EncryptFinal, C_DecryptFinal, ...).
+	- out may be NULL for operations that only consume their input (C_SignUpdate, C_VerifyUpdate, C_DigestUpdate) :
+	  the output buffers then only hold outSlack bytes, and what the StreamProcessFn puts there is dropped.
+	- StreamStats reports the throughput and the busy time of each stage : without the overlap the wall time would
+	  be their sum, with it the wall time comes close to the slowest stage.
+*/
+
+
+
+#ifndef LUNA_SAMPLES_STREAM_PIPELINE_H
+#define LUNA_SAMPLES_STREAM_PIPELINE_H
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+
+
+#define STREAM_BUFFERS 3 // one chunk being read, one being processed, one being written.
+
+
+// Processes one chunk. out can hold outSlack bytes more than the chunk; *outLen is its size on entry.
+// last is 1 for the final call, made with inLen 0 after the last chunk.
+typedef CK_RV (*StreamProcessFn)(void *context, CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen, int last);
+
+
+// Activity of one stream.
+typedef struct
+{
+	unsigned long long bytesIn;
+	unsigned long long bytesOut;
+	unsigned long chunks; // chunks of input processed.
+	CK_ULONG chunkSize;
+	double seconds; // wall time of the whole stream.
+	double readSeconds; // time spent in fread.
+	double processSeconds; // time spent in the StreamProcessFn (the HSM calls).
+	double writeSeconds; // time spent in fwrite.
+	int ioError; // errno of a failed read or write, 0 otherwise.
+} StreamStats;
+
+
+// Runs the whole stream from in to out, which may be NULL. Returns the first error of the StreamProcessFn, or CKR_FUNCTION_FAILED for
+// an I/O error (stats->ioError holds errno).
+CK_RV streamRun(FILE *in, FILE *out, CK_ULONG chunkSize, CK_ULONG outSlack, StreamProcessFn process, void *context, StreamStats *stats);
+
+// Prints the stats as a few lines, with MB/s computed on the input.
+void streamPrintStats(FILE *out, const StreamStats *stats);
+
+#endif
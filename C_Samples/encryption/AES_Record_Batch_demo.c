@@ -0,0 +1,470 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- This sample encrypts or decrypts many short records (tokens, card numbers, identifiers) one by one, with
+	  common/record_batch.c, instead of the single hard-coded string of the other encryption samples.
+	- Records are read from a file or stdin, as lines (--in-format lines), hex lines (hex) or with a 4 byte length
+	  before each (prefixed), and written in the same order with --out-format.
+	- Each record is encrypted on its own with CKM_AES_GCM, CKM_AES_CBC_PAD, or CKM_AES_ECB for records that are a
+	  multiple of 16 bytes, by --workers sessions of a session pool taking batches of --batch records.
+	- At most --window batches are in memory at once, so millions of records are processed at constant memory.
+	- The run reports records/sec.
+	- Batches end at --batch records or --batch-bytes bytes of records. Without --batch-bytes, the chunk size
+	  calibrated for the mechanism on the slot is used (common/chunk_tuner.c, see --calibrate in
+	  CKM_AES_ECB_demo, CKM_AES_CBC_PAD_demo and CKM_AES_GCM_Chunked_demo), or 256K.
+	- Example :-
+		AES_Record_Batch_demo 0 userpin --encrypt --mech gcm --label token-key --in pans.txt --out pans.hex --workers 8
+		AES_Record_Batch_demo 0 userpin --decrypt --mech gcm --label token-key --in pans.hex --out pans.txt
+		cat ids.txt | AES_Record_Batch_demo 0 userpin --encrypt --mech cbc-pad --label id-key --out-format prefixed > ids.bin
+*/
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../common/session_pool.h"
+#include "../common/record_batch.h"
+#include "../common/chunk_tuner.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+SessionPool *sessionPool = NULL;
+CK_OBJECT_HANDLE hAesKey = 0;
+
+int streamMode = 0; // 'e' to encrypt, 'd' to decrypt.
+char *inPath = "-";
+char *outPath = "-";
+char *keyLabel = NULL;
+CK_MECHANISM_TYPE mechanism = CKM_AES_GCM;
+int inFormat = -1; // -1 until set : lines to encrypt, hex to decrypt.
+int outFormat = -1; // -1 until set : hex for encryption, lines for decryption.
+unsigned int workers = 4;
+unsigned int window = 0; // 0 until set : twice the workers.
+unsigned int batchRecords = 256;
+CK_ULONG batchBytes = 0; // 0 until set : the chunk size calibrated for the mechanism on the slot, or 256K.
+CK_ULONG maxRecord = 64*1024;
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+
+
+// Initializes the library, logs in, and opens the session pool used by the workers.
+void connectToLunaSlot()
+{
+	CK_RV rv = CKR_OK;
+
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), workers, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Closes the pool and the session, and finalizes the library.
+void disconnectFromLunaSlot()
+{
+	sessionPoolDestroy(sessionPool);
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Finds the AES key labelled keyLabel, or generates it on the token.
+void findOrGenerateAESKey()
+{
+	CK_MECHANISM mech = {CKM_AES_KEY_GEN};
+	CK_OBJECT_CLASS keyClass = CKO_SECRET_KEY;
+	CK_KEY_TYPE keyType = CKK_AES;
+	CK_ULONG keyLen = 32;
+	CK_ULONG found = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+
+	CK_ATTRIBUTE search[] =
+	{
+		{CKA_CLASS,		&keyClass,		sizeof(keyClass)},
+		{CKA_KEY_TYPE,		&keyType,		sizeof(keyType)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_TOKEN,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_WRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_UNWRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_VALUE_LEN,		&keyLen,		sizeof(CK_ULONG)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+
+	checkOperation(p11Func->C_FindObjectsInit(hSession, search, sizeof(search)/sizeof(*search)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hAesKey, 1, &found), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	if(found==1)
+	{
+		printf("\n> AES key '%s' found as handle : %lu\n", keyLabel, hAesKey);
+		return;
+	}
+	if(streamMode=='d')
+	{
+		printf("\n> No AES key labelled '%s' to decrypt with.\n\n", keyLabel);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	checkOperation(p11Func->C_GenerateKey(hSession, &mech, attrib, sizeof(attrib)/sizeof(*attrib), &hAesKey), "C_GenerateKey");
+	printf("\n> AES key '%s' generated on the token as handle : %lu\n", keyLabel, hAesKey);
+}
+
+
+
+// Opens the files of the run, or exits. With stdout as output, the messages of the sample go to stderr.
+void openStreams(FILE **in, FILE **out)
+{
+	*in = (strcmp(inPath, "-")==0) ? stdin : fopen(inPath, "rb");
+	if(*in==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", inPath, strerror(errno));
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	if(strcmp(outPath, "-")==0)
+	{
+		*out = fdopen(dup(1), "wb");
+		dup2(2, 1);
+	}
+	else
+		*out = fopen(outPath, "wb");
+	if(*out==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", outPath, strerror(errno));
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Without --batch-bytes, cuts batches at the chunk size calibrated for the mechanism on the slot (see
+// common/chunk_tuner.h), or at 256K.
+CK_ULONG pickBatchBytes()
+{
+	if(batchBytes==0)
+		batchBytes = chunkTunerPick(p11Func, slotId, mechanism, RECORD_BATCH_BYTES, stdout);
+	return batchBytes;
+}
+
+
+
+// Runs the whole batch from inPath to outPath.
+void runBatch()
+{
+	RecordBatchConfig config;
+	RecordBatchStats stats;
+	FILE *in = NULL, *out = NULL;
+	CK_RV rv = CKR_OK;
+
+	memset(&config, 0, sizeof(config));
+	config.mechanism = mechanism;
+	config.encrypt = (streamMode=='e');
+	config.hKey = hAesKey;
+	config.inFormat = (RecordFormat)inFormat;
+	config.outFormat = (RecordFormat)outFormat;
+	config.workers = workers;
+	config.window = window;
+	config.batchRecords = batchRecords;
+	config.maxRecord = maxRecord;
+
+	openStreams(&in, &out);
+	config.batchBytes = pickBatchBytes(); // after openStreams, which moves the messages off stdout.
+	rv = recordBatchRun(p11Func, sessionPool, &config, in, out, &stats);
+	fclose(out);
+	if(in!=stdin)
+		fclose(in);
+	if(rv!=CKR_OK && stats.failedRecord!=~0ULL)
+		printf("\n> Record %llu (counted from 0) failed.\n", stats.failedRecord);
+	if(rv==CKR_FUNCTION_FAILED && stats.ioError!=0)
+		printf("\n> I/O error : %s\n", strerror(stats.ioError));
+	checkOperation(rv, "recordBatchRun");
+
+	printf("\n> %s %s into %s.\n", (streamMode=='e') ? "Encrypted" : "Decrypted", inPath, outPath);
+	recordBatchPrintStats(stdout, &stats);
+}
+
+
+
+// Reads a record framing name, or returns -1.
+int parseFormat(const char *text)
+{
+	if(strcmp(text, "prefixed")==0)
+		return RECORD_PREFIXED;
+	if(strcmp(text, "lines")==0)
+		return RECORD_LINES;
+	if(strcmp(text, "hex")==0)
+		return RECORD_HEX;
+	return -1;
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> --encrypt|--decrypt --label <label> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --encrypt | --decrypt  encrypt the records, or decrypt them.\n");
+	printf("  --label <label>        label of the AES key, generated on the token if missing.\n");
+	printf("  --mech <mechanism>     gcm (default), cbc-pad, or ecb for records that are a multiple of 16 bytes.\n");
+	printf("  --in <file>            input file, '-' for stdin (default).\n");
+	printf("  --out <file>           output file, '-' for stdout (default).\n");
+	printf("  --in-format <format>   lines, hex or prefixed (default lines to encrypt, hex to decrypt).\n");
+	printf("  --out-format <format>  lines, hex or prefixed (default hex when encrypting, lines when decrypting).\n");
+	printf("  --workers <n>          sessions encrypting batches at once (default 4).\n");
+	printf("  --batch <n>            records per batch (default 256).\n");
+	printf("  --batch-bytes <size>   record bytes per batch, K and M suffixes accepted (default : calibrated, or 256K).\n");
+	printf("  --window <n>           batches in memory at once (default twice the workers).\n");
+	printf("  --max-record <size>    longest record accepted, K and M suffixes accepted (default 64K).\n\n");
+}
+
+
+
+// Reads a size such as 4096, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"encrypt",	no_argument,		NULL,	'e'},
+		{"decrypt",	no_argument,		NULL,	'd'},
+		{"label",	required_argument,	NULL,	'l'},
+		{"mech",	required_argument,	NULL,	'm'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"out",		required_argument,	NULL,	'o'},
+		{"in-format",	required_argument,	NULL,	'I'},
+		{"out-format",	required_argument,	NULL,	'O'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{"batch",	required_argument,	NULL,	'b'},
+		{"batch-bytes",	required_argument,	NULL,	'B'},
+		{"window",	required_argument,	NULL,	'W'},
+		{"max-record",	required_argument,	NULL,	'x'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'e': case 'd': streamMode = opt; break;
+			case 'l': keyLabel = optarg; break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 'I': inFormat = parseFormat(optarg); if(inFormat<0) { usage(exeName); exit(1); } break;
+			case 'O': outFormat = parseFormat(optarg); if(outFormat<0) { usage(exeName); exit(1); } break;
+			case 'w': workers = atoi(optarg); break;
+			case 'b': batchRecords = atoi(optarg); break;
+			case 'B': batchBytes = parseSize(optarg, exeName); break;
+			case 'W': window = atoi(optarg); break;
+			case 'x': maxRecord = parseSize(optarg, exeName); break;
+			case 'm':
+				if(strcmp(optarg, "gcm")==0)
+					mechanism = CKM_AES_GCM;
+				else if(strcmp(optarg, "cbc-pad")==0)
+					mechanism = CKM_AES_CBC_PAD;
+				else if(strcmp(optarg, "ecb")==0)
+					mechanism = CKM_AES_ECB;
+				else
+				{
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(streamMode==0 || keyLabel==NULL || workers==0 || batchRecords==0 || maxRecord==0)
+	{
+		usage(exeName);
+		exit(1);
+	}
+	if(inFormat<0)
+		inFormat = (streamMode=='e') ? RECORD_LINES : RECORD_HEX;
+	if(outFormat<0)
+		outFormat = (streamMode=='e') ? RECORD_HEX : RECORD_LINES;
+	if(window==0)
+		window = 2 * workers;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	findOrGenerateAESKey();
+	runBatch();
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
@@ -11,12 +11,32 @@
 
 
 	OBJECTIVE : This sample demonstrates how to encrypt and decrypt using CKM_AES_CBC_PAD.
+
+	- Without options, a short string is encrypted and decrypted with single-part C_Encrypt and C_Decrypt.
+	- With --encrypt or --decrypt, a file or a pipe of any size is streamed through C_EncryptUpdate / C_EncryptFinal
+	  (or C_DecryptUpdate / C_DecryptFinal) in chunks of --chunk bytes, using common/stream_pipeline.c : the next
+	  chunk is read and the previous one written while the HSM processes the current one.
+	- The key is the AES key labelled --label, generated on the token if it does not exist yet.
+	- Unless --iv is given, a random IV is generated and written in front of the ciphertext, and read back from there
+	  when decrypting.
+	- --calibrate measures the throughput of C_EncryptUpdate for chunk sizes from 1K to 4M with common/chunk_tuner.c,
+	  picks the knee of the curve, and saves it for the token in the slot (see chunkTunerDefaultPath). Without
+	  --chunk, the stream mode then uses the calibrated size of the slot.
+	- Example :-
+		CKM_AES_CBC_PAD_demo 0 userpin --calibrate --label stream-key
+		CKM_AES_CBC_PAD_demo 0 userpin --encrypt --label stream-key --in big.bin --out big.enc --chunk 1M
+		cat big.enc | CKM_AES_CBC_PAD_demo 0 userpin --decrypt --label stream-key --in - --out - > big.out
 */
 
 #include <stdio.h>
 #include <cryptoki_v2.h>
 #include <string.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../common/stream_pipeline.h"
+#include "../common/chunk_tuner.h"
 
 
 // Windows and Linux OS uses different header files for loading libraries.
@@ -46,6 +66,15 @@ CK_BYTE *decryptedData = NULL;
 CK_BYTE iv[] = "1234567812345678";
 CK_BYTE rawData[] = "Earth is the third planet of our Solar System.";
 
+int streamMode = 0; // 0 for the single-part demo, 'e' to encrypt or 'd' to decrypt a stream, 'c' to calibrate.
+char *inPath = "-";
+char *outPath = "-";
+CK_ULONG chunkSize = 0; // 0 until set : the calibrated size of the slot, or 64K.
+CK_ULONG probeBytes = 16*1024*1024;
+char *keyLabel = NULL;
+char *ivHex = NULL;
+CK_BYTE streamIv[16];
+
 
 // Loads Luna cryptoki library
 void loadLunaLibrary()
@@ -214,11 +243,282 @@ void bytesToHex(const CK_BYTE *data, CK_ULONG dataLen)
 
 
 
+// Finds the AES key labelled keyLabel, or generates it on the token.
+void findOrGenerateAESKey()
+{
+	CK_MECHANISM mech = {CKM_AES_KEY_GEN};
+	CK_OBJECT_CLASS keyClass = CKO_SECRET_KEY;
+	CK_KEY_TYPE keyType = CKK_AES;
+	CK_ULONG keyLen = 32;
+	CK_ULONG found = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+
+	CK_ATTRIBUTE search[] =
+	{
+		{CKA_CLASS,		&keyClass,		sizeof(keyClass)},
+		{CKA_KEY_TYPE,		&keyType,		sizeof(keyType)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_TOKEN,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_WRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_UNWRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_VALUE_LEN,		&keyLen,		sizeof(CK_ULONG)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+
+	checkOperation(p11Func->C_FindObjectsInit(hSession, search, sizeof(search)/sizeof(*search)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hAesKey, 1, &found), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	if(found==1)
+	{
+		printf("\n> AES key '%s' found as handle : %lu\n", keyLabel, hAesKey);
+		return;
+	}
+	if(streamMode=='d')
+	{
+		printf("\n> No AES key labelled '%s' to decrypt with.\n\n", keyLabel);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	checkOperation(p11Func->C_GenerateKey(hSession, &mech, attrib, sizeof(attrib)/sizeof(*attrib), &hAesKey), "C_GenerateKey");
+	printf("\n> AES key '%s' generated on the token as handle : %lu\n", keyLabel, hAesKey);
+}
+
+
+
+// Encrypts one chunk of the stream, or finishes the operation.
+CK_RV encryptChunk(void *context, CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen, int last)
+{
+	CK_SESSION_HANDLE session = *(CK_SESSION_HANDLE*)context;
+
+	if(last)
+		return p11Func->C_EncryptFinal(session, out, outLen);
+	return p11Func->C_EncryptUpdate(session, in, inLen, out, outLen);
+}
+
+
+
+// Decrypts one chunk of the stream, or finishes the operation.
+CK_RV decryptChunk(void *context, CK_BYTE *in, CK_ULONG inLen, CK_BYTE *out, CK_ULONG *outLen, int last)
+{
+	CK_SESSION_HANDLE session = *(CK_SESSION_HANDLE*)context;
+
+	if(last)
+		return p11Func->C_DecryptFinal(session, out, outLen);
+	return p11Func->C_DecryptUpdate(session, in, inLen, out, outLen);
+}
+
+
+
+// Sets up the IV of the stream : from --iv, or random and written in front of the ciphertext, or read back from there.
+void prepareIv(FILE *in, FILE *out)
+{
+	unsigned int byte = 0;
+
+	if(ivHex!=NULL)
+	{
+		for(int ctr=0; ctr<sizeof(streamIv); ctr++)
+		{
+			sscanf(ivHex + 2*ctr, "%2x", &byte);
+			streamIv[ctr] = (CK_BYTE)byte;
+		}
+		return;
+	}
+	if(streamMode=='e')
+	{
+		checkOperation(p11Func->C_GenerateRandom(hSession, streamIv, sizeof(streamIv)), "C_GenerateRandom");
+		if(fwrite(streamIv, 1, sizeof(streamIv), out)!=sizeof(streamIv))
+		{
+			printf("\n> Failed to write the IV.\n\n");
+			exit(1);
+		}
+	}
+	else if(fread(streamIv, 1, sizeof(streamIv), in)!=sizeof(streamIv))
+	{
+		printf("\n> The input is too short to hold an IV.\n\n");
+		exit(1);
+	}
+}
+
+
+
+// Measures chunk sizes from 1K to 4M for CKM_AES_CBC_PAD, and saves the knee of the curve for the slot.
+void calibrateChunkSize()
+{
+	CK_MECHANISM mech = {CKM_AES_CBC_PAD, iv, 16};
+	ChunkTuning tuning;
+
+	checkOperation(chunkTunerCalibrateAndSave(p11Func, hSession, slotId, &mech, hAesKey, probeBytes, stdout, &tuning),
+		"chunkTunerCalibrateAndSave");
+}
+
+
+
+// Encrypts or decrypts inPath into outPath with the multi-part functions.
+void streamData(FILE *in, FILE *out)
+{
+	CK_MECHANISM mech = {CKM_AES_CBC_PAD, streamIv, sizeof(streamIv)};
+	StreamStats stats;
+	CK_RV rv = CKR_OK;
+
+	if(chunkSize==0)
+		chunkSize = chunkTunerPick(p11Func, slotId, CKM_AES_CBC_PAD, 64*1024, stdout);
+	prepareIv(in, out);
+	printf("\n> IV (HEX)\t\t\t: "); bytesToHex(streamIv, sizeof(streamIv));
+	if(streamMode=='e')
+	{
+		checkOperation(p11Func->C_EncryptInit(hSession, &mech, hAesKey), "C_EncryptInit");
+		rv = streamRun(in, out, chunkSize, 16, &encryptChunk, &hSession, &stats);
+	}
+	else
+	{
+		checkOperation(p11Func->C_DecryptInit(hSession, &mech, hAesKey), "C_DecryptInit");
+		rv = streamRun(in, out, chunkSize, 16, &decryptChunk, &hSession, &stats);
+	}
+	if(rv==CKR_FUNCTION_FAILED && stats.ioError!=0)
+		printf("\n> I/O error : %s\n", strerror(stats.ioError));
+	checkOperation(rv, (streamMode=='e') ? "Streaming encryption" : "Streaming decryption");
+
+	printf("\n> %s %s into %s.\n", (streamMode=='e') ? "Encrypted" : "Decrypted", inPath, outPath);
+	streamPrintStats(stdout, &stats);
+}
+
+
+
+// Opens the files of the stream. When the output is stdout, the messages of the sample move to stderr.
+void openStreams(FILE **in, FILE **out)
+{
+	*in = (strcmp(inPath, "-")==0) ? stdin : fopen(inPath, "rb");
+	if(*in==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", inPath, strerror(errno));
+		exit(1);
+	}
+	if(strcmp(outPath, "-")==0)
+	{
+		*out = fdopen(dup(STDOUT_FILENO), "wb");
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+	else
+		*out = fopen(outPath, "wb");
+	if(*out==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", outPath, strerror(errno));
+		exit(1);
+	}
+}
+
+
+
 // Prints the syntax for executing this code.
 void usage(const char *exeName)
 {
 	printf("\nUsage :-\n");
-	printf("%s <slot_number> <crypto_office_password>\n\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> [options]\n\n", exeName);
+	printf("Options (stream mode) :-\n");
+	printf("  --encrypt | --decrypt  stream the input through C_EncryptUpdate or C_DecryptUpdate.\n");
+	printf("  --label <label>        label of the AES key, generated on the token when encrypting if missing.\n");
+	printf("  --in <file>            input file, '-' for stdin (default).\n");
+	printf("  --out <file>           output file, '-' for stdout (default).\n");
+	printf("  --chunk <bytes>        bytes per HSM call, with an optional K or M suffix (default : calibrated, or 64K).\n");
+	printf("  --iv <hex>             fixed 16 byte IV, instead of a random one stored in front of the ciphertext.\n\n");
+	printf("Options (calibration) :-\n");
+	printf("  --calibrate            find the best chunk size for the slot, and save it for the stream mode.\n");
+	printf("  --label <label>        label of the AES key, generated on the token if missing.\n");
+	printf("  --probe <bytes>        bytes encrypted per chunk size, with an optional K or M suffix (default 16M).\n\n");
+}
+
+
+
+// Reads a size such as 4096, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the stream options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"encrypt",	no_argument,		NULL,	'e'},
+		{"decrypt",	no_argument,		NULL,	'd'},
+		{"label",	required_argument,	NULL,	'l'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"out",		required_argument,	NULL,	'o'},
+		{"chunk",	required_argument,	NULL,	'c'},
+		{"iv",		required_argument,	NULL,	'v'},
+		{"calibrate",	no_argument,		NULL,	'C'},
+		{"probe",	required_argument,	NULL,	'p'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'e': case 'd': streamMode = opt; break;
+			case 'l': keyLabel = optarg; break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 'c': chunkSize = parseSize(optarg, exeName); break;
+			case 'v': ivHex = optarg; break;
+			case 'C': streamMode = 'c'; break;
+			case 'p': probeBytes = parseSize(optarg, exeName); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(argc>3 && streamMode==0)
+	{
+		printf("\n> --encrypt, --decrypt or --calibrate is required with options.\n");
+		usage(exeName);
+		exit(1);
+	}
+	if(streamMode!=0 && keyLabel==NULL)
+	{
+		printf("\n> --label is required with --encrypt, --decrypt and --calibrate, so the key outlives the session.\n");
+		usage(exeName);
+		exit(1);
+	}
+	if(ivHex!=NULL && strlen(ivHex)!=2*sizeof(streamIv))
+	{
+		printf("\n> --iv takes %d hex digits.\n", (int)(2*sizeof(streamIv)));
+		exit(1);
+	}
 }
 
 
@@ -233,6 +533,33 @@ int main(int argc, char **argv[])
 	slotId = atoi((const char*)argv[1]);
 	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
 	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	if(streamMode=='c')
+	{
+		loadLunaLibrary();
+		connectToLunaSlot();
+		findOrGenerateAESKey();
+		calibrateChunkSize();
+		disconnectFromLunaSlot();
+		freeMem();
+		return 0;
+	}
+	if(streamMode!=0)
+	{
+		FILE *in = NULL, *out = NULL;
+		openStreams(&in, &out);
+		loadLunaLibrary();
+		connectToLunaSlot();
+		findOrGenerateAESKey();
+		streamData(in, out);
+		fclose(out);
+		if(in!=stdin)
+			fclose(in);
+		disconnectFromLunaSlot();
+		freeMem();
+		return 0;
+	}
 
 	loadLunaLibrary();
 	connectToLunaSlot();
@@ -0,0 +1,479 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+        OBJECTIVE :
+	- This sample encrypts files with CKM_AES_CTR in parallel, and decrypts any byte range of them without
+	  processing the data before it, using common/ctr_engine.c.
+	- The file is cut into --segment byte segments; the counter block of every segment is computed from its offset,
+	  and the segments are spread over --workers sessions.
+	- The encrypted file is the initial counter block (16 bytes : 8 random bytes and a 64 bit counter starting at 0)
+	  followed by the ciphertext, which has the size of the plaintext. CTR alone does not authenticate the data.
+	- --calibrate measures CKM_AES_CTR for chunk sizes from 1K to 4M with common/chunk_tuner.c and saves the knee
+	  for the token in the slot; without --segment, encryption and decryption then use it as the segment size.
+	- Example :-
+		CKM_AES_CTR_Parallel_demo 0 userpin --calibrate --label blob-key
+		CKM_AES_CTR_Parallel_demo 0 userpin --encrypt --label blob-key --in video.mp4 --out video.ctr --workers 8
+		CKM_AES_CTR_Parallel_demo 0 userpin --decrypt --label blob-key --in video.ctr --out clip.bin --offset 1000000 --length 65536
+*/
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../common/session_pool.h"
+#include <sys/stat.h>
+#include "../common/ctr_engine.h"
+#include "../common/chunk_tuner.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+SessionPool *sessionPool = NULL;
+CK_OBJECT_HANDLE hAesKey = 0;
+
+int streamMode = 0; // 'e' to encrypt, 'd' to decrypt, 'c' to calibrate.
+char *inPath = NULL;
+char *outPath = NULL;
+char *keyLabel = NULL;
+CK_ULONG segmentSize = 0; // 0 until set : the calibrated size of the slot, or 1M.
+unsigned int workers = 4;
+unsigned long long rangeOffset = 0;
+long long rangeLength = -1; // -1 up to the end of the file.
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+
+
+// Initializes the library, logs in, and opens the session pool used by the workers.
+void connectToLunaSlot()
+{
+	CK_RV rv = CKR_OK;
+
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), workers, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Closes the pool and the session, and finalizes the library.
+void disconnectFromLunaSlot()
+{
+	sessionPoolDestroy(sessionPool);
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Finds the AES key labelled keyLabel, or generates it on the token.
+void findOrGenerateAESKey()
+{
+	CK_MECHANISM mech = {CKM_AES_KEY_GEN};
+	CK_OBJECT_CLASS keyClass = CKO_SECRET_KEY;
+	CK_KEY_TYPE keyType = CKK_AES;
+	CK_ULONG keyLen = 32;
+	CK_ULONG found = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+
+	CK_ATTRIBUTE search[] =
+	{
+		{CKA_CLASS,		&keyClass,		sizeof(keyClass)},
+		{CKA_KEY_TYPE,		&keyType,		sizeof(keyType)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_TOKEN,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_WRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_UNWRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_VALUE_LEN,		&keyLen,		sizeof(CK_ULONG)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+
+	checkOperation(p11Func->C_FindObjectsInit(hSession, search, sizeof(search)/sizeof(*search)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hAesKey, 1, &found), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	if(found==1)
+	{
+		printf("\n> AES key '%s' found as handle : %lu\n", keyLabel, hAesKey);
+		return;
+	}
+	if(streamMode=='d')
+	{
+		printf("\n> No AES key labelled '%s' to decrypt with.\n\n", keyLabel);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	checkOperation(p11Func->C_GenerateKey(hSession, &mech, attrib, sizeof(attrib)/sizeof(*attrib), &hAesKey), "C_GenerateKey");
+	printf("\n> AES key '%s' generated on the token as handle : %lu\n", keyLabel, hAesKey);
+}
+
+
+
+// Opens a file of the sample, or exits.
+int openFile(const char *path, int flags)
+{
+	int fd = open(path, flags, 0600);
+	if(fd<0)
+	{
+		printf("\n> Cannot open %s : %s\n\n", path, strerror(errno));
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	return fd;
+}
+
+
+
+// This function displays data in bytes as HEX.
+void bytesToHex(const CK_BYTE *data, CK_ULONG dataLen)
+{
+	for(int ctr=0;ctr<dataLen; ctr++)
+	{
+		printf("%02x",data[ctr]);
+	}
+	printf("\n");
+}
+
+
+
+// Prints the throughput of a run.
+void printStats(const CtrStats *stats)
+{
+	printf("  --> %llu bytes in %llu segments, %u workers.\n", stats->bytes, stats->segments, stats->workers);
+	printf("  --> %.3f seconds, %.2f MB/s.\n", stats->seconds, (stats->seconds>0) ? stats->bytes / stats->seconds / (1024*1024) : 0);
+}
+
+
+
+// Without --segment, takes the chunk size calibrated for CKM_AES_CTR on the slot, or 1M.
+void pickSegmentSize()
+{
+	if(segmentSize==0)
+		segmentSize = chunkTunerPick(p11Func, slotId, CKM_AES_CTR, 1024*1024, stdout);
+}
+
+
+
+// Measures chunk sizes from 1K to 4M for CKM_AES_CTR, and saves the knee of the curve for the slot.
+void calibrateSegmentSize()
+{
+	CK_AES_CTR_PARAMS param;
+	CK_MECHANISM mech = {CKM_AES_CTR, &param, sizeof(param)};
+	ChunkTuning tuning;
+
+	memset(&param, 0, sizeof(param));
+	param.ulCounterBits = 64;
+	checkOperation(chunkTunerCalibrateAndSave(p11Func, hSession, slotId, &mech, hAesKey, 16*1024*1024, stdout, &tuning),
+		"chunkTunerCalibrateAndSave");
+}
+
+
+
+// Encrypts inPath into outPath, behind a new initial counter block.
+void encryptFile()
+{
+	CtrStream stream;
+	CtrStats stats;
+	struct stat info;
+	int inFd = openFile(inPath, O_RDONLY);
+	int outFd = openFile(outPath, O_WRONLY|O_CREAT|O_TRUNC);
+
+	memset(&stream, 0, sizeof(stream));
+	stream.hKey = hAesKey;
+	stream.counterBits = 64;
+	checkOperation(p11Func->C_GenerateRandom(hSession, stream.counter, 8), "C_GenerateRandom");
+	if(fstat(inFd, &info)!=0 || write(outFd, stream.counter, CTR_BLOCK_LEN)!=CTR_BLOCK_LEN)
+		checkOperation(CKR_FUNCTION_FAILED, "Writing the counter block");
+
+	pickSegmentSize();
+	checkOperation(ctrCryptFile(p11Func, sessionPool, &stream, inFd, 0, outFd, CTR_BLOCK_LEN, 0, info.st_size, segmentSize, workers, &stats), "ctrCryptFile");
+	close(inFd);
+	if(close(outFd)!=0)
+		checkOperation(CKR_FUNCTION_FAILED, "Closing the output");
+	printf("\n> Encrypted %s into %s.\n", inPath, outPath);
+	printf("  --> Initial counter block (Hex) : "); bytesToHex(stream.counter, CTR_BLOCK_LEN);
+	printStats(&stats);
+}
+
+
+
+// Decrypts the bytes rangeOffset to rangeOffset + rangeLength of the plaintext of inPath into outPath.
+void decryptFile()
+{
+	CtrStream stream;
+	CtrStats stats;
+	struct stat info;
+	unsigned long long plainSize = 0;
+	int inFd = openFile(inPath, O_RDONLY);
+	int outFd = openFile(outPath, O_WRONLY|O_CREAT|O_TRUNC);
+
+	memset(&stream, 0, sizeof(stream));
+	stream.hKey = hAesKey;
+	stream.counterBits = 64;
+	if(fstat(inFd, &info)!=0 || info.st_size<CTR_BLOCK_LEN || read(inFd, stream.counter, CTR_BLOCK_LEN)!=CTR_BLOCK_LEN)
+		checkOperation(CKR_ENCRYPTED_DATA_LEN_RANGE, "Reading the counter block");
+	plainSize = info.st_size - CTR_BLOCK_LEN;
+	if(rangeLength<0)
+		rangeLength = (rangeOffset<plainSize) ? plainSize - rangeOffset : 0;
+	if(rangeOffset + rangeLength>plainSize)
+	{
+		printf("\n> The range ends after the %llu bytes of data.\n\n", plainSize);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+
+	pickSegmentSize();
+	checkOperation(ctrCryptFile(p11Func, sessionPool, &stream, inFd, CTR_BLOCK_LEN + rangeOffset, outFd, 0, rangeOffset, rangeLength, segmentSize, workers, &stats), "ctrCryptFile");
+	close(inFd);
+	if(close(outFd)!=0)
+		checkOperation(CKR_FUNCTION_FAILED, "Closing the output");
+	printf("\n> Decrypted bytes %llu to %llu of %s into %s.\n", rangeOffset, rangeOffset + rangeLength, inPath, outPath);
+	printStats(&stats);
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> --encrypt|--decrypt --label <label> --in <file> --out <file> [options]\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> --calibrate --label <label>\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --encrypt | --decrypt  encrypt a file, or decrypt a file or a part of it.\n");
+	printf("  --label <label>        label of the AES key, generated on the token when encrypting if missing.\n");
+	printf("  --in <file>            input file.\n");
+	printf("  --out <file>           output file.\n");
+	printf("  --segment <bytes>      bytes per HSM call, with an optional K or M suffix (default : calibrated, or 1M).\n");
+	printf("  --workers <n>          sessions and threads processing segments (default 4).\n");
+	printf("  --offset <bytes>       when decrypting, first byte of the plaintext to decrypt (default 0).\n");
+	printf("  --length <bytes>       when decrypting, bytes to decrypt (default up to the end).\n");
+	printf("  --calibrate            find the best segment size for the slot, and save it for --encrypt and --decrypt.\n\n");
+}
+
+
+
+// Reads a size such as 4096, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"encrypt",	no_argument,		NULL,	'e'},
+		{"decrypt",	no_argument,		NULL,	'd'},
+		{"label",	required_argument,	NULL,	'l'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"out",		required_argument,	NULL,	'o'},
+		{"segment",	required_argument,	NULL,	's'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{"offset",	required_argument,	NULL,	'f'},
+		{"length",	required_argument,	NULL,	'n'},
+		{"calibrate",	no_argument,		NULL,	'C'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'e': case 'd': streamMode = opt; break;
+			case 'l': keyLabel = optarg; break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 's': segmentSize = parseSize(optarg, exeName); break;
+			case 'w': workers = atoi(optarg); break;
+			case 'f': rangeOffset = strtoull(optarg, NULL, 10); break;
+			case 'n': rangeLength = atoll(optarg); break;
+			case 'C': streamMode = 'c'; break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(streamMode==0 || keyLabel==NULL || (streamMode!='c' && (inPath==NULL || outPath==NULL)))
+	{
+		usage(exeName);
+		exit(1);
+	}
+	if(workers==0)
+		workers = 1;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	findOrGenerateAESKey();
+	if(streamMode=='c')
+		calibrateSegmentSize();
+	else if(streamMode=='e')
+		encryptFile();
+	else
+		decryptFile();
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
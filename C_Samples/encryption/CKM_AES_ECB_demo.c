@@ -14,6 +14,12 @@
 
 
         OBJECTIVE : This sample demonstrates how to encrypt and decrypt using CKM_AES_ECB mechanism.
+
+	- With --calibrate, it measures the throughput of C_EncryptUpdate with CKM_AES_ECB for chunk sizes from 1K to
+	  4M instead, using common/chunk_tuner.c, and saves the knee of the curve for the token in the slot. The
+	  CKM_AES_ECB runs of AES_Record_Batch_demo then size their batches from it.
+	- Example :-
+		CKM_AES_ECB_demo 0 userpin --calibrate
 */
 
 
@@ -24,6 +30,7 @@
 #include <cryptoki_v2.h>
 #include <string.h>
 #include <stdlib.h>
+#include "../common/chunk_tuner.h"
 
 
 // Windows and Linux OS uses different header files for loading libraries.
@@ -223,11 +230,23 @@ void bytesToHex(const CK_BYTE *data, CK_ULONG dataLen)
 
 
 
+// Measures chunk sizes from 1K to 4M for CKM_AES_ECB, and saves the knee of the curve for the slot.
+void calibrateChunkSize()
+{
+	CK_MECHANISM mech = {CKM_AES_ECB};
+	ChunkTuning tuning;
+
+	checkOperation(chunkTunerCalibrateAndSave(p11Func, hSession, slotId, &mech, hObject, 16*1024*1024, stdout, &tuning),
+		"chunkTunerCalibrateAndSave");
+}
+
+
+
 // Prints the syntax for executing this code.
 void usage(const char exeName[30])
 {
 	printf("\nUsage :-\n");
-	printf("%s <slot_number> <crypto_office_password>\n\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> [--calibrate]\n\n", exeName);
 }
 
 
@@ -239,6 +258,10 @@ int main(int argc, char **argv[])
 		usage((char*)argv[0]);
 		exit(1);
 	}
+	if(argc>4 || (argc==4 && strcmp((const char*)argv[3], "--calibrate")!=0)) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
 	slotId = atoi((const char*)argv[1]);
 	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
 	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
@@ -247,6 +270,13 @@ int main(int argc, char **argv[])
 	connectToLunaSlot();
 
 	generateAESKey();
+	if(argc==4)
+	{
+		calibrateChunkSize();
+		disconnectFromLunaSlot();
+		freeMem();
+		return 0;
+	}
 	CK_ULONG encryptedDataLen = encryptData();
 	decryptData(encryptedDataLen);
 
@@ -18,8 +18,9 @@
 		> During Encryption, IV is passed as NULL into CK_AES_GCM_PARAM.
 		> Instead of using an external IV, CK_AES_GCM uses an IV generated internally within the HSM.
 		> That generated IV is then appended to the encrypted data.
-		> Before decryption, appended IV is read from the encrypted data and passed into CK_AES_GCM_PARAM.
-		> appended IV is also removed from the encrypted data before C_Decrypt.
+		> Before decryption, CK_AES_GCM_PARAM points to the appended IV where it lies in the encrypted data.
+		> C_Decrypt is given the encrypted data with a length that leaves the appended IV out.
+	Both steps are done by common/gcm_fips.c, without copying the IV or the encrypted data.
 */
 
 
@@ -28,6 +29,7 @@
 #include <cryptoki_v2.h>
 #include <string.h>
 #include <stdlib.h>
+#include "../common/gcm_fips.h"
 
 
 // Windows and Linux OS uses different header files for loading libraries.
@@ -55,12 +57,9 @@ CK_OBJECT_HANDLE hAesKey = 0;
 char rawData[] = "Earth is the third planet of our solar system.";
 CK_BYTE *encryptedData = NULL; // Encrypted data containing the appended IV.
 CK_BYTE *decryptedData = NULL; // Decrypted data.
-CK_BYTE *encrypted = NULL; // used for storing decrypted data with IV removed.
+CK_ULONG encLen = 0;
 
 CK_BYTE aad[] = "127.0.0.1";
-const CK_ULONG tagBits = 128;
-CK_BYTE *iv = NULL; // NO need to pass IV in FIPS mode.
-CK_AES_GCM_PARAMS gcmParam = {NULL, 0, 0, aad, sizeof(aad)-1, tagBits};
 
 
 
@@ -188,46 +187,17 @@ void generateAESKey()
 
 
 
-// This function reads the 16 byte IV appended to the encrypted data.
-void readIV(CK_ULONG encLen)
-{
-        int count = 0;
-        iv = (CK_BYTE*)calloc(16, sizeof(CK_BYTE));
-        for(int ctr=(encLen-16); ctr<encLen; ctr++)
-        {
-                iv[count] = encryptedData[ctr];
-                count++;
-        }
-}
-
-
-
-// This function trims the IV from the Encrypted Data.
-void trimIV(CK_ULONG encLen)
-{
-        encrypted = malloc(encLen - 16);
-        memcpy(encrypted, encryptedData, (encLen-16));
-}
-
-
-
 // This function will decrypt data
-void decryptData(CK_ULONG dataLen)
+void decryptData()
 {
-        gcmParam.pIv = iv;
-	gcmParam.ulIvLen = 16;
-	gcmParam.ulIvBits = 128;
-	gcmParam.pAAD = aad;
-	gcmParam.ulAADLen = sizeof(aad)-1;
-	gcmParam.ulTagBits = tagBits;
-
-        CK_MECHANISM mech = {CKM_AES_GCM, &gcmParam, sizeof(gcmParam)};
-        CK_ULONG decLen = 0;
-        checkOperation(p11Func->C_DecryptInit(hSession, &mech, hAesKey),"C_DecryptInit");
-        checkOperation(p11Func->C_Decrypt(hSession, encrypted, dataLen-16, NULL_PTR, &decLen),"C_Decrypt");
-        decryptedData = (CK_BYTE*)calloc(decLen, sizeof(CK_BYTE));
-        checkOperation(p11Func->C_Decrypt(hSession, encrypted, dataLen-16, decryptedData, &dataLen),"C_Decrypt");
-        printf("\n> Data decrypted.\n");
+	GcmFipsRecord record;
+	CK_ULONG decLen = encLen - GCM_FIPS_IV_LEN;
+
+	checkOperation(gcmFipsParse(encryptedData, encLen, &record), "gcmFipsParse");
+	printf("\n> IV read in place, at offset %lu of the encrypted data.\n", (CK_ULONG)(record.iv - encryptedData));
+	decryptedData = (CK_BYTE*)calloc(decLen, sizeof(CK_BYTE));
+	checkOperation(gcmFipsDecrypt(p11Func, hSession, hAesKey, aad, sizeof(aad)-1, encryptedData, encLen, decryptedData, &decLen), "gcmFipsDecrypt");
+	printf("\n> Data decrypted : %.*s\n", (int)decLen, decryptedData);
 }
 
 
@@ -235,18 +205,15 @@ void decryptData(CK_ULONG dataLen)
 // This function will encrypt data
 void encryptData()
 {
-        CK_MECHANISM mech = {CKM_AES_GCM, &gcmParam, sizeof(gcmParam)};
-        CK_ULONG encLen = 0;
-        checkOperation(p11Func->C_EncryptInit(hSession, &mech, hAesKey),"C_EncryptInit");
-        checkOperation(p11Func->C_Encrypt(hSession, rawData, sizeof(rawData)-1, NULL_PTR, &encLen),"C_Encrypt");
-        encryptedData = (CK_BYTE*)calloc(encLen, sizeof(CK_BYTE));
-        checkOperation(p11Func->C_Encrypt(hSession, rawData, sizeof(rawData)-1, encryptedData, &encLen),"C_Encrypt");
-        printf("\n> Data encrypted.\n");
-        readIV(encLen);
-        trimIV(encLen);
-        decryptData(encLen);
+	checkOperation(gcmFipsEncrypt(p11Func, hSession, hAesKey, aad, sizeof(aad)-1, rawData, sizeof(rawData)-1, NULL_PTR, &encLen), "gcmFipsEncrypt");
+	encryptedData = (CK_BYTE*)calloc(encLen, sizeof(CK_BYTE));
+	checkOperation(gcmFipsEncrypt(p11Func, hSession, hAesKey, aad, sizeof(aad)-1, rawData, sizeof(rawData)-1, encryptedData, &encLen), "gcmFipsEncrypt");
+	printf("\n> Data encrypted.\n");
+	decryptData();
 }
 
+
+
 // Prints the syntax for executing this code.
 void usage(const char exeName[30])
 {
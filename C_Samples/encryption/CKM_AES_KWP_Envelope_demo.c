@@ -0,0 +1,381 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+	OBJECTIVE : This sample demonstrates envelope encryption with CKM_AES_KWP, using common/envelope.c.
+
+	- Every object is encrypted on the host with AES-256-GCM (OpenSSL, AES-NI accelerated), under its own data key.
+	- The data key comes from the HSM random generator and is wrapped with CKM_AES_KWP by the AES key labelled
+	  --label, which never leaves the HSM; the wrapped key is stored in the header of the object.
+	- Only the key wrap and unwrap go to the HSM, so the throughput is no longer capped by the HSM link.
+	- Unwrapped data keys are cached in locked, zeroized memory (--cache entries) : --repeat decrypts the same object
+	  several times, and only the first pass unwraps its key on the HSM.
+	- Example :-
+		CKM_AES_KWP_Envelope_demo 0 userpin --encrypt --label kek --in backup.tar --out backup.env
+		CKM_AES_KWP_Envelope_demo 0 userpin --decrypt --label kek --in backup.env --out backup.tar --repeat 5
+*/
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../common/envelope.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+CK_OBJECT_HANDLE hAesKey = 0; // key wrapping the data keys.
+EnvelopeKeyCache *keyCache = NULL;
+
+int streamMode = 0; // 'e' to encrypt or 'd' to decrypt.
+char *inPath = "-";
+char *outPath = "-";
+char *keyLabel = NULL;
+unsigned int cacheSize = 64;
+int repeat = 1;
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Connects to a Luna slot (C_Initialize, C_OpenSession, C_Login)
+void connectToLunaSlot()
+{
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Disconnects from Luna slot (C_Logout, C_CloseSession and C_Finalize)
+void disconnectFromLunaSlot()
+{
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Finds the AES key labelled keyLabel, or generates it on the token.
+void findOrGenerateAESKey()
+{
+	CK_MECHANISM mech = {CKM_AES_KEY_GEN};
+	CK_OBJECT_CLASS keyClass = CKO_SECRET_KEY;
+	CK_KEY_TYPE keyType = CKK_AES;
+	CK_ULONG keyLen = 32;
+	CK_ULONG found = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+
+	CK_ATTRIBUTE search[] =
+	{
+		{CKA_CLASS,		&keyClass,		sizeof(keyClass)},
+		{CKA_KEY_TYPE,		&keyType,		sizeof(keyType)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_TOKEN,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_WRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_UNWRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_VALUE_LEN,		&keyLen,		sizeof(CK_ULONG)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+
+	checkOperation(p11Func->C_FindObjectsInit(hSession, search, sizeof(search)/sizeof(*search)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hAesKey, 1, &found), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	if(found==1)
+	{
+		printf("\n> AES key '%s' found as handle : %lu\n", keyLabel, hAesKey);
+		return;
+	}
+	if(streamMode=='d')
+	{
+		printf("\n> No AES key labelled '%s' to decrypt with.\n\n", keyLabel);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	checkOperation(p11Func->C_GenerateKey(hSession, &mech, attrib, sizeof(attrib)/sizeof(*attrib), &hAesKey), "C_GenerateKey");
+	printf("\n> AES key '%s' generated on the token as handle : %lu\n", keyLabel, hAesKey);
+}
+
+
+
+// Opens the files of the stream. When the output is stdout, the messages of the sample move to stderr.
+void openStreams(FILE **in, FILE **out)
+{
+	*in = (strcmp(inPath, "-")==0) ? stdin : fopen(inPath, "rb");
+	if(*in==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", inPath, strerror(errno));
+		exit(1);
+	}
+	if(strcmp(outPath, "-")==0)
+	{
+		*out = fdopen(dup(STDOUT_FILENO), "wb");
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+	else
+		*out = fopen(outPath, "wb");
+	if(*out==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", outPath, strerror(errno));
+		exit(1);
+	}
+}
+
+
+
+// Prints the result of one pass.
+void printStats(const EnvelopeStats *stats)
+{
+	printf("  --> %llu bytes, %.3f seconds, %.2f MB/s.\n", stats->bytes, stats->seconds,
+		(stats->seconds>0) ? stats->bytes / stats->seconds / (1024*1024) : 0);
+	printf("  --> Data key %s, HSM time %.3f ms.\n", (streamMode=='e') ? "generated and wrapped" : (stats->cacheHit ? "found in the cache" : "unwrapped"),
+		stats->hsmSeconds * 1000);
+}
+
+
+
+// Encrypts or decrypts inPath into outPath, repeat times.
+void runEnvelope()
+{
+	EnvelopeStats stats;
+	EnvelopeCacheStats cacheStats;
+	FILE *in = NULL, *out = NULL;
+	CK_RV rv = CKR_OK;
+
+	for(int pass=0; pass<repeat; pass++)
+	{
+		openStreams(&in, &out);
+		if(streamMode=='e')
+			rv = envelopeEncrypt(p11Func, hSession, hAesKey, keyCache, in, out, &stats);
+		else
+			rv = envelopeDecrypt(p11Func, hSession, hAesKey, keyCache, in, out, &stats);
+		fclose(out);
+		if(in!=stdin)
+			fclose(in);
+		if(rv!=CKR_OK && strcmp(outPath, "-")!=0)
+			remove(outPath); // never leave unauthenticated plaintext behind.
+		checkOperation(rv, (streamMode=='e') ? "envelopeEncrypt" : "envelopeDecrypt");
+
+		printf("\n> Pass %d : %s %s into %s.\n", pass + 1, (streamMode=='e') ? "encrypted" : "decrypted", inPath, outPath);
+		printStats(&stats);
+	}
+
+	envelopeCacheGetStats(keyCache, &cacheStats);
+	printf("\n> Data key cache : %u of %u entries, %lu hits, %lu misses, %lu evictions, memory %s.\n", cacheStats.entries,
+		cacheStats.capacity, cacheStats.hits, cacheStats.misses, cacheStats.evictions, cacheStats.locked ? "locked" : "NOT locked (see ulimit -l)");
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> --encrypt|--decrypt --label <label> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --encrypt | --decrypt  encrypt an object, or decrypt one.\n");
+	printf("  --label <label>        label of the AES key wrapping the data keys, generated on the token if missing.\n");
+	printf("  --in <file>            input file, '-' for stdin (default).\n");
+	printf("  --out <file>           output file, '-' for stdout (default).\n");
+	printf("  --cache <n>            data keys kept in the cache (default 64).\n");
+	printf("  --repeat <n>           run the operation n times on the same file (default 1).\n\n");
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"encrypt",	no_argument,		NULL,	'e'},
+		{"decrypt",	no_argument,		NULL,	'd'},
+		{"label",	required_argument,	NULL,	'l'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"out",		required_argument,	NULL,	'o'},
+		{"cache",	required_argument,	NULL,	'c'},
+		{"repeat",	required_argument,	NULL,	'r'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'e': case 'd': streamMode = opt; break;
+			case 'l': keyLabel = optarg; break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 'c': cacheSize = atoi(optarg); break;
+			case 'r': repeat = atoi(optarg); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(streamMode==0 || keyLabel==NULL)
+	{
+		usage(exeName);
+		exit(1);
+	}
+	if(repeat<1)
+		repeat = 1;
+	if(repeat>1 && (strcmp(inPath, "-")==0 || strcmp(outPath, "-")==0))
+	{
+		printf("\n> --repeat needs --in and --out files.\n\n");
+		exit(1);
+	}
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	CK_RV rv = CKR_OK;
+
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	keyCache = envelopeCacheCreate(cacheSize, &rv);
+	if(keyCache==NULL)
+	{
+		printf("\n> Cannot allocate the data key cache.\n\n");
+		exit(1);
+	}
+	loadLunaLibrary();
+	connectToLunaSlot();
+	findOrGenerateAESKey();
+	runEnvelope();
+	disconnectFromLunaSlot();
+	envelopeCacheDestroy(keyCache);
+	freeMem();
+	return 0;
+}
@@ -0,0 +1,491 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- This sample demonstrates hybrid encryption : RSA-OAEP (CKM_RSA_PKCS_OAEP, SHA-256) for a random AES-256 key, and
+	  AES-256-GCM for the payload, using common/envelope.c.
+	- Unlike CKM_RSA_PKCS_OAEP_demo, the payload can be of any size, and encryption needs no HSM at all : it runs on
+	  the host from the public key, exported once with --export-pub (CKA_MODULUS and CKA_PUBLIC_EXPONENT as PEM).
+	- Only decryption uses the HSM, for one private key operation per object; unwrapped AES keys are cached in
+	  locked, zeroized memory, so --repeat decrypts the same object again without any HSM call.
+	- The key pair labelled --label is generated on the token if it does not exist yet.
+	- Example :-
+		CKM_RSA_PKCS_OAEP_Hybrid_demo 0 userpin --export-pub vault.pem --label vault-rsa
+		CKM_RSA_PKCS_OAEP_Hybrid_demo --encrypt --pub vault.pem --in report.pdf --out report.enc
+		CKM_RSA_PKCS_OAEP_Hybrid_demo 0 userpin --decrypt --label vault-rsa --in report.enc --out report.pdf
+*/
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include <unistd.h>
+#include "../common/envelope.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+CK_OBJECT_HANDLE hPublic = 0;
+CK_OBJECT_HANDLE hPrivate = 0;
+EnvelopeKeyCache *keyCache = NULL;
+
+int streamMode = 0; // 'e' to encrypt, 'd' to decrypt, 'x' to export the public key.
+char *inPath = "-";
+char *outPath = "-";
+char *keyLabel = NULL;
+char *pubPath = NULL; // PEM public key : written by --export-pub, read by --encrypt --pub.
+CK_ULONG modulusBits = 2048;
+unsigned int cacheSize = 64;
+int repeat = 1;
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Connects to a Luna slot (C_Initialize, C_OpenSession, C_Login)
+void connectToLunaSlot()
+{
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Disconnects from Luna slot (C_Logout, C_CloseSession and C_Finalize)
+void disconnectFromLunaSlot()
+{
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Finds the RSA key pair labelled keyLabel, or generates it on the token.
+void findOrGenerateRSAKeyPair()
+{
+	CK_MECHANISM mech = {CKM_RSA_PKCS_KEY_PAIR_GEN};
+	CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+	CK_OBJECT_CLASS priClass = CKO_PRIVATE_KEY;
+	CK_BYTE exp[] = {0x01, 0x00, 0x01};
+	CK_ULONG foundPub = 0, foundPri = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+
+	CK_ATTRIBUTE searchPub[] =
+	{
+		{CKA_CLASS,		&pubClass,		sizeof(pubClass)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE searchPri[] =
+	{
+		{CKA_CLASS,		&priClass,		sizeof(priClass)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE attribPub[] =
+	{
+		{CKA_TOKEN,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&no,			sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&no,			sizeof(CK_BBOOL)},
+		{CKA_MODULUS_BITS,	&modulusBits,		sizeof(CK_ULONG)},
+		{CKA_PUBLIC_EXPONENT,	exp,			sizeof(exp)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_SIGN,		&no,			sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+
+	checkOperation(p11Func->C_FindObjectsInit(hSession, searchPub, sizeof(searchPub)/sizeof(*searchPub)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hPublic, 1, &foundPub), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	checkOperation(p11Func->C_FindObjectsInit(hSession, searchPri, sizeof(searchPri)/sizeof(*searchPri)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hPrivate, 1, &foundPri), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	if(foundPub==1 && foundPri==1)
+	{
+		printf("\n> RSA key pair '%s' found : public key %lu, private key %lu.\n", keyLabel, hPublic, hPrivate);
+		return;
+	}
+	if(streamMode=='d' && foundPri==1)
+	{
+		printf("\n> RSA private key '%s' found as handle : %lu\n", keyLabel, hPrivate);
+		return;
+	}
+	if(streamMode=='d' || foundPub==1 || foundPri==1)
+	{
+		printf("\n> No complete RSA key pair labelled '%s' on the token.\n\n", keyLabel);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	checkOperation(p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, sizeof(attribPub)/sizeof(*attribPub),
+		attribPri, sizeof(attribPri)/sizeof(*attribPri), &hPublic, &hPrivate), "C_GenerateKeyPair");
+	printf("\n> RSA-%lu key pair '%s' generated on the token : public key %lu, private key %lu.\n", modulusBits, keyLabel,
+		hPublic, hPrivate);
+}
+
+
+
+// Reads the public key from the token, and writes it as PEM.
+void exportPublicKey()
+{
+	CK_RV rv = CKR_OK;
+	EnvelopeRsaKey *publicKey = envelopeRsaKeyFromToken(p11Func, hSession, hPublic, &rv);
+
+	checkOperation(rv, "Reading CKA_MODULUS and CKA_PUBLIC_EXPONENT");
+	checkOperation(envelopeRsaKeySave(publicKey, pubPath), "Writing the public key");
+	envelopeRsaKeyFree(publicKey);
+	printf("\n> Public key of '%s' written to %s.\n", keyLabel, pubPath);
+}
+
+
+
+// Opens the files of the stream. When the output is stdout, the messages of the sample move to stderr.
+void openStreams(FILE **in, FILE **out)
+{
+	*in = (strcmp(inPath, "-")==0) ? stdin : fopen(inPath, "rb");
+	if(*in==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", inPath, strerror(errno));
+		exit(1);
+	}
+	if(strcmp(outPath, "-")==0)
+	{
+		*out = fdopen(dup(STDOUT_FILENO), "wb");
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+	else
+		*out = fopen(outPath, "wb");
+	if(*out==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", outPath, strerror(errno));
+		exit(1);
+	}
+}
+
+
+
+// Prints the result of one pass.
+void printStats(const EnvelopeStats *stats)
+{
+	printf("  --> %llu bytes, %.3f seconds, %.2f MB/s.\n", stats->bytes, stats->seconds,
+		(stats->seconds>0) ? stats->bytes / stats->seconds / (1024*1024) : 0);
+	if(streamMode=='e')
+		printf("  --> AES key generated and wrapped on the host, no HSM call.\n");
+	else
+		printf("  --> AES key %s, HSM time %.3f ms.\n", stats->cacheHit ? "found in the cache" : "unwrapped with the private key",
+			stats->hsmSeconds * 1000);
+}
+
+
+
+// Encrypts inPath into outPath on the host, with a public key from a PEM file or from the token.
+void encryptHybrid(EnvelopeRsaKey *publicKey)
+{
+	EnvelopeStats stats;
+	FILE *in = NULL, *out = NULL;
+	CK_RV rv = CKR_OK;
+
+	openStreams(&in, &out);
+	rv = envelopeEncryptRsa(publicKey, in, out, &stats);
+	fclose(out);
+	if(in!=stdin)
+		fclose(in);
+	if(rv!=CKR_OK)
+	{
+		if(strcmp(outPath, "-")!=0)
+			remove(outPath);
+		printf("envelopeEncryptRsa failed with Ox%lX\n\n", rv);
+		exit(1);
+	}
+	printf("\n> Encrypted %s into %s.\n", inPath, outPath);
+	printStats(&stats);
+}
+
+
+
+// Decrypts inPath into outPath, repeat times.
+void decryptHybrid()
+{
+	EnvelopeStats stats;
+	EnvelopeCacheStats cacheStats;
+	FILE *in = NULL, *out = NULL;
+	CK_RV rv = CKR_OK;
+
+	for(int pass=0; pass<repeat; pass++)
+	{
+		openStreams(&in, &out);
+		rv = envelopeDecryptRsa(p11Func, hSession, hPrivate, keyCache, in, out, &stats);
+		fclose(out);
+		if(in!=stdin)
+			fclose(in);
+		if(rv!=CKR_OK && strcmp(outPath, "-")!=0)
+			remove(outPath); // never leave unauthenticated plaintext behind.
+		checkOperation(rv, "envelopeDecryptRsa");
+
+		printf("\n> Pass %d : decrypted %s into %s.\n", pass + 1, inPath, outPath);
+		printStats(&stats);
+	}
+
+	envelopeCacheGetStats(keyCache, &cacheStats);
+	printf("\n> AES key cache : %u of %u entries, %lu hits, %lu misses, memory %s.\n", cacheStats.entries,
+		cacheStats.capacity, cacheStats.hits, cacheStats.misses, cacheStats.locked ? "locked" : "NOT locked (see ulimit -l)");
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> --export-pub <pem> --label <label> [--bits <n>]\n", exeName);
+	printf("%s --encrypt --pub <pem> [--in <file>] [--out <file>]\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> --encrypt --label <label> [--in <file>] [--out <file>]\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> --decrypt --label <label> [--in <file>] [--out <file>] [--cache <n>] [--repeat <n>]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --export-pub <pem>     write the public key of the pair as PEM, for encryption without the HSM.\n");
+	printf("  --encrypt | --decrypt  encrypt an object, or decrypt one.\n");
+	printf("  --pub <pem>            public key to encrypt with; no slot, password or HSM needed.\n");
+	printf("  --label <label>        label of the RSA key pair, generated on the token if missing (not when decrypting).\n");
+	printf("  --bits <n>             modulus size of a generated key pair (default 2048).\n");
+	printf("  --in <file>            input file, '-' for stdin (default).\n");
+	printf("  --out <file>           output file, '-' for stdout (default).\n");
+	printf("  --cache <n>            AES keys kept in the cache (default 64).\n");
+	printf("  --repeat <n>           decrypt the same file n times (default 1).\n\n");
+}
+
+
+
+// Reads the options, from optind.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"encrypt",	no_argument,		NULL,	'e'},
+		{"decrypt",	no_argument,		NULL,	'd'},
+		{"export-pub",	required_argument,	NULL,	'x'},
+		{"pub",		required_argument,	NULL,	'p'},
+		{"label",	required_argument,	NULL,	'l'},
+		{"bits",	required_argument,	NULL,	'b'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"out",		required_argument,	NULL,	'o'},
+		{"cache",	required_argument,	NULL,	'c'},
+		{"repeat",	required_argument,	NULL,	'r'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'e': case 'd': streamMode = opt; break;
+			case 'x': streamMode = 'x'; pubPath = optarg; break;
+			case 'p': pubPath = optarg; break;
+			case 'l': keyLabel = optarg; break;
+			case 'b': modulusBits = atoi(optarg); break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 'c': cacheSize = atoi(optarg); break;
+			case 'r': repeat = atoi(optarg); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(streamMode==0 || (keyLabel==NULL && !(streamMode=='e' && pubPath!=NULL)))
+	{
+		usage(exeName);
+		exit(1);
+	}
+	if(repeat<1)
+		repeat = 1;
+	if(repeat>1 && (strcmp(inPath, "-")==0 || strcmp(outPath, "-")==0))
+	{
+		printf("\n> --repeat needs --in and --out files.\n\n");
+		exit(1);
+	}
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	EnvelopeRsaKey *publicKey = NULL;
+	CK_RV rv = CKR_OK;
+
+	printf("\n%s\n", (char*)argv[0]);
+
+	// Encryption with a PEM public key : no slot, no password, no library.
+	if(argc>1 && ((char*)argv[1])[0]=='-')
+	{
+		optind = 1;
+		parseOptions(argc, (char**)argv, (char*)argv[0]);
+		if(streamMode!='e' || pubPath==NULL)
+		{
+			usage((char*)argv[0]);
+			exit(1);
+		}
+		publicKey = envelopeRsaKeyLoad(pubPath, &rv);
+		if(publicKey==NULL)
+		{
+			printf("\n> Cannot read an RSA public key from %s (0x%lX).\n\n", pubPath, rv);
+			exit(1);
+		}
+		encryptHybrid(publicKey);
+		envelopeRsaKeyFree(publicKey);
+		return 0;
+	}
+
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	optind = 3;
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	findOrGenerateRSAKeyPair();
+	if(streamMode=='x')
+		exportPublicKey();
+	else if(streamMode=='e')
+	{
+		// The public key is read once from the token; the encryption itself runs on the host.
+		publicKey = envelopeRsaKeyFromToken(p11Func, hSession, hPublic, &rv);
+		checkOperation(rv, "Reading CKA_MODULUS and CKA_PUBLIC_EXPONENT");
+		encryptHybrid(publicKey);
+		envelopeRsaKeyFree(publicKey);
+	}
+	else
+	{
+		keyCache = envelopeCacheCreate(cacheSize, &rv);
+		checkOperation(rv, "envelopeCacheCreate");
+		decryptHybrid();
+		envelopeCacheDestroy(keyCache);
+	}
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
@@ -12,6 +12,8 @@
 
 
         OBJECTIVE : This sample demonstrates how to use CKM_RSA_PKCS_OAEP mechanism for encryption using Luna HSM.
+	- The encryption runs on the host, with OpenSSL and the public key read once from the token (see
+	  common/pubkey_cache.h), so the HSM only does the decryption. --hsm-public sends the encryption to the HSM.
 */
 
 
@@ -21,6 +23,7 @@
 #include <cryptoki_v2.h>
 #include <string.h>
 #include <stdlib.h>
+#include "../common/pubkey_cache.h"
 
 
 // Windows and Linux OS uses different header files for loading libraries.
@@ -44,6 +47,8 @@ CK_FUNCTION_LIST *p11Func = NULL;
 CK_SESSION_HANDLE hSession = 0;
 CK_SLOT_ID slotId = 0; // slot id
 CK_BYTE *slotPin = NULL; // slot password
+PubKeyCache *publicKeys = NULL; // runs the public-key operations on the host.
+int localPublic = 1; // 0 with --hsm-public.
 
 CK_OBJECT_HANDLE hPrivate = 0; // Handle number of private key.
 CK_OBJECT_HANDLE hPublic = 0; // Handle number of public key.
@@ -114,6 +119,7 @@ void freeMem()
                 FreeLibrary(libHandle); // Close library handle on Windows.
         #endif
 	free(slotPin);
+	pubKeyCacheDestroy(publicKeys);
 	free(encryptedData);
 	free(decryptedData);
 }
@@ -210,17 +216,37 @@ void initOAEP()
 
 
 
+// Creates the cache that reads the public key once and runs the public-key operations on the host.
+void createPublicKeyCache()
+{
+	CK_RV rv = CKR_OK;
+	publicKeys = pubKeyCacheCreate(p11Func, 1, localPublic, &rv);
+	checkOperation(rv, "pubKeyCacheCreate");
+}
+
+
+
+// Tells where the last public-key operation ran.
+void printPublicKeyUse()
+{
+	PubKeyCacheStats stats;
+	pubKeyCacheGetStats(publicKeys, &stats);
+	printf("  --> %s.\n", (stats.localOps>0) ? "done on the host with the public key read from the token" : "done by the HSM");
+}
+
+
+
 // This function encrypt data
 CK_ULONG encryptData()
 {
         initOAEP();
         CK_MECHANISM mech = {CKM_RSA_PKCS_OAEP, &oaepParam, sizeof(oaepParam)};
         CK_ULONG encLen = 0;
-        checkOperation(p11Func->C_EncryptInit(hSession, &mech, hPublic),"C_EncryptInit");
-        checkOperation(p11Func->C_Encrypt(hSession, (CK_BYTE_PTR)rawData, strlen(rawData), NULL_PTR, &encLen),"C_Encrypt");
+        checkOperation(pubKeyEncrypt(publicKeys, hSession, &mech, hPublic, (CK_BYTE_PTR)rawData, strlen(rawData), NULL_PTR, &encLen),"pubKeyEncrypt");
         encryptedData = (CK_BYTE*)calloc(encLen, sizeof(CK_BYTE));
-        checkOperation(p11Func->C_Encrypt(hSession, (CK_BYTE_PTR)rawData, strlen(rawData), encryptedData, &encLen),"C_Encrypt");
+        checkOperation(pubKeyEncrypt(publicKeys, hSession, &mech, hPublic, (CK_BYTE_PTR)rawData, strlen(rawData), encryptedData, &encLen),"pubKeyEncrypt");
 	printf("\n> Plaintext encrypted.\n");
+        printPublicKeyUse();
         return encLen;
 }
 
@@ -256,7 +282,8 @@ void bytesToHex(const CK_BYTE *data, CK_ULONG dataLen)
 void usage(const char exeName[30])
 {
 	printf("\nUsage :-\n");
-	printf("%s <slot_number> <crypto_office_password>\n\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> [--hsm-public]\n\n", exeName);
+	printf("  --hsm-public  encrypt on the HSM instead of on the host.\n\n");
 }
 
 
@@ -271,9 +298,12 @@ int main(int argc, char **argv[])
 	slotId = atoi((const char*)argv[1]);
 	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
 	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	if(argc>3 && strcmp((const char*)argv[3], "--hsm-public")==0)
+		localPublic = 0;
 
 	loadLunaLibrary();
 	connectToLunaSlot();
+	createPublicKeyCache();
 	generateRSAKeyPair();
 	CK_ULONG dataLen = encryptData();
 	decryptData(dataLen);
@@ -0,0 +1,508 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- This sample migrates legacy 3DES ciphertext to AES : every record encrypted with CKM_DES3_CBC_PAD, as
+	  CKM_DES3_CBC_PAD_demo does, is decrypted and encrypted again with CKM_AES_GCM under an AES-256 key, in the same
+	  session, with common/record_migration.c.
+	- The plaintext of a record never leaves the worker that re-encrypts it, and is wiped as soon as the record is
+	  encrypted again. --workers sessions re-encrypt batches of records in parallel, and the output keeps the input
+	  order.
+	- A checkpoint is saved every --interval seconds, after the output is synced to disk. If the run stops, for any
+	  reason, running the same command with --resume carries on from the last checkpoint, so a migration of many
+	  hours survives restarts.
+	- The migrated records use the layout of AES_Record_Batch_demo (IV || ciphertext || tag), which decrypts them
+	  with --decrypt --mech gcm.
+	- --generate n first writes n test records encrypted under the 3DES key (generated if missing) into --in.
+	- Batches end at --batch records or --batch-bytes bytes of records. Without --batch-bytes, the chunk size
+	  calibrated for the mechanism on the slot is used (common/chunk_tuner.c, see --calibrate in
+	  CKM_AES_ECB_demo, CKM_AES_CBC_PAD_demo and CKM_AES_GCM_Chunked_demo), or 256K.
+	- Example :-
+		DES3_To_AES_Migration_demo 0 userpin --des3-label legacy-key --aes-label new-key --in legacy.hex --out migrated.hex --workers 8
+		DES3_To_AES_Migration_demo 0 userpin --des3-label legacy-key --aes-label new-key --in legacy.hex --out migrated.hex --workers 8 --resume
+	NOTE :- CKM_DES3_CBC_PAD is not FIPS Approved, and CKM_AES_GCM with an IV from the host is refused in FIPS mode,
+	therefore this sample needs a Luna HSM with FIPS restrictions off.
+*/
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include "../common/session_pool.h"
+#include "../common/record_batch.h"
+#include "../common/chunk_tuner.h"
+#include "../common/record_migration.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+SessionPool *sessionPool = NULL;
+CK_OBJECT_HANDLE hDes3Key = 0;
+CK_OBJECT_HANDLE hAesKey = 0;
+
+char *des3Label = NULL;
+char *aesLabel = NULL;
+char *inPath = NULL;
+char *outPath = NULL;
+char *checkpointPath = NULL; // NULL until set : <out>.checkpoint.
+int resume = 0;
+double interval = 5;
+unsigned long generateRecords = 0;
+int inFormat = RECORD_HEX;
+int outFormat = RECORD_HEX;
+unsigned int workers = 4;
+unsigned int window = 0; // 0 until set : twice the workers.
+unsigned int batchRecords = 256;
+CK_ULONG batchBytes = 0; // 0 until set : the chunk size calibrated for the mechanism on the slot, or 256K.
+CK_ULONG maxRecord = 64*1024;
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+
+
+// Initializes the library, logs in, and opens the session pool used by the workers.
+void connectToLunaSlot()
+{
+	CK_RV rv = CKR_OK;
+
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), workers, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Closes the pool and the session, and finalizes the library.
+void disconnectFromLunaSlot()
+{
+	sessionPoolDestroy(sessionPool);
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Finds the secret key of keyType labelled label. If it is missing and generate is set, a token key is generated
+// with genMechanism, otherwise the sample exits.
+CK_OBJECT_HANDLE findOrGenerateKey(const char *label, CK_KEY_TYPE keyType, CK_MECHANISM_TYPE genMechanism,
+	CK_ULONG keyLen, int generate)
+{
+	CK_MECHANISM mech = {genMechanism};
+	CK_OBJECT_CLASS keyClass = CKO_SECRET_KEY;
+	CK_OBJECT_HANDLE hKey = 0;
+	CK_ULONG found = 0;
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+
+	CK_ATTRIBUTE search[] =
+	{
+		{CKA_CLASS,		&keyClass,		sizeof(keyClass)},
+		{CKA_KEY_TYPE,		&keyType,		sizeof(keyType)},
+		{CKA_LABEL,		(char*)label,		strlen(label)}
+	};
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_TOKEN,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_ENCRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_DECRYPT,		&yes,			sizeof(CK_BBOOL)},
+		{CKA_WRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_UNWRAP,		&no,			sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,			sizeof(CK_BBOOL)},
+		{CKA_LABEL,		(char*)label,		strlen(label)},
+		{CKA_VALUE_LEN,		&keyLen,		sizeof(CK_ULONG)}
+	};
+	CK_ULONG attribLen = sizeof(attrib)/sizeof(*attrib) - ((keyType==CKK_DES3) ? 1 : 0); // 3DES keys have a fixed length.
+
+	checkOperation(p11Func->C_FindObjectsInit(hSession, search, sizeof(search)/sizeof(*search)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hKey, 1, &found), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	if(found==1)
+	{
+		printf("\n> %s key '%s' found as handle : %lu\n", (keyType==CKK_DES3) ? "3DES" : "AES", label, hKey);
+		return hKey;
+	}
+	if(!generate)
+	{
+		printf("\n> No %s key labelled '%s'.\n\n", (keyType==CKK_DES3) ? "3DES" : "AES", label);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	checkOperation(p11Func->C_GenerateKey(hSession, &mech, attrib, attribLen, &hKey), "C_GenerateKey");
+	printf("\n> %s key '%s' generated on the token as handle : %lu\n", (keyType==CKK_DES3) ? "3DES" : "AES", label, hKey);
+	return hKey;
+}
+
+
+
+// Without --batch-bytes, cuts batches at the chunk size calibrated for CKM_DES3_CBC_PAD on the slot (see
+// common/chunk_tuner.h), or at 256K.
+CK_ULONG pickBatchBytes()
+{
+	if(batchBytes==0)
+		batchBytes = chunkTunerPick(p11Func, slotId, CKM_DES3_CBC_PAD, RECORD_BATCH_BYTES, stdout);
+	return batchBytes;
+}
+
+
+
+// Writes generateRecords test records, encrypted under the 3DES key, into inPath.
+void generateLegacyRecords()
+{
+	RecordBatchConfig config;
+	RecordBatchStats stats;
+	FILE *plain = tmpfile();
+	FILE *out = fopen(inPath, "wb");
+
+	if(plain==NULL || out==NULL)
+	{
+		printf("\n> Cannot create %s : %s\n\n", inPath, strerror(errno));
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	for(unsigned long ctr=0; ctr<generateRecords; ctr++)
+		fprintf(plain, "account-%08lu;%016lu\n", ctr, (ctr * 2654435761UL) % 10000000000000000UL);
+	rewind(plain);
+
+	memset(&config, 0, sizeof(config));
+	config.mechanism = CKM_DES3_CBC_PAD;
+	config.encrypt = 1;
+	config.hKey = hDes3Key;
+	config.inFormat = RECORD_LINES;
+	config.outFormat = (RecordFormat)inFormat;
+	config.workers = workers;
+	config.window = window;
+	config.batchRecords = batchRecords;
+	config.batchBytes = pickBatchBytes();
+	config.maxRecord = maxRecord;
+	checkOperation(recordBatchRun(p11Func, sessionPool, &config, plain, out, &stats), "recordBatchRun");
+	fclose(plain);
+	fclose(out);
+	printf("\n> %lu legacy records encrypted with CKM_DES3_CBC_PAD into %s.\n", generateRecords, inPath);
+}
+
+
+
+// Re-encrypts inPath into outPath, resuming from the checkpoint when asked to.
+void migrate()
+{
+	MigrationConfig config;
+	MigrationStats stats;
+	CK_RV rv = CKR_OK;
+
+	memset(&config, 0, sizeof(config));
+	config.batch.mechanism = CKM_DES3_CBC_PAD;
+	config.batch.hKey = hDes3Key;
+	config.batch.targetMechanism = CKM_AES_GCM;
+	config.batch.hTargetKey = hAesKey;
+	config.batch.inFormat = (RecordFormat)inFormat;
+	config.batch.outFormat = (RecordFormat)outFormat;
+	config.batch.workers = workers;
+	config.batch.window = window;
+	config.batch.batchRecords = batchRecords;
+	config.batch.batchBytes = pickBatchBytes();
+	config.batch.maxRecord = maxRecord;
+	config.inPath = inPath;
+	config.outPath = outPath;
+	config.checkpointPath = checkpointPath;
+	config.checkpointSeconds = interval;
+	config.resume = resume;
+
+	rv = migrationRun(p11Func, sessionPool, &config, &stats);
+	if(rv==CKR_OK && stats.resumedFrom.complete)
+	{
+		printf("\n> %s says the migration of %s is already complete (%llu records).\n", checkpointPath, inPath,
+			stats.resumedFrom.records);
+		return;
+	}
+	if(rv!=CKR_OK)
+	{
+		if(stats.batch.failedRecord!=~0ULL)
+			printf("\n> Record %llu (counted from 0) failed.\n", stats.batch.failedRecord);
+		if(stats.batch.ioError!=0)
+			printf("\n> I/O error : %s\n", strerror(stats.batch.ioError));
+		if(rv==CKR_SAVED_STATE_INVALID)
+			printf("\n> %s does not match this input, these mechanisms, or the output.\n", checkpointPath);
+		else
+			printf("\n> %s covers %llu records; run again with --resume to carry on from there.\n", checkpointPath,
+				stats.reached.records);
+	}
+	checkOperation(rv, "migrationRun");
+
+	printf("\n> Migrated %s from CKM_DES3_CBC_PAD to CKM_AES_GCM into %s.\n", inPath, outPath);
+	migrationPrintStats(stdout, &stats);
+}
+
+
+
+// Reads a record framing name, or returns -1.
+int parseFormat(const char *text)
+{
+	if(strcmp(text, "prefixed")==0)
+		return RECORD_PREFIXED;
+	if(strcmp(text, "lines")==0)
+		return RECORD_LINES;
+	if(strcmp(text, "hex")==0)
+		return RECORD_HEX;
+	return -1;
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> --des3-label <label> --aes-label <label> --in <file> --out <file> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --des3-label <label>   label of the 3DES key the records are encrypted with.\n");
+	printf("  --aes-label <label>    label of the AES-256 key to encrypt them with, generated on the token if missing.\n");
+	printf("  --in <file>            legacy records, encrypted with CKM_DES3_CBC_PAD (a regular file).\n");
+	printf("  --out <file>           migrated records, encrypted with CKM_AES_GCM (a regular file).\n");
+	printf("  --checkpoint <file>    checkpoint file (default <out>.checkpoint).\n");
+	printf("  --resume               carry on from the checkpoint, if there is one.\n");
+	printf("  --interval <seconds>   least time between two checkpoints (default 5, 0 for every batch).\n");
+	printf("  --in-format <format>   hex (default), prefixed or lines.\n");
+	printf("  --out-format <format>  hex (default), prefixed or lines.\n");
+	printf("  --workers <n>          sessions re-encrypting batches at once (default 4).\n");
+	printf("  --batch <n>            records per batch (default 256).\n");
+	printf("  --batch-bytes <size>   record bytes per batch, K and M suffixes accepted (default : calibrated, or 256K).\n");
+	printf("  --window <n>           batches in memory at once (default twice the workers).\n");
+	printf("  --max-record <size>    longest record accepted, K and M suffixes accepted (default 64K).\n");
+	printf("  --generate <n>         first write n test records encrypted under the 3DES key into --in.\n\n");
+}
+
+
+
+// Reads a size such as 4096, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"des3-label",	required_argument,	NULL,	'D'},
+		{"aes-label",	required_argument,	NULL,	'A'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"out",		required_argument,	NULL,	'o'},
+		{"checkpoint",	required_argument,	NULL,	'c'},
+		{"resume",	no_argument,		NULL,	'r'},
+		{"interval",	required_argument,	NULL,	't'},
+		{"in-format",	required_argument,	NULL,	'I'},
+		{"out-format",	required_argument,	NULL,	'O'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{"batch",	required_argument,	NULL,	'b'},
+		{"batch-bytes",	required_argument,	NULL,	'B'},
+		{"window",	required_argument,	NULL,	'W'},
+		{"max-record",	required_argument,	NULL,	'x'},
+		{"generate",	required_argument,	NULL,	'g'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'D': des3Label = optarg; break;
+			case 'A': aesLabel = optarg; break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 'c': checkpointPath = optarg; break;
+			case 'r': resume = 1; break;
+			case 't': interval = atof(optarg); break;
+			case 'I': inFormat = parseFormat(optarg); if(inFormat<0) { usage(exeName); exit(1); } break;
+			case 'O': outFormat = parseFormat(optarg); if(outFormat<0) { usage(exeName); exit(1); } break;
+			case 'w': workers = atoi(optarg); break;
+			case 'b': batchRecords = atoi(optarg); break;
+			case 'B': batchBytes = parseSize(optarg, exeName); break;
+			case 'W': window = atoi(optarg); break;
+			case 'x': maxRecord = parseSize(optarg, exeName); break;
+			case 'g': generateRecords = strtoul(optarg, NULL, 10); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(des3Label==NULL || aesLabel==NULL || inPath==NULL || outPath==NULL || workers==0 || batchRecords==0
+		|| maxRecord==0 || interval<0)
+	{
+		usage(exeName);
+		exit(1);
+	}
+	if(checkpointPath==NULL)
+	{
+		checkpointPath = (char*)malloc(strlen(outPath) + sizeof(".checkpoint"));
+		sprintf(checkpointPath, "%s.checkpoint", outPath);
+	}
+	if(window==0)
+		window = 2 * workers;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	hDes3Key = findOrGenerateKey(des3Label, CKK_DES3, CKM_DES3_KEY_GEN, 0, generateRecords>0);
+	hAesKey = findOrGenerateKey(aesLabel, CKK_AES, CKM_AES_KEY_GEN, 32, 1);
+	if(generateRecords>0)
+		generateLegacyRecords();
+	migrate();
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
@@ -18,6 +18,13 @@
 	- Cryptographic operations in a session are processed serially in Luna HSM, and each session can handle a limited number of operations.
 	- To boost performance, a PKCS#11 application can open multiple threads, with a session open for each thread.
 	- These sessions can then execute cryptographic operations in parallel, significantly improving performance.
+	- Sessions are taken from a shared pool (common/session_pool.c) : they are opened once, stay logged in, and
+	  threads acquire one per sign operation without locking. --sessions caps how many are open on the partition.
+	- By default each sign is a single C_Sign into a buffer owned by the thread and sized once from the key (common/crypto_ops.c).
+	  --sign-path probe switches back to the usual size probe + calloc + C_Sign, to compare the two.
+	- The latency of every sign operation is recorded, and the run is summarised as ops/sec plus p50/p90/p99/p99.9/max latency.
+	- Passing options after the password runs it as a non-interactive benchmark, for example :-
+		MultiThread_Signing_demo 0 userpin --threads 8 --duration 30 --warmup 50 --mechanism ecdsa-sha256 --key-size 256 --json result.json
 
 */
 
@@ -31,6 +38,11 @@
 #include <stdlib.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <stdatomic.h>
+#include "../common/bench_stats.h"
+#include "../common/session_pool.h"
+#include "../common/crypto_ops.h"
 
 
 // Windows and Linux OS uses different header files for loading libraries.
@@ -60,6 +72,53 @@ CK_BYTE plainText[] = "Hello World, I've been waiting for the chance to see your
 int nThreads = 0;
 int ops = 0;
 
+int warmupOps = 0; // sign operations performed by each thread before measurement starts.
+int durationSec = 0; // when set, threads keep signing for this many seconds instead of a fixed number of operations.
+CK_ULONG keySize = 2048; // RSA modulus bits, or EC curve size (256, 384, 521). EdDSA keys are Ed25519.
+char *jsonPath = NULL;
+char *csvPath = NULL;
+int maxSessions = 0; // sessions the pool may open, defaults to the number of threads.
+SessionPool *sessionPool = NULL;
+int probeSignPath = 0; // 1 to size every signature with an extra C_Sign call and allocate it.
+CryptoKeyInfo signKey; // output sizing for hPrivate, read once after key generation.
+atomic_int stopSigning = 0;
+pthread_barrier_t startBarrier;
+
+
+// Signing mechanisms that can be benchmarked.
+typedef struct
+{
+	const char *option; // value accepted by --mechanism
+	const char *name;
+	CK_MECHANISM_TYPE type;
+	CK_KEY_TYPE keyType;
+	CK_ULONG dataLen; // bytes signed per operation. Raw ECDSA signs a 32 byte digest.
+} SignMechanism;
+
+SignMechanism signMechanisms[] =
+{
+	{"sha256-rsa-pkcs",	"CKM_SHA256_RSA_PKCS",		CKM_SHA256_RSA_PKCS,		CKK_RSA,	0},
+	{"sha256-rsa-pkcs-pss",	"CKM_SHA256_RSA_PKCS_PSS",	CKM_SHA256_RSA_PKCS_PSS,	CKK_RSA,	0},
+	{"rsa-pkcs",		"CKM_RSA_PKCS",			CKM_RSA_PKCS,			CKK_RSA,	0},
+	{"ecdsa-sha256",	"CKM_ECDSA_SHA256",		CKM_ECDSA_SHA256,		CKK_EC,		0},
+	{"ecdsa",		"CKM_ECDSA",			CKM_ECDSA,			CKK_EC,		32},
+	{"eddsa",		"CKM_EDDSA",			CKM_EDDSA,			CKK_EC_EDWARDS,	0}
+};
+SignMechanism *signMech = &signMechanisms[0];
+CK_RSA_PKCS_PSS_PARAMS pssParams = {CKM_SHA256, CKG_MGF1_SHA256, 32};
+
+
+// State owned by each signing thread.
+typedef struct
+{
+	LatencyRecorder latency;
+	unsigned long errors;
+	CK_RV lastError;
+	double started; // measured phase of this thread, used for the wall time of the run.
+	double finished;
+	CryptoBuffer signature; // reused by every sign of this thread.
+} SignWorker;
+
 
 // Loads Luna cryptoki library
 void loadLunaLibrary()
@@ -161,14 +220,13 @@ void disconnectFromLunaSlot()
 
 
 
-//This function generates RSA-2048 keypair for C_Sign operation.
+//This function generates an RSA keypair (keySize bits) for C_Sign operation.
 void generateRSAKeyPair()
 {
         CK_MECHANISM mech = {CKM_RSA_PKCS_KEY_PAIR_GEN};
         CK_BBOOL yes = CK_TRUE;
         CK_BBOOL no = CK_FALSE;
-        CK_ULONG mod = 2048;
-        CK_BYTE exp[] = "10001";
+        CK_BYTE exp[] = {0x01, 0x00, 0x01};
 
         CK_ATTRIBUTE attribPub[] =
         {
@@ -176,8 +234,8 @@ void generateRSAKeyPair()
                 {CKA_ENCRYPT,           &yes,           sizeof(CK_BBOOL)},
                 {CKA_VERIFY,            &yes,           sizeof(CK_BBOOL)},
                 {CKA_PRIVATE,           &yes,           sizeof(CK_BBOOL)},
-                {CKA_MODULUS_BITS,      &mod,           sizeof(CK_ULONG)},
-                {CKA_PUBLIC_EXPONENT,   &exp,           sizeof(exp)-1}
+                {CKA_MODULUS_BITS,      &keySize,       sizeof(CK_ULONG)},
+                {CKA_PUBLIC_EXPONENT,   &exp,           sizeof(exp)}
         };
         CK_ULONG pubTemplateLen = sizeof(attribPub)/sizeof(*attribPub);
 
@@ -194,51 +252,368 @@ void generateRSAKeyPair()
         CK_ULONG priTemplateLen = sizeof(attribPri)/sizeof(*attribPri);
 
         checkOperation(p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, pubTemplateLen, attribPri, priTemplateLen, &hPublic, &hPrivate), "C_GenerateKeyPair");
-	printf(">\n RSA-2048 keypair generated.\n");
+	printf("\n> RSA-%lu keypair generated.\n", keySize);
 	printf("  --> Private key handle : %lu.\n", hPrivate);
 	printf("  --> Public key handle : %lu.\n", hPublic);
 }
 
 
 
-// This function signs the plaintext.
-void *signData(void *arg)
+//This function generates an EC keypair on the curve matching keySize.
+void generateECKeyPair()
+{
+	CK_MECHANISM mech = {CKM_EC_KEY_PAIR_GEN};
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_BYTE p256[] = {0x06,0x08,0x2A,0x86,0x48,0xCE,0x3D,0x03,0x01,0x07}; // secp256r1
+	CK_BYTE p384[] = {0x06,0x05,0x2B,0x81,0x04,0x00,0x22}; // secp384r1
+	CK_BYTE p521[] = {0x06,0x05,0x2B,0x81,0x04,0x00,0x23}; // secp521r1
+	CK_BYTE *ecParam = p256;
+	CK_ULONG ecParamLen = sizeof(p256);
+
+	if(keySize==384)
+	{
+		ecParam = p384;
+		ecParamLen = sizeof(p384);
+	}
+	else if(keySize==521)
+	{
+		ecParam = p521;
+		ecParamLen = sizeof(p521);
+	}
+	else if(keySize!=256)
+	{
+		printf("Unsupported EC key size %lu. Use 256, 384 or 521.\n", keySize);
+		exit(1);
+	}
+
+	CK_ATTRIBUTE attribPub[] =
+	{
+		{CKA_TOKEN,	&no,		sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,	&yes,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,	&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,	ecParam,	ecParamLen}
+	};
+	CK_ULONG pubTemplateLen = sizeof(attribPub)/sizeof(*attribPub);
+
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,		&no,	sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,	sizeof(CK_BBOOL)},
+		{CKA_SIGN,		&yes,	sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,	sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,	sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,	sizeof(CK_BBOOL)}
+	};
+	CK_ULONG priTemplateLen = sizeof(attribPri)/sizeof(*attribPri);
+
+	checkOperation(p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, pubTemplateLen, attribPri, priTemplateLen, &hPublic, &hPrivate), "C_GenerateKeyPair");
+	printf("\n> EC-%lu keypair generated.\n", keySize);
+	printf("  --> Private key handle : %lu.\n", hPrivate);
+	printf("  --> Public key handle : %lu.\n", hPublic);
+}
+
+
+
+//This function generates an Ed25519 keypair for CKM_EDDSA.
+void generateEdwardsKeyPair()
+{
+	CK_MECHANISM mech = {CKM_EC_EDWARDS_KEY_PAIR_GEN};
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_BYTE ed25519[] = {0x06,0x09,0x2B,0x06,0x01,0x04,0x01,0xDA,0x47,0x0F,0x01}; // Ed25519, oid 1.3.6.1.4.1.11591.15.1
+
+	CK_ATTRIBUTE attribPub[] =
+	{
+		{CKA_TOKEN,	&no,		sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,	&yes,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,	&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,	ed25519,	sizeof(ed25519)}
+	};
+	CK_ULONG pubTemplateLen = sizeof(attribPub)/sizeof(*attribPub);
+
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,		&no,	sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,	sizeof(CK_BBOOL)},
+		{CKA_SIGN,		&yes,	sizeof(CK_BBOOL)},
+		{CKA_MODIFIABLE,	&no,	sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,	sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,	sizeof(CK_BBOOL)}
+	};
+	CK_ULONG priTemplateLen = sizeof(attribPri)/sizeof(*attribPri);
+
+	checkOperation(p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, pubTemplateLen, attribPri, priTemplateLen, &hPublic, &hPrivate), "C_GenerateKeyPair");
+	printf("\n> Ed25519 keypair generated.\n");
+	printf("  --> Private key handle : %lu.\n", hPrivate);
+	printf("  --> Public key handle : %lu.\n", hPublic);
+}
+
+
+
+// Performs a single sign operation : size probe, allocate, sign.
+CK_RV signWithProbe(CK_SESSION_HANDLE hChildSession, CK_MECHANISM *mech, CK_ULONG dataLen)
+{
+	CK_BYTE *signature = NULL;
+	CK_ULONG sigLen = 0;
+	CK_RV rv;
+
+	rv = p11Func->C_SignInit(hChildSession, mech, hPrivate);
+	if(rv!=CKR_OK)
+		return rv;
+	rv = p11Func->C_Sign(hChildSession, plainText, dataLen, NULL, &sigLen);
+	if(rv!=CKR_OK)
+		return rv;
+	signature = (CK_BYTE*)calloc(sigLen, 1);
+	rv = p11Func->C_Sign(hChildSession, plainText, dataLen, signature, &sigLen);
+	free(signature);
+	return rv;
+}
+
+
+
+// Takes a session from the pool, signs once and gives the session back.
+CK_RV signWithPooledSession(SignWorker *worker, CK_MECHANISM *mech, CK_ULONG dataLen)
 {
-        CK_SESSION_HANDLE hChildSession = 0;
-        CK_BYTE *signature = NULL;
-        CK_MECHANISM mech = {CKM_SHA256_RSA_PKCS};
-        CK_ULONG sigLen = 0;
+	CK_ULONG sigLen = 0;
+	PooledSession *session = NULL;
+	CK_RV rv = sessionPoolAcquire(sessionPool, &session);
+	if(rv!=CKR_OK)
+		return rv;
+	if(probeSignPath)
+		rv = signWithProbe(session->hSession, mech, dataLen);
+	else
+		rv = cryptoSign(p11Func, session->hSession, mech, &signKey, plainText, dataLen, &worker->signature, &sigLen);
+	sessionPoolRelease(sessionPool, session, rv);
+	return rv;
+}
 
-        checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL_PTR, NULL_PTR, &hChildSession), "C_OpenSession");
 
-	for(int ctr=0;ctr<ops;ctr++)
+
+// This function signs the plaintext and records the latency of every operation.
+void *signData(void *arg)
+{
+	SignWorker *worker = (SignWorker*)arg;
+        CK_MECHANISM mech = {signMech->type, NULL_PTR, 0};
+	CK_ULONG dataLen = signMech->dataLen ? signMech->dataLen : sizeof(plainText)-1;
+	double start = 0;
+	CK_RV rv;
+
+	if(signMech->type==CKM_SHA256_RSA_PKCS_PSS)
 	{
-        	checkOperation(p11Func->C_SignInit(hChildSession, &mech, hPrivate), "C_SignInit");
-	        checkOperation(p11Func->C_Sign(hChildSession, plainText, sizeof(plainText)-1, NULL, &sigLen), "C_Sign");
-        	signature = (CK_BYTE*)calloc(sigLen, 1);
-	        checkOperation(p11Func->C_Sign(hChildSession, plainText, sizeof(plainText)-1, signature, &sigLen), "C_Sign");
-		free(signature);
+		mech.pParameter = &pssParams;
+		mech.ulParameterLen = sizeof(pssParams);
 	}
 
-       	checkOperation(p11Func->C_CloseSession(hChildSession), "C_CloseSession");
+	for(int ctr=0;ctr<warmupOps;ctr++)
+		signWithPooledSession(worker, &mech, dataLen);
+
+	pthread_barrier_wait(&startBarrier); // all threads start measuring together.
+	worker->started = benchNowMicros();
+
+	for(int ctr=0; (durationSec>0) ? !atomic_load(&stopSigning) : (ctr<ops); ctr++)
+	{
+		start = benchNowMicros();
+		rv = signWithPooledSession(worker, &mech, dataLen);
+		if(rv==CKR_OK)
+			latencyRecord(&worker->latency, benchNowMicros() - start);
+		else
+		{
+			worker->errors++;
+			worker->lastError = rv;
+		}
+	}
+	worker->finished = benchNowMicros();
         return 0;
 }
 
 
 
+// Starts the signing threads, waits for them and reports the measured throughput and latency.
+void runBenchmark()
+{
+	pthread_t *sign = (pthread_t*)malloc(nThreads * sizeof(pthread_t));
+	SignWorker *workers = (SignWorker*)calloc(nThreads, sizeof(SignWorker));
+	LatencyRecorder all;
+	BenchResult result;
+	SessionPoolStats poolStats;
+	CK_MECHANISM mech = {signMech->type, NULL_PTR, 0};
+	double start = 0;
+	double end = 0;
+	double elapsed = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(&result, 0, sizeof(result));
+	if(maxSessions<=0)
+		maxSessions = nThreads;
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), maxSessions, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+	pthread_barrier_init(&startBarrier, NULL, nThreads+1);
+
+	printf("\n> Starting %d threads.\n", nThreads);
+	for(int ctr=0;ctr<nThreads;ctr++)
+	{
+		latencyInit(&workers[ctr].latency, (durationSec>0) ? 0 : ops);
+		pthread_create(&sign[ctr], NULL, &signData, &workers[ctr]);
+		printf("  --> Thread %d has started. TID : %lu.\n", ctr, sign[ctr]);
+	}
+
+	pthread_barrier_wait(&startBarrier); // released once every thread has finished its warmup.
+	if(durationSec>0)
+	{
+		sleep(durationSec);
+		atomic_store(&stopSigning, 1);
+	}
+
+	for(int ctr=0;ctr<nThreads;ctr++)
+	{
+		pthread_join(sign[ctr], NULL);
+	}
+
+	latencyInit(&all, 0);
+	for(int ctr=0;ctr<nThreads;ctr++)
+	{
+		latencyMerge(&all, &workers[ctr].latency);
+		if(ctr==0 || workers[ctr].started<start)
+			start = workers[ctr].started;
+		if(workers[ctr].finished>end)
+			end = workers[ctr].finished;
+		result.errors += workers[ctr].errors;
+		if(workers[ctr].errors>0)
+			printf("  --> Thread %d : %lu sign operations failed, last error 0x%lX.\n", ctr, workers[ctr].errors, workers[ctr].lastError);
+		latencyFree(&workers[ctr].latency);
+		cryptoBufferFree(&workers[ctr].signature);
+	}
+
+	elapsed = (end - start) / 1e6;
+	snprintf(result.mechanism, sizeof(result.mechanism), "%s", signMech->name);
+	result.keySize = keySize;
+	result.payload = signMech->dataLen ? signMech->dataLen : sizeof(plainText)-1;
+	result.threads = nThreads;
+	benchSummarize(&all, elapsed, &result);
+	latencyFree(&all);
+
+	sessionPoolGetStats(sessionPool, &poolStats);
+	sessionPoolDestroy(sessionPool);
+
+	printf("\n> %lu sign operation completed by %d threads in %.2f seconds.\n", result.ops, nThreads, elapsed);
+	if(probeSignPath)
+		printf("  --> Sign path : size probe + calloc + C_Sign.\n");
+	else
+		printf("  --> Sign path : single C_Sign into a %lu byte per-thread buffer.\n", cryptoSignatureSize(&signKey, &mech));
+	printf("  --> Session pool : %u sessions open (max %u), %lu opened, %lu acquisitions waited, %lu dropped.\n",
+		poolStats.open, poolStats.maxSessions, poolStats.opened, poolStats.waited, poolStats.dropped);
+	benchPrintTable(stdout, &result, 1);
+	if(jsonPath!=NULL)
+		benchSaveJson(jsonPath, "MultiThread_Signing_demo", &result, 1);
+	if(csvPath!=NULL)
+		benchSaveCsv(csvPath, &result, 1);
+
+	pthread_barrier_destroy(&startBarrier);
+	free(workers);
+	free(sign);
+}
+
+
+
 // Prints the syntax for executing this code.
 void usage(const char exeName[30])
 {
 	printf("\nUsage :-\n");
-	printf("%s <slot_number> <crypto_office_password>\n\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> [options]\n\n", exeName);
+	printf("Without options the number of threads and operations are read interactively.\n\n");
+	printf("Options :-\n");
+	printf("  --threads <n>        number of signing threads.\n");
+	printf("  --ops <n>            sign operations per thread (default 1000).\n");
+	printf("  --duration <sec>     sign for this many seconds instead of a fixed number of operations.\n");
+	printf("  --warmup <n>         unmeasured sign operations per thread before the run (default 0).\n");
+	printf("  --sessions <n>       maximum sessions opened on the slot (default : one per thread).\n");
+	printf("  --mechanism <name>   sha256-rsa-pkcs (default), sha256-rsa-pkcs-pss, rsa-pkcs, ecdsa-sha256, ecdsa, eddsa.\n");
+	printf("  --key-size <bits>    RSA : 2048 (default), 3072, 4096.  EC : 256, 384, 521.  EdDSA : Ed25519 only.\n");
+	printf("  --sign-path <path>   presized (default) : one C_Sign into a reused buffer, probe : size probe + calloc + C_Sign.\n");
+	printf("  --json <file>        write the results as JSON ('-' for stdout).\n");
+	printf("  --csv <file>         write the results as CSV ('-' for stdout).\n\n");
 }
 
 
 
-int main(int argc, char **argv[])
+// Reads the benchmark options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
 {
-	pthread_t *sign = NULL;
+	int opt = 0;
+	int keySizeSet = 0;
+	struct option longOptions[] =
+	{
+		{"threads",	required_argument,	NULL,	't'},
+		{"ops",		required_argument,	NULL,	'o'},
+		{"duration",	required_argument,	NULL,	'd'},
+		{"warmup",	required_argument,	NULL,	'w'},
+		{"sessions",	required_argument,	NULL,	's'},
+		{"mechanism",	required_argument,	NULL,	'm'},
+		{"key-size",	required_argument,	NULL,	'k'},
+		{"json",	required_argument,	NULL,	'j'},
+		{"csv",		required_argument,	NULL,	'c'},
+		{"sign-path",	required_argument,	NULL,	'p'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 't': nThreads = atoi(optarg); break;
+			case 'o': ops = atoi(optarg); break;
+			case 'd': durationSec = atoi(optarg); break;
+			case 'w': warmupOps = atoi(optarg); break;
+			case 's': maxSessions = atoi(optarg); break;
+			case 'k': keySize = strtoul(optarg, NULL, 10); keySizeSet = 1; break;
+			case 'j': jsonPath = optarg; break;
+			case 'c': csvPath = optarg; break;
+			case 'p':
+				if(strcmp(optarg, "probe")==0)
+					probeSignPath = 1;
+				else if(strcmp(optarg, "presized")==0)
+					probeSignPath = 0;
+				else
+				{
+					printf("Unknown sign path : %s\n", optarg);
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			case 'm':
+				signMech = NULL;
+				for(size_t ctr=0; ctr<sizeof(signMechanisms)/sizeof(*signMechanisms); ctr++)
+				{
+					if(strcmp(optarg, signMechanisms[ctr].option)==0)
+						signMech = &signMechanisms[ctr];
+				}
+				if(signMech==NULL)
+				{
+					printf("Unknown mechanism : %s\n", optarg);
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+
+	if(signMech->keyType==CKK_EC && !keySizeSet)
+		keySize = 256;
+	else if(signMech->keyType==CKK_EC_EDWARDS)
+		keySize = 255; // Ed25519, whatever --key-size says.
+	if(nThreads>0 && ops<=0)
+		ops = 1000;
+}
 
+
+
+int main(int argc, char **argv[])
+{
 	printf("\n%s\n", (char*)argv[0]);
 	if(argc<3) {
 		usage((char*)argv[0]);
@@ -247,33 +622,30 @@ int main(int argc, char **argv[])
 	slotId = atoi((const char*)argv[1]);
 	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
 	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
 
 	loadLunaLibrary();
 	connectToLunaSlot();
-	generateRSAKeyPair();
-
-	printf("\n> Enter number of threads you want to start : ");
-	scanf("%d",&nThreads);
-	sign = (pthread_t*)malloc(nThreads * sizeof(pthread_t));
-	printf("\n> Enter the number of sign operations each thread should perform : ");
-	scanf("%d", &ops);
-
-	printf("\n> Starting %d threads.\n", nThreads);
-	for(int ctr=0;ctr<nThreads;ctr++)
+	if(signMech->keyType==CKK_EC)
+		generateECKeyPair();
+	else if(signMech->keyType==CKK_EC_EDWARDS)
+		generateEdwardsKeyPair();
+	else
+		generateRSAKeyPair();
+	checkOperation(cryptoKeyInfo(p11Func, hSession, hPrivate, &signKey), "cryptoKeyInfo");
+
+	if(nThreads<=0)
 	{
-		pthread_create(&sign[ctr], NULL, &signData, NULL);
-		printf("  --> Thread %d has started. TID : %lu.\n", ctr, sign[ctr]);
+		printf("\n> Enter number of threads you want to start : ");
+		scanf("%d",&nThreads);
+		printf("\n> Enter the number of sign operations each thread should perform : ");
+		scanf("%d", &ops);
 	}
 
-	for(int ctr=0;ctr<nThreads;ctr++)
-	{
-		pthread_join(sign[ctr], NULL);
-	}
+	runBenchmark();
 
 	printf(">\nPlease wait ...\n");
 	disconnectFromLunaSlot();
-	free(sign);
-	printf("\n> %d sign operation completed by %d threads.\n\n", (nThreads*ops), nThreads);
 	freeMem();
 	return 0;
 }
@@ -0,0 +1,282 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This sample is a command line client for Signing_Daemon, meant to be called from scripts.
+	- It does not load the PKCS#11 library or log in : each call is one request over the daemon's UNIX socket.
+	- Input is read from --in (or stdin) and the result is written to --out (or stdout), raw or as hex.
+	- --repeat sends the same request many times on one connection and prints the round trip time.
+	- Examples :-
+		echo -n "hello" | Daemon_Client sign --mechanism sha256-rsa-pkcs --label signing-key --hex
+		Daemon_Client encrypt --mechanism aes-gcm --label data-key --iv 000102030405060708090a0b --in plain.txt --out cipher.bin
+		Daemon_Client random --bytes 32 --hex
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include "../common/daemon_client.h"
+
+
+const char *socketPath = DAEMON_DEFAULT_SOCKET;
+CK_MECHANISM_TYPE mechanism = CKM_SHA256_RSA_PKCS;
+const char *label = NULL;
+CK_BYTE iv[16];
+CK_ULONG ivLen = 0;
+const char *inPath = NULL;
+const char *outPath = NULL;
+CK_ULONG randomBytes = 32;
+int hexOutput = 0;
+int repeat = 1;
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <sign|encrypt|decrypt|random> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --socket <path>      daemon socket (default %s).\n", DAEMON_DEFAULT_SOCKET);
+	printf("  --mechanism <name>   sha256-rsa-pkcs (default), sha256-rsa-pkcs-pss, rsa-pkcs, rsa-pkcs-oaep, ecdsa, ecdsa-sha256,\n");
+	printf("                       eddsa, sha256-hmac, aes-cmac, aes-cbc-pad, aes-ctr, aes-gcm, aes-ecb, des3-cbc-pad.\n");
+	printf("  --label <label>      CKA_LABEL of the key.\n");
+	printf("  --iv <hex>           IV for CBC / CTR / GCM.\n");
+	printf("  --in <file>          input file (default stdin).\n");
+	printf("  --out <file>         output file (default stdout).\n");
+	printf("  --bytes <n>          random bytes to generate (default 32).\n");
+	printf("  --hex                write the output as hex.\n");
+	printf("  --repeat <n>         send the request n times and print the average round trip.\n\n");
+}
+
+
+
+// Decodes a hex string into buf. Returns the number of bytes, or -1.
+int parseHex(const char *hex, CK_BYTE *buf, CK_ULONG size)
+{
+	CK_ULONG len = strlen(hex) / 2;
+	unsigned int byte = 0;
+
+	if(strlen(hex)%2!=0 || len>size)
+		return -1;
+	for(CK_ULONG ctr=0; ctr<len; ctr++)
+	{
+		if(sscanf(hex + 2*ctr, "%2x", &byte)!=1)
+			return -1;
+		buf[ctr] = (CK_BYTE)byte;
+	}
+	return (int)len;
+}
+
+
+
+// Reads the whole input file (or stdin) into memory.
+CK_BYTE *readInput(CK_ULONG *len)
+{
+	FILE *in = (inPath!=NULL) ? fopen(inPath, "rb") : stdin;
+	CK_BYTE *data = NULL;
+	CK_ULONG size = 0;
+	size_t got = 0;
+
+	*len = 0;
+	if(in==NULL)
+	{
+		perror(inPath);
+		exit(1);
+	}
+	do
+	{
+		if(*len==size)
+		{
+			size = (size==0) ? 4096 : size*2;
+			data = (CK_BYTE*)realloc(data, size);
+		}
+		got = fread(data + *len, 1, size - *len, in);
+		*len += got;
+	} while(got>0);
+	if(in!=stdin)
+		fclose(in);
+	return data;
+}
+
+
+
+void writeOutput(const CK_BYTE *data, CK_ULONG len)
+{
+	FILE *out = (outPath!=NULL) ? fopen(outPath, "wb") : stdout;
+
+	if(out==NULL)
+	{
+		perror(outPath);
+		exit(1);
+	}
+	if(hexOutput)
+	{
+		for(CK_ULONG ctr=0; ctr<len; ctr++)
+			fprintf(out, "%02x", data[ctr]);
+		fprintf(out, "\n");
+	}
+	else
+		fwrite(data, 1, len, out);
+	if(out!=stdout)
+		fclose(out);
+}
+
+
+
+// Reads the options that follow the operation name.
+void parseOptions(int argc, char **argv)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"socket",	required_argument,	NULL,	'S'},
+		{"mechanism",	required_argument,	NULL,	'm'},
+		{"label",	required_argument,	NULL,	'l'},
+		{"iv",		required_argument,	NULL,	'v'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"out",		required_argument,	NULL,	'o'},
+		{"bytes",	required_argument,	NULL,	'b'},
+		{"hex",		no_argument,		NULL,	'x'},
+		{"repeat",	required_argument,	NULL,	'r'},
+		{NULL,		0,			NULL,	0}
+	};
+	int len = 0;
+
+	optind = 2;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'S': socketPath = optarg; break;
+			case 'l': label = optarg; break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 'b': randomBytes = strtoul(optarg, NULL, 10); break;
+			case 'x': hexOutput = 1; break;
+			case 'r': repeat = atoi(optarg); break;
+			case 'm':
+				mechanism = daemonMechanismByName(optarg);
+				if(mechanism==0)
+				{
+					printf("Unknown mechanism : %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'v':
+				len = parseHex(optarg, iv, sizeof(iv));
+				if(len<0)
+				{
+					printf("Invalid IV : %s\n", optarg);
+					exit(1);
+				}
+				ivLen = len;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if(repeat<1)
+		repeat = 1;
+}
+
+
+
+int main(int argc, char **argv)
+{
+	CK_BYTE *input = NULL;
+	CK_BYTE *output = NULL;
+	CK_ULONG inputLen = 0;
+	CK_ULONG outputSize = 0;
+	CK_ULONG outputLen = 0;
+	struct timespec start, end;
+	double micros = 0;
+	int fd = -1;
+	CK_RV rv = CKR_OK;
+
+	if(argc<2)
+	{
+		usage(argv[0]);
+		exit(1);
+	}
+	parseOptions(argc, argv);
+
+	if(strcmp(argv[1], "random")==0)
+		outputSize = randomBytes;
+	else if(strcmp(argv[1], "sign")==0 || strcmp(argv[1], "encrypt")==0 || strcmp(argv[1], "decrypt")==0)
+	{
+		if(label==NULL)
+		{
+			printf("--label is required for %s.\n", argv[1]);
+			exit(1);
+		}
+		input = readInput(&inputLen);
+		outputSize = inputLen + 1024; // covers padding, tags and signatures up to 8192 bit RSA.
+	}
+	else
+	{
+		usage(argv[0]);
+		exit(1);
+	}
+	output = (CK_BYTE*)malloc(outputSize);
+
+	fd = daemonConnect(socketPath);
+	if(fd<0)
+	{
+		fprintf(stderr, "Cannot connect to the signing daemon at %s.\n", socketPath);
+		exit(1);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int ctr=0; ctr<repeat && rv==CKR_OK; ctr++)
+	{
+		outputLen = outputSize;
+		if(argv[1][0]=='r')
+			rv = daemonRandom(fd, output, randomBytes);
+		else if(argv[1][0]=='s')
+			rv = daemonSign(fd, mechanism, label, input, inputLen, output, &outputLen);
+		else if(argv[1][0]=='e')
+			rv = daemonEncrypt(fd, mechanism, label, iv, ivLen, input, inputLen, output, &outputLen);
+		else
+			rv = daemonDecrypt(fd, mechanism, label, iv, ivLen, input, inputLen, output, &outputLen);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	daemonClose(fd);
+
+	if(rv!=CKR_OK)
+	{
+		fprintf(stderr, "%s failed with 0x%lX\n", argv[1], rv);
+		exit(1);
+	}
+	writeOutput(output, outputLen);
+	if(repeat>1)
+	{
+		micros = (end.tv_sec - start.tv_sec) * 1e6 + (end.tv_nsec - start.tv_nsec) / 1e3;
+		fprintf(stderr, "%d requests, %.1f us per round trip.\n", repeat, micros / repeat);
+	}
+
+	free(input);
+	free(output);
+	return 0;
+}
@@ -0,0 +1,802 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This sample is a resident signing daemon : the library is loaded, the slot is logged in and sessions are opened once,
+	  and then sign / encrypt / decrypt / random requests are served over a local UNIX domain socket.
+	- A script calling the daemon pays for one socket round trip instead of dlopen, C_Initialize, C_OpenSession and C_Login.
+	- Requests are length-prefixed frames (see common/daemon_client.h). Keys are named by CKA_LABEL and their handles are cached.
+	- The main thread only accepts connections and polls the idle ones; a connection with a request waiting is handed to
+	  one of the worker threads, which takes a session from the session pool, runs the operation and answers.
+	- Clients use common/daemon_client.c, or the Daemon_Client command line tool.
+	- Stop the daemon with Ctrl-C or SIGTERM; it closes its sessions and removes the socket file.
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "../common/session_pool.h"
+#include "../common/crypto_ops.h"
+#include "../common/daemon_client.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+#define MAX_CONNECTIONS 256
+#define MAX_CACHED_KEYS 256
+#define REQUEST_TIMEOUT_SEC 5 // a worker gives up on a client that stops sending half way through a request.
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+const char *socketPath = DAEMON_DEFAULT_SOCKET;
+int nWorkers = 8;
+int maxSessions = 0; // sessions the pool may open, defaults to the number of workers.
+SessionPool *sessionPool = NULL;
+volatile sig_atomic_t stopDaemon = 0;
+
+atomic_ulong requestCount = 0;
+atomic_ulong failedCount = 0;
+atomic_int connectionCount = 0;
+
+
+// Connections with a request waiting, handed from the main thread to the workers.
+typedef struct
+{
+	int fds[MAX_CONNECTIONS];
+	int head;
+	int count;
+	int closing;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+} ConnectionQueue;
+
+ConnectionQueue readyQueue = {.lock = PTHREAD_MUTEX_INITIALIZER, .ready = PTHREAD_COND_INITIALIZER};
+
+// Connections a worker has answered, given back to the main thread to poll. wakePipe interrupts its poll.
+int returnedFds[MAX_CONNECTIONS];
+int returnedCount = 0;
+pthread_mutex_t returnedLock = PTHREAD_MUTEX_INITIALIZER;
+int wakePipe[2] = {-1, -1};
+
+
+// Key handles found by label.
+typedef struct
+{
+	char label[DAEMON_MAX_LABEL+1];
+	CK_OBJECT_CLASS keyClass;
+	CryptoKeyInfo info;
+} CachedKey;
+
+CachedKey keyCache[MAX_CACHED_KEYS];
+int keyCacheCount = 0;
+pthread_rwlock_t keyCacheLock = PTHREAD_RWLOCK_INITIALIZER;
+
+
+// Mechanism and parameter storage for one request.
+typedef struct
+{
+	CK_MECHANISM mech;
+	CK_BYTE iv[16];
+	CK_AES_CTR_PARAMS ctr;
+	CK_AES_GCM_PARAMS gcm;
+	CK_RSA_PKCS_PSS_PARAMS pss;
+	CK_RSA_PKCS_OAEP_PARAMS oaep;
+} RequestMechanism;
+
+
+// Buffers owned by each worker thread and reused for every request.
+typedef struct
+{
+	CK_BYTE *frame;
+	CK_ULONG frameSize;
+	CryptoBuffer output;
+} DaemonWorker;
+
+
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Connects to a Luna slot (C_Initialize, C_OpenSession, C_Login)
+void connectToLunaSlot()
+{
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Disconnects from Luna slot (C_Logout, C_CloseSession and C_Finalize)
+void disconnectFromLunaSlot()
+{
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+
+// Sets stopDaemon on SIGINT / SIGTERM. poll() in the main loop returns with EINTR.
+void onSignal(int sig)
+{
+	stopDaemon = 1;
+}
+
+
+
+// Queues a connection for the workers.
+void pushReady(int fd)
+{
+	pthread_mutex_lock(&readyQueue.lock);
+	readyQueue.fds[(readyQueue.head + readyQueue.count) % MAX_CONNECTIONS] = fd;
+	readyQueue.count++;
+	pthread_cond_signal(&readyQueue.ready);
+	pthread_mutex_unlock(&readyQueue.lock);
+}
+
+
+
+// Waits for a connection with a request. Returns -1 when the daemon is stopping.
+int popReady()
+{
+	int fd = -1;
+
+	pthread_mutex_lock(&readyQueue.lock);
+	while(readyQueue.count==0 && !readyQueue.closing)
+		pthread_cond_wait(&readyQueue.ready, &readyQueue.lock);
+	if(readyQueue.count>0)
+	{
+		fd = readyQueue.fds[readyQueue.head];
+		readyQueue.head = (readyQueue.head + 1) % MAX_CONNECTIONS;
+		readyQueue.count--;
+	}
+	pthread_mutex_unlock(&readyQueue.lock);
+	return fd;
+}
+
+
+
+// Gives an answered connection back to the main thread.
+void returnConnection(int fd)
+{
+	char wake = 1;
+
+	pthread_mutex_lock(&returnedLock);
+	returnedFds[returnedCount++] = fd;
+	pthread_mutex_unlock(&returnedLock);
+	if(write(wakePipe[1], &wake, 1)<0 && errno!=EAGAIN)
+		perror("write");
+}
+
+
+
+void closeConnection(int fd)
+{
+	close(fd);
+	atomic_fetch_sub(&connectionCount, 1);
+}
+
+
+
+// Class of key a request needs : public key for RSA encryption, private key for RSA decryption and signing, secret key otherwise.
+CK_OBJECT_CLASS requiredKeyClass(const DaemonRequest *req)
+{
+	switch(req->mechanism)
+	{
+		case CKM_RSA_PKCS:
+		case CKM_RSA_PKCS_OAEP:
+		case CKM_RSA_X_509:
+			return (req->op==DAEMON_OP_ENCRYPT) ? CKO_PUBLIC_KEY : CKO_PRIVATE_KEY;
+		case CKM_SHA_1_HMAC:
+		case CKM_SHA224_HMAC:
+		case CKM_SHA256_HMAC:
+		case CKM_SHA384_HMAC:
+		case CKM_SHA512_HMAC:
+		case CKM_AES_CMAC:
+		case CKM_DES3_CMAC:
+			return CKO_SECRET_KEY;
+		default:
+			return (req->op==DAEMON_OP_SIGN) ? CKO_PRIVATE_KEY : CKO_SECRET_KEY;
+	}
+}
+
+
+
+// Finds the key named by the request, from the cache or with C_FindObjects.
+CK_RV findKey(CK_SESSION_HANDLE hWorkerSession, const DaemonRequest *req, CryptoKeyInfo *info)
+{
+	char label[DAEMON_MAX_LABEL+1];
+	CK_OBJECT_CLASS keyClass = requiredKeyClass(req);
+	CK_OBJECT_HANDLE hKey = 0;
+	CK_ULONG found = 0;
+	CK_RV rv;
+	CK_ATTRIBUTE attrib[] =
+	{
+		{CKA_LABEL,	(CK_VOID_PTR)req->label,	req->labelLen},
+		{CKA_CLASS,	&keyClass,			sizeof(keyClass)}
+	};
+
+	memcpy(label, req->label, req->labelLen);
+	label[req->labelLen] = 0;
+
+	pthread_rwlock_rdlock(&keyCacheLock);
+	for(int ctr=0; ctr<keyCacheCount; ctr++)
+	{
+		if(keyCache[ctr].keyClass==keyClass && strcmp(keyCache[ctr].label, label)==0)
+		{
+			*info = keyCache[ctr].info;
+			pthread_rwlock_unlock(&keyCacheLock);
+			return CKR_OK;
+		}
+	}
+	pthread_rwlock_unlock(&keyCacheLock);
+
+	rv = p11Func->C_FindObjectsInit(hWorkerSession, attrib, sizeof(attrib)/sizeof(*attrib));
+	if(rv!=CKR_OK)
+		return rv;
+	rv = p11Func->C_FindObjects(hWorkerSession, &hKey, 1, &found);
+	p11Func->C_FindObjectsFinal(hWorkerSession);
+	if(rv!=CKR_OK)
+		return rv;
+	if(found==0)
+		return CKR_KEY_HANDLE_INVALID;
+	rv = cryptoKeyInfo(p11Func, hWorkerSession, hKey, info);
+	if(rv!=CKR_OK)
+		return rv;
+
+	pthread_rwlock_wrlock(&keyCacheLock);
+	if(keyCacheCount<MAX_CACHED_KEYS)
+	{
+		strcpy(keyCache[keyCacheCount].label, label);
+		keyCache[keyCacheCount].keyClass = keyClass;
+		keyCache[keyCacheCount].info = *info;
+		keyCacheCount++;
+	}
+	pthread_rwlock_unlock(&keyCacheLock);
+	return CKR_OK;
+}
+
+
+
+// Removes a key from the cache when the HSM no longer knows its handle, so the next request looks it up again.
+void forgetKey(CK_OBJECT_HANDLE hKey)
+{
+	pthread_rwlock_wrlock(&keyCacheLock);
+	for(int ctr=0; ctr<keyCacheCount; ctr++)
+	{
+		if(keyCache[ctr].info.hKey==hKey)
+		{
+			keyCache[ctr] = keyCache[--keyCacheCount];
+			break;
+		}
+	}
+	pthread_rwlock_unlock(&keyCacheLock);
+}
+
+
+
+// Fills the mechanism parameters from the request IV. Hash choices follow the signing and encryption samples (SHA-256).
+CK_RV buildMechanism(const DaemonRequest *req, RequestMechanism *rm)
+{
+	memset(rm, 0, sizeof(*rm));
+	rm->mech.mechanism = req->mechanism;
+
+	switch(req->mechanism)
+	{
+		case CKM_AES_CBC_PAD:
+		case CKM_AES_CBC:
+		case CKM_DES3_CBC_PAD:
+		case CKM_DES3_CBC:
+			if(req->ivLen!=((req->mechanism==CKM_AES_CBC_PAD || req->mechanism==CKM_AES_CBC) ? 16 : 8))
+				return CKR_MECHANISM_PARAM_INVALID;
+			memcpy(rm->iv, req->iv, req->ivLen);
+			rm->mech.pParameter = rm->iv;
+			rm->mech.ulParameterLen = req->ivLen;
+			break;
+
+		case CKM_AES_CTR:
+			if(req->ivLen!=16)
+				return CKR_MECHANISM_PARAM_INVALID;
+			rm->ctr.ulCounterBits = 128;
+			memcpy(rm->ctr.cb, req->iv, 16);
+			rm->mech.pParameter = &rm->ctr;
+			rm->mech.ulParameterLen = sizeof(rm->ctr);
+			break;
+
+		case CKM_AES_GCM:
+			if(req->ivLen==0 || req->ivLen>16)
+				return CKR_MECHANISM_PARAM_INVALID;
+			memcpy(rm->iv, req->iv, req->ivLen);
+			rm->gcm.pIv = rm->iv;
+			rm->gcm.ulIvLen = req->ivLen;
+			rm->gcm.ulIvBits = req->ivLen * 8;
+			rm->gcm.ulTagBits = 128;
+			rm->mech.pParameter = &rm->gcm;
+			rm->mech.ulParameterLen = sizeof(rm->gcm);
+			break;
+
+		case CKM_SHA256_RSA_PKCS_PSS:
+			rm->pss.hashAlg = CKM_SHA256;
+			rm->pss.mgf = CKG_MGF1_SHA256;
+			rm->pss.usSaltLen = 32;
+			rm->mech.pParameter = &rm->pss;
+			rm->mech.ulParameterLen = sizeof(rm->pss);
+			break;
+
+		case CKM_RSA_PKCS_OAEP:
+			rm->oaep.hashAlg = CKM_SHA256;
+			rm->oaep.mgf = CKG_MGF1_SHA256;
+			rm->oaep.source = CKZ_DATA_SPECIFIED;
+			rm->mech.pParameter = &rm->oaep;
+			rm->mech.ulParameterLen = sizeof(rm->oaep);
+			break;
+
+		default:
+			if(req->ivLen!=0)
+				return CKR_MECHANISM_PARAM_INVALID;
+			break;
+	}
+	return CKR_OK;
+}
+
+
+
+// Runs one request with a pooled session. The output is left in worker->output.
+CK_RV executeRequest(DaemonWorker *worker, const DaemonRequest *req, CK_ULONG *outLen)
+{
+	PooledSession *session = NULL;
+	RequestMechanism rm;
+	CryptoKeyInfo key;
+	CK_RV rv;
+
+	*outLen = 0;
+	if(req->version!=DAEMON_PROTOCOL_VERSION)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	if(req->op==DAEMON_OP_RANDOM)
+	{
+		if(req->outLen>DAEMON_MAX_RANDOM)
+			return CKR_ARGUMENTS_BAD;
+		if(cryptoBufferReserve(&worker->output, req->outLen)!=0)
+			return CKR_HOST_MEMORY;
+	}
+	else if(req->op<DAEMON_OP_SIGN || req->op>DAEMON_OP_DECRYPT)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	else
+	{
+		rv = buildMechanism(req, &rm);
+		if(rv!=CKR_OK)
+			return rv;
+	}
+
+	rv = sessionPoolAcquire(sessionPool, &session);
+	if(rv!=CKR_OK)
+		return rv;
+
+	if(req->op==DAEMON_OP_RANDOM)
+	{
+		rv = p11Func->C_GenerateRandom(session->hSession, worker->output.data, req->outLen);
+		if(rv==CKR_OK)
+			*outLen = req->outLen;
+	}
+	else if((rv = findKey(session->hSession, req, &key))==CKR_OK)
+	{
+		if(req->op==DAEMON_OP_SIGN)
+			rv = cryptoSign(p11Func, session->hSession, &rm.mech, &key, (CK_BYTE*)req->data, req->dataLen, &worker->output, outLen);
+		else if(req->op==DAEMON_OP_ENCRYPT)
+			rv = cryptoEncrypt(p11Func, session->hSession, &rm.mech, &key, (CK_BYTE*)req->data, req->dataLen, &worker->output, outLen);
+		else
+			rv = cryptoDecrypt(p11Func, session->hSession, &rm.mech, &key, (CK_BYTE*)req->data, req->dataLen, &worker->output, outLen);
+		if(rv==CKR_KEY_HANDLE_INVALID || rv==CKR_OBJECT_HANDLE_INVALID)
+			forgetKey(key.hKey);
+	}
+
+	sessionPoolRelease(sessionPool, session, rv);
+	if(rv!=CKR_OK)
+		*outLen = 0;
+	return rv;
+}
+
+
+
+// Reads one request from the connection and answers it. Returns -1 if the connection must be closed.
+int serveOne(DaemonWorker *worker, int fd)
+{
+	DaemonRequest req;
+	CK_ULONG frameLen = 0;
+	CK_ULONG outLen = 0;
+	CK_RV rv;
+
+	if(daemonReadFrame(fd, &worker->frame, &worker->frameSize, &frameLen)!=0)
+		return -1; // closed by the client, timed out or oversized.
+	if(daemonParseRequest(worker->frame, frameLen, &req)!=0)
+	{
+		daemonWriteResponse(fd, CKR_ARGUMENTS_BAD, NULL, 0);
+		return -1; // the stream cannot be trusted after a malformed frame.
+	}
+
+	rv = executeRequest(worker, &req, &outLen);
+	atomic_fetch_add(&requestCount, 1);
+	if(rv!=CKR_OK)
+		atomic_fetch_add(&failedCount, 1);
+	return daemonWriteResponse(fd, rv, worker->output.data, outLen);
+}
+
+
+
+// Worker thread : serves one request at a time from whichever connection is ready.
+void *serveRequests(void *arg)
+{
+	DaemonWorker worker;
+	int fd = -1;
+
+	memset(&worker, 0, sizeof(worker));
+	while((fd = popReady())>=0)
+	{
+		if(serveOne(&worker, fd)==0)
+			returnConnection(fd);
+		else
+			closeConnection(fd);
+	}
+	free(worker.frame);
+	cryptoBufferFree(&worker.output);
+	return 0;
+}
+
+
+
+// Creates, binds and listens on the UNIX socket. Only the owner may connect.
+int openListener()
+{
+	struct sockaddr_un addr;
+	mode_t oldMask = 0;
+	int fd = -1;
+	int bound = -1;
+
+	if(strlen(socketPath)>=sizeof(addr.sun_path))
+	{
+		printf("Socket path too long : %s\n", socketPath);
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketPath);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd<0)
+	{
+		perror("socket");
+		return -1;
+	}
+	unlink(socketPath); // left over by a daemon that did not shut down cleanly.
+	oldMask = umask(S_IRWXG|S_IRWXO); // the socket file is created 0600, with no window where others could connect.
+	bound = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(oldMask);
+	if(bound!=0 || listen(fd, 64)!=0)
+	{
+		perror(socketPath);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+
+// Accepts a new client, or turns it away when MAX_CONNECTIONS are already open.
+void acceptConnection(int listenFd, int *idle, int *idleCount)
+{
+	struct timeval timeout = {REQUEST_TIMEOUT_SEC, 0};
+	int fd = accept(listenFd, NULL, NULL);
+
+	if(fd<0)
+		return;
+	if(atomic_load(&connectionCount)>=MAX_CONNECTIONS)
+	{
+		close(fd);
+		return;
+	}
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	atomic_fetch_add(&connectionCount, 1);
+	idle[(*idleCount)++] = fd;
+}
+
+
+
+// Main loop : polls the listener and the idle connections, and queues every connection that has a request waiting.
+void runDaemon(int listenFd)
+{
+	struct pollfd fds[2 + MAX_CONNECTIONS];
+	int idle[MAX_CONNECTIONS];
+	int idleCount = 0;
+	int nfds = 0;
+	char drain[64];
+
+	while(!stopDaemon)
+	{
+		fds[0].fd = listenFd;
+		fds[0].events = POLLIN;
+		fds[1].fd = wakePipe[0];
+		fds[1].events = POLLIN;
+		for(int ctr=0; ctr<idleCount; ctr++)
+		{
+			fds[2+ctr].fd = idle[ctr];
+			fds[2+ctr].events = POLLIN;
+		}
+		nfds = 2 + idleCount;
+
+		if(poll(fds, nfds, 500)<=0)
+			continue;
+
+		// Connections that are readable (or hung up) leave the idle list for a worker.
+		for(int ctr=nfds-1; ctr>=2; ctr--)
+		{
+			if(fds[ctr].revents!=0)
+			{
+				pushReady(idle[ctr-2]);
+				idle[ctr-2] = idle[--idleCount];
+			}
+		}
+
+		if(fds[1].revents & POLLIN)
+		{
+			while(read(wakePipe[0], drain, sizeof(drain))>0)
+				;
+			pthread_mutex_lock(&returnedLock);
+			for(int ctr=0; ctr<returnedCount; ctr++)
+				idle[idleCount++] = returnedFds[ctr];
+			returnedCount = 0;
+			pthread_mutex_unlock(&returnedLock);
+		}
+
+		if(fds[0].revents & POLLIN)
+			acceptConnection(listenFd, idle, &idleCount);
+	}
+
+	for(int ctr=0; ctr<idleCount; ctr++)
+		closeConnection(idle[ctr]);
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char exeName[30])
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_officer_password> [options]\n\n", exeName);
+	printf("Options :-\n");
+	printf("  --socket <path>      UNIX socket to listen on (default %s).\n", DAEMON_DEFAULT_SOCKET);
+	printf("  --workers <n>        worker threads serving requests (default 8).\n");
+	printf("  --sessions <n>       maximum sessions opened on the slot (default : one per worker).\n\n");
+}
+
+
+
+// Reads the daemon options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"socket",	required_argument,	NULL,	'S'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{"sessions",	required_argument,	NULL,	's'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'S': socketPath = optarg; break;
+			case 'w': nWorkers = atoi(optarg); break;
+			case 's': maxSessions = atoi(optarg); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(nWorkers<=0 || nWorkers>MAX_CONNECTIONS)
+	{
+		printf("--workers must be between 1 and %d.\n", MAX_CONNECTIONS);
+		exit(1);
+	}
+	if(maxSessions<=0)
+		maxSessions = nWorkers;
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	pthread_t *workers = NULL;
+	struct sigaction action;
+	int listenFd = -1;
+	CK_RV rv = CKR_OK;
+
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), maxSessions, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+
+	listenFd = openListener();
+	if(listenFd<0 || pipe(wakePipe)!=0)
+		exit(1);
+	fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(wakePipe[1], F_SETFL, O_NONBLOCK);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal; // no SA_RESTART, so poll() is interrupted.
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	workers = (pthread_t*)malloc(nWorkers * sizeof(pthread_t));
+	for(int ctr=0; ctr<nWorkers; ctr++)
+		pthread_create(&workers[ctr], NULL, &serveRequests, NULL);
+	printf("\n> Listening on %s with %d workers and up to %d sessions.\n", socketPath, nWorkers, maxSessions);
+
+	runDaemon(listenFd);
+
+	printf("\n> Stopping.\n");
+	pthread_mutex_lock(&readyQueue.lock);
+	readyQueue.closing = 1;
+	pthread_cond_broadcast(&readyQueue.ready);
+	pthread_mutex_unlock(&readyQueue.lock);
+	for(int ctr=0; ctr<nWorkers; ctr++)
+		pthread_join(workers[ctr], NULL);
+	while(readyQueue.count>0)
+		closeConnection(popReady());
+	for(int ctr=0; ctr<returnedCount; ctr++)
+		closeConnection(returnedFds[ctr]);
+
+	close(listenFd);
+	unlink(socketPath);
+	close(wakePipe[0]);
+	close(wakePipe[1]);
+	sessionPoolDestroy(sessionPool);
+	printf("  --> %lu requests served, %lu failed.\n", atomic_load(&requestCount), atomic_load(&failedCount));
+
+	disconnectFromLunaSlot();
+	freeMem();
+	free(workers);
+	return 0;
+}
@@ -0,0 +1,508 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+        OBJECTIVE :
+	- This sample verifies a large number of signatures, such as the signed entries of an audit log, on all CPU
+	  cores of the host with common/batch_verify.c : the public key is read once from the token and no HSM call is
+	  made for the verifications.
+	- The input holds (message, signature) pairs, either one per line in hex ("<message hex> <signature hex>") or
+	  length-prefixed (4 byte big-endian length before the message and before the signature).
+	- Pairs that do not verify are reported by index (from 0, in input order), followed by the verifications/sec.
+	- --generate writes a test file instead : random messages signed on the HSM with the private key of the pair,
+	  with every --corrupt'th signature altered so that the failure report has something to show.
+	- Example :-
+		Batch_Verify_demo 0 userpin --label audit-ec --mechanism ecdsa-sha256 --generate 100000 --corrupt 1000 --out pairs.txt
+		Batch_Verify_demo 0 userpin --label audit-ec --mechanism ecdsa-sha256 --in pairs.txt --workers 8
+*/
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <errno.h>
+#include "../common/pubkey_cache.h"
+#include "../common/batch_verify.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+
+CK_OBJECT_HANDLE hPublic = 0;
+CK_OBJECT_HANDLE hPrivate = 0;
+PubKeyCache *publicKeys = NULL;
+
+char *keyLabel = NULL;
+char *inPath = "-";
+char *outPath = NULL;
+VerifyPairFormat pairFormat = VERIFY_PAIRS_HEX;
+unsigned int nWorkers = 0; // one per CPU.
+unsigned int batchPairs = 1024;
+CK_ULONG maxMessage = 64*1024;
+unsigned long long maxReport = 20; // failures printed, the others are only counted.
+unsigned long long reported = 0;
+unsigned long long generateCount = 0; // --generate : pairs to write instead of verifying.
+unsigned long long corruptEvery = 0;
+CK_ULONG messageSize = 64;
+
+
+// Signature mechanisms that can be verified on the host.
+typedef struct
+{
+	const char *option; // value accepted by --mechanism
+	const char *name;
+	CK_MECHANISM_TYPE type;
+} VerifyMechanism;
+
+VerifyMechanism verifyMechanisms[] =
+{
+	{"sha256-rsa-pkcs",	"CKM_SHA256_RSA_PKCS",		CKM_SHA256_RSA_PKCS},
+	{"sha256-rsa-pkcs-pss",	"CKM_SHA256_RSA_PKCS_PSS",	CKM_SHA256_RSA_PKCS_PSS},
+	{"ecdsa-sha256",	"CKM_ECDSA_SHA256",		CKM_ECDSA_SHA256},
+	{"ecdsa-sha384",	"CKM_ECDSA_SHA384",		CKM_ECDSA_SHA384},
+	{"eddsa",		"CKM_EDDSA",			CKM_EDDSA}
+};
+VerifyMechanism *verifyMech = &verifyMechanisms[2];
+CK_RSA_PKCS_PSS_PARAMS pssParams = {CKM_SHA256, CKG_MGF1_SHA256, 32};
+CK_MECHANISM mech;
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Connects to a Luna slot (C_Initialize, C_OpenSession, C_Login)
+void connectToLunaSlot()
+{
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Disconnects from Luna slot (C_Logout, C_CloseSession and C_Finalize)
+void disconnectFromLunaSlot()
+{
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// Finds the key pair labelled keyLabel. The private key is only needed by --generate.
+void findKeyPair()
+{
+	CK_OBJECT_CLASS pubClass = CKO_PUBLIC_KEY;
+	CK_OBJECT_CLASS priClass = CKO_PRIVATE_KEY;
+	CK_ULONG foundPub = 0, foundPri = 0;
+	CK_ATTRIBUTE searchPub[] =
+	{
+		{CKA_CLASS,		&pubClass,		sizeof(pubClass)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+	CK_ATTRIBUTE searchPri[] =
+	{
+		{CKA_CLASS,		&priClass,		sizeof(priClass)},
+		{CKA_LABEL,		keyLabel,		strlen(keyLabel)}
+	};
+
+	checkOperation(p11Func->C_FindObjectsInit(hSession, searchPub, sizeof(searchPub)/sizeof(*searchPub)), "C_FindObjectsInit");
+	checkOperation(p11Func->C_FindObjects(hSession, &hPublic, 1, &foundPub), "C_FindObjects");
+	checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	if(generateCount>0)
+	{
+		checkOperation(p11Func->C_FindObjectsInit(hSession, searchPri, sizeof(searchPri)/sizeof(*searchPri)), "C_FindObjectsInit");
+		checkOperation(p11Func->C_FindObjects(hSession, &hPrivate, 1, &foundPri), "C_FindObjects");
+		checkOperation(p11Func->C_FindObjectsFinal(hSession), "C_FindObjectsFinal");
+	}
+	if(foundPub!=1 || (generateCount>0 && foundPri!=1))
+	{
+		printf("\n> No %s labelled '%s' on the token.\n\n", (foundPub!=1) ? "public key" : "private key", keyLabel);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	printf("\n> Public key '%s' found as handle : %lu\n", keyLabel, hPublic);
+}
+
+
+
+// Writes one field of a pair with the chosen framing. Returns 0 on success.
+int writeField(FILE *out, const CK_BYTE *field, CK_ULONG len, const char *separator)
+{
+	CK_BYTE prefix[4] = {(CK_BYTE)(len >> 24), (CK_BYTE)(len >> 16), (CK_BYTE)(len >> 8), (CK_BYTE)len};
+
+	if(pairFormat==VERIFY_PAIRS_PREFIXED)
+		return (fwrite(prefix, 1, 4, out)!=4 || fwrite(field, 1, len, out)!=len) ? -1 : 0;
+	for(CK_ULONG ctr=0; ctr<len; ctr++)
+		if(fprintf(out, "%02x", field[ctr])<0)
+			return -1;
+	return (fputs(separator, out)<0) ? -1 : 0;
+}
+
+
+
+// Signs generateCount random messages on the HSM and writes the pairs to outPath.
+void generatePairs()
+{
+	CK_BYTE *message = (CK_BYTE*)malloc(messageSize);
+	CK_BYTE signature[BATCH_VERIFY_MAX_SIGNATURE];
+	CK_ULONG signatureLen = 0;
+	FILE *out = fopen(outPath, "wb");
+
+	if(out==NULL || message==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", outPath, strerror(errno));
+		exit(1);
+	}
+	for(unsigned long long index=0; index<generateCount; index++)
+	{
+		checkOperation(p11Func->C_GenerateRandom(hSession, message, messageSize), "C_GenerateRandom");
+		signatureLen = sizeof(signature);
+		checkOperation(p11Func->C_SignInit(hSession, &mech, hPrivate), "C_SignInit");
+		checkOperation(p11Func->C_Sign(hSession, message, messageSize, signature, &signatureLen), "C_Sign");
+		if(corruptEvery>0 && index % corruptEvery==corruptEvery - 1)
+			signature[signatureLen / 2] ^= 0x01;
+		if(writeField(out, message, messageSize, " ")!=0 || writeField(out, signature, signatureLen, "\n")!=0)
+		{
+			printf("\n> Cannot write %s : %s\n\n", outPath, strerror(errno));
+			exit(1);
+		}
+	}
+	if(fclose(out)!=0)
+	{
+		printf("\n> Cannot write %s : %s\n\n", outPath, strerror(errno));
+		exit(1);
+	}
+	free(message);
+	printf("\n> %llu pairs signed with %s written to %s", generateCount, verifyMech->name, outPath);
+	if(corruptEvery>0)
+		printf(", %llu of them altered", generateCount / corruptEvery);
+	printf(".\n");
+}
+
+
+
+// Prints one failed pair, up to maxReport of them.
+void reportFailure(unsigned long long index, CK_RV rv, void *arg)
+{
+	if(reported++<maxReport)
+		printf("  --> pair %llu failed with Ox%lX%s\n", index, rv, (rv==CKR_SIGNATURE_INVALID) ? " (signature invalid)" : "");
+}
+
+
+
+// Verifies every pair of inPath on the host.
+void verifyPairs()
+{
+	BatchVerifyConfig config;
+	BatchVerifyStats stats;
+	FILE *in = (strcmp(inPath, "-")==0) ? stdin : fopen(inPath, "rb");
+	CK_RV rv = CKR_OK;
+
+	if(in==NULL)
+	{
+		printf("\n> Cannot open %s : %s\n\n", inPath, strerror(errno));
+		exit(1);
+	}
+	memset(&config, 0, sizeof(config));
+	config.mech = &mech;
+	config.hPublic = hPublic;
+	config.format = pairFormat;
+	config.workers = nWorkers;
+	config.batchPairs = batchPairs;
+	config.maxMessage = maxMessage;
+
+	printf("\n> Verifying the pairs of %s with %s on the host.\n", inPath, verifyMech->name);
+	rv = batchVerifyRun(publicKeys, hSession, &config, in, &reportFailure, NULL, &stats);
+	if(in!=stdin)
+		fclose(in);
+	if(rv==CKR_MECHANISM_INVALID)
+		printf("\n> The key '%s' cannot be used with %s on the host.\n", keyLabel, verifyMech->name);
+	checkOperation(rv, "batchVerifyRun");
+	if(stats.failed>maxReport)
+		printf("  --> ... %llu more.\n", stats.failed - maxReport);
+	printf("\n> %s.\n", (stats.failed==0) ? "Every signature verified" : "Some signatures did not verify");
+	batchVerifyPrintStats(stdout, &stats);
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> --label <label> [--mechanism <name>] [--in <file>] [--format hex|prefixed]\n", exeName);
+	printf("\t[--workers <n>] [--batch <n>] [--max-message <n>] [--report <n>]\n");
+	printf("%s <slot_number> <crypto_office_password> --label <label> [--mechanism <name>] --generate <n> --out <file>\n", exeName);
+	printf("\t[--corrupt <k>] [--message-size <n>] [--format hex|prefixed]\n\n");
+	printf("Options :-\n");
+	printf("  --label <label>        label of the key pair; only the public key is used to verify.\n");
+	printf("  --mechanism <name>     ");
+	for(int ctr=0; ctr<sizeof(verifyMechanisms)/sizeof(*verifyMechanisms); ctr++)
+		printf("%s%s", (ctr>0) ? ", " : "", verifyMechanisms[ctr].option);
+	printf(" (default ecdsa-sha256).\n");
+	printf("  --in <file>            pairs to verify, '-' for stdin (default).\n");
+	printf("  --format <f>           hex (one pair per line, default) or prefixed.\n");
+	printf("  --workers <n>          verifying threads (default one per CPU).\n");
+	printf("  --batch <n>            pairs handed to a worker at once (default 1024).\n");
+	printf("  --max-message <n>      longest message accepted, K or M suffix allowed (default 64K).\n");
+	printf("  --report <n>           failed pairs printed (default 20).\n");
+	printf("  --generate <n>         sign n random messages on the HSM and write the pairs to --out.\n");
+	printf("  --corrupt <k>          alter every k-th generated signature.\n");
+	printf("  --message-size <n>     size of the generated messages (default 64).\n\n");
+}
+
+
+
+// Parses a size such as 512, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the options, from argv[3].
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	int found = 0;
+	struct option longOptions[] =
+	{
+		{"label",		required_argument,	NULL,	'l'},
+		{"mechanism",		required_argument,	NULL,	'm'},
+		{"in",			required_argument,	NULL,	'i'},
+		{"out",			required_argument,	NULL,	'o'},
+		{"format",		required_argument,	NULL,	'f'},
+		{"workers",		required_argument,	NULL,	'w'},
+		{"batch",		required_argument,	NULL,	'b'},
+		{"max-message",		required_argument,	NULL,	'x'},
+		{"report",		required_argument,	NULL,	'r'},
+		{"generate",		required_argument,	NULL,	'g'},
+		{"corrupt",		required_argument,	NULL,	'c'},
+		{"message-size",	required_argument,	NULL,	's'},
+		{NULL,			0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'l': keyLabel = optarg; break;
+			case 'm':
+				found = 0;
+				for(int ctr=0; ctr<sizeof(verifyMechanisms)/sizeof(*verifyMechanisms); ctr++)
+					if(strcmp(optarg, verifyMechanisms[ctr].option)==0)
+					{
+						verifyMech = &verifyMechanisms[ctr];
+						found = 1;
+					}
+				if(!found)
+				{
+					printf("\n> Unknown mechanism : %s\n", optarg);
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			case 'i': inPath = optarg; break;
+			case 'o': outPath = optarg; break;
+			case 'f':
+				if(strcmp(optarg, "hex")==0)
+					pairFormat = VERIFY_PAIRS_HEX;
+				else if(strcmp(optarg, "prefixed")==0)
+					pairFormat = VERIFY_PAIRS_PREFIXED;
+				else
+				{
+					usage(exeName);
+					exit(1);
+				}
+				break;
+			case 'w': nWorkers = atoi(optarg); break;
+			case 'b': batchPairs = atoi(optarg); break;
+			case 'x': maxMessage = parseSize(optarg, exeName); break;
+			case 'r': maxReport = strtoull(optarg, NULL, 10); break;
+			case 'g': generateCount = strtoull(optarg, NULL, 10); break;
+			case 'c': corruptEvery = strtoull(optarg, NULL, 10); break;
+			case 's': messageSize = parseSize(optarg, exeName); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(keyLabel==NULL || batchPairs==0 || messageSize==0 || (generateCount>0 && outPath==NULL))
+	{
+		usage(exeName);
+		exit(1);
+	}
+
+	mech.mechanism = verifyMech->type;
+	mech.pParameter = NULL;
+	mech.ulParameterLen = 0;
+	if(verifyMech->type==CKM_SHA256_RSA_PKCS_PSS)
+	{
+		mech.pParameter = &pssParams;
+		mech.ulParameterLen = sizeof(pssParams);
+	}
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	CK_RV rv = CKR_OK;
+
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	findKeyPair();
+	if(generateCount>0)
+		generatePairs();
+	else
+	{
+		publicKeys = pubKeyCacheCreate(p11Func, 1, 1, &rv);
+		checkOperation(rv, "pubKeyCacheCreate");
+		verifyPairs();
+		pubKeyCacheDestroy(publicKeys);
+	}
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
@@ -11,9 +11,17 @@
 
 
 
-	OBJECTIVE : This sample demonstrates how to connect to a Luna HSM and then disconnect from it.
-	- To connect, the sample loads Luna cryptoki library and then calls C_Initialize, C_OpenSession and C_Login.
-	- To disconnect, the sample calls C_Logout, C_CloseSession and C_Finalize.
+	OBJECTIVE : This sample demonstrates how to use CKM_AES_CMAC.
+	- --records n tags n records of --size bytes, such as the lines of a log, then verifies them, with
+	  common/mac_engine.c : --workers threads each hold a pooled session, and a record costs one C_SignInit +
+	  C_Sign, without a length query. The same records are first tagged one by one on a single session, the way
+	  signData does, for comparison. One record is then altered to show that its tag no longer verifies.
+	- --in MACs a file of any size with C_SignUpdate / C_SignFinal, and verifies the tag with C_VerifyUpdate.
+	- --calibrate measures C_SignUpdate with CKM_AES_CMAC for chunk sizes from 1K to 4M (common/chunk_tuner.c) and
+	  saves the knee for the token in the slot; without --chunk, --in then uses that chunk size.
+	- Example :-
+		CKM_AES_CMAC_demo 0 userpin --records 100000 --size 200 --workers 8
+		CKM_AES_CMAC_demo 0 userpin --in app.log --chunk 4M
 */
 
 
@@ -22,7 +30,14 @@
 #include <stdio.h>
 #include <cryptoki_v2.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include "../common/session_pool.h"
+#include "../common/mac_engine.h"
+#include "../common/file_sign.h"
+#include "../common/chunk_tuner.h"
 
 
 // Windows and Linux OS uses different header files for loading libraries.
@@ -33,6 +48,7 @@
 #endif
 
 
+
 // Windows uses HINSTANCE for storing library handles.
 #ifdef OS_UNIX
         void *libHandle = 0; // Library handle for Unix/Linux
@@ -41,11 +57,25 @@
 #endif
 
 
+
 CK_FUNCTION_LIST *p11Func = NULL;
 CK_SESSION_HANDLE hSession = 0;
 CK_SLOT_ID slotId = 0; // slot id
 CK_BYTE *slotPin = NULL; // slot password
 
+CK_OBJECT_HANDLE hObject = 0;
+CK_BYTE rawData[] = "Earth is the third planet of our Solar System.";
+CK_BYTE *signature = NULL;
+CK_ULONG signatureLen = 0;
+
+unsigned long recordCount = 0; // records tagged with --records.
+CK_ULONG recordSize = 128; // bytes per record.
+unsigned int workers = 4; // threads, and pooled sessions, of the MAC engine.
+char *inPath = NULL; // file MACed with --in, "-" for stdin.
+CK_ULONG chunkSize = 0; // bytes per C_SignUpdate, 0 until set : the calibrated size of the slot, or 1M.
+int calibrate = 0; // 1 with --calibrate.
+int useMap = 1; // 0 with --no-mmap.
+
 
 
 // Loads Luna cryptoki library
@@ -98,6 +128,7 @@ void loadLunaLibrary()
 }
 
 
+
 // Always a good idea to free up some memory before exiting.
 void freeMem()
 {
@@ -107,6 +138,7 @@ void freeMem()
                 FreeLibrary(libHandle); // Close library handle on Windows.
         #endif
 	free(slotPin);
+	free(signature);
 }
 
 
@@ -148,11 +180,261 @@ void disconnectFromLunaSlot()
 
 
 
+// This function generates an AES key for generating the CMAC signature.
+void generateAESKey()
+{
+        CK_MECHANISM mech = {CKM_AES_KEY_GEN};
+        CK_ULONG yes = CK_TRUE;
+        CK_ULONG keySize = 16;
+
+        CK_ATTRIBUTE attrib[] =
+        {
+                {CKA_TOKEN,             &yes,           sizeof(CK_BBOOL)},
+                {CKA_PRIVATE,           &yes,           sizeof(CK_BBOOL)},
+                {CKA_SENSITIVE,         &yes,           sizeof(CK_BBOOL)},
+                {CKA_VALUE_LEN,         &keySize,       sizeof(CK_ULONG)},
+                {CKA_SIGN,              &yes,           sizeof(CK_ULONG)},
+                {CKA_VERIFY,            &yes,           sizeof(CK_ULONG)}
+        };
+
+        checkOperation(p11Func->C_GenerateKey(hSession,&mech,attrib,6,&hObject),"C_GenerateKey");
+        printf("\n> AES key generated as handle : %lu\n", hObject);
+}
+
+
+
+// This function generates signature for a given data using CKM_AES_CMAC.
+void signData()
+{
+        CK_MECHANISM mech = {CKM_AES_CMAC};
+        checkOperation(p11Func->C_SignInit(hSession,&mech,hObject),"C_SignInit");
+        checkOperation(p11Func->C_Sign(hSession,rawData,sizeof(rawData)-1,NULL_PTR,&signatureLen),"C_Sign");
+        signature = (CK_BYTE*)malloc(signatureLen);
+        checkOperation(p11Func->C_Sign(hSession,rawData,sizeof(rawData)-1,signature,&signatureLen),"C_Sign");
+        printf("\n> Data signed.\n");
+}
+
+
+
+// This function verifies the signature provided for a data.
+void verifyData()
+{
+        CK_MECHANISM mech = {CKM_AES_CMAC};
+        checkOperation(p11Func->C_VerifyInit(hSession,&mech,hObject),"C_VerifyInit");
+        checkOperation(p11Func->C_Verify(hSession,rawData,sizeof(rawData)-1,signature,signatureLen),"C_Verify");
+        printf("\n> Data verified.\n");
+}
+
+
+
+// Returns a monotonic time in seconds.
+double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Tags recordCount records one by one on hSession, then with the MAC engine, and verifies them.
+void tagRecords()
+{
+	CK_MECHANISM mech = {CKM_AES_CMAC};
+	CK_ULONG tagLen = macTagLength(CKM_AES_CMAC);
+	CK_BYTE *data = (CK_BYTE*)malloc(recordCount * recordSize);
+	const CK_BYTE **records = (const CK_BYTE**)calloc(recordCount, sizeof(CK_BYTE*));
+	CK_ULONG *lens = (CK_ULONG*)calloc(recordCount, sizeof(CK_ULONG));
+	CK_BYTE *tags = (CK_BYTE*)malloc(recordCount * tagLen);
+	CK_RV *results = (CK_RV*)calloc(recordCount, sizeof(CK_RV));
+	CK_BYTE tag[MAC_MAX_TAG];
+	CK_ULONG oneTagLen = 0;
+	SessionPool *sessionPool = NULL;
+	MacBatchStats stats;
+	unsigned long altered = recordCount / 2;
+	double start = 0, seconds = 0;
+	CK_RV rv = CKR_OK;
+
+	if(data==NULL || records==NULL || lens==NULL || tags==NULL || results==NULL)
+	{
+		printf("\n> Not enough memory for %lu records.\n\n", recordCount);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	// Printable filler, so the records look like the lines of a log.
+	for(unsigned long ctr=0; ctr<recordCount * recordSize; ctr++)
+		data[ctr] = (CK_BYTE)(' ' + (ctr * 2654435761UL >> 11) % 95);
+	for(unsigned long ctr=0; ctr<recordCount; ctr++)
+	{
+		records[ctr] = data + ctr * recordSize;
+		lens[ctr] = recordSize;
+	}
+
+	start = nowSeconds();
+	for(unsigned long ctr=0; ctr<recordCount; ctr++)
+	{
+		oneTagLen = 0;
+		checkOperation(p11Func->C_SignInit(hSession, &mech, hObject), "C_SignInit");
+		checkOperation(p11Func->C_Sign(hSession, (CK_BYTE*)records[ctr], lens[ctr], NULL_PTR, &oneTagLen), "C_Sign");
+		checkOperation(p11Func->C_Sign(hSession, (CK_BYTE*)records[ctr], lens[ctr], tag, &oneTagLen), "C_Sign");
+	}
+	seconds = nowSeconds() - start;
+	printf("\n> %lu records of %lu bytes tagged one by one on one session.\n", recordCount, recordSize);
+	printf("  --> %.3f s : %.0f tags/sec.\n", seconds, recordCount / seconds);
+
+	sessionPool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), workers, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+	checkOperation(macTagBatch(p11Func, sessionPool, CKM_AES_CMAC, hObject, recordCount, records, lens, tags, workers, &stats),
+		"macTagBatch");
+	printf("\n> Same records tagged with the MAC engine.\n");
+	macPrintStats(stdout, "tagged", &stats);
+	printf("  --> Last tag %s the one of C_Sign.\n",
+		(memcmp(tags + (recordCount-1) * tagLen, tag, tagLen)==0) ? "identical to" : "differs from");
+
+	checkOperation(macVerifyBatch(p11Func, sessionPool, CKM_AES_CMAC, hObject, recordCount, records, lens, tags, NULL, workers,
+		&stats), "macVerifyBatch");
+	printf("\n> Tags verified.\n");
+	macPrintStats(stdout, "verified", &stats);
+
+	data[altered * recordSize] ^= 0x01;
+	checkOperation(macVerifyBatch(p11Func, sessionPool, CKM_AES_CMAC, hObject, recordCount, records, lens, tags, results, workers,
+		&stats), "macVerifyBatch");
+	printf("\n> Record %lu altered, tags verified again.\n", altered);
+	for(unsigned long ctr=0; ctr<recordCount; ctr++)
+		if(results[ctr]!=CKR_OK)
+			printf("  --> Record %lu : tag does not verify (Ox%lX).\n", ctr, results[ctr]);
+	macPrintStats(stdout, "verified", &stats);
+
+	sessionPoolDestroy(sessionPool);
+	free(data);
+	free(records);
+	free(lens);
+	free(tags);
+	free(results);
+}
+
+
+
+// Measures chunk sizes from 1K to 4M for CKM_AES_CMAC, and saves the knee of the curve for the slot.
+void calibrateChunkSize()
+{
+	CK_MECHANISM mech = {CKM_AES_CMAC};
+	ChunkTuning tuning;
+
+	checkOperation(chunkTunerCalibrateAndSave(p11Func, hSession, slotId, &mech, hObject, 16*1024*1024, stdout, &tuning),
+		"chunkTunerCalibrateAndSave");
+}
+
+
+
+// MACs inPath with C_SignUpdate / C_SignFinal, and verifies the tag with C_VerifyUpdate / C_VerifyFinal.
+void macFile()
+{
+	CK_MECHANISM mech = {CKM_AES_CMAC};
+	CK_BYTE tag[MAC_MAX_TAG];
+	CK_ULONG tagLen = sizeof(tag);
+	FileSignStats stats;
+
+	if(chunkSize==0)
+		chunkSize = chunkTunerPick(p11Func, slotId, CKM_AES_CMAC, 1024*1024, stdout);
+	checkOperation(fileSign(p11Func, hSession, &mech, hObject, inPath, chunkSize, useMap, tag, &tagLen, &stats), "fileSign");
+	printf("\n> %s tagged with C_SignUpdate / C_SignFinal :-\n  --> ", inPath);
+	for(CK_ULONG ctr=0; ctr<tagLen; ctr++)
+		printf("%02X", tag[ctr]);
+	printf("\n");
+	fileSignPrintStats(stdout, &stats);
+	if(strcmp(inPath, "-")==0)
+		return;
+
+	checkOperation(fileVerify(p11Func, hSession, &mech, hObject, inPath, chunkSize, useMap, tag, tagLen, &stats), "fileVerify");
+	printf("\n> Tag verified with C_VerifyUpdate / C_VerifyFinal.\n");
+	fileSignPrintStats(stdout, &stats);
+}
+
+
+
 // Prints the syntax for executing this code.
-void usage(const char exeName[30])
+void usage(const char *exeName)
 {
 	printf("\nUsage :-\n");
-	printf("%s <slot_number> <crypto_office_password>\n\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> [--records <n> [--size <bytes>] [--workers <n>]]\n", exeName);
+	printf("\t[--in <file> [--chunk <size>] [--no-mmap]] [--calibrate]\n\n");
+	printf("  --records <n>    tag and verify n records one by one and with the MAC engine, and report tags/sec.\n");
+	printf("  --size <bytes>   bytes per record (default 128).\n");
+	printf("  --workers <n>    threads and pooled sessions of the MAC engine (default 4).\n");
+	printf("  --in <file>      MAC and verify a file with C_SignUpdate / C_VerifyUpdate, '-' for stdin (tagging only).\n");
+	printf("  --chunk <size>   bytes per update, K and M suffixes accepted (default : calibrated, or 1M).\n");
+	printf("  --no-mmap        read the file in chunks instead of memory-mapping it.\n");
+	printf("  --calibrate      find the best chunk size for the slot, and save it for --in.\n\n");
+}
+
+
+
+// Reads a size such as 4096, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"records",	required_argument,	NULL,	'r'},
+		{"size",	required_argument,	NULL,	's'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"chunk",	required_argument,	NULL,	'c'},
+		{"no-mmap",	no_argument,		NULL,	'n'},
+		{"calibrate",	no_argument,		NULL,	'C'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'r': recordCount = strtoul(optarg, NULL, 10); break;
+			case 's': recordSize = parseSize(optarg, exeName); break;
+			case 'w': workers = atoi(optarg); break;
+			case 'i': inPath = optarg; break;
+			case 'c': chunkSize = parseSize(optarg, exeName); break;
+			case 'n': useMap = 0; break;
+			case 'C': calibrate = 1; break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(recordSize==0 || workers==0)
+	{
+		usage(exeName);
+		exit(1);
+	}
 }
 
 
@@ -168,8 +450,19 @@ int main(int argc, char **argv[])
 	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
 	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
 
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
 	loadLunaLibrary();
 	connectToLunaSlot();
+	generateAESKey();
+	signData();
+	verifyData();
+	if(recordCount>0)
+		tagRecords();
+	if(calibrate)
+		calibrateChunkSize();
+	if(inPath!=NULL)
+		macFile();
 	disconnectFromLunaSlot();
 	freeMem();
 	return 0;
@@ -12,6 +12,15 @@
 
 
         OBJECTIVE :  This sample demonstrates the usage of CKM_ECDSA mechanism for sign/verify operation.
+	- The signature is verified on the host, with OpenSSL and the public key read once from the token (see
+	  common/pubkey_cache.h), so the HSM only does the signing. --hsm-public sends the verification to the HSM.
+	- --local-digest also signs the data as CKM_ECDSA_SHA256 would, but hashes it on the host (OpenSSL, SHA extensions
+	  or AVX2 of the CPU) and only sends its digest to the HSM with CKM_ECDSA, through common/digest_sign.c. The
+	  signature verifies as a CKM_ECDSA_SHA256 one.
+	- --batch n signs n messages of --size bytes both ways, and reports signatures/sec and MB/s : the HSM link
+	  carries the whole messages with CKM_ECDSA_SHA256, only their digests with the local digest.
+	- Example :-
+		CKM_ECDSA_demo 0 userpin --local-digest --batch 1000 --size 1M
 */
 
 
@@ -20,7 +29,12 @@
 #include <stdio.h>
 #include <cryptoki_v2.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include <time.h>
+#include "../common/pubkey_cache.h"
+#include "../common/digest_sign.h"
 
 
 // Windows and Linux OS uses different header files for loading libraries.
@@ -43,6 +57,11 @@ CK_FUNCTION_LIST *p11Func = NULL;
 CK_SESSION_HANDLE hSession = 0;
 CK_SLOT_ID slotId = 0; // slot id
 CK_BYTE *slotPin = NULL; // slot password
+PubKeyCache *publicKeys = NULL; // runs the public-key operations on the host.
+int localPublic = 1; // 0 with --hsm-public.
+int localDigest = 0; // 1 with --local-digest.
+unsigned long batchMessages = 0; // messages signed both ways with --batch.
+CK_ULONG messageSize = 64*1024; // bytes per message of --batch.
 
 CK_OBJECT_HANDLE hPublic = 0;
 CK_OBJECT_HANDLE hPrivate = 0;
@@ -111,6 +130,7 @@ void freeMem()
                 FreeLibrary(libHandle); // Close library handle on Windows.
         #endif
 	free(slotPin);
+	pubKeyCacheDestroy(publicKeys);
 }
 
 
@@ -208,22 +228,210 @@ CK_ULONG signData()
 
 
 
+// Creates the cache that reads the public key once and runs the public-key operations on the host.
+void createPublicKeyCache()
+{
+	CK_RV rv = CKR_OK;
+	publicKeys = pubKeyCacheCreate(p11Func, 1, localPublic, &rv);
+	checkOperation(rv, "pubKeyCacheCreate");
+}
+
+
+
+// Tells where the last public-key operation ran.
+void printPublicKeyUse()
+{
+	PubKeyCacheStats stats;
+	pubKeyCacheGetStats(publicKeys, &stats);
+	printf("  --> %s.\n", (stats.localOps>0) ? "done on the host with the public key read from the token" : "done by the HSM");
+}
+
+
+
 // This function verifies the signature.
 void verifyData()
 {
         CK_MECHANISM mech = {CKM_ECDSA};
-        checkOperation(p11Func->C_VerifyInit(hSession, &mech, hPublic),"C_VerifyInit");
-        checkOperation(p11Func->C_Verify(hSession, rawData, sizeof(rawData)-1, signature, signatureLen),"C_Verify");
+        checkOperation(pubKeyVerify(publicKeys, hSession, &mech, hPublic, rawData, sizeof(rawData)-1, signature, signatureLen), "pubKeyVerify");
         printf("\n> Signature verified.\n");
+        printPublicKeyUse();
+}
+
+
+
+// Returns a monotonic time in seconds.
+double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Signs rawData as CKM_ECDSA_SHA256 would, with the digest computed on the host and only its digest sent to the HSM.
+void signDigestLocally()
+{
+	CK_MECHANISM mech = {CKM_ECDSA_SHA256};
+	CK_BYTE localSignature[DIGEST_SIGN_MAX_SIGNATURE];
+	CK_ULONG localSignatureLen = sizeof(localSignature);
+	DigestSigner *signer = NULL;
+	CK_RV rv = CKR_OK;
+
+	signer = digestSignerCreate(p11Func, &mech, hPrivate, &rv);
+	checkOperation(rv, "digestSignerCreate");
+	checkOperation(digestSign(signer, hSession, rawData, sizeof(rawData)-1, localSignature, &localSignatureLen), "digestSign");
+	digestSignerFree(signer);
+	printf("\n> Data hashed on the host, its digest signed with CKM_ECDSA.\n");
+	checkOperation(pubKeyVerify(publicKeys, hSession, &mech, hPublic, rawData, sizeof(rawData)-1, localSignature, localSignatureLen),
+		"pubKeyVerify");
+	printf("  --> Verified as a CKM_ECDSA_SHA256 signature.\n");
+}
+
+
+
+// Signs batchMessages messages of messageSize bytes with CKM_ECDSA_SHA256 on the HSM, then with digestSignBatch.
+void benchmarkDigestSigning()
+{
+	CK_MECHANISM mech = {CKM_ECDSA_SHA256};
+	CK_BYTE *data = (CK_BYTE*)malloc(messageSize + batchMessages);
+	const CK_BYTE **messages = (const CK_BYTE**)calloc(batchMessages, sizeof(CK_BYTE*));
+	CK_ULONG *messageLens = (CK_ULONG*)calloc(batchMessages, sizeof(CK_ULONG));
+	CK_BYTE *signatures = (CK_BYTE*)malloc(batchMessages * DIGEST_SIGN_MAX_SIGNATURE);
+	CK_ULONG *signatureLens = (CK_ULONG*)calloc(batchMessages, sizeof(CK_ULONG));
+	CK_BYTE hsmSignature[DIGEST_SIGN_MAX_SIGNATURE];
+	CK_ULONG hsmSignatureLen = 0;
+	DigestSigner *signer = NULL;
+	DigestSignStats stats;
+	unsigned long failed = 0;
+	double start = 0, hsmSeconds = 0, localSeconds = 0;
+	double megabytes = (double)batchMessages * messageSize / (1024*1024);
+	CK_RV rv = CKR_OK;
+
+	if(data==NULL || messages==NULL || messageLens==NULL || signatures==NULL || signatureLens==NULL)
+	{
+		printf("\n> Not enough memory for %lu messages.\n\n", batchMessages);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	// Message n starts n bytes into the buffer, so every message differs without holding them all.
+	for(CK_ULONG ctr=0; ctr<messageSize + batchMessages; ctr++)
+		data[ctr] = (CK_BYTE)(ctr * 2654435761UL >> 13);
+	for(unsigned long ctr=0; ctr<batchMessages; ctr++)
+	{
+		messages[ctr] = data + ctr;
+		messageLens[ctr] = messageSize;
+	}
+
+	start = nowSeconds();
+	for(unsigned long ctr=0; ctr<batchMessages; ctr++)
+	{
+		hsmSignatureLen = sizeof(hsmSignature);
+		checkOperation(p11Func->C_SignInit(hSession, &mech, hPrivate), "C_SignInit");
+		checkOperation(p11Func->C_Sign(hSession, (CK_BYTE*)messages[ctr], messageLens[ctr], hsmSignature, &hsmSignatureLen), "C_Sign");
+	}
+	hsmSeconds = nowSeconds() - start;
+
+	signer = digestSignerCreate(p11Func, &mech, hPrivate, &rv);
+	checkOperation(rv, "digestSignerCreate");
+	start = nowSeconds();
+	rv = digestSignBatch(signer, hSession, batchMessages, messages, messageLens, signatures, DIGEST_SIGN_MAX_SIGNATURE,
+		signatureLens, &failed);
+	localSeconds = nowSeconds() - start;
+	if(rv!=CKR_OK)
+		printf("\n> Message %lu failed.\n", failed);
+	checkOperation(rv, "digestSignBatch");
+	digestSignerGetStats(signer, &stats);
+	digestSignerFree(signer);
+
+	printf("\n> %lu messages of %lu bytes signed both ways.\n", batchMessages, messageSize);
+	printf("  --> CKM_ECDSA_SHA256 on the HSM : %.3f s, %.0f signatures/sec, %.2f MB/s.\n", hsmSeconds,
+		batchMessages / hsmSeconds, megabytes / hsmSeconds);
+	printf("  --> Digest on the host + CKM_ECDSA : %.3f s, %.0f signatures/sec, %.2f MB/s (hash %.3f s, HSM %.3f s).\n",
+		localSeconds, batchMessages / localSeconds, megabytes / localSeconds, stats.hashSeconds, stats.hsmSeconds);
+	free(data);
+	free(messages);
+	free(messageLens);
+	free(signatures);
+	free(signatureLens);
 }
 
 
 
 // Prints the syntax for executing this code.
-void usage(const char exeName[30])
+void usage(const char *exeName)
 {
 	printf("\nUsage :-\n");
-	printf("%s <slot_number> <crypto_office_password>\n\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> [--hsm-public] [--local-digest] [--batch <n> [--size <bytes>]]\n\n", exeName);
+	printf("  --hsm-public     verify the signature on the HSM instead of on the host.\n");
+	printf("  --local-digest   also sign the data from a digest computed on the host.\n");
+	printf("  --batch <n>      sign n messages on the HSM and from local digests, and compare the throughput.\n");
+	printf("  --size <bytes>   bytes per message of --batch, K and M suffixes accepted (default 64K).\n\n");
+}
+
+
+
+// Reads a size such as 4096, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"hsm-public",	no_argument,		NULL,	'h'},
+		{"local-digest",	no_argument,		NULL,	'l'},
+		{"batch",	required_argument,	NULL,	'b'},
+		{"size",	required_argument,	NULL,	's'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'h': localPublic = 0; break;
+			case 'l': localDigest = 1; break;
+			case 'b': batchMessages = strtoul(optarg, NULL, 10); break;
+			case 's': messageSize = parseSize(optarg, exeName); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+#ifndef HOST_CRYPTO
+	if(localDigest || batchMessages>0)
+	{
+		printf("--local-digest and --batch hash on the host : build with make HOST_CRYPTO=1 (OpenSSL 3.0 or later).\n");
+		exit(1);
+	}
+#endif
 }
 
 
@@ -238,13 +446,19 @@ int main(int argc, char **argv[])
 	slotId = atoi((const char*)argv[1]);
 	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
 	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
 
 	loadLunaLibrary();
 	connectToLunaSlot();
+	createPublicKeyCache();
 
 	generateECKeyPair();
 	signData();
 	verifyData();
+	if(localDigest)
+		signDigestLocally();
+	if(batchMessages>0)
+		benchmarkDigestSigning();
 
 	disconnectFromLunaSlot();
 	freeMem();
@@ -0,0 +1,591 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The " luna-samples" project is provided under the MIT license (see the         *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+        OBJECTIVE :  This sample demonstrates the usage of CKM_EDDSA mechanism for sign/verify operation.
+	- An Ed25519 key pair (Ed448 with --ed448) is generated with CKM_EC_EDWARDS_KEY_PAIR_GEN. Note that
+	  CKM_EC_EDWARDS_KEY_PAIR_GEN and CKM_EDDSA are not FIPS approved.
+	- The public key is exported from the token (CKA_EC_POINT) and printed, and the signature is verified on the
+	  host with it, through OpenSSL (see common/pubkey_cache.h). --hsm-public sends the verification to the HSM.
+	- --compare n signs n messages of --size bytes with Ed25519, ECDSA P-256 (CKM_ECDSA_SHA256) and RSA-2048
+	  (CKM_SHA256_RSA_PKCS) on the same HSM, from --workers threads holding pooled sessions, then verifies every
+	  signature on the host on the same number of threads, and prints signatures/sec and verifications/sec. With
+	  --hsm-public, or in a build without HOST_CRYPTO, the verifications run on the HSM over pooled sessions instead.
+	- Example :-
+		CKM_EDDSA_demo 0 userpin --compare 20000 --workers 8
+*/
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "../common/pubkey_cache.h"
+#include "../common/session_pool.h"
+
+
+// Windows and Linux OS uses different header files for loading libraries.
+#ifdef OS_UNIX
+        #include <dlfcn.h> // For Unix/Linux OS.
+#else
+        #include <windows.h> // For Windows OS.
+#endif
+
+
+// Windows uses HINSTANCE for storing library handles.
+#ifdef OS_UNIX
+        void *libHandle = 0; // Library handle for Unix/Linux
+#else
+        HINSTANCE libHandle = 0; //Library handle for Windows.
+#endif
+
+
+#define COMPARE_MAX_SIGNATURE 256 // RSA-2048.
+
+
+CK_FUNCTION_LIST *p11Func = NULL;
+CK_SESSION_HANDLE hSession = 0;
+CK_SLOT_ID slotId = 0; // slot id
+CK_BYTE *slotPin = NULL; // slot password
+PubKeyCache *publicKeys = NULL; // runs the public-key operations on the host.
+int localPublic = 1; // 0 with --hsm-public.
+int ed448 = 0; // 1 with --ed448.
+unsigned long compareMessages = 0; // messages signed per algorithm with --compare.
+CK_ULONG messageSize = 64; // bytes per message of --compare.
+unsigned int workers = 4; // signing and verifying threads of --compare.
+
+CK_OBJECT_HANDLE hPublic = 0;
+CK_OBJECT_HANDLE hPrivate = 0;
+CK_BYTE rawData[] = "Earth is the third planet of our Solar System.";
+CK_BYTE *signature = NULL;
+CK_ULONG signatureLen = 0;
+
+
+// An algorithm of --compare, and its key pair.
+typedef struct
+{
+	const char *name;
+	CK_MECHANISM_TYPE keyGen;
+	CK_MECHANISM_TYPE sign;
+	CK_OBJECT_HANDLE hPublic;
+	CK_OBJECT_HANDLE hPrivate;
+} CompareAlgorithm;
+
+
+// State shared by the threads signing, then verifying, the messages of one algorithm.
+typedef struct
+{
+	SessionPool *pool;
+	CompareAlgorithm *algorithm;
+	CK_BYTE *messages; // compareMessages of messageSize bytes.
+	CK_BYTE *signatures; // COMPARE_MAX_SIGNATURE bytes each.
+	CK_ULONG *signatureLens;
+	atomic_ulong next;
+	atomic_ulong failed;
+	atomic_ulong error; // first CK_RV that was not CKR_OK.
+} CompareRun;
+
+
+// Loads Luna cryptoki library
+void loadLunaLibrary()
+{
+	CK_C_GetFunctionList C_GetFunctionList = NULL;
+
+	char *libPath = getenv("P11_LIB"); // P11_LIB is the complete path of Cryptoki library.
+	if(libPath==NULL)
+	{
+		printf("P11_LIB environment variable not set.\n");
+		printf("\n > On Unix/Linux :-\n");
+		printf("export P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\n > On Windows :-\n");
+		printf("set P11_LIB=<PATH_TO_CRYPTOKI>");
+		printf("\n\nExample :-");
+		printf("\nexport P11_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so");
+		printf("\nset P11_LIB=C:\\Program Files\\SafeNet\\LunaClient\\cryptoki.dll\n\n");
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+		libHandle = dlopen(libPath, RTLD_NOW); // Loads shared library on Unix/Linux.
+	#else
+		libHandle = LoadLibrary(libPath); // Loads shared library on Windows.
+	#endif
+	if(!libHandle)
+	{
+		printf("Failed to load Luna library from path : %s\n", libPath);
+		exit(1);
+	}
+
+
+	#ifdef OS_UNIX
+	    C_GetFunctionList = (CK_C_GetFunctionList)dlsym(libHandle, "C_GetFunctionList"); // Loads symbols on Unix/Linux
+	#else
+		C_GetFunctionList = (CK_C_GetFunctionList)GetProcAddress(libHandle, "C_GetFunctionList"); // Loads symbols on Windows.
+	#endif
+
+	C_GetFunctionList(&p11Func); // Gets the list of all Pkcs11 Functions.
+	if(p11Func==NULL)
+	{
+		printf("Failed to load P11 functions.\n");
+		exit(1);
+	}
+
+	printf ("\n> P11 library loaded.\n");
+	printf ("  --> %s\n", libPath);
+}
+
+
+
+// Always a good idea to free up some memory before exiting.
+void freeMem()
+{
+        #ifdef OS_UNIX
+                dlclose(libHandle); // Close library handle on Unix/Linux
+        #else
+                FreeLibrary(libHandle); // Close library handle on Windows.
+        #endif
+	free(slotPin);
+	pubKeyCacheDestroy(publicKeys);
+}
+
+
+
+// Checks if a P11 operation was a success or failure
+void checkOperation(CK_RV rv, const char *message)
+{
+	if(rv!=CKR_OK)
+	{
+		printf("%s failed with Ox%lX\n\n",message,rv);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+}
+
+
+
+// Connects to a Luna slot (C_Initialize, C_OpenSession, C_Login)
+void connectToLunaSlot()
+{
+	checkOperation(p11Func->C_Initialize(NULL), "C_Initialize");
+	checkOperation(p11Func->C_OpenSession(slotId, CKF_SERIAL_SESSION|CKF_RW_SESSION, NULL, NULL, &hSession), "C_OpenSession");
+	checkOperation(p11Func->C_Login(hSession, CKU_USER, slotPin, strlen(slotPin)), "C_Login");
+	printf("\n> Connected to Luna.\n");
+	printf("  --> SLOT ID : %ld.\n", slotId);
+	printf("  --> SESSION ID : %ld.\n", hSession);
+}
+
+
+
+// Disconnects from Luna slot (C_Logout, C_CloseSession and C_Finalize)
+void disconnectFromLunaSlot()
+{
+	checkOperation(p11Func->C_Logout(hSession), "C_Logout");
+	checkOperation(p11Func->C_CloseSession(hSession), "C_CloseSession");
+	checkOperation(p11Func->C_Finalize(NULL), "C_Finalize");
+	printf("\n> Disconnected from Luna slot.\n\n");
+}
+
+
+
+// This function generates an Ed25519 (or Ed448) key pair.
+void generateEdwardsKeyPair()
+{
+        CK_BBOOL yes = CK_TRUE;
+        CK_BBOOL no = CK_FALSE;
+        CK_MECHANISM mech = {CKM_EC_EDWARDS_KEY_PAIR_GEN};
+        CK_BYTE ed25519[] = {0x06,0x09,0x2B,0x06,0x01,0x04,0x01,0xDA,0x47,0x0F,0x01}; // oid : 1.3.6.1.4.1.11591.15.1
+        CK_BYTE ed448Param[] = {0x06,0x03,0x2B,0x65,0x71}; // oid : 1.3.101.113
+
+        CK_ATTRIBUTE attribPub[] =
+        {
+                {CKA_TOKEN,             &no,            sizeof(CK_BBOOL)},
+                {CKA_PRIVATE,           &yes,           sizeof(CK_BBOOL)},
+                {CKA_VERIFY,            &yes,           sizeof(CK_BBOOL)},
+                {CKA_EC_PARAMS,         ed25519,        sizeof(ed25519)}
+        };
+        CK_ULONG attribPubLen = sizeof(attribPub) / sizeof(*attribPub);
+
+        CK_ATTRIBUTE attribPri[] =
+        {
+                {CKA_TOKEN,             &no,            sizeof(CK_BBOOL)},
+                {CKA_PRIVATE,           &yes,           sizeof(CK_BBOOL)},
+                {CKA_SENSITIVE,         &yes,           sizeof(CK_BBOOL)},
+                {CKA_EXTRACTABLE,       &no,            sizeof(CK_BBOOL)},
+                {CKA_SIGN,              &yes,           sizeof(CK_BBOOL)}
+        };
+        CK_ULONG attribPriLen = sizeof(attribPri) / sizeof(*attribPri);
+
+        if(ed448)
+        {
+                attribPub[3].pValue = ed448Param;
+                attribPub[3].ulValueLen = sizeof(ed448Param);
+        }
+        checkOperation(p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, attribPubLen, attribPri, attribPriLen, &hPublic, &hPrivate),"C_GenerateKeyPair");
+	printf("\n> %s keypair generated \n", ed448 ? "Ed448" : "Ed25519");
+	printf("  --> PRIVATE KEY HANDLE : %lu\n", hPrivate);
+	printf("  --> PUBLIC KEY HANDLE : %lu\n", hPublic);
+}
+
+
+
+// Reads the public key from the token and prints it : CKA_EC_POINT holds it as a DER OCTET STRING.
+void exportPublicKey()
+{
+	CK_BYTE point[128];
+	CK_ATTRIBUTE attrib = {CKA_EC_POINT, point, sizeof(point)};
+
+	checkOperation(p11Func->C_GetAttributeValue(hSession, hPublic, &attrib, 1), "C_GetAttributeValue");
+	printf("\n> Public key exported (CKA_EC_POINT) :-\n  --> ");
+	for(CK_ULONG ctr=0; ctr<attrib.ulValueLen; ctr++)
+		printf("%02X", point[ctr]);
+	printf("\n");
+}
+
+
+
+// This function signs the raw data.
+void signData()
+{
+        CK_MECHANISM mech = {CKM_EDDSA};
+        checkOperation(p11Func->C_SignInit(hSession, &mech, hPrivate),"C_SignInit");
+        checkOperation(p11Func->C_Sign(hSession, rawData, sizeof(rawData)-1, NULL_PTR, &signatureLen),"C_Sign");
+        signature = (CK_BYTE*)calloc(signatureLen, 1);
+        checkOperation(p11Func->C_Sign(hSession, rawData, sizeof(rawData)-1, signature, &signatureLen),"C_Sign");
+	printf("\n> Plaintext signed, %lu byte signature.\n", signatureLen);
+}
+
+
+
+// Creates the cache that reads the public key once and runs the public-key operations on the host.
+void createPublicKeyCache()
+{
+	CK_RV rv = CKR_OK;
+	publicKeys = pubKeyCacheCreate(p11Func, 4, localPublic, &rv);
+	checkOperation(rv, "pubKeyCacheCreate");
+}
+
+
+
+// Tells where the last public-key operation ran.
+void printPublicKeyUse()
+{
+	PubKeyCacheStats stats;
+	pubKeyCacheGetStats(publicKeys, &stats);
+	printf("  --> %s.\n", (stats.localOps>0) ? "done on the host with the public key read from the token" : "done by the HSM");
+}
+
+
+
+// This function verifies the signature.
+void verifyData()
+{
+        CK_MECHANISM mech = {CKM_EDDSA};
+        checkOperation(pubKeyVerify(publicKeys, hSession, &mech, hPublic, rawData, sizeof(rawData)-1, signature, signatureLen), "pubKeyVerify");
+        printf("\n> Signature verified.\n");
+        printPublicKeyUse();
+}
+
+
+
+// Returns a monotonic time in seconds.
+double nowSeconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+
+// Generates the session key pair of one --compare algorithm. Session objects are visible to the pooled sessions too.
+void generateCompareKeyPair(CompareAlgorithm *algorithm)
+{
+	CK_MECHANISM mech = {algorithm->keyGen};
+	CK_BBOOL yes = CK_TRUE;
+	CK_BBOOL no = CK_FALSE;
+	CK_ULONG modulusBits = 2048;
+	CK_BYTE exp[] = {0x01, 0x00, 0x01};
+	CK_BYTE p256[] = {0x06,0x08,0x2A,0x86,0x48,0xCE,0x3D,0x03,0x01,0x07}; // secp256r1
+	CK_BYTE ed25519[] = {0x06,0x09,0x2B,0x06,0x01,0x04,0x01,0xDA,0x47,0x0F,0x01}; // Ed25519, oid 1.3.6.1.4.1.11591.15.1
+	CK_ATTRIBUTE attribPub[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_VERIFY,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EC_PARAMS,		ed25519,	sizeof(ed25519)}, // replaced by CKA_MODULUS_BITS for RSA.
+		{CKA_PUBLIC_EXPONENT,	exp,		sizeof(exp)}
+	};
+	CK_ULONG attribPubLen = 3;
+	CK_ATTRIBUTE attribPri[] =
+	{
+		{CKA_TOKEN,		&no,		sizeof(CK_BBOOL)},
+		{CKA_PRIVATE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SIGN,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_SENSITIVE,		&yes,		sizeof(CK_BBOOL)},
+		{CKA_EXTRACTABLE,	&no,		sizeof(CK_BBOOL)}
+	};
+
+	if(algorithm->keyGen==CKM_EC_KEY_PAIR_GEN)
+	{
+		attribPub[2].pValue = p256;
+		attribPub[2].ulValueLen = sizeof(p256);
+	}
+	else if(algorithm->keyGen==CKM_RSA_PKCS_KEY_PAIR_GEN)
+	{
+		attribPub[2].type = CKA_MODULUS_BITS;
+		attribPub[2].pValue = &modulusBits;
+		attribPub[2].ulValueLen = sizeof(modulusBits);
+		attribPubLen = 4;
+	}
+	checkOperation(p11Func->C_GenerateKeyPair(hSession, &mech, attribPub, attribPubLen, attribPri,
+		sizeof(attribPri)/sizeof(*attribPri), &algorithm->hPublic, &algorithm->hPrivate), "C_GenerateKeyPair");
+}
+
+
+
+// Signs messages taken from the shared counter, with one pooled session.
+void *signWorker(void *arg)
+{
+	CompareRun *run = (CompareRun*)arg;
+	CK_MECHANISM mech = {run->algorithm->sign};
+	PooledSession *session = NULL;
+	unsigned long index = 0;
+	CK_RV rv = sessionPoolAcquire(run->pool, &session);
+
+	while(rv==CKR_OK && (index = atomic_fetch_add(&run->next, 1))<compareMessages)
+	{
+		run->signatureLens[index] = COMPARE_MAX_SIGNATURE;
+		rv = p11Func->C_SignInit(session->hSession, &mech, run->algorithm->hPrivate);
+		if(rv==CKR_OK)
+			rv = p11Func->C_Sign(session->hSession, run->messages + index * messageSize, messageSize,
+				run->signatures + index * COMPARE_MAX_SIGNATURE, &run->signatureLens[index]);
+	}
+	if(session!=NULL)
+		sessionPoolRelease(run->pool, session, rv);
+	if(rv!=CKR_OK)
+	{
+		CK_ULONG expected = CKR_OK;
+		atomic_compare_exchange_strong(&run->error, &expected, rv);
+		atomic_store(&run->next, compareMessages); // stops the other threads.
+	}
+	return 0;
+}
+
+
+
+// Verifies signatures taken from the shared counter on the host, with a verifier of its own, or on the HSM with one
+// pooled session when the cache leaves the verification to the HSM.
+void *verifyWorker(void *arg)
+{
+	CompareRun *run = (CompareRun*)arg;
+	CK_MECHANISM mech = {run->algorithm->sign};
+	PubKeyVerifier *verifier = NULL;
+	PooledSession *session = NULL;
+	CK_BYTE *message = NULL;
+	CK_BYTE *signature = NULL;
+	unsigned long index = 0;
+	CK_RV verified = CKR_OK;
+	CK_RV rv = CKR_OK;
+
+	verifier = pubKeyVerifierCreate(publicKeys, hSession, &mech, run->algorithm->hPublic, &rv);
+	if(verifier==NULL && rv==CKR_MECHANISM_INVALID)
+		rv = sessionPoolAcquire(run->pool, &session);
+	while(rv==CKR_OK && (index = atomic_fetch_add(&run->next, 1))<compareMessages)
+	{
+		message = run->messages + index * messageSize;
+		signature = run->signatures + index * COMPARE_MAX_SIGNATURE;
+		if(verifier!=NULL)
+			verified = pubKeyVerifierRun(verifier, message, messageSize, signature, run->signatureLens[index]);
+		else
+			verified = pubKeyVerify(publicKeys, session->hSession, &mech, run->algorithm->hPublic, message, messageSize,
+				signature, run->signatureLens[index]);
+		if(verified!=CKR_OK)
+			atomic_fetch_add(&run->failed, 1);
+	}
+	pubKeyVerifierFree(verifier);
+	if(session!=NULL)
+		sessionPoolRelease(run->pool, session, CKR_OK);
+	if(rv!=CKR_OK)
+	{
+		CK_ULONG expected = CKR_OK;
+		atomic_compare_exchange_strong(&run->error, &expected, rv);
+	}
+	return 0;
+}
+
+
+
+// Runs worker on workers threads over the messages of run. Returns the elapsed seconds.
+double runThreads(CompareRun *run, void *(*worker)(void*))
+{
+	pthread_t *threads = (pthread_t*)calloc(workers, sizeof(pthread_t));
+	unsigned int started = 0;
+	double start = nowSeconds();
+
+	atomic_store(&run->next, 0);
+	for(started=0; threads!=NULL && started<workers; started++)
+		if(pthread_create(&threads[started], NULL, worker, run)!=0)
+			break;
+	if(started==0)
+		atomic_store(&run->error, CKR_HOST_MEMORY);
+	for(unsigned int ctr=0; ctr<started; ctr++)
+		pthread_join(threads[ctr], NULL);
+	free(threads);
+	return nowSeconds() - start;
+}
+
+
+
+// Signs compareMessages messages with Ed25519, ECDSA P-256 and RSA-2048, and verifies them where the public-key
+// cache runs its operations.
+void compareAlgorithms()
+{
+	CompareAlgorithm algorithms[] =
+	{
+		{"Ed25519 (CKM_EDDSA)",			CKM_EC_EDWARDS_KEY_PAIR_GEN,	CKM_EDDSA},
+		{"ECDSA P-256 (CKM_ECDSA_SHA256)",	CKM_EC_KEY_PAIR_GEN,		CKM_ECDSA_SHA256},
+		{"RSA-2048 (CKM_SHA256_RSA_PKCS)",	CKM_RSA_PKCS_KEY_PAIR_GEN,	CKM_SHA256_RSA_PKCS}
+	};
+	CompareRun run;
+	PubKeyCacheStats stats;
+	double signSeconds = 0, verifySeconds = 0;
+	CK_RV rv = CKR_OK;
+
+	memset(&run, 0, sizeof(run));
+	run.messages = (CK_BYTE*)malloc(compareMessages * messageSize);
+	run.signatures = (CK_BYTE*)malloc(compareMessages * COMPARE_MAX_SIGNATURE);
+	run.signatureLens = (CK_ULONG*)calloc(compareMessages, sizeof(CK_ULONG));
+	if(run.messages==NULL || run.signatures==NULL || run.signatureLens==NULL)
+	{
+		printf("\n> Not enough memory for %lu messages.\n\n", compareMessages);
+		p11Func->C_Finalize(NULL_PTR);
+		exit(1);
+	}
+	checkOperation(p11Func->C_GenerateRandom(hSession, run.messages, compareMessages * messageSize), "C_GenerateRandom");
+	run.pool = sessionPoolCreate(p11Func, slotId, CKU_USER, slotPin, strlen(slotPin), workers, &rv);
+	checkOperation(rv, "sessionPoolCreate");
+
+	printf("\n> %lu messages of %lu bytes per algorithm, %u threads.\n", compareMessages, messageSize, workers);
+	pubKeyCacheGetStats(publicKeys, &stats);
+	printf("  %-32s %16s %20s\n", "ALGORITHM", "SIGNATURES/SEC", stats.local ? "HOST VERIFIES/SEC" : "HSM VERIFIES/SEC");
+	for(size_t ctr=0; ctr<sizeof(algorithms)/sizeof(*algorithms); ctr++)
+	{
+		run.algorithm = &algorithms[ctr];
+		atomic_init(&run.failed, 0);
+		atomic_init(&run.error, CKR_OK);
+		generateCompareKeyPair(run.algorithm);
+		signSeconds = runThreads(&run, signWorker);
+		checkOperation(atomic_load(&run.error), "C_Sign");
+		verifySeconds = runThreads(&run, verifyWorker);
+		checkOperation(atomic_load(&run.error), "verifyWorker");
+		printf("  %-32s %16.0f %20.0f", run.algorithm->name, compareMessages / signSeconds, compareMessages / verifySeconds);
+		if(atomic_load(&run.failed)>0)
+			printf("   %lu signatures did not verify", atomic_load(&run.failed));
+		printf("\n");
+		p11Func->C_DestroyObject(hSession, run.algorithm->hPrivate);
+		p11Func->C_DestroyObject(hSession, run.algorithm->hPublic);
+		pubKeyCacheForget(publicKeys, run.algorithm->hPublic);
+	}
+
+	sessionPoolDestroy(run.pool);
+	free(run.messages);
+	free(run.signatures);
+	free(run.signatureLens);
+}
+
+
+
+// Prints the syntax for executing this code.
+void usage(const char *exeName)
+{
+	printf("\nUsage :-\n");
+	printf("%s <slot_number> <crypto_office_password> [--hsm-public] [--ed448] [--compare <n> [--size <bytes>] [--workers <n>]]\n\n", exeName);
+	printf("  --hsm-public     verify the signature on the HSM instead of on the host.\n");
+	printf("  --ed448          use an Ed448 key instead of Ed25519.\n");
+	printf("  --compare <n>    sign n messages with Ed25519, ECDSA P-256 and RSA-2048, and verify them (on the HSM with --hsm-public).\n");
+	printf("  --size <bytes>   bytes per message of --compare (default 64).\n");
+	printf("  --workers <n>    signing and verifying threads of --compare (default 4).\n\n");
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"hsm-public",	no_argument,		NULL,	'h'},
+		{"ed448",	no_argument,		NULL,	'e'},
+		{"compare",	required_argument,	NULL,	'c'},
+		{"size",	required_argument,	NULL,	's'},
+		{"workers",	required_argument,	NULL,	'w'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'h': localPublic = 0; break;
+			case 'e': ed448 = 1; break;
+			case 'c': compareMessages = strtoul(optarg, NULL, 10); break;
+			case 's': messageSize = strtoul(optarg, NULL, 10); break;
+			case 'w': workers = atoi(optarg); break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
+	if(messageSize==0 || workers==0)
+	{
+		usage(exeName);
+		exit(1);
+	}
+}
+
+
+
+int main(int argc, char **argv[])
+{
+	printf("\n%s\n", (char*)argv[0]);
+	if(argc<3) {
+		usage((char*)argv[0]);
+		exit(1);
+	}
+	slotId = atoi((const char*)argv[1]);
+	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
+	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
+
+	loadLunaLibrary();
+	connectToLunaSlot();
+	createPublicKeyCache();
+
+	generateEdwardsKeyPair();
+	exportPublicKey();
+	signData();
+	verifyData();
+	if(compareMessages>0)
+		compareAlgorithms();
+
+	disconnectFromLunaSlot();
+	freeMem();
+	return 0;
+}
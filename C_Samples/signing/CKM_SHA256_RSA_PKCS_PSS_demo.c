@@ -14,6 +14,16 @@
 	OBJECTIVE : This sample demonstrates how to generate an RSA keypair and use it for signing data and verifying the signature.
 	- Mechanism used for generating KeyPair is : CKM_RSA_FIPS_186_3_PRIME_KEY_PAIR_GEN.
 	- Mechanism used for sign/verify operation : CKM_SHA256_RSA_PKCS_PSS.
+	- The signature is verified on the host, with OpenSSL and the public key read once from the token (see
+	  common/pubkey_cache.h), so the HSM only does the signing. --hsm-public sends the verification to the HSM.
+	- --in signs a file of any size instead, in constant memory, with C_SignUpdate / C_SignFinal over chunks of
+	  --chunk bytes (common/file_sign.c) : a regular file is memory-mapped, a pipe or --no-mmap is streamed. The
+	  signature is then verified with C_VerifyUpdate / C_VerifyFinal, and the file is signed once more from a
+	  SHA-256 digest computed on the host (CKM_RSA_PKCS_PSS), to compare the throughput of both ways.
+	- --calibrate measures C_SignUpdate with CKM_SHA256_RSA_PKCS_PSS for chunk sizes from 1K to 4M (common/chunk_tuner.c) and
+	  saves the knee for the token in the slot; without --chunk, --in then uses that chunk size.
+	- Example :-
+		CKM_SHA256_RSA_PKCS_PSS_demo 0 userpin --in release.tar.gz --chunk 4M
 */
 
 
@@ -21,7 +31,12 @@
 #include <stdio.h>
 #include <cryptoki_v2.h>
 #include <string.h>
+#include <errno.h>
 #include <stdlib.h>
+#include <getopt.h>
+#include "../common/pubkey_cache.h"
+#include "../common/file_sign.h"
+#include "../common/chunk_tuner.h"
 
 
 
@@ -47,6 +62,12 @@ CK_FUNCTION_LIST *p11Func = NULL;
 CK_SESSION_HANDLE hSession = 0;
 CK_SLOT_ID slotId = 0; // slot id
 CK_BYTE *slotPin = NULL; // slot password
+PubKeyCache *publicKeys = NULL; // runs the public-key operations on the host.
+int localPublic = 1; // 0 with --hsm-public.
+char *inPath = NULL; // file to sign with --in, '-' for stdin.
+CK_ULONG chunkSize = 0; // bytes per C_SignUpdate, 0 until set : the calibrated size of the slot, or 1M.
+int calibrate = 0; // 1 with --calibrate.
+int useMap = 1; // 0 with --no-mmap.
 
 CK_OBJECT_HANDLE hPrivate = 0; // Stores private key handle.
 CK_OBJECT_HANDLE hPublic = 0; // Stores public key handle.
@@ -119,6 +140,7 @@ void freeMem()
                 FreeLibrary(libHandle); // Close library handle on Windows.
         #endif
         free(slotPin);
+	pubKeyCacheDestroy(publicKeys);
 	free(signature);
 }
 
@@ -230,13 +252,91 @@ void signData()
 
 
 
+// Creates the cache that reads the public key once and runs the public-key operations on the host.
+void createPublicKeyCache()
+{
+	CK_RV rv = CKR_OK;
+	publicKeys = pubKeyCacheCreate(p11Func, 1, localPublic, &rv);
+	checkOperation(rv, "pubKeyCacheCreate");
+}
+
+
+
+// Tells where the last public-key operation ran.
+void printPublicKeyUse()
+{
+	PubKeyCacheStats stats;
+	pubKeyCacheGetStats(publicKeys, &stats);
+	printf("  --> %s.\n", (stats.localOps>0) ? "done on the host with the public key read from the token" : "done by the HSM");
+}
+
+
+
 // Verify the signed data.
 void verifyData()
 {
 	CK_MECHANISM mech = {CKM_SHA256_RSA_PKCS_PSS, &pssParam, sizeof(pssParam)};
-	checkOperation(p11Func->C_VerifyInit(hSession, &mech, hPublic), "C_VerifyInit");
-	checkOperation(p11Func->C_Verify(hSession, rawData, sizeof(rawData)-1, signature, signatureLen), "C_Verify");
+	checkOperation(pubKeyVerify(publicKeys, hSession, &mech, hPublic, rawData, sizeof(rawData)-1, signature, signatureLen), "pubKeyVerify");
 	printf("\n> Signed data verified.\n");
+	printPublicKeyUse();
+}
+
+
+
+// Measures chunk sizes from 1K to 4M for CKM_SHA256_RSA_PKCS_PSS, and saves the knee of the curve for the slot.
+void calibrateChunkSize()
+{
+	initPSSParam();
+	CK_MECHANISM mech = {CKM_SHA256_RSA_PKCS_PSS, &pssParam, sizeof(pssParam)};
+	ChunkTuning tuning;
+
+	checkOperation(chunkTunerCalibrateAndSave(p11Func, hSession, slotId, &mech, hPrivate, 16*1024*1024, stdout, &tuning),
+		"chunkTunerCalibrateAndSave");
+}
+
+
+
+// Signs inPath with C_SignUpdate / C_SignFinal and verifies it with C_VerifyUpdate / C_VerifyFinal, then signs it
+// again from a digest computed on the host, for comparison. Only the first step can read stdin.
+void signFile()
+{
+	CK_BYTE fileSignature[FILE_SIGN_MAX_SIGNATURE];
+	CK_BYTE localSignature[FILE_SIGN_MAX_SIGNATURE];
+	CK_ULONG fileSignatureLen = sizeof(fileSignature);
+	CK_ULONG localSignatureLen = sizeof(localSignature);
+	FileSignStats signStats, stats, localStats;
+	initPSSParam();
+	CK_MECHANISM mech = {CKM_SHA256_RSA_PKCS_PSS, &pssParam, sizeof(pssParam)};
+	CK_RV rv = CKR_OK;
+
+	if(chunkSize==0)
+		chunkSize = chunkTunerPick(p11Func, slotId, CKM_SHA256_RSA_PKCS_PSS, 1024*1024, stdout);
+	checkOperation(fileSign(p11Func, hSession, &mech, hPrivate, inPath, chunkSize, useMap, fileSignature, &fileSignatureLen,
+		&signStats), "fileSign");
+	printf("\n> %s signed with C_SignUpdate / C_SignFinal, %lu byte signature.\n", inPath, fileSignatureLen);
+	fileSignPrintStats(stdout, &signStats);
+	if(strcmp(inPath, "-")==0)
+		return;
+
+	checkOperation(fileVerify(p11Func, hSession, &mech, hPublic, inPath, chunkSize, useMap, fileSignature, fileSignatureLen,
+		&stats), "fileVerify");
+	printf("\n> Signature verified with C_VerifyUpdate / C_VerifyFinal.\n");
+	fileSignPrintStats(stdout, &stats);
+
+	rv = fileSignDigestLocally(p11Func, hSession, &mech, hPrivate, inPath, chunkSize, useMap, localSignature,
+		&localSignatureLen, &localStats);
+	if(rv==CKR_FUNCTION_NOT_SUPPORTED)
+	{
+		printf("\n> Not signed from a digest computed on the host : this build has no HOST_CRYPTO (OpenSSL).\n");
+		return;
+	}
+	checkOperation(rv, "fileSignDigestLocally");
+	printf("\n> %s hashed on the host, only its digest signed on the HSM (CKM_RSA_PKCS_PSS).\n", inPath);
+	fileSignPrintStats(stdout, &localStats);
+	checkOperation(fileVerify(p11Func, hSession, &mech, hPublic, inPath, chunkSize, useMap, localSignature, localSignatureLen,
+		&stats), "fileVerify");
+	printf("  --> Verified with C_VerifyUpdate / C_VerifyFinal, like the signature of C_SignFinal.\n");
+	fileSignPrintComparison(stdout, &signStats, &localStats);
 }
 
 
@@ -245,7 +345,72 @@ void verifyData()
 void usage(const char *exeName)
 {
 	printf("\nUsage :-\n");
-	printf("%s <slot_number> <crypto_office_password>\n\n", exeName);
+	printf("%s <slot_number> <crypto_office_password> [--hsm-public] [--in <file> [--chunk <size>] [--no-mmap]] [--calibrate]\n\n", exeName);
+	printf("  --hsm-public     verify the signature on the HSM instead of on the host.\n");
+	printf("  --in <file>      sign and verify a file with C_SignUpdate / C_VerifyUpdate, '-' for stdin (signing only).\n");
+	printf("  --chunk <size>   bytes per update, K and M suffixes accepted (default : calibrated, or 1M).\n");
+	printf("  --no-mmap        read the file in chunks instead of memory-mapping it.\n");
+	printf("  --calibrate      find the best chunk size for the slot, and save it for --in.\n\n");
+}
+
+
+
+// Reads a size such as 4096, 64K or 1M. Anything else, including 0 or a size that does not fit in a CK_ULONG,
+// prints the usage and exits.
+CK_ULONG parseSize(const char *text, const char *exeName)
+{
+	char *end = NULL;
+	CK_ULONG unit = 1;
+	CK_ULONG value = 0;
+
+	errno = 0;
+	value = strtoul(text, &end, 10);
+	if(*end=='K' || *end=='k')
+		unit = 1024;
+	else if(*end=='M' || *end=='m')
+		unit = 1024 * 1024;
+	if(unit>1)
+		end++;
+	if(text[0]<'0' || text[0]>'9' || *end!='\0' || errno==ERANGE || value==0 || value>(CK_ULONG)-1 / unit)
+	{
+		printf("\n> Invalid size : %s\n", text);
+		usage(exeName);
+		exit(1);
+	}
+	return value * unit;
+}
+
+
+
+// Reads the options that follow the slot number and password.
+void parseOptions(int argc, char **argv, const char *exeName)
+{
+	int opt = 0;
+	struct option longOptions[] =
+	{
+		{"hsm-public",	no_argument,		NULL,	'h'},
+		{"in",		required_argument,	NULL,	'i'},
+		{"chunk",	required_argument,	NULL,	'c'},
+		{"no-mmap",	no_argument,		NULL,	'n'},
+		{"calibrate",	no_argument,		NULL,	'C'},
+		{NULL,		0,			NULL,	0}
+	};
+
+	optind = 3;
+	while((opt = getopt_long(argc, argv, "", longOptions, NULL))!=-1)
+	{
+		switch(opt)
+		{
+			case 'h': localPublic = 0; break;
+			case 'i': inPath = optarg; break;
+			case 'c': chunkSize = parseSize(optarg, exeName); break;
+			case 'n': useMap = 0; break;
+			case 'C': calibrate = 1; break;
+			default:
+				usage(exeName);
+				exit(1);
+		}
+	}
 }
 
 
@@ -259,12 +424,21 @@ int main(int argc, char **argv[])
 	slotId = atoi((const char*)argv[1]);
 	slotPin = (CK_BYTE*)malloc(strlen((const char*)argv[2]));
 	strncpy(slotPin, (char*)argv[2], strlen((const char*)argv[2]));
+	parseOptions(argc, (char**)argv, (char*)argv[0]);
 
 	loadLunaLibrary();
 	connectToLunaSlot();
+	createPublicKeyCache();
 	generateRSAKey();
-	signData();
-	verifyData();
+	if(calibrate)
+		calibrateChunkSize();
+	else if(inPath!=NULL)
+		signFile();
+	else
+	{
+		signData();
+		verifyData();
+	}
 	disconnectFromLunaSlot();
 	freeMem();
 	return 0;
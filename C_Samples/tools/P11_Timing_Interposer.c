@@ -0,0 +1,572 @@
+        /*********************************************************************************\
+        *                                                                                *
+        * This file is part of the "luna-samples" project.                               *
+        *                                                                                *
+        * The "luna-samples" project is provided under the MIT license (see the          *
+        * following Web site for further details: https://mit-license.org/ ).            *
+        *                                                                                *
+        * Copyright © 2024 Thales Group                                                  *
+        *                                                                                *
+        **********************************************************************************
+
+
+
+
+
+        OBJECTIVE :
+	- This is not a sample but a shared library : a PKCS#11 interposer that measures every call an application makes.
+	- Point P11_LIB at it and P11_TIMING_LIB at the real library. C_GetFunctionList returns a function list whose
+	  entries time the call and forward it to the real library, so any sample runs through it unmodified.
+	- Unlike cklog, nothing is written per call : each thread counts calls, errors and a latency histogram per
+	  function in its own memory, without locks or shared cache lines.
+	- The summary (calls, errors, mean and percentile latency, total time per function) is written when the
+	  application calls C_Finalize, and every time the process receives P11_TIMING_SIGNAL (SIGUSR1 by default).
+	- Environment variables :-
+		P11_TIMING_LIB      path of the real PKCS#11 library (required).
+		P11_TIMING_OUT      file the summary is appended to (default stderr).
+		P11_TIMING_FORMAT   text (default) or json.
+		P11_TIMING_SIGNAL   signal number that dumps the summary, 0 to disable (default SIGUSR1).
+	- CA_GetFunctionList (SafeNet extensions) is forwarded to the real library without timing.
+	- Example :-
+		export P11_TIMING_LIB=/usr/safenet/lunaclient/lib/libCryptoki2_64.so
+		export P11_LIB=$PWD/bin/tools/libp11timing.so
+		./bin/benchmark/Async_Signing_Benchmark 0 userpin --duration 10 &
+		kill -USR1 $!
+
+*/
+
+
+
+
+
+#include <stdio.h>
+#include <cryptoki_v2.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <dlfcn.h>
+
+
+#define HISTOGRAM_BUCKETS 256 // 4 buckets per power of two nanoseconds.
+
+
+// Every timed function of CK_FUNCTION_LIST : name, parameters, arguments. C_GetFunctionList is not timed.
+#define TIMED_FUNCTIONS(X) \
+	X(C_Initialize, (CK_VOID_PTR pInitArgs), (pInitArgs)) \
+	X(C_Finalize, (CK_VOID_PTR pReserved), (pReserved)) \
+	X(C_GetInfo, (CK_INFO_PTR pInfo), (pInfo)) \
+	X(C_GetSlotList, (CK_BBOOL tokenPresent, CK_SLOT_ID_PTR pSlotList, CK_ULONG_PTR pulCount), (tokenPresent, pSlotList, pulCount)) \
+	X(C_GetSlotInfo, (CK_SLOT_ID slotID, CK_SLOT_INFO_PTR pInfo), (slotID, pInfo)) \
+	X(C_GetTokenInfo, (CK_SLOT_ID slotID, CK_TOKEN_INFO_PTR pInfo), (slotID, pInfo)) \
+	X(C_GetMechanismList, (CK_SLOT_ID slotID, CK_MECHANISM_TYPE_PTR pMechanismList, CK_ULONG_PTR pulCount), (slotID, pMechanismList, pulCount)) \
+	X(C_GetMechanismInfo, (CK_SLOT_ID slotID, CK_MECHANISM_TYPE type, CK_MECHANISM_INFO_PTR pInfo), (slotID, type, pInfo)) \
+	X(C_InitToken, (CK_SLOT_ID slotID, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen, CK_UTF8CHAR_PTR pLabel), (slotID, pPin, ulPinLen, pLabel)) \
+	X(C_InitPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen), (hSession, pPin, ulPinLen)) \
+	X(C_SetPIN, (CK_SESSION_HANDLE hSession, CK_UTF8CHAR_PTR pOldPin, CK_ULONG ulOldLen, CK_UTF8CHAR_PTR pNewPin, CK_ULONG ulNewLen), \
+		(hSession, pOldPin, ulOldLen, pNewPin, ulNewLen)) \
+	X(C_OpenSession, (CK_SLOT_ID slotID, CK_FLAGS flags, CK_VOID_PTR pApplication, CK_NOTIFY Notify, CK_SESSION_HANDLE_PTR phSession), \
+		(slotID, flags, pApplication, Notify, phSession)) \
+	X(C_CloseSession, (CK_SESSION_HANDLE hSession), (hSession)) \
+	X(C_CloseAllSessions, (CK_SLOT_ID slotID), (slotID)) \
+	X(C_GetSessionInfo, (CK_SESSION_HANDLE hSession, CK_SESSION_INFO_PTR pInfo), (hSession, pInfo)) \
+	X(C_GetOperationState, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG_PTR pulOperationStateLen), \
+		(hSession, pOperationState, pulOperationStateLen)) \
+	X(C_SetOperationState, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pOperationState, CK_ULONG ulOperationStateLen, \
+		CK_OBJECT_HANDLE hEncryptionKey, CK_OBJECT_HANDLE hAuthenticationKey), \
+		(hSession, pOperationState, ulOperationStateLen, hEncryptionKey, hAuthenticationKey)) \
+	X(C_Login, (CK_SESSION_HANDLE hSession, CK_USER_TYPE userType, CK_UTF8CHAR_PTR pPin, CK_ULONG ulPinLen), (hSession, userType, pPin, ulPinLen)) \
+	X(C_Logout, (CK_SESSION_HANDLE hSession), (hSession)) \
+	X(C_CreateObject, (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, CK_OBJECT_HANDLE_PTR phObject), \
+		(hSession, pTemplate, ulCount, phObject)) \
+	X(C_CopyObject, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, \
+		CK_OBJECT_HANDLE_PTR phNewObject), (hSession, hObject, pTemplate, ulCount, phNewObject)) \
+	X(C_DestroyObject, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject), (hSession, hObject)) \
+	X(C_GetObjectSize, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ULONG_PTR pulSize), (hSession, hObject, pulSize)) \
+	X(C_GetAttributeValue, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount), \
+		(hSession, hObject, pTemplate, ulCount)) \
+	X(C_SetAttributeValue, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hObject, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount), \
+		(hSession, hObject, pTemplate, ulCount)) \
+	X(C_FindObjectsInit, (CK_SESSION_HANDLE hSession, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount), (hSession, pTemplate, ulCount)) \
+	X(C_FindObjects, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE_PTR phObject, CK_ULONG ulMaxObjectCount, CK_ULONG_PTR pulObjectCount), \
+		(hSession, phObject, ulMaxObjectCount, pulObjectCount)) \
+	X(C_FindObjectsFinal, (CK_SESSION_HANDLE hSession), (hSession)) \
+	X(C_EncryptInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey)) \
+	X(C_Encrypt, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pEncryptedData, \
+		CK_ULONG_PTR pulEncryptedDataLen), (hSession, pData, ulDataLen, pEncryptedData, pulEncryptedDataLen)) \
+	X(C_EncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, \
+		CK_ULONG_PTR pulEncryptedPartLen), (hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen)) \
+	X(C_EncryptFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastEncryptedPart, CK_ULONG_PTR pulLastEncryptedPartLen), \
+		(hSession, pLastEncryptedPart, pulLastEncryptedPartLen)) \
+	X(C_DecryptInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey)) \
+	X(C_Decrypt, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedData, CK_ULONG ulEncryptedDataLen, CK_BYTE_PTR pData, \
+		CK_ULONG_PTR pulDataLen), (hSession, pEncryptedData, ulEncryptedDataLen, pData, pulDataLen)) \
+	X(C_DecryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, \
+		CK_ULONG_PTR pulPartLen), (hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen)) \
+	X(C_DecryptFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pLastPart, CK_ULONG_PTR pulLastPartLen), (hSession, pLastPart, pulLastPartLen)) \
+	X(C_DigestInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism), (hSession, pMechanism)) \
+	X(C_Digest, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen), \
+		(hSession, pData, ulDataLen, pDigest, pulDigestLen)) \
+	X(C_DigestUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen), (hSession, pPart, ulPartLen)) \
+	X(C_DigestKey, (CK_SESSION_HANDLE hSession, CK_OBJECT_HANDLE hKey), (hSession, hKey)) \
+	X(C_DigestFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pDigest, CK_ULONG_PTR pulDigestLen), (hSession, pDigest, pulDigestLen)) \
+	X(C_SignInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey)) \
+	X(C_Sign, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen), \
+		(hSession, pData, ulDataLen, pSignature, pulSignatureLen)) \
+	X(C_SignUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen), (hSession, pPart, ulPartLen)) \
+	X(C_SignFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG_PTR pulSignatureLen), (hSession, pSignature, pulSignatureLen)) \
+	X(C_SignRecoverInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey)) \
+	X(C_SignRecover, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, \
+		CK_ULONG_PTR pulSignatureLen), (hSession, pData, ulDataLen, pSignature, pulSignatureLen)) \
+	X(C_VerifyInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey)) \
+	X(C_Verify, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pData, CK_ULONG ulDataLen, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen), \
+		(hSession, pData, ulDataLen, pSignature, ulSignatureLen)) \
+	X(C_VerifyUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen), (hSession, pPart, ulPartLen)) \
+	X(C_VerifyFinal, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen), (hSession, pSignature, ulSignatureLen)) \
+	X(C_VerifyRecoverInit, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hKey), (hSession, pMechanism, hKey)) \
+	X(C_VerifyRecover, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSignature, CK_ULONG ulSignatureLen, CK_BYTE_PTR pData, \
+		CK_ULONG_PTR pulDataLen), (hSession, pSignature, ulSignatureLen, pData, pulDataLen)) \
+	X(C_DigestEncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, \
+		CK_ULONG_PTR pulEncryptedPartLen), (hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen)) \
+	X(C_DecryptDigestUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, \
+		CK_ULONG_PTR pulPartLen), (hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen)) \
+	X(C_SignEncryptUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pPart, CK_ULONG ulPartLen, CK_BYTE_PTR pEncryptedPart, \
+		CK_ULONG_PTR pulEncryptedPartLen), (hSession, pPart, ulPartLen, pEncryptedPart, pulEncryptedPartLen)) \
+	X(C_DecryptVerifyUpdate, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pEncryptedPart, CK_ULONG ulEncryptedPartLen, CK_BYTE_PTR pPart, \
+		CK_ULONG_PTR pulPartLen), (hSession, pEncryptedPart, ulEncryptedPartLen, pPart, pulPartLen)) \
+	X(C_GenerateKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulCount, \
+		CK_OBJECT_HANDLE_PTR phKey), (hSession, pMechanism, pTemplate, ulCount, phKey)) \
+	X(C_GenerateKeyPair, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_ATTRIBUTE_PTR pPublicKeyTemplate, \
+		CK_ULONG ulPublicKeyAttributeCount, CK_ATTRIBUTE_PTR pPrivateKeyTemplate, CK_ULONG ulPrivateKeyAttributeCount, \
+		CK_OBJECT_HANDLE_PTR phPublicKey, CK_OBJECT_HANDLE_PTR phPrivateKey), (hSession, pMechanism, pPublicKeyTemplate, \
+		ulPublicKeyAttributeCount, pPrivateKeyTemplate, ulPrivateKeyAttributeCount, phPublicKey, phPrivateKey)) \
+	X(C_WrapKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hWrappingKey, CK_OBJECT_HANDLE hKey, \
+		CK_BYTE_PTR pWrappedKey, CK_ULONG_PTR pulWrappedKeyLen), (hSession, pMechanism, hWrappingKey, hKey, pWrappedKey, pulWrappedKeyLen)) \
+	X(C_UnwrapKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hUnwrappingKey, CK_BYTE_PTR pWrappedKey, \
+		CK_ULONG ulWrappedKeyLen, CK_ATTRIBUTE_PTR pTemplate, CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey), \
+		(hSession, pMechanism, hUnwrappingKey, pWrappedKey, ulWrappedKeyLen, pTemplate, ulAttributeCount, phKey)) \
+	X(C_DeriveKey, (CK_SESSION_HANDLE hSession, CK_MECHANISM_PTR pMechanism, CK_OBJECT_HANDLE hBaseKey, CK_ATTRIBUTE_PTR pTemplate, \
+		CK_ULONG ulAttributeCount, CK_OBJECT_HANDLE_PTR phKey), (hSession, pMechanism, hBaseKey, pTemplate, ulAttributeCount, phKey)) \
+	X(C_SeedRandom, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR pSeed, CK_ULONG ulSeedLen), (hSession, pSeed, ulSeedLen)) \
+	X(C_GenerateRandom, (CK_SESSION_HANDLE hSession, CK_BYTE_PTR RandomData, CK_ULONG ulRandomLen), (hSession, RandomData, ulRandomLen)) \
+	X(C_GetFunctionStatus, (CK_SESSION_HANDLE hSession), (hSession)) \
+	X(C_CancelFunction, (CK_SESSION_HANDLE hSession), (hSession)) \
+	X(C_WaitForSlotEvent, (CK_FLAGS flags, CK_SLOT_ID_PTR pSlot, CK_VOID_PTR pReserved), (flags, pSlot, pReserved))
+
+
+#define FUNCTION_INDEX(name, params, args) FN_##name,
+#define FUNCTION_NAME(name, params, args) #name,
+
+enum { TIMED_FUNCTIONS(FUNCTION_INDEX) FUNCTION_COUNT };
+static const char *functionNames[FUNCTION_COUNT] = { TIMED_FUNCTIONS(FUNCTION_NAME) };
+
+
+// Counters of one function in one thread. Only the owning thread writes them ; atomics keep the readers tear-free.
+typedef struct
+{
+	atomic_ulong calls;
+	atomic_ulong errors;
+	atomic_ullong totalNanos;
+	atomic_ullong maxNanos;
+	atomic_ulong buckets[HISTOGRAM_BUCKETS];
+} FunctionStats;
+
+
+// Counters of one thread, allocated per function on its first call. Blocks are never freed : when a thread exits,
+// its block is released and taken over by the next new thread, counters included.
+typedef struct ThreadStats
+{
+	_Atomic(FunctionStats*) functions[FUNCTION_COUNT];
+	atomic_int owned;
+	struct ThreadStats *next;
+} ThreadStats;
+
+
+static CK_FUNCTION_LIST *realFunctions = NULL;
+static CK_FUNCTION_LIST timedFunctions;
+static void *realLibrary = NULL;
+static pthread_once_t setupOnce = PTHREAD_ONCE_INIT;
+static CK_RV setupRv = CKR_OK;
+
+static _Atomic(ThreadStats*) allThreads = NULL;
+static __thread ThreadStats *threadStats = NULL;
+static pthread_key_t threadKey;
+
+static int dumpPipe[2] = {-1, -1}; // the signal handler writes to it, the dump thread reads it.
+static pthread_mutex_t dumpLock = PTHREAD_MUTEX_INITIALIZER;
+static double loadedAt = 0;
+
+
+
+static unsigned long long nowNanos()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+
+// Histogram bucket : the power of two of the latency, and which quarter of that power it falls in.
+static int bucketOf(unsigned long long nanos)
+{
+	int msb = 0;
+
+	if(nanos<4)
+		return (int)nanos;
+	msb = 63 - __builtin_clzll(nanos);
+	return msb * 4 + (int)((nanos >> (msb - 2)) & 3);
+}
+
+
+
+// Largest latency in nanoseconds that falls into a bucket.
+static double bucketLimit(int bucket)
+{
+	int msb = bucket / 4;
+
+	if(bucket<4)
+		return bucket;
+	return (double)((unsigned long long)(5 + bucket % 4) << (msb - 2)) - 1;
+}
+
+
+
+// Releases the block of an exiting thread, so the next new thread can take it.
+static void releaseThreadStats(void *block)
+{
+	atomic_store(&((ThreadStats*)block)->owned, 0);
+}
+
+
+
+// Returns the block of the calling thread, taking a released one or adding a new one to the list. NULL if there is
+// no memory for one : the call then goes unrecorded.
+static ThreadStats *getThreadStats()
+{
+	ThreadStats *stats = threadStats;
+	int expected = 0;
+
+	if(stats!=NULL)
+		return stats;
+
+	for(stats = atomic_load(&allThreads); stats!=NULL; stats = stats->next)
+	{
+		expected = 0;
+		if(atomic_compare_exchange_strong(&stats->owned, &expected, 1))
+			break;
+	}
+	if(stats==NULL)
+	{
+		stats = (ThreadStats*)calloc(1, sizeof(ThreadStats));
+		if(stats==NULL)
+			return NULL;
+		atomic_store(&stats->owned, 1);
+		stats->next = atomic_load(&allThreads);
+		while(!atomic_compare_exchange_weak(&allThreads, &stats->next, stats))
+			;
+	}
+	threadStats = stats;
+	pthread_setspecific(threadKey, stats);
+	return stats;
+}
+
+
+
+// Adds one call to the counters of the calling thread. Plain load + store : no other thread writes them.
+static void recordCall(int function, CK_RV rv, unsigned long long start)
+{
+	unsigned long long nanos = nowNanos() - start;
+	ThreadStats *thread = getThreadStats();
+	FunctionStats *stats = NULL;
+	int bucket = bucketOf(nanos);
+
+	if(thread==NULL)
+		return;
+	stats = atomic_load_explicit(&thread->functions[function], memory_order_relaxed);
+	if(stats==NULL)
+	{
+		stats = (FunctionStats*)calloc(1, sizeof(FunctionStats));
+		if(stats==NULL)
+			return;
+		atomic_store_explicit(&thread->functions[function], stats, memory_order_release);
+	}
+	atomic_store_explicit(&stats->calls, atomic_load_explicit(&stats->calls, memory_order_relaxed) + 1, memory_order_relaxed);
+	if(rv!=CKR_OK)
+		atomic_store_explicit(&stats->errors, atomic_load_explicit(&stats->errors, memory_order_relaxed) + 1, memory_order_relaxed);
+	atomic_store_explicit(&stats->totalNanos, atomic_load_explicit(&stats->totalNanos, memory_order_relaxed) + nanos, memory_order_relaxed);
+	if(nanos>atomic_load_explicit(&stats->maxNanos, memory_order_relaxed))
+		atomic_store_explicit(&stats->maxNanos, nanos, memory_order_relaxed);
+	atomic_store_explicit(&stats->buckets[bucket], atomic_load_explicit(&stats->buckets[bucket], memory_order_relaxed) + 1, memory_order_relaxed);
+}
+
+
+
+// Summary of one function over all threads.
+typedef struct
+{
+	int function;
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long long totalNanos;
+	unsigned long long maxNanos;
+	unsigned long buckets[HISTOGRAM_BUCKETS];
+} FunctionSummary;
+
+
+
+static void mergeFunction(FunctionSummary *summary, int function)
+{
+	FunctionStats *stats = NULL;
+
+	memset(summary, 0, sizeof(FunctionSummary));
+	summary->function = function;
+	for(ThreadStats *thread = atomic_load(&allThreads); thread!=NULL; thread = thread->next)
+	{
+		stats = atomic_load_explicit(&thread->functions[function], memory_order_acquire);
+		if(stats==NULL)
+			continue;
+		summary->calls += atomic_load_explicit(&stats->calls, memory_order_relaxed);
+		summary->errors += atomic_load_explicit(&stats->errors, memory_order_relaxed);
+		summary->totalNanos += atomic_load_explicit(&stats->totalNanos, memory_order_relaxed);
+		if(atomic_load_explicit(&stats->maxNanos, memory_order_relaxed)>summary->maxNanos)
+			summary->maxNanos = atomic_load_explicit(&stats->maxNanos, memory_order_relaxed);
+		for(int bucket=0; bucket<HISTOGRAM_BUCKETS; bucket++)
+			summary->buckets[bucket] += atomic_load_explicit(&stats->buckets[bucket], memory_order_relaxed);
+	}
+}
+
+
+
+// Latency in microseconds below which the fraction of calls falls (the bucket limit, capped at the maximum).
+static double percentile(const FunctionSummary *summary, double fraction)
+{
+	unsigned long seen = 0;
+	unsigned long counted = 0;
+
+	for(int bucket=0; bucket<HISTOGRAM_BUCKETS; bucket++)
+		counted += summary->buckets[bucket];
+	for(int bucket=0; bucket<HISTOGRAM_BUCKETS && counted>0; bucket++)
+	{
+		seen += summary->buckets[bucket];
+		if(seen>=fraction * counted)
+			return ((bucketLimit(bucket) < summary->maxNanos) ? bucketLimit(bucket) : summary->maxNanos) / 1000;
+	}
+	return 0;
+}
+
+
+
+static int byTotalTime(const void *a, const void *b)
+{
+	const FunctionSummary *left = (const FunctionSummary*)a;
+	const FunctionSummary *right = (const FunctionSummary*)b;
+	return (left->totalNanos < right->totalNanos) - (left->totalNanos > right->totalNanos);
+}
+
+
+
+// Writes the summary of every function called so far, the most expensive first.
+static void dumpSummary(const char *reason)
+{
+	FunctionSummary *summaries = (FunctionSummary*)malloc(FUNCTION_COUNT * sizeof(FunctionSummary));
+	const char *path = getenv("P11_TIMING_OUT");
+	const char *format = getenv("P11_TIMING_FORMAT");
+	int json = (format!=NULL && strcmp(format, "json")==0);
+	double elapsed = (nowNanos() - loadedAt) / 1e9;
+	FILE *out = stderr;
+	int count = 0;
+	int first = 1;
+
+	pthread_mutex_lock(&dumpLock);
+	if(path!=NULL && (out = fopen(path, "a"))==NULL)
+		out = stderr;
+	for(int function=0; function<FUNCTION_COUNT; function++)
+	{
+		mergeFunction(&summaries[count], function);
+		if(summaries[count].calls>0)
+			count++;
+	}
+	qsort(summaries, count, sizeof(FunctionSummary), &byTotalTime);
+
+	if(json)
+		fprintf(out, "{\"pid\": %d, \"reason\": \"%s\", \"seconds\": %.3f, \"functions\": [", (int)getpid(), reason, elapsed);
+	else
+	{
+		fprintf(out, "\n> PKCS#11 timing (pid %d, %s, %.3f seconds since load) :-\n", (int)getpid(), reason, elapsed);
+		fprintf(out, "%-22s %10s %8s %12s %10s %10s %10s %10s %10s\n", "FUNCTION", "CALLS", "ERRORS", "TOTAL(ms)",
+			"MEAN(us)", "P50(us)", "P99(us)", "P99.9(us)", "MAX(us)");
+	}
+	for(int ctr=0; ctr<count; ctr++)
+	{
+		FunctionSummary *s = &summaries[ctr];
+		double mean = s->totalNanos / 1000.0 / s->calls;
+
+		if(json)
+			fprintf(out, "%s\n  {\"function\": \"%s\", \"calls\": %lu, \"errors\": %lu, \"totalMicros\": %.3f, \"meanMicros\": %.3f, "
+				"\"p50Micros\": %.3f, \"p99Micros\": %.3f, \"p99_9Micros\": %.3f, \"maxMicros\": %.3f}", first ? "" : ",",
+				functionNames[s->function], s->calls, s->errors, s->totalNanos / 1000.0, mean, percentile(s, 0.5),
+				percentile(s, 0.99), percentile(s, 0.999), s->maxNanos / 1000.0);
+		else
+			fprintf(out, "%-22s %10lu %8lu %12.3f %10.2f %10.2f %10.2f %10.2f %10.2f\n", functionNames[s->function], s->calls,
+				s->errors, s->totalNanos / 1e6, mean, percentile(s, 0.5), percentile(s, 0.99), percentile(s, 0.999), s->maxNanos / 1000.0);
+		first = 0;
+	}
+	if(json)
+		fprintf(out, "\n]}\n");
+	else
+		fprintf(out, "Percentiles are histogram bucket limits (within 25%%).\n");
+
+	if(out!=stderr)
+		fclose(out);
+	else
+		fflush(out);
+	pthread_mutex_unlock(&dumpLock);
+	free(summaries);
+}
+
+
+
+// Signal handler : only writes a byte, the dump thread does the rest outside of signal context. errno is kept for
+// the PKCS#11 call the signal interrupted.
+static void onDumpSignal(int signum)
+{
+	int savedErrno = errno;
+	char byte = (char)signum;
+
+	(void)!write(dumpPipe[1], &byte, 1); // fails when a dump is already pending.
+	errno = savedErrno;
+}
+
+
+
+static void *dumpThread(void *arg)
+{
+	char byte = 0;
+
+	(void)arg;
+	while(read(dumpPipe[0], &byte, 1)==1)
+		dumpSummary("signal");
+	return 0;
+}
+
+
+
+// Installs the dump signal, unless the application already handles that signal.
+static void setupSignal()
+{
+	const char *value = getenv("P11_TIMING_SIGNAL");
+	int signum = (value!=NULL) ? atoi(value) : SIGUSR1;
+	struct sigaction action, previous;
+	pthread_t thread;
+	sigset_t all, saved;
+
+	if(signum<=0 || sigaction(signum, NULL, &previous)!=0 || previous.sa_handler!=SIG_DFL)
+		return;
+	if(pipe(dumpPipe)!=0)
+		return;
+	fcntl(dumpPipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(dumpPipe[1], F_SETFD, FD_CLOEXEC);
+	fcntl(dumpPipe[1], F_SETFL, O_NONBLOCK);
+
+	// The dump thread blocks every signal, so it never runs an application handler.
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	if(pthread_create(&thread, NULL, &dumpThread, NULL)==0)
+		pthread_detach(thread);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = &onDumpSignal;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(signum, &action, NULL);
+}
+
+
+
+// One wrapper per function : time the call to the real library and record it.
+#define TIMED_WRAPPER(name, params, args) \
+	static CK_RV timed_##name params \
+	{ \
+		unsigned long long start = nowNanos(); \
+		CK_RV rv = realFunctions->name args; \
+		recordCall(FN_##name, rv, start); \
+		if(FN_##name==FN_C_Finalize && rv==CKR_OK) \
+			dumpSummary("C_Finalize"); \
+		return rv; \
+	}
+
+TIMED_FUNCTIONS(TIMED_WRAPPER)
+
+#define TIMED_ENTRY(name, params, args) timedFunctions.name = &timed_##name;
+
+
+
+// Loads the real library and builds the timed function list.
+static void setupInterposer()
+{
+	const char *path = getenv("P11_TIMING_LIB");
+	CK_C_GetFunctionList getFunctionList = NULL;
+
+	setupRv = CKR_GENERAL_ERROR;
+	loadedAt = nowNanos();
+	if(path==NULL)
+	{
+		fprintf(stderr, "P11 timing interposer : P11_TIMING_LIB environment variable not set.\n");
+		return;
+	}
+	realLibrary = dlopen(path, RTLD_NOW);
+	if(realLibrary==NULL)
+	{
+		fprintf(stderr, "P11 timing interposer : failed to load %s\n", path);
+		return;
+	}
+	getFunctionList = (CK_C_GetFunctionList)dlsym(realLibrary, "C_GetFunctionList");
+	if(getFunctionList==NULL || getFunctionList(&realFunctions)!=CKR_OK || realFunctions==NULL)
+	{
+		fprintf(stderr, "P11 timing interposer : %s has no usable C_GetFunctionList.\n", path);
+		return;
+	}
+
+	memcpy(&timedFunctions, realFunctions, sizeof(CK_FUNCTION_LIST)); // keeps the version.
+	TIMED_FUNCTIONS(TIMED_ENTRY)
+	timedFunctions.C_GetFunctionList = &C_GetFunctionList;
+	pthread_key_create(&threadKey, &releaseThreadStats);
+	setupSignal();
+	setupRv = CKR_OK;
+}
+
+
+
+CK_RV C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR ppFunctionList)
+{
+	pthread_once(&setupOnce, &setupInterposer);
+	if(setupRv!=CKR_OK)
+		return setupRv;
+	if(ppFunctionList==NULL)
+		return CKR_ARGUMENTS_BAD;
+	*ppFunctionList = &timedFunctions;
+	return CKR_OK;
+}
+
+
+
+// SafeNet extensions are passed through untimed.
+CK_RV CA_GetFunctionList(CK_SFNT_CA_FUNCTION_LIST_PTR_PTR ppSfntFunctionList)
+{
+	CK_CA_GetFunctionList getFunctionList = NULL;
+
+	pthread_once(&setupOnce, &setupInterposer);
+	if(setupRv!=CKR_OK)
+		return setupRv;
+	getFunctionList = (CK_CA_GetFunctionList)dlsym(realLibrary, "CA_GetFunctionList");
+	if(getFunctionList==NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+	return getFunctionList(ppSfntFunctionList);
+}